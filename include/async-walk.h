@@ -0,0 +1,177 @@
+#ifndef STEG_PNG_ASYNC_WALK_H
+#define STEG_PNG_ASYNC_WALK_H
+
+#include <sys/types.h>
+
+#include "io-ring.h"
+#include "png-chunk-processor.h"
+#include "strbuf.h"
+
+/**
+ * async-walk api
+ *
+ * Walks the chunks of many PNG files at once through an io_ring, for callers
+ * like scan and extract --recursive that visit large numbers of files. Rather
+ * than waiting on each chunk header of each file in turn, one read of each of
+ * up to `depth` files is in flight at once, and each file advances as its read
+ * completes.
+ *
+ * The first read of a file takes its signature along with the first chunk
+ * header, and every read after that takes either the next chunk header or a
+ * piece of chunk data. Chunk headers are checked just as the chunk iterator
+ * checks them (see png_chunk_decode_header()), so that a walk ends where the
+ * iterator's would. The caller decides what to do with each chunk through the
+ * callbacks in struct async_walk_ops.
+ *
+ * io_uring may be unavailable (see io-ring.h), in which case
+ * async_walk_init() fails and the caller must walk files synchronously.
+ *
+ * Example Usage:
+ * static enum async_walk_action chunk(struct async_walk *walk,
+ * 		struct async_walk_file *file, const struct png_chunk_detail *chunk)
+ * {
+ * 		if (!memcmp(chunk->chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+ * 			return ASYNC_WALK_STOP;
+ *
+ * 		return ASYNC_WALK_NEXT;
+ * }
+ *
+ * void example() {
+ * 		const struct async_walk_ops ops = { .chunk = chunk, .finish = finish };
+ *
+ * 		struct async_walk walk;
+ * 		if (async_walk_init(&walk, 32, 0, &ops, NULL))
+ * 			return walk_synchronously();
+ *
+ * 		for (size_t i = 0; i < count; i++)
+ * 			async_walk_add(&walk, paths[i]);
+ *
+ * 		async_walk_finish(&walk);
+ * 		async_walk_destroy(&walk);
+ * }
+ * */
+
+#define ASYNC_WALK_MAX_DEPTH 32
+
+/**
+ * What the walk should do after a chunk header has been handed to the caller:
+ * move on to the next chunk header, read the data of this chunk first, or end
+ * the walk of this file.
+ * */
+enum async_walk_action {
+	ASYNC_WALK_NEXT,
+	ASYNC_WALK_READ_DATA,
+	ASYNC_WALK_STOP
+};
+
+/**
+ * How the walk of a file ended:
+ * - ASYNC_WALK_DONE: there were no more chunks, or the next chunk header was
+ *   one the chunk iterator wouldn't accept.
+ * - ASYNC_WALK_STOPPED: the caller stopped the walk.
+ * - ASYNC_WALK_NOT_PNG: the file doesn't begin with a PNG signature.
+ * - ASYNC_WALK_READ_FAILED: the signature or chunk data couldn't be read.
+ * - ASYNC_WALK_CORRUPT: a chunk header after the first couldn't be read.
+ * */
+enum async_walk_status {
+	ASYNC_WALK_DONE,
+	ASYNC_WALK_STOPPED,
+	ASYNC_WALK_NOT_PNG,
+	ASYNC_WALK_READ_FAILED,
+	ASYNC_WALK_CORRUPT
+};
+
+/**
+ * A file being walked. `index` identifies the slot the file occupies, from zero
+ * up to the depth of the walk, so that callers can keep state of their own for
+ * each file in an array of the same depth.
+ * */
+struct async_walk_file {
+	size_t index;
+	struct strbuf path;
+	int fd;
+	mode_t mode;
+	off_t file_len;
+
+	// file offset of the read in flight, and the end of the chunk data being
+	// read, or zero while reading chunk headers
+	off_t offset;
+	off_t data_end;
+
+	unsigned char *buffer;
+};
+
+struct async_walk;
+
+struct async_walk_ops {
+	/*
+	 * Called once a file is opened, before its first read is queued. May be
+	 * NULL.
+	 * */
+	void (*start)(struct async_walk *, struct async_walk_file *);
+
+	/*
+	 * Called with each chunk header of the file, in order. The header is at
+	 * file->offset.
+	 * */
+	enum async_walk_action (*chunk)(struct async_walk *, struct async_walk_file *,
+			const struct png_chunk_detail *);
+
+	/*
+	 * Called with each piece of the data of a chunk whose data was requested,
+	 * in order. Returns non-zero to stop the walk of the file. May be NULL if
+	 * data is never requested.
+	 * */
+	int (*data)(struct async_walk *, struct async_walk_file *, const unsigned char *, size_t);
+
+	/*
+	 * Called once the walk of the file has ended. The file is closed, and its
+	 * slot freed, once this returns.
+	 * */
+	void (*finish)(struct async_walk *, struct async_walk_file *, enum async_walk_status);
+};
+
+struct async_walk {
+	struct io_ring ring;
+	size_t depth;
+	size_t buffer_len;
+	const struct async_walk_ops *ops;
+	void *data;
+
+	struct async_walk_file files[ASYNC_WALK_MAX_DEPTH];
+	size_t free_files[ASYNC_WALK_MAX_DEPTH];
+	size_t free_len;
+};
+
+/**
+ * Set up a walk of up to `depth` files at once, which may be no more than
+ * ASYNC_WALK_MAX_DEPTH. Chunk data is read in pieces of up to `buffer_len`
+ * bytes, which may be zero if data is never requested. `data` is left for the
+ * caller, to be used by the callbacks.
+ *
+ * Returns zero if successful, and -1 if io_uring is unavailable.
+ * */
+int async_walk_init(struct async_walk *walk, size_t depth, size_t buffer_len,
+		const struct async_walk_ops *ops, void *data);
+
+/**
+ * Begin walking the file at `path`. If every slot is taken, this waits for one
+ * of the files being walked to finish first.
+ *
+ * Returns zero if the walk began, 1 if the file is too short to be a PNG, and
+ * -1 if it couldn't be opened. In neither of the latter cases is any callback
+ * invoked for the file.
+ * */
+int async_walk_add(struct async_walk *walk, const char *path);
+
+/**
+ * Wait for every file being walked to finish.
+ * */
+void async_walk_finish(struct async_walk *walk);
+
+/**
+ * Tear down the walk. Every file must have been finished first.
+ * */
+void async_walk_destroy(struct async_walk *walk);
+
+#endif //STEG_PNG_ASYNC_WALK_H
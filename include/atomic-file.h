@@ -0,0 +1,76 @@
+#ifndef STEG_PNG_ATOMIC_FILE_H
+#define STEG_PNG_ATOMIC_FILE_H
+
+#include <sys/types.h>
+
+#include "strbuf.h"
+
+/**
+ * atomic-file api
+ *
+ * The atomic-file api is used to write output files without ever leaving a
+ * partially written or corrupted file at the destination path, and without
+ * writing the data anywhere else first.
+ *
+ * Output is written to an anonymous (O_TMPFILE) or hidden temporary file in the
+ * same directory as the destination. Once committed, the temporary file is
+ * renamed over the destination path in a single atomic step. If the process
+ * exits before the file is committed, the temporary file is removed.
+ *
+ * The special path "-" refers to stdout, in which case data is streamed
+ * directly to stdout and commit/rollback do nothing.
+ *
+ * Atomic files may be opened and committed from several threads at once, as
+ * long as each atomic_file is only used by one thread.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct atomic_file out;
+ * 		if (atomic_file_open(&out, "dest.png", 0644))
+ * 			DIE(FILE_OPEN_FAILED, "dest.png");
+ *
+ * 		write(out.fd, data, len);
+ *
+ * 		if (atomic_file_commit(&out))
+ * 			FATAL("failed to write 'dest.png'");
+ * }
+ * */
+
+struct atomic_file {
+	int fd;
+	struct strbuf path;
+	struct strbuf tmp_path;
+	unsigned int is_stdout: 1;
+	unsigned int is_anonymous: 1;
+	struct atomic_file *next;
+};
+
+/**
+ * Open a file for writing that will be moved to `path` once committed. The new
+ * file will assume the given mode, subject to the process umask. Unless it
+ * refers to stdout, the file can also be read back before it is committed.
+ *
+ * Returns zero if successful, and -1 if the temporary file could not be created.
+ * */
+int atomic_file_open(struct atomic_file *file, const char *path, mode_t mode);
+
+/**
+ * Returns non-zero if the file refers to stdout.
+ * */
+int atomic_file_is_stdout(struct atomic_file *file);
+
+/**
+ * Close the file and atomically move it to its destination path. The
+ * atomic_file must not be used after it is committed.
+ *
+ * Returns zero if successful, and -1 otherwise. On failure, the temporary file
+ * is removed.
+ * */
+int atomic_file_commit(struct atomic_file *file);
+
+/**
+ * Close and remove the temporary file, leaving the destination path untouched.
+ * */
+void atomic_file_rollback(struct atomic_file *file);
+
+#endif //STEG_PNG_ATOMIC_FILE_H
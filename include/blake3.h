@@ -0,0 +1,75 @@
+#ifndef STEG_PNG_BLAKE3_H
+#define STEG_PNG_BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * blake3 api
+ *
+ * A portable implementation of the BLAKE3 cryptographic hash function, in its
+ * default (unkeyed) mode with a 32-byte output. BLAKE3 splits its input into
+ * 1 KiB chunks and combines them in a binary tree, so independent subtrees can
+ * be hashed at the same time. When a hasher is given more than one thread with
+ * blake3_set_threads(), large updates are split across a thread pool; the
+ * digest is the same no matter how many threads are used.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct blake3_hasher hasher;
+ * 		blake3_init(&hasher);
+ * 		blake3_set_threads(&hasher, thread_pool_cpu_count());
+ * 		blake3_update(&hasher, data, len);
+ *
+ * 		unsigned char digest[BLAKE3_DIGEST_SIZE];
+ * 		blake3_final(&hasher, digest);
+ * }
+ * */
+
+#define BLAKE3_DIGEST_SIZE 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+// enough for inputs of up to 2^54 chunks
+#define BLAKE3_MAX_DEPTH 54
+
+struct blake3_chunk_state {
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	size_t block_len;
+	size_t blocks_compressed;
+};
+
+struct blake3_hasher {
+	struct blake3_chunk_state chunk;
+
+	// chaining values of completed subtrees, merged lazily as input arrives
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+	size_t cv_stack_len;
+
+	unsigned int threads;
+};
+
+/**
+ * Initialize the hasher for a new digest, using a single thread.
+ * */
+void blake3_init(struct blake3_hasher *hasher);
+
+/**
+ * Allow the hasher to use up to `threads` threads for large updates.
+ * */
+void blake3_set_threads(struct blake3_hasher *hasher, unsigned int threads);
+
+/**
+ * Hash `len` bytes of input. Larger updates leave more room for parallelism.
+ * */
+void blake3_update(struct blake3_hasher *hasher, const void *input, size_t len);
+
+/**
+ * Write the digest of all input to `digest`, which must have a length of
+ * BLAKE3_DIGEST_SIZE. The hasher is left unchanged, so more input may follow.
+ * */
+void blake3_final(const struct blake3_hasher *hasher, unsigned char digest[]);
+
+#endif //STEG_PNG_BLAKE3_H
@@ -9,5 +9,8 @@ struct steg_png_builtin {
 extern int cmd_embed(int argc, char *argv[]);
 extern int cmd_extract(int argc, char *argv[]);
 extern int cmd_inspect(int argc, char *argv[]);
+extern int cmd_strip(int argc, char *argv[]);
+extern int cmd_scan(int argc, char *argv[]);
+extern int cmd_verify(int argc, char *argv[]);
 
 #endif //STEG_PNG_BUILTIN_H
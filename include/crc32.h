@@ -0,0 +1,61 @@
+#ifndef STEG_PNG_CRC32_H
+#define STEG_PNG_CRC32_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "thread-pool.h"
+
+/**
+ * crc32 api
+ *
+ * Computes the CRC-32 used by PNG chunks (and zlib), with the same conventions
+ * as zlib's crc32_z(): a CRC of zero is the CRC of no data, and the CRC of a
+ * buffer can be updated with more data at any time.
+ *
+ * The engine is selected at runtime from the features of the processor. On
+ * x86, PCLMULQDQ folds 64 bytes of input per iteration with carry-less
+ * multiplication; on ARMv8, the CRC32 instructions consume eight bytes at a
+ * time. Elsewhere, and whenever STEG_PNG_NO_SIMD is defined in the
+ * environment, zlib's crc32_z() is used as is.
+ *
+ * CRC-32 is serial, but the CRCs of consecutive pieces of a buffer can be
+ * computed independently and merged with zlib's crc32_combine(), so
+ * crc32_update_parallel() splits large buffers across the workers of a thread
+ * pool owned by the caller, which can be reused for any number of buffers.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct thread_pool pool;
+ * 		thread_pool_init(&pool, thread_pool_cpu_count());
+ *
+ * 		u_int32_t crc = crc32_update(0, type, CHUNK_TYPE_LENGTH);
+ * 		crc = crc32_update_parallel(crc, data, data_length, &pool);
+ *
+ * 		if (crc != chunk_crc)
+ * 			WARN("invalid CRC");
+ *
+ * 		thread_pool_destroy(&pool);
+ * }
+ * */
+
+/**
+ * Update a running CRC with `len` bytes of data, exactly as crc32_z() would.
+ * */
+u_int32_t crc32_update(u_int32_t crc, const void *data, size_t len);
+
+/**
+ * Update a running CRC exactly like crc32_update(), but on the workers of
+ * `pool` when the buffer is large enough to be worth splitting. The pool must
+ * not be running other jobs, since this waits for it to drain. If `pool` is
+ * NULL, the CRC is computed on the calling thread.
+ * */
+u_int32_t crc32_update_parallel(u_int32_t crc, const void *data, size_t len, struct thread_pool *pool);
+
+/**
+ * Return the name of the engine selected for this processor: "pclmul",
+ * "armv8" or "zlib".
+ * */
+const char *crc32_engine(void);
+
+#endif //STEG_PNG_CRC32_H
@@ -0,0 +1,100 @@
+#ifndef STEG_PNG_DIGEST_H
+#define STEG_PNG_DIGEST_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "md5.h"
+#include "xxh3.h"
+#include "blake3.h"
+
+/**
+ * digest api
+ *
+ * The digest api computes file digests with any of the supported algorithms
+ * through a single interface, so that the algorithm can be chosen by the user
+ * with `--digest`:
+ *
+ * - md5: the default, for compatibility with md5sum and earlier summaries.
+ * - xxh3: the 64-bit XXH3 hash; not cryptographic, but much faster.
+ * - blake3: cryptographic, and hashed on several threads for large inputs.
+ *
+ * Example Usage:
+ * void example() {
+ * 		enum digest_type type;
+ * 		if (digest_type_from_name("blake3", &type))
+ * 			DIE("unknown digest");
+ *
+ * 		struct digest_ctx ctx;
+ * 		digest_init(&ctx, type);
+ * 		digest_set_threads(&ctx, thread_pool_cpu_count());
+ * 		digest_update(&ctx, data, len);
+ *
+ * 		unsigned char digest[DIGEST_MAX_SIZE];
+ * 		digest_final(&ctx, digest);
+ * 		print_digest(stdout, type, digest);
+ * }
+ * */
+
+#define DIGEST_MAX_SIZE BLAKE3_DIGEST_SIZE
+
+enum digest_type {
+	DIGEST_MD5,
+	DIGEST_XXH3,
+	DIGEST_BLAKE3
+};
+
+struct digest_ctx {
+	enum digest_type type;
+	union {
+		struct md5_ctx md5;
+		struct xxh3_state xxh3;
+		struct blake3_hasher blake3;
+	} state;
+};
+
+/**
+ * Look up the digest algorithm with the given name.
+ *
+ * Returns zero if successful, and -1 if no algorithm has that name.
+ * */
+int digest_type_from_name(const char *name, enum digest_type *type);
+
+/**
+ * Return the name of a digest algorithm, as accepted by digest_type_from_name().
+ * */
+const char *digest_name(enum digest_type type);
+
+/**
+ * Return the length in bytes of the digests produced by an algorithm.
+ * */
+size_t digest_size(enum digest_type type);
+
+/**
+ * Initialize a digest context for a new digest.
+ * */
+void digest_init(struct digest_ctx *ctx, enum digest_type type);
+
+/**
+ * Allow the digest to use up to `threads` threads for large updates. Only
+ * blake3 makes use of more than one.
+ * */
+void digest_set_threads(struct digest_ctx *ctx, unsigned int threads);
+
+/**
+ * Hash `len` bytes of input.
+ * */
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len);
+
+/**
+ * Write the digest of all input to `digest`, which must have a length of at
+ * least digest_size().
+ * */
+void digest_final(struct digest_ctx *ctx, unsigned char digest[]);
+
+/**
+ * Print a digest to a stream in lowercase hexadecimal.
+ * */
+void print_digest(FILE *stream, enum digest_type type, const unsigned char digest[]);
+
+#endif //STEG_PNG_DIGEST_H
@@ -0,0 +1,109 @@
+#ifndef STEG_PNG_INFLATE_INDEX_H
+#define STEG_PNG_INFLATE_INDEX_H
+
+#include <sys/types.h>
+
+#include "payload-sink.h"
+#include "steg-stream.h"
+
+/**
+ * inflate-index api
+ *
+ * An inflate index allows random access into a legacy steg stream (a single
+ * zlib stream) without inflating it from the beginning. The index holds a
+ * checkpoint roughly every INFLATE_INDEX_SPAN bytes of inflated data. Each
+ * checkpoint is taken at a DEFLATE block boundary, and records the offset of
+ * the block in the compressed and inflated data, the bit offset of the block
+ * within its first byte, and the 32 KiB of inflated data preceding it. That is
+ * all inflate needs to resume at the checkpoint.
+ *
+ * Building the index requires a single pass over the whole stream. Since the
+ * index can be large, it can be saved to a sidecar file and loaded on later
+ * runs. A saved index records the length and trailer (Adler-32) of the
+ * stream it was built from, and is rejected if they don't match.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct inflate_index index;
+ * 		inflate_index_init(&index);
+ *
+ * 		if (inflate_index_build(&index, &map, &error))
+ * 			DIE("%s", error);
+ *
+ * 		if (inflate_index_extract(&index, &map, offset, len, &sink, &error))
+ * 			DIE("%s", error);
+ *
+ * 		inflate_index_release(&index);
+ * }
+ * */
+
+#define INFLATE_INDEX_WINDOW_SIZE 32768
+#define INFLATE_INDEX_SPAN (4 * 1024 * 1024)
+
+struct inflate_checkpoint {
+	off_t in;
+	off_t out;
+	int bits;
+	unsigned char *window;
+};
+
+struct inflate_index {
+	struct inflate_checkpoint *points;
+	size_t len;
+	size_t alloc;
+
+	// identity of the stream the index was built from
+	off_t stream_len;
+	u_int32_t trailer;
+};
+
+/**
+ * Initialize an empty index. An empty index is valid for inflate_index_extract(),
+ * which then inflates from the beginning of the stream.
+ * */
+void inflate_index_init(struct inflate_index *index);
+
+/**
+ * Build the index with a single pass over the steg stream described by `map`.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt, in which case
+ * `error` describes the problem.
+ * */
+int inflate_index_build(struct inflate_index *index, const struct steg_stream_map *map,
+		const char **error);
+
+/**
+ * Load an index previously saved with inflate_index_save() from the file
+ * descriptor `fd`, and check that it was built from the stream described by
+ * `map`.
+ *
+ * Returns zero if successful, one if the file is not a valid index for this
+ * stream, and -1 if the file could not be read.
+ * */
+int inflate_index_load(struct inflate_index *index, const struct steg_stream_map *map, int fd);
+
+/**
+ * Save the index to the file descriptor `fd`.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+int inflate_index_save(struct inflate_index *index, int fd);
+
+/**
+ * Inflate `len` bytes of the payload starting at payload offset `offset`, and
+ * write them to the sink. Inflation resumes from the last checkpoint at or
+ * before `offset`, and stops as soon as the range has been written. A range
+ * extending beyond the end of the payload is truncated.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt or the payload
+ * could not be written, in which case `error` describes the problem.
+ * */
+int inflate_index_extract(struct inflate_index *index, const struct steg_stream_map *map,
+		off_t offset, off_t len, struct payload_sink *sink, const char **error);
+
+/**
+ * Release any resources held by the index.
+ * */
+void inflate_index_release(struct inflate_index *index);
+
+#endif //STEG_PNG_INFLATE_INDEX_H
@@ -0,0 +1,118 @@
+#ifndef STEG_PNG_IO_RING_H
+#define STEG_PNG_IO_RING_H
+
+#include <sys/types.h>
+
+/**
+ * io-ring api
+ *
+ * A minimal asynchronous read engine on top of Linux io_uring, driven through
+ * raw system calls so that no library is needed. Reads are queued into the
+ * submission ring with io_ring_queue_read(), handed to the kernel in bulk with
+ * io_ring_submit(), and their results collected from the completion ring with
+ * io_ring_reap(). This lets a single thread keep many small reads in flight
+ * across many files, where the synchronous path would wait on each in turn.
+ *
+ * io_uring may be missing from the kernel, or forbidden (for instance by a
+ * seccomp policy or the kernel.io_uring_disabled sysctl), so io_ring_init()
+ * can fail, and callers must fall back to reading synchronously. The engine
+ * can be disabled entirely by defining STEG_PNG_NO_IO_URING in the
+ * environment, which is mostly useful for exercising the fallback.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct io_ring ring;
+ * 		if (io_ring_init(&ring, 64))
+ * 			return read_synchronously();
+ *
+ * 		for (size_t i = 0; i < count; i++)
+ * 			io_ring_queue_read(&ring, fds[i], buffers[i], len, 0, i);
+ *
+ * 		while (ring.in_flight) {
+ * 			if (io_ring_submit(&ring, 1) < 0)
+ * 				DIE("failed to submit reads");
+ *
+ * 			u_int64_t tag;
+ * 			int res;
+ * 			while (io_ring_reap(&ring, &tag, &res))
+ * 				handle_read(tag, res);
+ * 		}
+ *
+ * 		io_ring_destroy(&ring);
+ * }
+ * */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct io_ring {
+	int fd;
+	unsigned int entries;
+
+	// reads queued or submitted, whose completions haven't been reaped yet
+	unsigned int in_flight;
+
+	// reads queued since the last submission
+	unsigned int pending;
+
+	// submission ring, shared with the kernel
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	// completion ring, shared with the kernel
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	size_t sqes_map_len;
+};
+
+/**
+ * Set up a ring able to hold `entries` reads in flight at once.
+ *
+ * Returns zero if successful, and -1 if io_uring is unavailable, in which case
+ * the caller must fall back to synchronous reads.
+ * */
+int io_ring_init(struct io_ring *ring, unsigned int entries);
+
+/**
+ * Queue a read of `len` bytes at `offset` of `fd` into `buffer`, which must
+ * remain valid until the read completes. `tag` is handed back with the result
+ * by io_ring_reap(). The read isn't started until io_ring_submit() is called.
+ *
+ * Returns zero if successful, and -1 if the ring is already full.
+ * */
+int io_ring_queue_read(struct io_ring *ring, int fd, void *buffer, size_t len, off_t offset,
+		u_int64_t tag);
+
+/**
+ * Hand every queued read to the kernel, and wait until at least `wait_nr`
+ * completions are ready to be reaped.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr);
+
+/**
+ * Take the next completed read off the ring, storing its tag in `tag`, and its
+ * result in `res`: the number of bytes read, or a negated errno value.
+ *
+ * Returns 1 if a completion was reaped, and zero if none are ready.
+ * */
+int io_ring_reap(struct io_ring *ring, u_int64_t *tag, int *res);
+
+/**
+ * Tear down the ring. Every read must have been reaped first, since the kernel
+ * may otherwise still write to its buffer.
+ * */
+void io_ring_destroy(struct io_ring *ring);
+
+#endif //STEG_PNG_IO_RING_H
@@ -0,0 +1,61 @@
+#ifndef STEG_PNG_MD5_MB_H
+#define STEG_PNG_MD5_MB_H
+
+#include <stddef.h>
+
+#include "md5.h"
+
+/**
+ * md5-mb api
+ *
+ * A multi-buffer MD5 engine. MD5 is serial within a single message, since each
+ * block depends on the state left by the one before it, but independent
+ * messages can be hashed in lockstep: the state of MD5_MB_LANES messages is
+ * held in the lanes of a vector register, and each step of the compression
+ * function is applied to every lane at once.
+ *
+ * The engine is selected at runtime from the features of the processor: AVX2
+ * hashes eight lanes per instruction, other x86 processors run the same code
+ * compiled for the baseline instruction set, and elsewhere each lane is hashed
+ * in turn with md5_process_block(). Defining STEG_PNG_NO_SIMD in the
+ * environment forces the scalar engine, which is also used whenever only one
+ * or two lanes are given.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct md5_ctx ctx[MD5_MB_LANES];
+ * 		struct md5_ctx *lanes[MD5_MB_LANES];
+ * 		for (size_t i = 0; i < count; i++) {
+ * 			md5_init_ctx(&ctx[i]);
+ * 			lanes[i] = &ctx[i];
+ * 		}
+ *
+ * 		// hash the whole blocks of every buffer at once
+ * 		md5_mb_process_blocks(lanes, buffers, count, len / 64);
+ *
+ * 		for (size_t i = 0; i < count; i++) {
+ * 			md5_process_bytes(buffers[i] + (len & ~63), len & 63, &ctx[i]);
+ * 			md5_finish_ctx(&ctx[i], hashes[i]);
+ * 		}
+ * }
+ * */
+
+#define MD5_MB_LANES 8
+#define MD5_MB_BLOCK_SIZE 64
+
+/**
+ * Hash `blocks` 64-byte blocks from each of the first `lanes` buffers, updating
+ * the corresponding contexts exactly as md5_process_block() would. At most
+ * MD5_MB_LANES lanes may be given, and no context may hold buffered input (as
+ * left by md5_process_bytes() with a length that isn't a multiple of 64).
+ * */
+void md5_mb_process_blocks(struct md5_ctx *ctx[], const unsigned char *const buffers[], size_t lanes,
+		size_t blocks);
+
+/**
+ * Return the name of the engine selected for this processor: "avx2",
+ * "generic" or "scalar".
+ * */
+const char *md5_mb_engine(void);
+
+#endif //STEG_PNG_MD5_MB_H
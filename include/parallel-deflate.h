@@ -0,0 +1,150 @@
+#ifndef STEG_PNG_PARALLEL_DEFLATE_H
+#define STEG_PNG_PARALLEL_DEFLATE_H
+
+#include <stddef.h>
+
+#include "steg-codec.h"
+#include "thread-pool.h"
+#include "zlib.h"
+
+/**
+ * parallel-deflate api
+ *
+ * The parallel-deflate api compresses data into a single zlib stream using
+ * several threads. Input is consumed in rounds. Each round is split into fixed
+ * size blocks, and the blocks are compressed concurrently as raw DEFLATE.
+ *
+ * Each block is primed with the last 32 KiB of the input preceding it as a
+ * preset dictionary, so compression is nearly as good as with a single stream.
+ * Every block but the last ends with a sync flush, which pads the block to a
+ * byte boundary with an empty stored block, so the compressed blocks can simply
+ * be concatenated. The zlib header and the Adler-32 of the whole input (combined
+ * from the checksums of each block) are written around the blocks, and the
+ * result decodes with a plain inflate().
+ *
+ * Alternatively, the compressor can produce a segmented steg stream (see
+ * steg-stream.h), in which case each block is compressed independently with
+ * any codec (see steg-codec.h) and prefixed with a segment header, so the
+ * blocks can also be decompressed concurrently.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct parallel_deflate pd;
+ * 		parallel_deflate_init(&pd, Z_DEFAULT_COMPRESSION, 4);
+ *
+ * 		int finish = 0;
+ * 		while (!finish) {
+ * 			size_t capacity;
+ * 			unsigned char *in = parallel_deflate_input(&pd, &capacity);
+ * 			size_t len = fill(in, capacity);
+ * 			finish = len < capacity;
+ *
+ * 			const unsigned char *out;
+ * 			size_t out_len;
+ * 			if (parallel_deflate_round(&pd, len, finish, &out, &out_len))
+ * 				FATAL("compression failed");
+ *
+ * 			write(fd, out, out_len);
+ * 		}
+ *
+ * 		parallel_deflate_destroy(&pd);
+ * }
+ * */
+
+#define PARALLEL_DEFLATE_BLOCK_SIZE 131072
+#define PARALLEL_DEFLATE_SEGMENT_SIZE 1048576
+#define PARALLEL_DEFLATE_DICT_SIZE 32768
+
+struct parallel_deflate_block {
+	struct z_stream_s strm;
+	struct steg_codec_encoder encoder;
+	int level;
+
+	const unsigned char *in;
+	size_t in_len;
+	const unsigned char *dict;
+	size_t dict_len;
+	int last;
+	int segmented;
+
+	unsigned char *out;
+	size_t out_len;
+	size_t out_capacity;
+
+	uLong adler;
+	uLong crc;
+	int status;
+};
+
+struct parallel_deflate {
+	struct thread_pool pool;
+	int level;
+	enum steg_codec codec;
+	unsigned int segmented: 1;
+
+	// flags written to the stream header, if segmented
+	unsigned char stream_flags;
+
+	// input for the current round, one block per worker
+	size_t block_size;
+	unsigned char *input;
+	size_t input_capacity;
+
+	struct parallel_deflate_block *blocks;
+	unsigned int block_count;
+
+	// tail of the input from the previous round
+	unsigned char dictionary[PARALLEL_DEFLATE_DICT_SIZE];
+	size_t dictionary_len;
+
+	uLong adler;
+	unsigned int header_written: 1;
+	unsigned int finished: 1;
+
+	// compressed output of the most recent round
+	unsigned char *output;
+	size_t output_capacity;
+};
+
+/**
+ * Initialize the parallel compressor with the given zlib compression level and
+ * number of threads. The first round of output begins with the zlib header.
+ * */
+void parallel_deflate_init(struct parallel_deflate *pd, int level, unsigned int threads);
+
+/**
+ * Initialize the parallel compressor like parallel_deflate_init(), but produce
+ * a segmented steg stream whose segments are compressed with `codec` instead of
+ * a single zlib stream. Each segment holds PARALLEL_DEFLATE_SEGMENT_SIZE bytes
+ * of input, except the last.
+ * */
+void parallel_deflate_init_segmented(struct parallel_deflate *pd, enum steg_codec codec, int level,
+		unsigned int threads);
+
+/**
+ * Get the buffer into which input for the next round should be placed, and
+ * store its length in `capacity`.
+ * */
+unsigned char *parallel_deflate_input(struct parallel_deflate *pd, size_t *capacity);
+
+/**
+ * Compress the first `len` bytes of the input buffer. If `finish` is non-zero,
+ * this is the last round, and the stream is terminated with the zlib trailer
+ * (or end of stream marker, if segmented).
+ * Rounds other than the last must fill the input buffer, unless segmented, in
+ * which case a partially filled round simply ends with a shorter segment. The
+ * next round then begins on a segment boundary.
+ *
+ * On success, `out` and `out_len` describe the compressed output of this round,
+ * which remains valid until the next round, and zero is returned. Returns -1 if
+ * the codec failed unexpectedly.
+ * */
+int parallel_deflate_round(struct parallel_deflate *pd, size_t len, int finish,
+		const unsigned char **out, size_t *out_len);
+
+/**
+ * Stop the worker threads and release any resources held by the compressor.
+ * */
+void parallel_deflate_destroy(struct parallel_deflate *pd);
+
+#endif //STEG_PNG_PARALLEL_DEFLATE_H
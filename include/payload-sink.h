@@ -0,0 +1,110 @@
+#ifndef STEG_PNG_PAYLOAD_SINK_H
+#define STEG_PNG_PAYLOAD_SINK_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "atomic-file.h"
+
+/**
+ * payload-sink api
+ *
+ * A payload sink is the destination of data extracted from a PNG image. Data
+ * written to the sink is delivered, in a single pass, to any combination of
+ * an output file (written atomically, see atomic-file.h), stdout, and a
+ * canonical hexdump. A sink with no destinations simply discards the data,
+ * which is useful when only validating a payload.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct payload_sink sink;
+ * 		payload_sink_init(&sink);
+ *
+ * 		if (payload_sink_open_file(&sink, "out.bin", 0644))
+ * 			DIE(FILE_OPEN_FAILED, "out.bin");
+ * 		payload_sink_hexdump(&sink, stdout);
+ *
+ * 		if (payload_sink_write(&sink, data, len))
+ * 			FATAL("failed to write payload");
+ *
+ * 		if (payload_sink_commit(&sink))
+ * 			FATAL("failed to write payload");
+ * }
+ * */
+
+#define HEXDUMP_LINE_LENGTH 16
+
+struct payload_sink {
+	off_t len;
+
+	unsigned int to_file: 1;
+	struct atomic_file file;
+
+	unsigned int to_hexdump: 1;
+	FILE *hexdump_stream;
+	unsigned char hexdump_line[HEXDUMP_LINE_LENGTH];
+	size_t hexdump_line_len;
+};
+
+/**
+ * Initialize a payload sink with no destinations.
+ * */
+void payload_sink_init(struct payload_sink *sink);
+
+/**
+ * Deliver data written to the sink to the file at `path`, which will assume
+ * the given mode. If `path` is "-", data is streamed to stdout.
+ *
+ * Returns zero if successful, and -1 if the file could not be opened.
+ * */
+int payload_sink_open_file(struct payload_sink *sink, const char *path, mode_t mode);
+
+/**
+ * Print a canonical hexdump of data written to the sink to the given stream.
+ * */
+void payload_sink_hexdump(struct payload_sink *sink, FILE *stream);
+
+/**
+ * Write data to every destination of the sink.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+int payload_sink_write(struct payload_sink *sink, const void *data, size_t len);
+
+/**
+ * Returns non-zero if data can be written to the sink at arbitrary offsets with
+ * payload_sink_pwrite(); that is, if the sink writes only to an output file
+ * other than stdout.
+ * */
+int payload_sink_is_seekable(struct payload_sink *sink);
+
+/**
+ * Write data to the output file of a seekable sink at the given offset. This
+ * may be called from several threads at once.
+ *
+ * The length of the sink is not updated; once all data has been written, the
+ * caller must record the total length with payload_sink_set_length().
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+int payload_sink_pwrite(struct payload_sink *sink, const void *data, size_t len, off_t offset);
+
+/**
+ * Record the length of data written to a seekable sink with payload_sink_pwrite().
+ * */
+void payload_sink_set_length(struct payload_sink *sink, off_t len);
+
+/**
+ * Complete the sink, flushing any buffered hexdump output and committing the
+ * output file.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+int payload_sink_commit(struct payload_sink *sink);
+
+/**
+ * Abandon the sink, leaving the destination path of the output file untouched.
+ * */
+void payload_sink_rollback(struct payload_sink *sink);
+
+#endif //STEG_PNG_PAYLOAD_SINK_H
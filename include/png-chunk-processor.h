@@ -42,10 +42,27 @@
  * 		close(fd);
  * }
  *
+ * Memory-Mapped Iterator:
+ * Large files can be processed without a read() per chunk by initializing the
+ * context with chunk_iterator_init_mmap_ctx() instead. The whole file is mapped
+ * once, and chunk data can be accessed directly through
+ * chunk_iterator_get_chunk_data(). All other functions behave identically
+ * regardless of how the context was initialized.
+ *
+ * Digests:
+ * The digest of a memory-mapped file can be computed as the iterator walks it,
+ * through chunk_iterator_begin_digest() and chunk_iterator_finish_digest().
+ * Chunks are hashed from the mapping as the iterator advances past them, while
+ * their pages are being brought in for the caller anyway, so that summarizing
+ * the file afterwards doesn't require reading it again. Small chunks are hashed
+ * a few megabytes at a time, which leaves room for digests that hash large
+ * inputs on several threads.
  * */
 
 #define SIGNATURE_LENGTH 8
 #define CHUNK_TYPE_LENGTH 4
+#define CHUNK_HEADER_LENGTH (sizeof(u_int32_t) + (sizeof(char) * CHUNK_TYPE_LENGTH))
+#define CHUNK_LENGTH(data_len) (CHUNK_HEADER_LENGTH + (data_len) + sizeof(u_int32_t))
 
 extern unsigned char PNG_SIG[];
 
@@ -54,31 +71,128 @@ extern const char PLTE_CHUNK_TYPE[];
 extern const char IDAT_CHUNK_TYPE[];
 extern const char IEND_CHUNK_TYPE[];
 
+struct digest_ctx;
+
 struct png_chunk_detail {
 	char chunk_type[CHUNK_TYPE_LENGTH];
 	u_int32_t data_length;
 	u_int32_t chunk_crc;
 };
 
+/**
+ * Decode the raw chunk header `header`, CHUNK_HEADER_LENGTH bytes in length,
+ * found at file offset `offset` of a file that is `file_len` bytes in length,
+ * or -1 if the length isn't known. The CRC of the chunk is left unset.
+ *
+ * Every walk over the chunks of a file applies the same checks through this
+ * function, so that walks agree on where a file ends.
+ *
+ * Returns zero if the header was decoded. Returns 1 if the chunk type isn't
+ * ASCII, or if the file is too short to hold the whole chunk, in which case the
+ * walk should end at this chunk.
+ * */
+int png_chunk_decode_header(const unsigned char *header, off_t offset, off_t file_len,
+		struct png_chunk_detail *chunk);
+
 struct chunk_iterator_ctx {
 	int fd;
 	unsigned int initialized: 1;
 	off_t chunk_file_offset;
 	struct png_chunk_detail current_chunk;
+
+	/*
+	 * The header of the chunk following the current chunk is decoded at most
+	 * once, by whichever of chunk_iterator_has_next() or chunk_iterator_next()
+	 * needs it first, and cached here. The CRC of the current chunk is read
+	 * lazily, since most callers that don't consume the chunk data don't need it.
+	 * */
+	unsigned int lookahead_valid: 1;
+	unsigned int crc_valid: 1;
+	off_t next_chunk_file_offset;
+	struct png_chunk_detail next_chunk;
+
+	/*
+	 * File offset of the next byte of chunk data to be read by
+	 * chunk_iterator_read_data(), and the length of the file, if known.
+	 * */
+	off_t data_offset;
+	off_t file_len;
+	unsigned int is_stream: 1;
+
+	/*
+	 * Read buffer for contexts backed by a file descriptor. `buffer_offset` is
+	 * the file offset of the first byte in the buffer.
+	 * */
+	unsigned char *buffer;
+	size_t buffer_capacity;
+	size_t buffer_len;
+	off_t buffer_offset;
+
+	// populated only when the context is backed by a memory mapping
+	unsigned char *map;
+	size_t map_len;
+
+	// digest of the file, and the offset of the first byte not yet hashed
+	struct digest_ctx *digest;
+	off_t digest_offset;
 };
 
 /**
  * Initialize a chunk_iterator_ctx. The file descriptor must be a valid open
- * file descriptor, and cannot be a socket, pipe or FIFO.
+ * file descriptor.
  *
  * Reads the the first eight bytes from the file and verifies that the file
  * is a valid PNG file.
  *
+ * The file is read through an internal buffer with pread(), so the file offset
+ * of the descriptor is never modified, and walking chunk headers costs roughly
+ * one read for every few chunks.
+ *
+ * If the file descriptor refers to a socket, pipe or FIFO, the file is instead
+ * read front to back with read(), starting from the current position of the
+ * stream. In this case, chunk data can only be read before advancing past the
+ * chunk, and fetching the CRC of a chunk discards any of its data that has not
+ * yet been read.
+ *
  * Returns -1 if unable to read from file, returns 1 if the file signature is
  * invalid, and returns 0 if the context was initialized successfully.
  * */
 int chunk_iterator_init_ctx(struct chunk_iterator_ctx *ctx, int fd);
 
+/**
+ * Initialize a chunk_iterator_ctx like chunk_iterator_init_ctx(), but with a
+ * read buffer that holds just a single chunk header. Walking the chunks then
+ * reads the signature and each chunk header with one pread() apiece, and never
+ * touches chunk data, which suits callers that only look at chunk types, like
+ * scanning large numbers of files.
+ *
+ * Chunk data can still be read, just less efficiently.
+ *
+ * Return values are identical to chunk_iterator_init_ctx().
+ * */
+int chunk_iterator_init_header_ctx(struct chunk_iterator_ctx *ctx, int fd);
+
+/**
+ * Initialize a chunk_iterator_ctx backed by a read-only memory mapping of the
+ * file. The file descriptor must be a valid open file descriptor, and must
+ * remain open until the context is destroyed.
+ *
+ * If the file cannot be mapped (for instance, if it's empty or isn't a regular
+ * file), the context falls back to reading from the file descriptor, exactly as
+ * if initialized through chunk_iterator_init_ctx(), as it does for every file
+ * once chunk_iterator_disable_mmap() has been called.
+ *
+ * Return values are identical to chunk_iterator_init_ctx().
+ * */
+int chunk_iterator_init_mmap_ctx(struct chunk_iterator_ctx *ctx, int fd);
+
+/**
+ * Make chunk_iterator_init_mmap_ctx() read every file through its file
+ * descriptor, rather than mapping it. This is mostly useful for exercising the
+ * fallback, and must be called before any iterator is initialized.
+ * */
+void chunk_iterator_disable_mmap(void);
+
 /**
  * Determine whether there are any file chunks left to be processed by this chunk
  * iterator, without advancing the iterator.
@@ -101,6 +215,33 @@ int chunk_iterator_has_next(struct chunk_iterator_ctx *ctx);
  * */
 int chunk_iterator_next(struct chunk_iterator_ctx *ctx);
 
+/**
+ * Reposition the chunk iterator so that the next call to chunk_iterator_next()
+ * advances to the chunk at the given file offset, rather than the chunk
+ * following the current one. Iteration then continues from that chunk. This is
+ * useful when the location of a chunk is known in advance, since the chunks
+ * before it need not be walked.
+ *
+ * If the context reads from a stream, the iterator can only be moved forward.
+ *
+ * Returns 0 if a chunk header was found at the offset, and 1 if not. If an
+ * unexpected error occurs, -1 is returned and this chunk iterator is no longer
+ * reliable.
+ * */
+int chunk_iterator_seek(struct chunk_iterator_ctx *ctx, off_t offset);
+
+/**
+ * Advance the chunk iterator straight to the IEND chunk, without walking the
+ * chunks before it. Since IEND carries no data and must be the last chunk, it
+ * is located by reading the last CHUNK_LENGTH(0) bytes of the file.
+ *
+ * Returns 0 if the iterator was advanced to IEND. Returns 1 if the file doesn't
+ * end with an IEND chunk (for instance, if data trails the IEND chunk), or if
+ * the context reads from a stream. If an unexpected error occurs, -1 is
+ * returned and this chunk iterator is no longer reliable.
+ * */
+int chunk_iterator_find_iend(struct chunk_iterator_ctx *ctx);
+
 /**
  * Read at most 'length' bytes from the current chunk data into the buffer. If
  * all bytes have been read for the current chunk, returns zero and the buffer
@@ -108,6 +249,22 @@ int chunk_iterator_next(struct chunk_iterator_ctx *ctx);
  * */
 ssize_t chunk_iterator_read_data(struct chunk_iterator_ctx *ctx, unsigned char *buffer, size_t length);
 
+/**
+ * Returns non-zero if the context reads from a stream (socket, pipe or FIFO),
+ * in which case the file cannot be read at arbitrary offsets, and zero otherwise.
+ * */
+int chunk_iterator_is_stream(struct chunk_iterator_ctx *ctx);
+
+/**
+ * Get a pointer to the data of the current chunk within the memory mapping. The
+ * pointer remains valid until the context is destroyed. The length of the data
+ * can be obtained through chunk_iterator_get_chunk_data_length().
+ *
+ * Returns NULL if the context is not backed by a memory mapping, or if
+ * chunk_iterator_next() has not yet been called.
+ * */
+const unsigned char *chunk_iterator_get_chunk_data(struct chunk_iterator_ctx *ctx);
+
 /**
  * Get the length of the data for the current chunk, in host byte order.
  * The length is written to 'len'.
@@ -125,7 +282,9 @@ int chunk_iterator_get_chunk_data_length(struct chunk_iterator_ctx *ctx, u_int32
 int chunk_iterator_get_chunk_type(struct chunk_iterator_ctx *ctx, char type[]);
 
 /**
- * Get the CRC for the current chunk, in host byte order.
+ * Get the CRC for the current chunk, in host byte order. The CRC is read from
+ * the file on first access, so this may require a read if the chunk data has
+ * not been consumed.
  *
  * Returns zero if successful, and non-zero otherwise.
  * */
@@ -150,7 +309,27 @@ int chunk_iterator_is_critical(struct chunk_iterator_ctx *ctx);
 int chunk_iterator_is_ancillary(struct chunk_iterator_ctx *ctx);
 
 /**
- * Destroy a chunk_iterator_ctx.
+ * Begin computing the digest of the whole file into `digest`, which must have
+ * been initialized with digest_init() and must remain valid until
+ * chunk_iterator_finish_digest() is called. As the iterator advances, the file
+ * is hashed up to the chunks it has walked, so bytes skipped by
+ * chunk_iterator_seek() are hashed too.
+ *
+ * Returns zero if successful, and -1 if the context is not backed by a memory
+ * mapping, in which case the file must be hashed some other way.
+ * */
+int chunk_iterator_begin_digest(struct chunk_iterator_ctx *ctx, struct digest_ctx *digest);
+
+/**
+ * Hash the rest of the file, including any data trailing the last chunk, and
+ * write the digest begun by chunk_iterator_begin_digest() to `hash`, which must
+ * have a length of at least digest_size().
+ * */
+void chunk_iterator_finish_digest(struct chunk_iterator_ctx *ctx, unsigned char hash[]);
+
+/**
+ * Destroy a chunk_iterator_ctx. If the context is backed by a memory mapping,
+ * the file is unmapped. The file descriptor is not closed.
  * */
 void chunk_iterator_destroy_ctx(struct chunk_iterator_ctx *ctx);
 
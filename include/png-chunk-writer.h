@@ -0,0 +1,235 @@
+#ifndef STEG_PNG_PNG_CHUNK_WRITER_H
+#define STEG_PNG_PNG_CHUNK_WRITER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "png-chunk-processor.h"
+#include "thread-pool.h"
+
+/**
+ * png-chunk-writer usage:
+ *
+ * The png-chunk-writer API can be used to write PNG chunks to a file with as
+ * few system calls as possible. The length, type, data and CRC of a chunk are
+ * not written individually; instead, they are queued and written together with
+ * a single writev() once the queue fills up or the writer is flushed. Byte
+ * ranges that should be copied verbatim from another file are also queued, and
+ * consecutive ranges are coalesced into a single copy_file_range_fd().
+ *
+ * Data given to the writer is not copied, so it must remain valid and unchanged
+ * until the writer is next flushed.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct chunk_writer writer;
+ * 		chunk_writer_init(&writer, out_fd);
+ *
+ * 		if (chunk_writer_write_raw(&writer, PNG_SIG, SIGNATURE_LENGTH))
+ * 			FATAL("failed to write signature");
+ *
+ * 		// copy a chunk from another file
+ * 		if (chunk_writer_copy_range(&writer, in_fd, offset, length))
+ * 			FATAL("failed to copy chunk");
+ *
+ * 		// write a chunk with a known data buffer
+ * 		if (chunk_writer_write_chunk(&writer, type, data, data_length))
+ * 			FATAL("failed to write chunk");
+ *
+ * 		// or stream the chunk data in pieces
+ * 		chunk_writer_begin_chunk(&writer, type, data_length);
+ * 		chunk_writer_write_data(&writer, piece, piece_length);
+ * 		chunk_writer_flush(&writer); // before `piece` is reused
+ * 		...
+ * 		chunk_writer_end_chunk(&writer, chunk_writer_get_crc(&writer));
+ *
+ * 		if (chunk_writer_flush(&writer))
+ * 			FATAL("failed to write chunks");
+ * }
+ *
+ * Digests:
+ * The writer can compute the digest of everything it writes, as it's
+ * written (see chunk_writer_begin_digest()). Queued data is hashed just before
+ * it's handed to writev(). Copied ranges never pass through the writer, so they
+ * are hashed from a memory mapping of the file they're copied from, such as
+ * the one held by a chunk_iterator_ctx.
+ *
+ * Bytes written as a placeholder to be filled in later can't be hashed as
+ * they're written, and neither can anything after them, since the digest must
+ * be computed in order. Once chunk_writer_defer_digest() is called, the writer
+ * records the ranges written after the placeholder instead: copied ranges by
+ * their place in the mapping, and queued data by keeping a copy of it. Only the
+ * placeholder itself is read back from the file, once it has been filled in, by
+ * chunk_writer_finish_digest().
+ * */
+
+#define CHUNK_WRITER_MAX_CHUNKS 16
+#define CHUNK_WRITER_MAX_IOVECS 64
+
+struct digest_ctx;
+
+/**
+ * A range of the output file whose digest was deferred. `data` points into the
+ * source mapping if the range was copied from it, and is NULL if the range was
+ * queued data, which is kept at `retained_offset` in the writer's copy.
+ * */
+struct chunk_writer_extent {
+	size_t retained_offset;
+	size_t len;
+	const unsigned char *data;
+};
+
+struct chunk_writer {
+	int fd;
+
+	// iovecs queued for the next writev()
+	struct iovec iov[CHUNK_WRITER_MAX_IOVECS];
+	size_t iov_count;
+
+	// storage for the length, type and CRC fields of queued chunks
+	unsigned char headers[CHUNK_WRITER_MAX_CHUNKS][CHUNK_HEADER_LENGTH];
+	unsigned char crcs[CHUNK_WRITER_MAX_CHUNKS][sizeof(u_int32_t)];
+	size_t chunk_count;
+
+	// running CRC of the chunk being written, and the pool it may use
+	u_int32_t crc;
+	struct thread_pool *crc_pool;
+
+	// byte range of another file waiting to be copied
+	int copy_fd;
+	off_t copy_offset;
+	size_t copy_len;
+
+	// total bytes written or queued through the writer
+	off_t offset;
+
+	// total bytes actually written to the file
+	off_t written;
+
+	/*
+	 * Digest of the bytes written, and the mapping of the file that ranges are
+	 * copied from. Once deferred, the placeholder is located by its offset
+	 * relative to where the writer began writing, and the ranges written after
+	 * it are recorded instead.
+	 * */
+	struct digest_ctx *digest;
+	unsigned int digest_deferred: 1;
+	unsigned int digest_failed: 1;
+	off_t digest_base;
+	off_t placeholder_offset;
+	size_t placeholder_len;
+	int source_fd;
+	const unsigned char *source_map;
+	size_t source_len;
+	struct chunk_writer_extent *extents;
+	size_t extents_len;
+	size_t extents_alloc;
+	unsigned char *retained;
+	size_t retained_len;
+	size_t retained_alloc;
+};
+
+/**
+ * Initialize a chunk_writer that writes to the file descriptor `fd` at its
+ * current file offset.
+ * */
+void chunk_writer_init(struct chunk_writer *writer, int fd);
+
+/**
+ * Queue arbitrary bytes, such as the PNG signature, to be written.
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_write_raw(struct chunk_writer *writer, const void *data, size_t len);
+
+/**
+ * Queue a copy of `len` bytes of the file `src_fd`, starting at `offset`. If the
+ * range immediately follows the previously queued range of the same file, the
+ * two are merged.
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_copy_range(struct chunk_writer *writer, int src_fd, off_t offset, size_t len);
+
+/**
+ * Queue a complete chunk with the given type and data. The CRC is computed over
+ * the chunk type and data.
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_write_chunk(struct chunk_writer *writer, const char type[],
+		const void *data, u_int32_t len);
+
+/**
+ * Begin a chunk with the given type and data length. The chunk data must then
+ * be queued through chunk_writer_write_data(), and the chunk completed with
+ * chunk_writer_end_chunk().
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_begin_chunk(struct chunk_writer *writer, const char type[], u_int32_t len);
+
+/**
+ * Queue a portion of the data of the current chunk, and update the running CRC.
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_write_data(struct chunk_writer *writer, const void *data, size_t len);
+
+/**
+ * Allow the CRC of large pieces of chunk data to be computed on the workers of
+ * `pool` (see crc32_update_parallel()), which must outlive the writer. By
+ * default, the writer computes CRCs on the calling thread.
+ * */
+void chunk_writer_set_pool(struct chunk_writer *writer, struct thread_pool *pool);
+
+/**
+ * Get the CRC computed over the type and data of the current chunk so far.
+ * */
+u_int32_t chunk_writer_get_crc(struct chunk_writer *writer);
+
+/**
+ * Complete the current chunk, writing `crc` (in host byte order) as its CRC.
+ * Usually, this is the value returned by chunk_writer_get_crc().
+ *
+ * Returns zero if successful, and -1 if queued data could not be written.
+ * */
+int chunk_writer_end_chunk(struct chunk_writer *writer, u_int32_t crc);
+
+/**
+ * Write everything queued in the writer to the file.
+ *
+ * Returns zero if successful, and -1 if the data could not be written.
+ * */
+int chunk_writer_flush(struct chunk_writer *writer);
+
+/**
+ * Begin computing the digest of everything written through the writer from now
+ * on into `digest`, which must have been initialized with digest_init() and
+ * must remain valid until the digest is finished.
+ * Ranges copied from `source_fd` are hashed from `source_map`, the mapping of
+ * its first `source_len` bytes. Copying from any other file, or from beyond the
+ * mapping, makes the digest unavailable.
+ * */
+void chunk_writer_begin_digest(struct chunk_writer *writer, struct digest_ctx *digest,
+		int source_fd, const unsigned char *source_map, size_t source_len);
+
+/**
+ * Declare the next `len` bytes written to be a placeholder that will be
+ * overwritten before the digest is finished. Everything written after it is
+ * recorded rather than hashed, and queued data is kept in memory until then.
+ * The output file must be open for reading as well as writing.
+ * */
+void chunk_writer_defer_digest(struct chunk_writer *writer, size_t len);
+
+/**
+ * Flush the writer, read back the placeholder, hash it along with everything
+ * written after it, and write the digest to `hash`, which must have a length of
+ * at least digest_size().
+ *
+ * Returns zero if successful, and -1 if the digest is unavailable or the
+ * placeholder could not be read back.
+ * */
+int chunk_writer_finish_digest(struct chunk_writer *writer, unsigned char hash[]);
+
+#endif //STEG_PNG_PNG_CHUNK_WRITER_H
@@ -0,0 +1,130 @@
+#ifndef STEG_PNG_STEG_ARCHIVE_H
+#define STEG_PNG_STEG_ARCHIVE_H
+
+#include <sys/types.h>
+
+#include "steg-stream.h"
+
+/**
+ * steg-archive api
+ *
+ * An archive is a segmented steg stream holding several named members, such as
+ * a manifest and the files it describes, with the STEG_STREAM_FLAG_ARCHIVE flag
+ * set in its stream header. The members are written one after the other, each
+ * beginning with a new segment, and the stream is ended as usual. A table of
+ * contents then follows the end of the stream. All fields are big-endian:
+ *
+ * 		+-------+
+ * 		| count |
+ * 		+-------+
+ *
+ * followed by `count` entries, one per member, in stream order:
+ *
+ * 		+-----------------------+------------+-------------+------+
+ * 		| stream offset (8)     | length (8) | name length | name |
+ * 		+-----------------------+------------+-------------+------+
+ *
+ * where the stream offset is that of the first segment header of the member,
+ * the length is the uncompressed length of the member, and the name length is
+ * two bytes. Finally, the trailer closes the stream:
+ *
+ * 		+------------+------------------+------+------+------+------+
+ * 		| TOC length | CRC-32 of TOC    | 'S'  | 'T'  | 'O'  | 'C'  |
+ * 		+------------+------------------+------+------+------+------+
+ *
+ * so that the table of contents can be found by reading backwards from the end
+ * of the stream, without walking the segments of the members.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct steg_archive archive;
+ * 		if (steg_archive_read(&archive, &map, &error) < 0)
+ * 			DIE("%s", error);
+ *
+ * 		const struct steg_archive_member *member = steg_archive_find(&archive, name);
+ * 		if (member && steg_stream_extract_member(&map, member->stream_offset,
+ * 				member->len, 0, member->len, &sink, &error))
+ * 			DIE("%s", error);
+ *
+ * 		steg_archive_release(&archive);
+ * }
+ * */
+
+#define STEG_ARCHIVE_MAGIC "STOC"
+#define STEG_ARCHIVE_MAGIC_LENGTH 4
+#define STEG_ARCHIVE_HEADER_LENGTH 4
+#define STEG_ARCHIVE_ENTRY_LENGTH 18
+#define STEG_ARCHIVE_TRAILER_LENGTH 12
+#define STEG_ARCHIVE_NAME_MAX 4096
+#define STEG_ARCHIVE_MAX_LENGTH (16 * 1024 * 1024)
+
+struct steg_archive_member {
+	char *name;
+	off_t stream_offset;
+	off_t len;
+};
+
+struct steg_archive {
+	struct steg_archive_member *members;
+	size_t len;
+	size_t alloc;
+};
+
+/**
+ * Initialize an empty archive.
+ * */
+void steg_archive_init(struct steg_archive *archive);
+
+/**
+ * Append a member with the given name to the archive. The name is copied.
+ * */
+void steg_archive_add(struct steg_archive *archive, const char *name, off_t stream_offset, off_t len);
+
+/**
+ * Find the member with the given name.
+ *
+ * Returns the member, or NULL if the archive has no such member.
+ * */
+const struct steg_archive_member *steg_archive_find(const struct steg_archive *archive, const char *name);
+
+/**
+ * Compute the length of the encoded table of contents of the archive, including
+ * its trailer. Since every field but the names is of fixed length, this is
+ * known as soon as the names of the members are.
+ * */
+size_t steg_archive_encoded_length(const struct steg_archive *archive);
+
+/**
+ * Encode the table of contents of the archive, and its trailer, into `buffer`,
+ * which must be steg_archive_encoded_length() bytes in length.
+ * */
+void steg_archive_encode(const struct steg_archive *archive, unsigned char *buffer);
+
+/**
+ * Read the table of contents of the archive held in the steg stream described
+ * by `map`. The archive is initialized by this function.
+ *
+ * Returns zero if successful. Returns 1 if the stream is not an archive.
+ * Returns -1 if the table of contents is corrupt, in which case `error`
+ * describes the problem. In any case, the archive must be released.
+ * */
+int steg_archive_read(struct steg_archive *archive, const struct steg_stream_map *map, const char **error);
+
+/**
+ * Walk the table of contents beginning at offset `offset` of the steg stream,
+ * just after the end of stream marker of an archive, and store the offset just
+ * past its trailer in `end`. Only the fixed length fields of each entry are
+ * read.
+ *
+ * Returns zero if successful, and -1 if the table of contents is corrupt, in
+ * which case `error` describes the problem.
+ * */
+int steg_archive_skip_toc(const struct steg_stream_map *map, off_t offset, off_t *end,
+		const char **error);
+
+/**
+ * Release any resources held by the archive.
+ * */
+void steg_archive_release(struct steg_archive *archive);
+
+#endif //STEG_PNG_STEG_ARCHIVE_H
@@ -0,0 +1,194 @@
+#ifndef STEG_PNG_STEG_CODEC_H
+#define STEG_PNG_STEG_CODEC_H
+
+#include <stddef.h>
+
+#include "zlib.h"
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * steg-codec api
+ *
+ * The segments of a segmented steg stream (see steg-stream.h) are compressed
+ * with the codec named in the stream header. The steg-codec api compresses and
+ * decompresses segments with any of the codecs built into steg-png through a
+ * single interface, so that the codec can be chosen by the user with `--codec`:
+ *
+ * - zlib: the default, and the only codec of legacy streams. When steg-png is
+ *   built with libdeflate, whole segments are compressed and decompressed with
+ *   libdeflate instead, which produces ordinary zlib streams much faster.
+ * - store: segments are stored as is, without any compression.
+ * - zstd: Zstandard frames, which decompress several times faster than zlib.
+ *   Only available if steg-png is built with libzstd.
+ *
+ * Segments are always held in memory in full when compressed, so encoders
+ * compress a whole segment at once. Decoders can either decompress a whole
+ * segment at once, or decompress a segment step by step as its compressed data
+ * is received, like inflate().
+ *
+ * Example Usage:
+ * void example() {
+ * 		enum steg_codec codec;
+ * 		if (steg_codec_from_name("zstd", &codec))
+ * 			DIE("unknown codec");
+ *
+ * 		struct steg_codec_encoder encoder;
+ * 		steg_codec_encoder_init(&encoder, codec, Z_DEFAULT_COMPRESSION);
+ * 		if (steg_codec_compress(&encoder, in, in_len, out, out_capacity, &out_len))
+ * 			DIE("compression failed");
+ * 		steg_codec_encoder_destroy(&encoder);
+ *
+ * 		struct steg_codec_decoder decoder;
+ * 		steg_codec_decoder_init(&decoder, codec);
+ * 		steg_codec_decoder_begin(&decoder, out_len);
+ * 		while ((status = steg_codec_decompress_step(&decoder, &next_in, &avail_in,
+ * 				&next_out, &avail_out)) == STEG_CODEC_OK)
+ * 			...
+ * 		steg_codec_decoder_destroy(&decoder);
+ * }
+ * */
+
+/**
+ * Each codec is identified in the stream header by its value, so values must
+ * never change.
+ * */
+enum steg_codec {
+	STEG_CODEC_ZLIB = 0,
+	STEG_CODEC_STORE = 1,
+	STEG_CODEC_ZSTD = 2
+};
+
+#ifdef HAVE_ZSTD
+#define STEG_CODEC_NAMES "zlib (default), store or zstd"
+#else
+#define STEG_CODEC_NAMES "zlib (default) or store"
+#endif
+
+#define STEG_CODEC_ERROR (-1)
+#define STEG_CODEC_OK 0
+#define STEG_CODEC_END 1
+
+struct steg_codec_encoder {
+	enum steg_codec codec;
+	int level;
+
+	union {
+#ifdef HAVE_LIBDEFLATE
+		struct libdeflate_compressor *libdeflate;
+#else
+		struct z_stream_s zlib;
+#endif
+#ifdef HAVE_ZSTD
+		ZSTD_CCtx *zstd;
+#endif
+	} state;
+};
+
+struct steg_codec_decoder {
+	enum steg_codec codec;
+
+	// compressed bytes of the current segment not yet consumed, if stored
+	size_t remaining;
+
+	struct z_stream_s zlib;
+	unsigned int zlib_initialized: 1;
+#ifdef HAVE_LIBDEFLATE
+	struct libdeflate_decompressor *libdeflate;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *zstd;
+#endif
+};
+
+/**
+ * Look up the codec with the given name, if it is built into steg-png.
+ *
+ * Returns zero if successful, and -1 if no available codec has that name.
+ * */
+int steg_codec_from_name(const char *name, enum steg_codec *codec);
+
+/**
+ * Look up the codec identified by `id` in a stream header, if it is built into
+ * steg-png.
+ *
+ * Returns zero if successful, and -1 if no available codec has that identifier.
+ * */
+int steg_codec_from_id(unsigned int id, enum steg_codec *codec);
+
+/**
+ * Return the name of a codec, as accepted by steg_codec_from_name().
+ * */
+const char *steg_codec_name(enum steg_codec codec);
+
+/**
+ * Initialize an encoder for the given codec. The compression level follows
+ * zlib, from 0 to 9 or Z_DEFAULT_COMPRESSION, and is mapped onto the levels of
+ * the codec.
+ * */
+void steg_codec_encoder_init(struct steg_codec_encoder *encoder, enum steg_codec codec, int level);
+
+/**
+ * Returns an upper bound on the compressed length of `len` bytes of input.
+ * */
+size_t steg_codec_compress_bound(struct steg_codec_encoder *encoder, size_t len);
+
+/**
+ * Compress `len` bytes of input as a single segment into `out`, which has room
+ * for `capacity` bytes, and store the compressed length in `out_len`.
+ *
+ * Returns zero if successful, and -1 if compression failed or the output did
+ * not fit.
+ * */
+int steg_codec_compress(struct steg_codec_encoder *encoder, const unsigned char *in, size_t len,
+		unsigned char *out, size_t capacity, size_t *out_len);
+
+/**
+ * Release any resources held by the encoder.
+ * */
+void steg_codec_encoder_destroy(struct steg_codec_encoder *encoder);
+
+/**
+ * Initialize a decoder for the given codec.
+ * */
+void steg_codec_decoder_init(struct steg_codec_decoder *decoder, enum steg_codec codec);
+
+/**
+ * Prepare the decoder for a new segment of `compressed_len` bytes.
+ * */
+void steg_codec_decoder_begin(struct steg_codec_decoder *decoder, size_t compressed_len);
+
+/**
+ * Decompress as much of the `avail_in` bytes at `next_in` as fits in the
+ * `avail_out` bytes at `next_out`, advancing both, like inflate().
+ *
+ * Returns STEG_CODEC_END once the segment is complete, STEG_CODEC_OK if more
+ * input or output space is needed, and STEG_CODEC_ERROR if the segment is
+ * corrupt.
+ * */
+int steg_codec_decompress_step(struct steg_codec_decoder *decoder, const unsigned char **next_in,
+		size_t *avail_in, unsigned char **next_out, size_t *avail_out);
+
+/**
+ * Decompress a whole segment of `len` bytes into `out`, which has room for
+ * `capacity` bytes. The number of bytes of input consumed and of output
+ * produced are stored in `in_len` and `out_len`.
+ *
+ * Return values are identical to steg_codec_decompress_step(); STEG_CODEC_OK
+ * means that the segment ended early or did not fit in `out`.
+ * */
+int steg_codec_decompress(struct steg_codec_decoder *decoder, const unsigned char *in, size_t len,
+		unsigned char *out, size_t capacity, size_t *in_len, size_t *out_len);
+
+/**
+ * Release any resources held by the decoder.
+ * */
+void steg_codec_decoder_destroy(struct steg_codec_decoder *decoder);
+
+#endif //STEG_PNG_STEG_CODEC_H
@@ -0,0 +1,171 @@
+#ifndef STEG_PNG_STEG_INDEX_H
+#define STEG_PNG_STEG_INDEX_H
+
+#include <sys/types.h>
+
+#include "png-chunk-processor.h"
+
+/**
+ * steg-index api
+ *
+ * The stEG chunks of an image are scattered between the chunks of the original
+ * image, so finding them normally requires walking every chunk in the file. To
+ * avoid this, embed writes a stIX chunk immediately after IHDR listing the file
+ * offset and data length of every stEG chunk, in order. All fields are
+ * big-endian:
+ *
+ * 		+---------+-------+----------+-------+
+ * 		| version | flags | reserved | count |
+ * 		+---------+-------+----------+-------+
+ *
+ * followed by `count` entries:
+ *
+ * 		+-----------------------+-------------+
+ * 		| chunk file offset (8) | data length |
+ * 		+-----------------------+-------------+
+ *
+ * Since the offsets aren't known until the payload has been written, the chunk
+ * is reserved before any stEG chunks are written and filled in afterwards. The
+ * number of entries reserved is an upper bound, so the chunk may hold unused,
+ * zeroed entries after the last one. A count of zero means that the index is
+ * unusable, and readers should walk the file instead.
+ *
+ * When a payload is appended to an image in place, a stIX chunk can't be
+ * inserted after IHDR without rewriting the image. Instead, a tail index is
+ * written between the appended stEG chunks and IEND. It has the
+ * STEG_INDEX_FLAG_TAIL flag set, holds exactly `count` entries, and its data
+ * ends with its own data length, so that it can be found by reading backwards
+ * from IEND.
+ *
+ * When a payload is replaced in place, the new stEG chunks reuse the space of
+ * the old ones, and any space left over is taken up by stFL filler chunks,
+ * which carry no meaningful data and are never listed in the index.
+ *
+ * Readers must not trust the index blindly: steg_index_read() verifies the CRC
+ * of the stIX chunk, and steg_index_seek() verifies that each entry refers to a
+ * stEG chunk of the expected length.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct steg_index index;
+ * 		if (steg_index_read(&index, &ctx) == 0) {
+ * 			for (size_t i = 0; i < index.len; i++) {
+ * 				if (steg_index_seek(&index, i, &ctx))
+ * 					break; // fall back to a full walk
+ *
+ * 				// read stEG chunk data
+ * 			}
+ * 		}
+ *
+ * 		steg_index_release(&index);
+ * }
+ * */
+
+#define STEG_INDEX_VERSION 1
+#define STEG_INDEX_HEADER_LENGTH 8
+#define STEG_INDEX_ENTRY_LENGTH 12
+#define STEG_INDEX_TRAILER_LENGTH 4
+#define STEG_INDEX_MAX_LENGTH (16 * 1024 * 1024)
+
+#define STEG_INDEX_FLAG_TAIL 0x01
+
+extern const char STEG_CHUNK_TYPE[];
+extern const char STEG_INDEX_CHUNK_TYPE[];
+extern const char STEG_FILLER_CHUNK_TYPE[];
+
+struct steg_index_entry {
+	off_t offset;
+	u_int32_t len;
+};
+
+struct steg_index {
+	struct steg_index_entry *entries;
+	size_t len;
+	size_t capacity;
+	unsigned int overflow: 1;
+};
+
+/**
+ * Initialize an empty index with room for `capacity` entries. An index with a
+ * capacity of zero discards every entry added to it.
+ * */
+void steg_index_init(struct steg_index *index, size_t capacity);
+
+/**
+ * Compute the number of entries to reserve for a payload of `payload_len` bytes
+ * written in stEG chunks of at most `chunk_len` bytes of data. This is an upper
+ * bound, which holds for any compression level and stream format.
+ *
+ * Returns zero if the index would exceed STEG_INDEX_MAX_LENGTH, in which case
+ * no index should be written.
+ * */
+size_t steg_index_capacity(off_t payload_len, size_t chunk_len);
+
+/**
+ * Compute the length of the data of a stIX chunk with room for `capacity`
+ * entries.
+ * */
+size_t steg_index_data_length(size_t capacity);
+
+/**
+ * Record a stEG chunk at file offset `offset` with `len` bytes of data. If the
+ * index is full, it is marked as overflowed, and will be encoded as unusable.
+ * */
+void steg_index_add(struct steg_index *index, off_t offset, u_int32_t len);
+
+/**
+ * Encode the index into `buffer`, which must be steg_index_data_length() bytes
+ * in length for the capacity of the index.
+ * */
+void steg_index_encode(const struct steg_index *index, unsigned char *buffer);
+
+/**
+ * Encode the index as a tail index into `buffer`, which must be
+ * steg_index_data_length() bytes in length for the number of entries in the
+ * index, plus STEG_INDEX_TRAILER_LENGTH.
+ * */
+void steg_index_encode_tail(const struct steg_index *index, unsigned char *buffer);
+
+/**
+ * Read the stIX chunk of the image, which may either follow IHDR or precede
+ * IEND (see steg_index_read_head() and steg_index_read_tail()). The context must
+ * have been freshly initialized. Once read, the iterator is left positioned at
+ * an arbitrary chunk.
+ *
+ * Returns zero if a usable index was read into `index`. Returns 1 if the image
+ * has no index, or if the index is marked unusable. Returns -1 if the index is
+ * corrupt. In any case, the index must be released.
+ * */
+int steg_index_read(struct steg_index *index, struct chunk_iterator_ctx *ctx);
+
+/**
+ * Read the stIX chunk following IHDR. The context must have been freshly
+ * initialized. If a stIX chunk was found, the iterator is left positioned at
+ * it, whether or not it is usable.
+ *
+ * Return values are identical to steg_index_read().
+ * */
+int steg_index_read_head(struct steg_index *index, struct chunk_iterator_ctx *ctx);
+
+/**
+ * Read the tail index preceding IEND, which is located from the end of the
+ * file. The chunks before it are never walked.
+ *
+ * Return values are identical to steg_index_read().
+ * */
+int steg_index_read_tail(struct steg_index *index, struct chunk_iterator_ctx *ctx);
+
+/**
+ * Advance the chunk iterator to the stEG chunk described by entry `i` of the
+ * index, and verify that it is indeed a stEG chunk of the expected length.
+ *
+ * Returns zero if successful, and -1 if the entry doesn't match the file.
+ * */
+int steg_index_seek(const struct steg_index *index, size_t i, struct chunk_iterator_ctx *ctx);
+
+/**
+ * Release any resources held by the index.
+ * */
+void steg_index_release(struct steg_index *index);
+
+#endif //STEG_PNG_STEG_INDEX_H
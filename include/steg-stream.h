@@ -0,0 +1,315 @@
+#ifndef STEG_PNG_STEG_STREAM_H
+#define STEG_PNG_STEG_STREAM_H
+
+#include <sys/types.h>
+
+#include "payload-sink.h"
+#include "steg-codec.h"
+#include "thread-pool.h"
+#include "zlib.h"
+
+/**
+ * steg-stream api
+ *
+ * The data of all stEG chunks in an image, concatenated in file order, forms
+ * the steg stream. The steg stream comes in one of two formats:
+ *
+ * The legacy format is a single zlib stream holding the whole payload.
+ *
+ * The segmented format splits the payload into segments that are compressed
+ * independently, so they can be inflated concurrently. It begins with a stream
+ * header, which can't be mistaken for a zlib header:
+ *
+ * 		+------+------+------+------+---------+-------+-------+----------+
+ * 		| 0x89 | 'S'  | 'T'  | 'G'  | version | codec | flags | reserved |
+ * 		+------+------+------+------+---------+-------+-------+----------+
+ *
+ * followed by any number of segments, each consisting of a segment header and
+ * the segment data, compressed with the codec named in the stream header (see
+ * steg-codec.h). All fields are big-endian:
+ *
+ * 		+-------------------+---------------------+-----------------+------+
+ * 		| compressed length | uncompressed length | CRC-32 of data  | data |
+ * 		+-------------------+---------------------+-----------------+------+
+ *
+ * The stream ends with a segment header where both lengths and the CRC are
+ * zero, which allows truncated streams to be detected.
+ *
+ * A segmented stream with the STEG_STREAM_FLAG_ARCHIVE flag set holds several
+ * members rather than a single payload (see steg-archive.h). Each member begins
+ * on a segment boundary, so members are compressed independently of each
+ * other, and a table of contents follows the end of the stream. Archives can't
+ * be decoded as a whole; members are extracted individually with
+ * steg_stream_extract_member().
+ *
+ * An image embedded into more than once may hold several steg streams, one
+ * after the other, each in either format. Decoders stop at the end of the
+ * first stream, and count whatever follows it. The streams of a seekable file
+ * can be told apart with steg_stream_delimit(), and each read through its own
+ * slice of the map (see steg_stream_map_slice()).
+ *
+ * The steg_stream_decoder decodes either format incrementally, as stEG chunk
+ * data is read from the image, writing the payload to a payload sink. Segmented
+ * streams in seekable files can instead be inflated concurrently with
+ * steg_stream_inflate_segments().
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct steg_stream_decoder decoder;
+ * 		steg_stream_decoder_init(&decoder, &sink);
+ *
+ * 		while ((len = read_steg_chunk_data(buffer)) > 0)
+ * 			if (steg_stream_decoder_write(&decoder, buffer, len))
+ * 				DIE("%s", decoder.error);
+ *
+ * 		if (steg_stream_decoder_finish(&decoder))
+ * 			DIE("%s", decoder.error);
+ *
+ * 		steg_stream_decoder_destroy(&decoder);
+ * }
+ * */
+
+#define STEG_STREAM_MAGIC "\211STG"
+#define STEG_STREAM_MAGIC_LENGTH 4
+#define STEG_STREAM_VERSION 1
+#define STEG_STREAM_HEADER_LENGTH 8
+#define STEG_SEGMENT_HEADER_LENGTH 12
+
+#define STEG_STREAM_FLAG_ARCHIVE 0x01
+
+#define STEG_STREAM_BUFFER_SIZE 16384
+#define STEG_SEGMENT_MAX_LENGTH (64 * 1024 * 1024)
+
+enum steg_stream_format {
+	STEG_FORMAT_UNKNOWN,
+	STEG_FORMAT_LEGACY,
+	STEG_FORMAT_SEGMENTED
+};
+
+enum steg_stream_decoder_state {
+	STEG_DECODER_STREAM_HEADER,
+	STEG_DECODER_SEGMENT_HEADER,
+	STEG_DECODER_SEGMENT_DATA,
+	STEG_DECODER_END
+};
+
+struct steg_segment_header {
+	u_int32_t compressed_len;
+	u_int32_t uncompressed_len;
+	u_int32_t crc;
+};
+
+/**
+ * The location of the data of a single stEG chunk within a file. If the file
+ * is memory mapped, `data` points to the chunk data, otherwise it is NULL.
+ * */
+struct steg_stream_range {
+	off_t offset;
+	size_t len;
+	const unsigned char *data;
+};
+
+/**
+ * The stEG chunks that make up a steg stream, along with the offset of each
+ * chunk within the stream, so that any part of the stream can be read quickly.
+ *
+ * A map may also be a slice of another, covering `len` bytes starting at
+ * offset `base` of the chunk data.
+ * */
+struct steg_stream_map {
+	int fd;
+	const struct steg_stream_range *ranges;
+	off_t *starts;
+	size_t count;
+
+	off_t base;
+	off_t len;
+	unsigned int slice: 1;
+};
+
+/**
+ * The location, format and length of a single steg stream within the data of
+ * the stEG chunks of an image, and the length of its payload.
+ * */
+struct steg_stream_info {
+	off_t offset;
+	off_t len;
+	off_t payload_len;
+	enum steg_stream_format format;
+	unsigned int archive: 1;
+};
+
+struct steg_stream_decoder {
+	enum steg_stream_format format;
+	struct payload_sink *sink;
+
+	// legacy streams are inflated with zlib, segments with the codec of the stream
+	struct z_stream_s strm;
+	unsigned int strm_initialized: 1;
+	struct steg_codec_decoder codec;
+	unsigned int codec_initialized: 1;
+	unsigned int finished: 1;
+
+	// partially received stream or segment header
+	enum steg_stream_decoder_state state;
+	unsigned char header[STEG_SEGMENT_HEADER_LENGTH];
+	size_t header_len;
+
+	// segment currently being inflated
+	struct steg_segment_header segment;
+	u_int32_t segment_in;
+	u_int32_t segment_out;
+	u_int32_t segment_crc;
+	unsigned int segment_ended: 1;
+	unsigned long segments;
+
+	// data following the end of the stream, which belongs to another stream
+	off_t trailing_len;
+
+	unsigned char *output_buffer;
+	const char *error;
+};
+
+/**
+ * Encode a stream header for the given codec and flags into `buffer`, which
+ * must be at least STEG_STREAM_HEADER_LENGTH bytes in length.
+ * */
+void steg_stream_encode_header(unsigned char *buffer, unsigned char codec, unsigned char flags);
+
+/**
+ * Encode a segment header into `buffer`, which must be at least
+ * STEG_SEGMENT_HEADER_LENGTH bytes in length.
+ * */
+void steg_segment_encode_header(unsigned char *buffer, const struct steg_segment_header *header);
+
+/**
+ * Decode a segment header from `buffer`.
+ * */
+void steg_segment_decode_header(const unsigned char *buffer, struct steg_segment_header *header);
+
+/**
+ * Determine the format of a steg stream from its first bytes. Returns
+ * STEG_FORMAT_UNKNOWN if `len` is too short to tell.
+ * */
+enum steg_stream_format steg_stream_detect_format(const unsigned char *data, size_t len);
+
+/**
+ * Initialize a decoder that writes the decoded payload to the given sink.
+ * */
+void steg_stream_decoder_init(struct steg_stream_decoder *decoder, struct payload_sink *sink);
+
+/**
+ * Decode the next `len` bytes of the steg stream.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt or the payload
+ * could not be written, in which case `error` describes the problem.
+ * */
+int steg_stream_decoder_write(struct steg_stream_decoder *decoder, const unsigned char *data, size_t len);
+
+/**
+ * Verify that the steg stream was complete.
+ *
+ * Returns zero if successful, and -1 if the stream was truncated, in which case
+ * `error` describes the problem.
+ * */
+int steg_stream_decoder_finish(struct steg_stream_decoder *decoder);
+
+/**
+ * Release any resources held by the decoder.
+ * */
+void steg_stream_decoder_destroy(struct steg_stream_decoder *decoder);
+
+/**
+ * Initialize a map of the steg stream made up of the data of the stEG chunks
+ * described by `ranges`, in order, which are read from `fd` unless mapped. The
+ * ranges must remain valid for the lifetime of the map.
+ * */
+void steg_stream_map_init(struct steg_stream_map *map, int fd,
+		const struct steg_stream_range *ranges, size_t count);
+
+/**
+ * Returns the total length of the steg stream.
+ * */
+off_t steg_stream_map_length(const struct steg_stream_map *map);
+
+/**
+ * Read `len` bytes of the steg stream starting at `offset`. Safe to call from
+ * several threads at once.
+ *
+ * Returns zero if successful, and -1 if the stream is too short or could not be
+ * read.
+ * */
+int steg_stream_map_read(const struct steg_stream_map *map, off_t offset,
+		unsigned char *buffer, size_t len);
+
+/**
+ * Initialize `slice` as a map of the `len` bytes of the steg stream of `map`
+ * starting at offset `offset`. The slice shares the chunks of the map, which
+ * must outlive it, and reads from it are relative to `offset`.
+ * */
+void steg_stream_map_slice(struct steg_stream_map *slice, const struct steg_stream_map *map,
+		off_t offset, off_t len);
+
+/**
+ * Release any resources held by the map.
+ * */
+void steg_stream_map_release(struct steg_stream_map *map);
+
+/**
+ * Locate the steg stream beginning at offset `offset` of the map, which may be
+ * followed by other streams, and describe it in `info`.
+ *
+ * The end of a segmented stream is found by walking its segment headers alone.
+ * A legacy stream carries no length, so it must be inflated to find its end;
+ * the inflated payload is written to the sink if non-null, and discarded
+ * otherwise. The sink is never written for segmented streams.
+ *
+ * Returns zero if successful, and 1 if there is no stream at `offset` because
+ * it is the end of the map. Returns -1 if the stream is corrupt, in which case
+ * `error` describes the problem.
+ * */
+int steg_stream_delimit(const struct steg_stream_map *map, off_t offset, struct steg_stream_info *info,
+		struct payload_sink *sink, const char **error);
+
+/**
+ * Inflate a segmented steg stream concurrently on the given thread pool.
+ *
+ * If the sink is seekable (see payload_sink_is_seekable()), each segment is
+ * written straight to its final offset by the worker that inflated it.
+ * Otherwise, segments are inflated in batches and written to the sink in
+ * order.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt or the payload
+ * could not be written, in which case `error` describes the problem.
+ * */
+int steg_stream_inflate_segments(const struct steg_stream_map *map, struct payload_sink *sink,
+		struct thread_pool *pool, const char **error);
+
+/**
+ * Inflate `len` bytes of the payload of a segmented steg stream, starting at
+ * payload offset `offset`, and write them to the sink. Segment headers are used
+ * to skip straight to the segments holding the range, so only those segments
+ * are read and inflated. A range extending beyond the end of the payload is
+ * truncated.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt or the payload
+ * could not be written, in which case `error` describes the problem.
+ * */
+int steg_stream_extract_segment_range(const struct steg_stream_map *map, off_t offset, off_t len,
+		struct payload_sink *sink, const char **error);
+
+/**
+ * Inflate `len` bytes of an archive member, starting at offset `offset` within
+ * the member, and write them to the sink. The member is `member_len` bytes in
+ * length, and its first segment header is at `stream_offset` in the steg
+ * stream. Like steg_stream_extract_segment_range(), only the segments holding
+ * the range are read and inflated, and a range extending beyond the end of the
+ * member is truncated.
+ *
+ * Returns zero if successful, and -1 if the stream is corrupt or the payload
+ * could not be written, in which case `error` describes the problem.
+ * */
+int steg_stream_extract_member(const struct steg_stream_map *map, off_t stream_offset, off_t member_len,
+		off_t offset, off_t len, struct payload_sink *sink, const char **error);
+
+#endif //STEG_PNG_STEG_STREAM_H
@@ -0,0 +1,85 @@
+#ifndef STEG_PNG_THREAD_POOL_H
+#define STEG_PNG_THREAD_POOL_H
+
+#include <pthread.h>
+
+/**
+ * thread-pool api
+ *
+ * The thread-pool api runs jobs on a fixed number of worker threads. Jobs are
+ * queued with thread_pool_submit() and run in the order they were submitted,
+ * although jobs on different workers may finish in any order. Callers that
+ * need the results of a batch of jobs submit them all and then wait for the
+ * queue to drain with thread_pool_wait().
+ *
+ * Jobs must not exit the process while other jobs may still be running; errors
+ * should instead be recorded in the job argument and reported by the caller
+ * once the job has finished.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct thread_pool pool;
+ * 		thread_pool_init(&pool, 4);
+ *
+ * 		for (size_t i = 0; i < job_count; i++)
+ * 			thread_pool_submit(&pool, run_job, &jobs[i]);
+ *
+ * 		thread_pool_wait(&pool);
+ * 		thread_pool_destroy(&pool);
+ * }
+ * */
+
+typedef void (*thread_pool_job_fn)(void *);
+
+struct thread_pool_job {
+	thread_pool_job_fn fn;
+	void *arg;
+	struct thread_pool_job *next;
+};
+
+struct thread_pool {
+	pthread_t *workers;
+	unsigned int worker_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t job_queued;
+	pthread_cond_t job_finished;
+
+	// jobs waiting to be picked up by a worker, oldest first
+	struct thread_pool_job *head;
+	struct thread_pool_job *tail;
+
+	// number of jobs queued or running
+	unsigned long pending;
+	unsigned int shutdown: 1;
+};
+
+/**
+ * Return the number of processors available to this process, or 1 if it
+ * cannot be determined.
+ * */
+unsigned int thread_pool_cpu_count(void);
+
+/**
+ * Initialize a thread pool with the given number of worker threads, which must
+ * be at least one. Dies if the threads cannot be created.
+ * */
+void thread_pool_init(struct thread_pool *pool, unsigned int threads);
+
+/**
+ * Queue a job to run `fn` with argument `arg` on one of the workers.
+ * */
+void thread_pool_submit(struct thread_pool *pool, thread_pool_job_fn fn, void *arg);
+
+/**
+ * Block until every job submitted to the pool has finished.
+ * */
+void thread_pool_wait(struct thread_pool *pool);
+
+/**
+ * Wait for all submitted jobs to finish, stop the worker threads and release
+ * any resources held by the pool.
+ * */
+void thread_pool_destroy(struct thread_pool *pool);
+
+#endif //STEG_PNG_THREAD_POOL_H
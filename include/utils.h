@@ -3,6 +3,9 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "digest.h"
 
 #define NORETURN __attribute__((noreturn))
 
@@ -70,12 +73,37 @@ void set_exit_routine(NORETURN void (*new_exit_routine)(int status));
  * */
 ssize_t recoverable_read(int fd, void *buf, size_t len);
 
+/**
+ * A self-recovering wrapper for pread(). If EINTR or EAGAIN is encountered,
+ * retries pread(). Short reads are retried until `len` bytes have been read or
+ * the end of the file is reached.
+ * */
+ssize_t recoverable_pread(int fd, void *buf, size_t len, off_t offset);
+
 /**
  * A self-recovering wrapper for write(). If EINTR or EAGAIN is encountered,
  * retries write().
  * */
 ssize_t recoverable_write(int fd, const void *buf, size_t len);
 
+/**
+ * A self-recovering wrapper for pwrite(). If EINTR or EAGAIN is encountered,
+ * retries pwrite(). Short writes are resumed until `len` bytes have been
+ * written.
+ *
+ * Returns the number of bytes written, or -1 if an error occurred.
+ * */
+ssize_t recoverable_pwrite(int fd, const void *buf, size_t len, off_t offset);
+
+/**
+ * A self-recovering wrapper for writev(). If EINTR or EAGAIN is encountered,
+ * retries writev(). Short writes are resumed until every iovec has been fully
+ * written, so the given iovecs may be modified.
+ *
+ * Returns the total number of bytes written, or -1 if an error occurred.
+ * */
+ssize_t recoverable_writev(int fd, struct iovec *iov, int iovcnt);
+
 /**
  * Copy a file from the src location to the dest location. `dest` and `src` must
  * be null-terminated strings.
@@ -106,6 +134,23 @@ ssize_t copy_file(const char *dest, const char *src, int mode);
  * */
 ssize_t copy_file_fd(int dest_fd, int src_fd);
 
+/**
+ * Copy `len` bytes from the file `src_fd`, starting at `offset`, to the file
+ * `dest_fd` at its current file offset. The file offset of `src_fd` is left
+ * untouched, and the file offset of `dest_fd` is advanced by the number of
+ * bytes copied.
+ *
+ * Where supported, the copy is performed by the kernel with copy_file_range(),
+ * which may reflink the data on filesystems like btrfs and XFS. If that isn't
+ * possible, sendfile() is attempted, and finally a plain buffered copy.
+ *
+ * If reading/writing could not be completed due to an unexpected error, returns
+ * the total number of bytes written so far.
+ *
+ * If successful, returns the total number of bytes written.
+ * */
+ssize_t copy_file_range_fd(int dest_fd, int src_fd, off_t offset, size_t len);
+
 /**
  * Print canonical hexdump of a given data buffer. The offset argument specifies
  * the offset of the chunk of data; useful for printing the hexdump of a file or
@@ -119,21 +164,42 @@ ssize_t copy_file_fd(int dest_fd, int src_fd);
 void hex_dump(FILE *output_stream, off_t offset, unsigned char *buffer, size_t len);
 
 /**
- * Compute the md5 sum of an open file. The md5_hash argument must be an array of
- * length MD5_DIGEST_SIZE. The file offset is assumed to be positioned at
- * byte zero.
+ * Compute the digest of an open file with the given algorithm. The hash argument
+ * must be an array of length of at least digest_size(). The file offset is
+ * assumed to be positioned at byte zero.
  * */
-int compute_md5_sum(int fd, unsigned char md5_hash[]);
+int compute_file_digest(int fd, enum digest_type type, unsigned char hash[]);
+
+/**
+ * Compute the digests of `count` open files with the given algorithm, exactly
+ * as compute_file_digest() would for each. MD5 digests are computed in
+ * lockstep with the multi-buffer engine (see md5-mb.h), so that many small
+ * files hash faster together than one after another. If a file can't be read,
+ * its entry in `failed` is set to 1 and its digest is left undefined; others
+ * are set to zero.
+ *
+ * Returns the number of files that couldn't be read.
+ * */
+int compute_file_digests(const int fds[], size_t count, enum digest_type type,
+		unsigned char hashes[][DIGEST_MAX_SIZE], int failed[]);
 
 /**
  * Print a summary of a file, with table formatting capability.
  *
  * Prints the file summary in the following format:
- * <filename> <file mode> <file length> <md5 hash>
+ * <filename> <file mode> <file length> <digest>
  *
- * The filename may be padded with whitespace using the filename_table_len
- * argument.
+ * The digest is computed with the given algorithm. The filename may be padded
+ * with whitespace using the filename_table_len argument.
+ * */
+void print_file_summary(const char *file_path, enum digest_type type, int filename_table_len);
+
+/**
+ * Print a summary of a file exactly like print_file_summary(), but with a
+ * digest the caller already computed (for instance, while the file was being
+ * read or written for other reasons), so that the file isn't read again.
  * */
-void print_file_summary(const char *file_path, int filename_table_len);
+void print_file_summary_with_digest(const char *file_path, enum digest_type type,
+		const unsigned char hash[], int filename_table_len);
 
 #endif //STEG_PNG_UTILS_H
@@ -0,0 +1,59 @@
+#ifndef STEG_PNG_XXH3_H
+#define STEG_PNG_XXH3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * xxh3 api
+ *
+ * A portable, streaming implementation of the 64-bit variant of XXH3 (as
+ * defined by xxHash 0.8), with the default secret and a seed of zero. XXH3 is
+ * not a cryptographic hash, but it runs at close to memory speed, which makes
+ * it a good fit for checking that files are intact.
+ *
+ * The digest is written in big-endian order, so that its hexadecimal form
+ * matches that printed by `xxhsum -H3`.
+ *
+ * Example Usage:
+ * void example() {
+ * 		struct xxh3_state state;
+ * 		xxh3_init(&state);
+ * 		xxh3_update(&state, data, len);
+ *
+ * 		unsigned char digest[XXH3_DIGEST_SIZE];
+ * 		xxh3_final(&state, digest);
+ * }
+ * */
+
+#define XXH3_DIGEST_SIZE 8
+#define XXH3_STRIPE_LEN 64
+#define XXH3_BUFFER_SIZE 256
+
+struct xxh3_state {
+	uint64_t acc[8];
+	uint64_t total_len;
+	size_t stripes_so_far;
+
+	// input not yet consumed; the last stripe consumed is kept at the end
+	unsigned char buffer[XXH3_BUFFER_SIZE];
+	size_t buffered;
+};
+
+/**
+ * Initialize the state for a new digest.
+ * */
+void xxh3_init(struct xxh3_state *state);
+
+/**
+ * Hash `len` bytes of input.
+ * */
+void xxh3_update(struct xxh3_state *state, const void *input, size_t len);
+
+/**
+ * Write the digest of all input to `digest`, which must have a length of
+ * XXH3_DIGEST_SIZE. The state is left unchanged, so more input may follow.
+ * */
+void xxh3_final(const struct xxh3_state *state, unsigned char digest[]);
+
+#endif //STEG_PNG_XXH3_H
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "async-walk.h"
+#include "utils.h"
+
+static void queue_read(struct async_walk *, struct async_walk_file *, off_t, size_t);
+static void queue_next_read(struct async_walk *, struct async_walk_file *, off_t);
+static void release_file(struct async_walk *, struct async_walk_file *, enum async_walk_status);
+static void handle_header(struct async_walk *, struct async_walk_file *, const unsigned char *,
+		off_t, size_t);
+static void handle_completion(struct async_walk *, struct async_walk_file *, int);
+static void wait_for_completions(struct async_walk *);
+
+int async_walk_init(struct async_walk *walk, size_t depth, size_t buffer_len,
+		const struct async_walk_ops *ops, void *data)
+{
+	if (depth > ASYNC_WALK_MAX_DEPTH)
+		BUG("async walk of %zu files exceeds the maximum depth", depth);
+
+	if (io_ring_init(&walk->ring, (unsigned int) depth)) {
+		errno = 0;
+		return -1;
+	}
+
+	// the first read takes the signature along with the first chunk header
+	if (buffer_len < SIGNATURE_LENGTH + CHUNK_HEADER_LENGTH)
+		buffer_len = SIGNATURE_LENGTH + CHUNK_HEADER_LENGTH;
+
+	walk->depth = depth;
+	walk->buffer_len = buffer_len;
+	walk->ops = ops;
+	walk->data = data;
+	walk->free_len = depth;
+	for (size_t i = 0; i < depth; i++) {
+		struct async_walk_file *file = &walk->files[i];
+		file->index = i;
+		file->fd = -1;
+		strbuf_init(&file->path);
+		file->buffer = (unsigned char *) malloc(sizeof(unsigned char) * buffer_len);
+		if (!file->buffer)
+			FATAL(MEM_ALLOC_FAILED);
+
+		walk->free_files[i] = depth - i - 1;
+	}
+
+	return 0;
+}
+
+int async_walk_add(struct async_walk *walk, const char *path)
+{
+	while (!walk->free_len)
+		wait_for_completions(walk);
+
+	// every slot holds a descriptor, so give some back if we run out
+	int fd;
+	while ((fd = open(path, O_RDONLY)) < 0 && (errno == EMFILE || errno == ENFILE) && walk->ring.in_flight)
+		wait_for_completions(walk);
+
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	// files too short to hold a signature aren't PNGs, rather than unreadable
+	if (st.st_size < SIGNATURE_LENGTH) {
+		close(fd);
+		return 1;
+	}
+
+	struct async_walk_file *file = &walk->files[walk->free_files[--walk->free_len]];
+	strbuf_clear(&file->path);
+	strbuf_attach_str(&file->path, path);
+	file->fd = fd;
+	file->mode = st.st_mode;
+	file->file_len = st.st_size;
+	file->data_end = 0;
+
+	if (walk->ops->start)
+		walk->ops->start(walk, file);
+
+	queue_read(walk, file, 0, SIGNATURE_LENGTH + CHUNK_HEADER_LENGTH);
+	return 0;
+}
+
+void async_walk_finish(struct async_walk *walk)
+{
+	while (walk->ring.in_flight)
+		wait_for_completions(walk);
+}
+
+void async_walk_destroy(struct async_walk *walk)
+{
+	io_ring_destroy(&walk->ring);
+	for (size_t i = 0; i < walk->depth; i++) {
+		strbuf_release(&walk->files[i].path);
+		free(walk->files[i].buffer);
+	}
+}
+
+/**
+ * Queue a read of `len` bytes at `offset` of the given file.
+ * */
+static void queue_read(struct async_walk *walk, struct async_walk_file *file, off_t offset, size_t len)
+{
+	file->offset = offset;
+
+	// each file has at most one read in flight, so the ring can't be full
+	if (io_ring_queue_read(&walk->ring, file->fd, file->buffer, len, offset, file->index))
+		BUG("io_ring full with %u reads in flight", walk->ring.in_flight);
+}
+
+/**
+ * Queue a read of the next piece of the chunk data being read from the given
+ * file, or of the chunk header following it once all has been read.
+ * */
+static void queue_next_read(struct async_walk *walk, struct async_walk_file *file, off_t offset)
+{
+	if (offset < file->data_end) {
+		off_t len = file->data_end - offset;
+		queue_read(walk, file, offset, len < (off_t) walk->buffer_len ? (size_t) len : walk->buffer_len);
+		return;
+	}
+
+	// skip the CRC of the chunk just read
+	if (file->data_end) {
+		offset = file->data_end + (off_t) sizeof(u_int32_t);
+		file->data_end = 0;
+	}
+
+	queue_read(walk, file, offset, CHUNK_HEADER_LENGTH);
+}
+
+/**
+ * End the walk of the given file, and free its slot.
+ * */
+static void release_file(struct async_walk *walk, struct async_walk_file *file,
+		enum async_walk_status status)
+{
+	walk->ops->finish(walk, file, status);
+
+	close(file->fd);
+	file->fd = -1;
+	walk->free_files[walk->free_len++] = file->index;
+}
+
+/**
+ * Handle a completed read of the chunk header at `header_offset` of the given
+ * file, where `header` points to the `available` bytes read.
+ * */
+static void handle_header(struct async_walk *walk, struct async_walk_file *file,
+		const unsigned char *header, off_t header_offset, size_t available)
+{
+	// no further chunk header, or one the iterator wouldn't accept, ends the walk
+	struct png_chunk_detail chunk;
+	if (available < CHUNK_HEADER_LENGTH || png_chunk_decode_header(header, header_offset, file->file_len, &chunk)) {
+		release_file(walk, file, ASYNC_WALK_DONE);
+		return;
+	}
+
+	file->offset = header_offset;
+	enum async_walk_action action = walk->ops->chunk(walk, file, &chunk);
+	if (action == ASYNC_WALK_STOP) {
+		release_file(walk, file, ASYNC_WALK_STOPPED);
+		return;
+	}
+
+	if (action == ASYNC_WALK_READ_DATA) {
+		// a chunk without data is followed straight by its CRC
+		file->data_end = header_offset + CHUNK_HEADER_LENGTH + (off_t) chunk.data_length;
+		queue_next_read(walk, file, header_offset + CHUNK_HEADER_LENGTH);
+		return;
+	}
+
+	queue_read(walk, file, header_offset + (off_t) CHUNK_LENGTH(chunk.data_length), CHUNK_HEADER_LENGTH);
+}
+
+/**
+ * Handle a completed read of the given file, where `res` is the number of bytes
+ * read or a negated errno value.
+ * */
+static void handle_completion(struct async_walk *walk, struct async_walk_file *file, int res)
+{
+	if (file->data_end) {
+		if (res <= 0) {
+			errno = res < 0 ? -res : 0;
+			release_file(walk, file, ASYNC_WALK_READ_FAILED);
+			return;
+		}
+
+		if (walk->ops->data(walk, file, file->buffer, (size_t) res)) {
+			release_file(walk, file, ASYNC_WALK_STOPPED);
+			return;
+		}
+
+		queue_next_read(walk, file, file->offset + res);
+		return;
+	}
+
+	if (res < 0) {
+		// the file was opened, so failing to read it later means it's corrupt
+		errno = -res;
+		release_file(walk, file, file->offset ? ASYNC_WALK_CORRUPT : ASYNC_WALK_READ_FAILED);
+		return;
+	}
+
+	if (!file->offset) {
+		if ((size_t) res < SIGNATURE_LENGTH) {
+			release_file(walk, file, ASYNC_WALK_READ_FAILED);
+			return;
+		}
+		if (memcmp(PNG_SIG, file->buffer, SIGNATURE_LENGTH) != 0) {
+			release_file(walk, file, ASYNC_WALK_NOT_PNG);
+			return;
+		}
+
+		handle_header(walk, file, file->buffer + SIGNATURE_LENGTH, SIGNATURE_LENGTH,
+				(size_t) res - SIGNATURE_LENGTH);
+		return;
+	}
+
+	handle_header(walk, file, file->buffer, file->offset, (size_t) res);
+}
+
+/**
+ * Submit any queued reads, wait for at least one to complete, and handle every
+ * completed read.
+ * */
+static void wait_for_completions(struct async_walk *walk)
+{
+	if (io_ring_submit(&walk->ring, 1))
+		FATAL("failed to submit reads to io_uring");
+
+	u_int64_t tag;
+	int res;
+	while (io_ring_reap(&walk->ring, &tag, &res))
+		handle_completion(walk, &walk->files[tag], res);
+}
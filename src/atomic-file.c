@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "atomic-file.h"
+#include "utils.h"
+
+// files may be opened and committed from several threads at once
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct atomic_file *open_files = NULL;
+static int cleanup_registered = 0;
+
+static void register_file(struct atomic_file *);
+static void unregister_file(struct atomic_file *);
+static void remove_temporary_files(void);
+static void release_file(struct atomic_file *);
+
+int atomic_file_open(struct atomic_file *file, const char *path, mode_t mode)
+{
+	file->fd = -1;
+	file->is_stdout = 0;
+	file->is_anonymous = 0;
+	file->next = NULL;
+	strbuf_init(&file->path);
+	strbuf_init(&file->tmp_path);
+
+	if (!strcmp(path, "-")) {
+		file->fd = STDOUT_FILENO;
+		file->is_stdout = 1;
+		return 0;
+	}
+
+	strbuf_attach_str(&file->path, path);
+
+	// the temporary file must live in the same directory so that rename() is atomic
+	struct strbuf dir;
+	strbuf_init(&dir);
+	strbuf_attach_str(&dir, path);
+	strbuf_attach_str(&file->tmp_path, dirname(dir.buff));
+	strbuf_release(&dir);
+
+	// umask() can only be read by setting it, which must not race with other threads
+	pthread_mutex_lock(&open_files_lock);
+	mode_t mask = umask(0);
+	umask(mask);
+	pthread_mutex_unlock(&open_files_lock);
+
+	mode &= (S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO);
+
+#ifdef O_TMPFILE
+	// an anonymous file can only be named later through /proc
+	if (!access("/proc/self/fd", X_OK))
+		file->fd = open(file->tmp_path.buff, O_TMPFILE | O_RDWR, mode & ~mask);
+	if (file->fd >= 0) {
+		file->is_anonymous = 1;
+		return 0;
+	}
+
+	// not every filesystem supports O_TMPFILE
+	errno = 0;
+#endif
+
+	strbuf_attach_str(&file->tmp_path, "/.steg-png_XXXXXX");
+	file->fd = mkstemp(file->tmp_path.buff);
+	if (file->fd < 0) {
+		release_file(file);
+		return -1;
+	}
+
+	register_file(file);
+
+	if (fchmod(file->fd, mode & ~mask) < 0) {
+		atomic_file_rollback(file);
+		return -1;
+	}
+
+	return 0;
+}
+
+int atomic_file_is_stdout(struct atomic_file *file)
+{
+	return file->is_stdout;
+}
+
+int atomic_file_commit(struct atomic_file *file)
+{
+	if (file->is_stdout) {
+		release_file(file);
+		return 0;
+	}
+
+	/*
+	 * An anonymous file must first be given a name before it can replace the
+	 * destination, since linkat() refuses to overwrite an existing file.
+	 * */
+	if (file->is_anonymous) {
+		struct strbuf proc_path;
+		strbuf_init(&proc_path);
+		strbuf_attach_fmt(&proc_path, "/proc/self/fd/%d", file->fd);
+
+		strbuf_attach_str(&file->tmp_path, "/.steg-png_XXXXXX");
+		int ret = -1;
+		for (int attempt = 0; ret < 0 && attempt < 16; attempt++) {
+			strbuf_remove(&file->tmp_path, file->tmp_path.len - 6, 6);
+			strbuf_attach_fmt(&file->tmp_path, "%06x", (unsigned) random() & 0xffffffu);
+
+			ret = linkat(AT_FDCWD, proc_path.buff, AT_FDCWD, file->tmp_path.buff, AT_SYMLINK_FOLLOW);
+			if (ret < 0 && errno != EEXIST)
+				break;
+		}
+
+		strbuf_release(&proc_path);
+		if (ret < 0) {
+			atomic_file_rollback(file);
+			return -1;
+		}
+
+		errno = 0;
+		file->is_anonymous = 0;
+		register_file(file);
+	}
+
+	if (close(file->fd) < 0) {
+		file->fd = -1;
+		atomic_file_rollback(file);
+		return -1;
+	}
+
+	file->fd = -1;
+	if (rename(file->tmp_path.buff, file->path.buff) < 0) {
+		atomic_file_rollback(file);
+		return -1;
+	}
+
+	unregister_file(file);
+	release_file(file);
+	return 0;
+}
+
+void atomic_file_rollback(struct atomic_file *file)
+{
+	if (file->fd >= 0 && !file->is_stdout)
+		close(file->fd);
+	file->fd = -1;
+
+	if (!file->is_stdout && !file->is_anonymous) {
+		int errsv = errno;
+		unlink(file->tmp_path.buff);
+		errno = errsv;
+	}
+
+	unregister_file(file);
+	release_file(file);
+}
+
+/**
+ * Track a named temporary file so that it is removed if the process exits
+ * before the file is committed (e.g. through DIE() or FATAL()).
+ * */
+static void register_file(struct atomic_file *file)
+{
+	pthread_mutex_lock(&open_files_lock);
+	if (!cleanup_registered) {
+		atexit(remove_temporary_files);
+		cleanup_registered = 1;
+	}
+
+	file->next = open_files;
+	open_files = file;
+	pthread_mutex_unlock(&open_files_lock);
+}
+
+static void unregister_file(struct atomic_file *file)
+{
+	pthread_mutex_lock(&open_files_lock);
+	struct atomic_file **entry = &open_files;
+	while (*entry) {
+		if (*entry == file) {
+			*entry = file->next;
+			break;
+		}
+
+		entry = &(*entry)->next;
+	}
+
+	file->next = NULL;
+	pthread_mutex_unlock(&open_files_lock);
+}
+
+static void remove_temporary_files(void)
+{
+	for (struct atomic_file *file = open_files; file; file = file->next)
+		unlink(file->tmp_path.buff);
+
+	open_files = NULL;
+}
+
+static void release_file(struct atomic_file *file)
+{
+	strbuf_release(&file->path);
+	strbuf_release(&file->tmp_path);
+}
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "blake3.h"
+#include "thread-pool.h"
+#include "utils.h"
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+/*
+ * Below this many bytes per thread, starting the threads costs more than
+ * hashing the input on a single one.
+ * */
+#define BLAKE3_PARALLEL_MIN_LEN (512 * 1024)
+
+static const uint32_t IV[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+		0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char MSG_PERMUTATION[16] = {
+		2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+/**
+ * The chaining value and last block of a chunk or parent node, from which
+ * either its chaining value or (if it's the root) the digest is computed.
+ * */
+struct output {
+	uint32_t input_cv[8];
+	uint32_t block_words[16];
+	uint64_t counter;
+	uint32_t block_len;
+	uint32_t flags;
+};
+
+struct subtree_job {
+	const unsigned char *input;
+	size_t chunks;
+	uint64_t chunk_counter;
+	uint32_t cv[8];
+};
+
+static void subtree_cv(const unsigned char *, size_t, uint64_t, uint32_t[]);
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void words_from_block(const unsigned char *block, uint32_t words[])
+{
+	for (size_t i = 0; i < 16; i++)
+		words[i] = read_le32(block + 4 * i);
+}
+
+static inline void g(uint32_t state[], size_t a, size_t b, size_t c, size_t d, uint32_t mx, uint32_t my)
+{
+	state[a] = state[a] + state[b] + mx;
+	state[d] = rotr32(state[d] ^ state[a], 16);
+	state[c] = state[c] + state[d];
+	state[b] = rotr32(state[b] ^ state[c], 12);
+	state[a] = state[a] + state[b] + my;
+	state[d] = rotr32(state[d] ^ state[a], 8);
+	state[c] = state[c] + state[d];
+	state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+/**
+ * The BLAKE3 compression function. All sixteen words of the state are written
+ * to `out`; the first eight are the new chaining value.
+ * */
+static void compress(const uint32_t cv[], const uint32_t block_words[], uint64_t counter,
+		uint32_t block_len, uint32_t flags, uint32_t out[])
+{
+	uint32_t state[16] = {
+			cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+			IV[0], IV[1], IV[2], IV[3],
+			(uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags
+	};
+
+	uint32_t m[16];
+	memcpy(m, block_words, sizeof(m));
+
+	for (size_t round = 0; round < 7; round++) {
+		g(state, 0, 4, 8, 12, m[0], m[1]);
+		g(state, 1, 5, 9, 13, m[2], m[3]);
+		g(state, 2, 6, 10, 14, m[4], m[5]);
+		g(state, 3, 7, 11, 15, m[6], m[7]);
+		g(state, 0, 5, 10, 15, m[8], m[9]);
+		g(state, 1, 6, 11, 12, m[10], m[11]);
+		g(state, 2, 7, 8, 13, m[12], m[13]);
+		g(state, 3, 4, 9, 14, m[14], m[15]);
+
+		uint32_t permuted[16];
+		for (size_t i = 0; i < 16; i++)
+			permuted[i] = m[MSG_PERMUTATION[i]];
+		memcpy(m, permuted, sizeof(m));
+	}
+
+	for (size_t i = 0; i < 8; i++) {
+		out[i] = state[i] ^ state[i + 8];
+		out[i + 8] = state[i + 8] ^ cv[i];
+	}
+}
+
+static void output_chaining_value(const struct output *output, uint32_t cv[])
+{
+	uint32_t out[16];
+	compress(output->input_cv, output->block_words, output->counter, output->block_len, output->flags, out);
+	memcpy(cv, out, sizeof(uint32_t) * 8);
+}
+
+static void parent_output(const uint32_t left_cv[], const uint32_t right_cv[], struct output *output)
+{
+	memcpy(output->input_cv, IV, sizeof(IV));
+	memcpy(output->block_words, left_cv, sizeof(uint32_t) * 8);
+	memcpy(output->block_words + 8, right_cv, sizeof(uint32_t) * 8);
+	output->counter = 0;
+	output->block_len = BLAKE3_BLOCK_LEN;
+	output->flags = PARENT;
+}
+
+static void parent_cv(const uint32_t left_cv[], const uint32_t right_cv[], uint32_t cv[])
+{
+	struct output output;
+	parent_output(left_cv, right_cv, &output);
+	output_chaining_value(&output, cv);
+}
+
+static void chunk_state_init(struct blake3_chunk_state *chunk, uint64_t chunk_counter)
+{
+	memcpy(chunk->cv, IV, sizeof(IV));
+	chunk->chunk_counter = chunk_counter;
+	memset(chunk->block, 0, BLAKE3_BLOCK_LEN);
+	chunk->block_len = 0;
+	chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const struct blake3_chunk_state *chunk)
+{
+	return BLAKE3_BLOCK_LEN * chunk->blocks_compressed + chunk->block_len;
+}
+
+static uint32_t chunk_state_start_flag(const struct blake3_chunk_state *chunk)
+{
+	return chunk->blocks_compressed ? 0 : CHUNK_START;
+}
+
+static void chunk_state_update(struct blake3_chunk_state *chunk, const unsigned char *input, size_t len)
+{
+	while (len) {
+		// the last block of a chunk is only compressed once it's known to be the last
+		if (chunk->block_len == BLAKE3_BLOCK_LEN) {
+			uint32_t block_words[16];
+			uint32_t out[16];
+			words_from_block(chunk->block, block_words);
+			compress(chunk->cv, block_words, chunk->chunk_counter, BLAKE3_BLOCK_LEN,
+					chunk_state_start_flag(chunk), out);
+			memcpy(chunk->cv, out, sizeof(chunk->cv));
+
+			chunk->blocks_compressed++;
+			memset(chunk->block, 0, BLAKE3_BLOCK_LEN);
+			chunk->block_len = 0;
+		}
+
+		size_t take = BLAKE3_BLOCK_LEN - chunk->block_len;
+		if (take > len)
+			take = len;
+
+		memcpy(chunk->block + chunk->block_len, input, take);
+		chunk->block_len += take;
+		input += take;
+		len -= take;
+	}
+}
+
+static void chunk_state_output(const struct blake3_chunk_state *chunk, struct output *output)
+{
+	memcpy(output->input_cv, chunk->cv, sizeof(chunk->cv));
+	words_from_block(chunk->block, output->block_words);
+	output->counter = chunk->chunk_counter;
+	output->block_len = (uint32_t) chunk->block_len;
+	output->flags = chunk_state_start_flag(chunk) | CHUNK_END;
+}
+
+/**
+ * Compute the chaining value of a subtree of `chunks` whole chunks, where
+ * `chunks` is a power of two and the subtree is not the root of the tree.
+ * */
+static void subtree_cv(const unsigned char *input, size_t chunks, uint64_t chunk_counter, uint32_t cv[])
+{
+	if (chunks == 1) {
+		struct blake3_chunk_state chunk;
+		struct output output;
+		chunk_state_init(&chunk, chunk_counter);
+		chunk_state_update(&chunk, input, BLAKE3_CHUNK_LEN);
+		chunk_state_output(&chunk, &output);
+		output_chaining_value(&output, cv);
+		return;
+	}
+
+	uint32_t left_cv[8];
+	uint32_t right_cv[8];
+	size_t half = chunks / 2;
+	subtree_cv(input, half, chunk_counter, left_cv);
+	subtree_cv(input + half * BLAKE3_CHUNK_LEN, half, chunk_counter + half, right_cv);
+	parent_cv(left_cv, right_cv, cv);
+}
+
+static void run_subtree_job(void *arg)
+{
+	struct subtree_job *job = (struct subtree_job *) arg;
+	subtree_cv(job->input, job->chunks, job->chunk_counter, job->cv);
+}
+
+/**
+ * Compute the chaining value of a subtree like subtree_cv(), splitting it into
+ * `parts` equal subtrees hashed on a thread pool, and merging their chaining
+ * values once they're all done. `parts` must be a power of two.
+ * */
+static void subtree_cv_parallel(const unsigned char *input, size_t chunks, uint64_t chunk_counter,
+		size_t parts, uint32_t cv[])
+{
+	struct subtree_job *jobs = (struct subtree_job *) calloc(parts, sizeof(struct subtree_job));
+	if (!jobs)
+		FATAL(MEM_ALLOC_FAILED);
+
+	size_t part_chunks = chunks / parts;
+	for (size_t i = 0; i < parts; i++) {
+		jobs[i].input = input + i * part_chunks * BLAKE3_CHUNK_LEN;
+		jobs[i].chunks = part_chunks;
+		jobs[i].chunk_counter = chunk_counter + i * part_chunks;
+	}
+
+	struct thread_pool pool;
+	thread_pool_init(&pool, (unsigned int) parts);
+	for (size_t i = 0; i < parts; i++)
+		thread_pool_submit(&pool, run_subtree_job, &jobs[i]);
+	thread_pool_destroy(&pool);
+
+	for (size_t n = parts; n > 1; n /= 2) {
+		for (size_t i = 0; i < n / 2; i++)
+			parent_cv(jobs[2 * i].cv, jobs[2 * i + 1].cv, jobs[i].cv);
+	}
+
+	memcpy(cv, jobs[0].cv, sizeof(jobs[0].cv));
+	free(jobs);
+}
+
+/**
+ * Push the chaining value of a completed subtree of 2^`height` chunks, which
+ * brings the number of chunks hashed to `total_chunks`. Sibling subtrees are
+ * merged into their parents as they complete, like the carries of a binary
+ * counter.
+ * */
+static void push_subtree_cv(struct blake3_hasher *hasher, const uint32_t cv[], uint64_t total_chunks,
+		unsigned int height)
+{
+	uint32_t new_cv[8];
+	memcpy(new_cv, cv, sizeof(new_cv));
+
+	total_chunks >>= height;
+	while (!(total_chunks & 1)) {
+		hasher->cv_stack_len--;
+		parent_cv(hasher->cv_stack[hasher->cv_stack_len], new_cv, new_cv);
+		total_chunks >>= 1;
+	}
+
+	memcpy(hasher->cv_stack[hasher->cv_stack_len], new_cv, sizeof(new_cv));
+	hasher->cv_stack_len++;
+}
+
+void blake3_init(struct blake3_hasher *hasher)
+{
+	chunk_state_init(&hasher->chunk, 0);
+	hasher->cv_stack_len = 0;
+	hasher->threads = 1;
+}
+
+void blake3_set_threads(struct blake3_hasher *hasher, unsigned int threads)
+{
+	hasher->threads = threads ? threads : 1;
+}
+
+void blake3_update(struct blake3_hasher *hasher, const void *input, size_t len)
+{
+	const unsigned char *pos = (const unsigned char *) input;
+	struct blake3_chunk_state *chunk = &hasher->chunk;
+
+	/*
+	 * The last chunk of the input always stays in the chunk state, since it
+	 * may turn out to be the root. Only once more input follows it is it added
+	 * to the tree.
+	 * */
+	if (chunk_state_len(chunk)) {
+		size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(chunk);
+		if (take > len)
+			take = len;
+
+		chunk_state_update(chunk, pos, take);
+		pos += take;
+		len -= take;
+		if (!len)
+			return;
+
+		struct output output;
+		uint32_t cv[8];
+		chunk_state_output(chunk, &output);
+		output_chaining_value(&output, cv);
+		push_subtree_cv(hasher, cv, chunk->chunk_counter + 1, 0);
+		chunk_state_init(chunk, chunk->chunk_counter + 1);
+	}
+
+	while (len > BLAKE3_CHUNK_LEN) {
+		uint64_t chunk_counter = chunk->chunk_counter;
+
+		// the largest subtree that leaves some input behind, and starts on a multiple of its size
+		size_t chunks = 1;
+		unsigned int height = 0;
+		while ((chunks * 2) * BLAKE3_CHUNK_LEN < len && !(chunk_counter & (chunks * 2 - 1))) {
+			chunks *= 2;
+			height++;
+		}
+
+		size_t parts = 1;
+		while (parts * 2 <= hasher->threads && chunks >= parts * 2
+				&& chunks / (parts * 2) * BLAKE3_CHUNK_LEN >= BLAKE3_PARALLEL_MIN_LEN)
+			parts *= 2;
+
+		uint32_t cv[8];
+		if (parts > 1)
+			subtree_cv_parallel(pos, chunks, chunk_counter, parts, cv);
+		else
+			subtree_cv(pos, chunks, chunk_counter, cv);
+
+		push_subtree_cv(hasher, cv, chunk_counter + chunks, height);
+		chunk_state_init(chunk, chunk_counter + chunks);
+
+		pos += chunks * BLAKE3_CHUNK_LEN;
+		len -= chunks * BLAKE3_CHUNK_LEN;
+	}
+
+	chunk_state_update(chunk, pos, len);
+}
+
+void blake3_final(const struct blake3_hasher *hasher, unsigned char digest[])
+{
+	struct output output;
+	chunk_state_output(&hasher->chunk, &output);
+
+	for (size_t i = hasher->cv_stack_len; i > 0; i--) {
+		uint32_t cv[8];
+		output_chaining_value(&output, cv);
+		parent_output(hasher->cv_stack[i - 1], cv, &output);
+	}
+
+	uint32_t out[16];
+	compress(output.input_cv, output.block_words, 0, output.block_len, output.flags | ROOT, out);
+	for (size_t i = 0; i < BLAKE3_DIGEST_SIZE / 4; i++) {
+		digest[4 * i] = (unsigned char) out[i];
+		digest[4 * i + 1] = (unsigned char) (out[i] >> 8);
+		digest[4 * i + 2] = (unsigned char) (out[i] >> 16);
+		digest[4 * i + 3] = (unsigned char) (out[i] >> 24);
+	}
+}
@@ -9,58 +9,140 @@
 #include <limits.h>
 #include <libgen.h>
 
-#include "md5.h"
+#include "atomic-file.h"
+#include "digest.h"
+#include "parallel-deflate.h"
 #include "strbuf.h"
 #include "parse-options.h"
 #include "png-chunk-processor.h"
+#include "png-chunk-writer.h"
+#include "steg-archive.h"
+#include "steg-codec.h"
+#include "steg-index.h"
+#include "str-array.h"
 #include "utils.h"
 #include "zlib.h"
 
 #define BUFF_LEN 1024
 #define DEFLATE_CHUNK_DATA_LENGTH 8192
 #define DEFLATE_STREAM_BUFFER_SIZE 16384
+#define BATCH_MANIFEST_FIELDS 3
 
 struct chunk_summary {
 	size_t bytes_in;
 	size_t bytes_out;
 	double compression_ratio;
 	unsigned chunks_written;
+
+	// digests of the input and output images, if computed while embedding
+	unsigned int want_digests: 1;
+	unsigned int has_digests: 1;
+	unsigned char in_digest[DIGEST_MAX_SIZE];
+	unsigned char out_digest[DIGEST_MAX_SIZE];
+};
+
+/**
+ * State of the payload compressor. The payload is compressed incrementally,
+ * between chunks of the image, so that it never needs to be held in memory.
+ * */
+struct payload_deflater {
+	int data_fd;
+	struct strbuf *data;
+	int flush;
+
+	struct z_stream_s strm;
+	unsigned char *input_buffer;
+	unsigned char *output_buffer;
+
+	struct parallel_deflate pd;
+	unsigned int use_parallel_deflate: 1;
+	size_t carry_len;
+
+	// members of an archive, compressed one after the other
+	unsigned int archive: 1;
+	struct steg_archive toc;
+	size_t member;
+	off_t stream_len;
 };
 
 static int compression_level = Z_DEFAULT_COMPRESSION;
+static int verify_crc = 0;
+static long threads = 1;
+static int segmented = 0;
+static enum steg_codec codec = STEG_CODEC_ZLIB;
+static int no_index = 0;
+static int tail = 0;
+static int replace = 0;
+static int archive = 0;
+static int null_terminated = 0;
+static enum digest_type digest_type = DIGEST_MD5;
+static int digest_selected = 0;
+static struct str_array files_to_embed;
 
 static int embed(const char *, const char *, const char *, const char *,
 		struct chunk_summary *);
+static int embed_batch(const char *);
 static void print_summary(const char *, const char *, struct chunk_summary *);
 
+/**
+ * Get the name under which the file at `path` is stored in an archive, which is
+ * the last component of its path.
+ * */
+static inline const char *archive_member_name(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	return name ? name + 1 : path;
+}
+
 int cmd_embed(int argc, char *argv[])
 {
 	const char *message = NULL;
 	const char *output_file = NULL;
-	const char *file_to_embed = NULL;
+	const char *batch_manifest = NULL;
+	const char *digest_algorithm = NULL;
+	const char *codec_name = NULL;
+	int in_place = 0;
 	int help = 0;
 	int quiet = 0;
 
 	const struct usage_string embed_cmd_usage[] = {
-			USAGE("steg-png embed [options] (-m | --message <message>) [(-q | --quiet)] <file>"),
-			USAGE("steg-png embed [options] (-f | --file <file>) [(-q | --quiet)] <file>"),
+			USAGE("steg-png embed [options] (-m | --message <message>) [(-q | --quiet)] (<file> | -)"),
+			USAGE("steg-png embed [options] (-f | --file <file>) [(-q | --quiet)] (<file> | -)"),
+			USAGE("steg-png embed [options] [--archive] (-f | --file <file>)... [(-q | --quiet)] (<file> | -)"),
+			USAGE("steg-png embed [options] --in-place --tail (-m <message> | -f <file>) [(-q | --quiet)] <file>"),
+			USAGE("steg-png embed [options] --replace (-m <message> | -f <file>) [(-q | --quiet)] <file>"),
+			USAGE("steg-png embed [options] [(-z | --nul)] --batch (<manifest> | -)"),
 			USAGE("steg-png embed (-h | --help)"),
 			USAGE_END()
 	};
 
 	const struct command_option embed_cmd_options[] = {
 			OPT_STRING('m', "message", "message", "specify the message to embed in the png image", &message),
-			OPT_STRING('f', "file", "file", "specify a file to embed in the png image", &file_to_embed),
-			OPT_STRING('o', "output", "file", "output to a specific file", &output_file),
+			OPT_STRING_LIST('f', "file", "file", "specify a file to embed in the png image; repeat to embed an archive", &files_to_embed),
+			OPT_LONG_BOOL("archive", "embed the files as an archive, even if there is only one", &archive),
+			OPT_STRING('o', "output", "file", "output to a specific file, or '-' for stdout", &output_file),
 			OPT_INT('l', "compression-level", "alternate compression level (0 none, 1 fastest - 9 slowest, default 6)", &compression_level),
+			OPT_LONG_INT("threads", "compress the payload using <n> threads (0 for one per processor, default 1)", &threads),
+			OPT_LONG_BOOL("segmented", "compress the payload in independent segments that can be extracted in parallel", &segmented),
+			OPT_LONG_STRING("codec", "codec", "compress segments with " STEG_CODEC_NAMES "; implies --segmented", &codec_name),
+			OPT_LONG_BOOL("tail", "place the embedded chunks at the end of the image, just before IEND", &tail),
+			OPT_LONG_BOOL("in-place", "with --tail, append to the image itself rather than writing a new file", &in_place),
+			OPT_LONG_BOOL("replace", "replace the data embedded in the image, in place where possible", &replace),
+			OPT_LONG_BOOL("no-index", "don't write an index of the embedded chunks after the IHDR chunk", &no_index),
+			OPT_LONG_STRING("batch", "manifest", "embed into every image listed in <manifest>, using --threads workers", &batch_manifest),
+			OPT_BOOL('z', "nul", "with --batch, manifest fields and result fields are NUL-terminated", &null_terminated),
+			OPT_LONG_BOOL("verify-crc", "verify the CRC of every chunk copied from the input file", &verify_crc),
+			OPT_LONG_STRING("digest", "algorithm", "summarize files with an md5 (default), xxh3 or blake3 digest", &digest_algorithm),
 			OPT_BOOL('q', "quiet", "suppress informational summary to stdout", &quiet),
 			OPT_BOOL('h', "help", "show help and exit", &help),
 			OPT_END()
 	};
 
+	str_array_init(&files_to_embed);
 	argc = parse_options(argc, argv, embed_cmd_options, 0, 1);
 	if (help) {
 		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 0, NULL);
+		str_array_release(&files_to_embed);
 		return 0;
 	}
 
@@ -69,22 +151,124 @@ int cmd_embed(int argc, char *argv[])
 		return 1;
 	}
 
-	if (argc < 1) {
+	if (null_terminated && !batch_manifest) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "--nul requires --batch");
+		return 1;
+	}
+
+	if (batch_manifest) {
+		if (argc || message || files_to_embed.len || archive || output_file) {
+			show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "--batch takes images and payloads from the manifest only");
+			return 1;
+		}
+
+		if (in_place || replace || segmented || codec_name || verify_crc) {
+			show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "--batch cannot be combined with --in-place, --replace, --segmented, --codec or --verify-crc");
+			return 1;
+		}
+	}
+
+	if (argc < 1 && !batch_manifest) {
 		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "nothing to do");
 		return 1;
 	}
 
-	if (file_to_embed && message) {
+	if (files_to_embed.len && message) {
 		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "cannot mix --file and --message options");
 		return 1;
 	}
 
+	if (archive && !files_to_embed.len) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "--archive requires --file");
+		return 1;
+	}
+
+	// several files are always embedded as an archive
+	archive = archive || files_to_embed.len > 1;
+	for (size_t i = 0; archive && i < files_to_embed.len; i++) {
+		const char *name = archive_member_name(files_to_embed.entries[i].string);
+		if (!*name || strlen(name) > STEG_ARCHIVE_NAME_MAX) {
+			show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "invalid archive member name '%s'", name);
+			return 1;
+		}
+
+		for (size_t j = 0; j < i; j++) {
+			if (!strcmp(name, archive_member_name(files_to_embed.entries[j].string))) {
+				show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "duplicate archive member name '%s'", name);
+				return 1;
+			}
+		}
+	}
+
+	// stdin can't carry both the image and the message
+	if (!batch_manifest && !strcmp(argv[0], "-") && !files_to_embed.len && !message) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "reading image from stdin requires --file or --message");
+		return 1;
+	}
+
+	if (in_place && !tail) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "--in-place requires --tail");
+		return 1;
+	}
+
+	if (in_place && output_file) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "cannot mix --in-place and --output");
+		return 1;
+	}
+
+	if (replace && in_place) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "cannot mix --replace and --in-place");
+		return 1;
+	}
+
+	if (replace && output_file) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "cannot mix --replace and --output");
+		return 1;
+	}
+
+	if ((in_place || replace) && !strcmp(argv[0], "-")) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "cannot modify an image read from stdin in place");
+		return 1;
+	}
+
 	if (compression_level != Z_DEFAULT_COMPRESSION && (compression_level > 9 || compression_level < 0)) {
 		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "invalid compression level %d", compression_level);
 		return 1;
 	}
 
-	if (compression_level == 0)
+	if (threads < 0) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "invalid number of threads %ld", threads);
+		return 1;
+	}
+
+	if (digest_algorithm && digest_type_from_name(digest_algorithm, &digest_type)) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "unknown digest algorithm '%s'", digest_algorithm);
+		return 1;
+	}
+
+	digest_selected = digest_algorithm != NULL;
+
+	if (codec_name && steg_codec_from_name(codec_name, &codec)) {
+		show_usage_with_options(embed_cmd_usage, embed_cmd_options, 1, "unknown codec '%s'", codec_name);
+		return 1;
+	}
+
+	if (!threads)
+		threads = thread_pool_cpu_count();
+
+	if (batch_manifest) {
+		str_array_release(&files_to_embed);
+		return embed_batch(batch_manifest);
+	}
+
+	// members of an archive are compressed independently, and only segmented streams name their codec
+	if (archive || codec_name)
+		segmented = 1;
+
+	if (codec == STEG_CODEC_STORE)
+		WARN("the store codec embeds the message or file without compression, so it will not\n"
+			"be sufficiently obfuscated. Consider encrypting your input message or file.");
+	else if (compression_level == 0)
 		WARN("using a compression level of zero is discouraged, since the embedded message\n"
 			"or file will not be sufficiently obfuscated. Consider increasing the compression level\n"
 			"or encrypting your input message or file.");
@@ -96,6 +280,10 @@ int cmd_embed(int argc, char *argv[])
 	strbuf_init(&output_file_path);
 	if (output_file)
 		strbuf_attach_str(&output_file_path, output_file);
+	else if (in_place || replace)
+		strbuf_attach_str(&output_file_path, argv[0]);
+	else if (!strcmp(argv[0], "-"))
+		strbuf_attach_str(&output_file_path, "-");
 	else
 		strbuf_attach_fmt(&output_file_path, "%s.steg", basename(argv[0]));
 
@@ -104,20 +292,27 @@ int cmd_embed(int argc, char *argv[])
 			.chunks_written = 0,
 			.bytes_in = 0,
 			.bytes_out = 0,
-			.compression_ratio = 0
+			.compression_ratio = 0,
+			.want_digests = !quiet && strcmp(output_file_path.buff, "-") != 0,
+			.has_digests = 0
 	};
 
-	ret = embed(argv[0], output_file_path.buff, file_to_embed, message, &result);
+	const char *file_to_embed = files_to_embed.len && !archive ? files_to_embed.entries[0].string : NULL;
+	ret = embed(argv[0], in_place ? NULL : output_file_path.buff, file_to_embed, message, &result);
 
-	if (!quiet)
+	// when streaming the image to stdout, the summary would only get in the way
+	if (!quiet && strcmp(output_file_path.buff, "-") != 0)
 		print_summary(argv[0], output_file_path.buff, &result);
 
 	strbuf_release(&output_file_path);
+	str_array_release(&files_to_embed);
 
 	return ret;
 }
 
 static int embed_data(int, int, int, struct strbuf *, struct chunk_summary *);
+static int embed_tail_in_place(int, int, struct strbuf *, struct chunk_summary *);
+static int embed_replace(int, const char *, mode_t, int, struct strbuf *, struct chunk_summary *);
 
 /**
  * Embed a file or message into a PNG image with the file path `input_file`, and
@@ -125,48 +320,57 @@ static int embed_data(int, int, int, struct strbuf *, struct chunk_summary *);
  *
  * If file_to_embed is nonnull, the content of the file is embedded. Otherwise,
  * if message is nonnull, the message string is embedded. If both are null, the
- * message is read from stdin.
+ * message is read from stdin. When embedding an archive, the files to embed are
+ * instead opened one by one as they are compressed (see archive_round()).
  *
  * Once complete, the chunk_summary is populated with the details of the embedded
  * chunk, which can be used to print diagnostic/informational messages.
  *
- * Note: to avoid leaving partially written or corrupted output files on error,
- * the output PNG is first written to a temporary file and then copied over to
- * its final location if successful.
+ * If `output_file` is "-", the output PNG is streamed to stdout. Otherwise, to
+ * avoid leaving partially written or corrupted output files on error, the output
+ * PNG is written to a temporary file alongside the destination and atomically
+ * renamed into place once successful.
+ *
+ * If `input_file` is "-", the PNG image is read from stdin. Since stdin may be
+ * a pipe, chunks are copied through the chunk iterator rather than by range.
+ *
+ * If `output_file` is NULL, the payload is instead appended to the input file
+ * in place (see embed_tail_in_place()). When replacing the payload, the output
+ * file is the input file (see embed_replace()).
  * */
 static int embed(const char *input_file, const char *output_file,
 		const char *file_to_embed, const char *message, struct chunk_summary *result)
 {
 	// stat and open descriptor to input file
 	struct stat st;
-	if (lstat(input_file, &st) && errno == ENOENT)
-		FATAL("failed to stat %s'", input_file);
+	int in_fd = STDIN_FILENO;
+	if (!strcmp(input_file, "-")) {
+		st.st_mode = 0666;
+	} else {
+		if (lstat(input_file, &st) && errno == ENOENT)
+			FATAL("failed to stat %s'", input_file);
 
-	int in_fd = open(input_file, O_RDONLY);
-	if (in_fd < 0)
-		DIE(FILE_OPEN_FAILED, input_file);
+		in_fd = open(input_file, output_file && !replace ? O_RDONLY : O_RDWR);
+		if (in_fd < 0)
+			DIE(FILE_OPEN_FAILED, input_file);
+	}
 
-	// create and unlink a temporary file
-	char tmp_file_name_template[] = "/tmp/steg-png_XXXXXX";
-	int tmp_fd = mkstemp(tmp_file_name_template);
-	if (tmp_fd < 0)
-		FATAL("unable to create temporary file");
-	if (unlink(tmp_file_name_template) < 0)
-		FATAL("failed to unlink temporary file from filesystem");
+	int data_fd = -1;
+	struct strbuf message_buf;
+	strbuf_init(&message_buf);
 
-	if (file_to_embed) {
+	if (archive) {
+		// members are opened as they are compressed
+	} else if (file_to_embed) {
 		// open descriptor to file that will be embedded
-		int file_to_embed_fd = open(file_to_embed, O_RDONLY);
-		if (file_to_embed_fd < 0)
+		data_fd = open(file_to_embed, O_RDONLY);
+		if (data_fd < 0)
 			DIE(FILE_OPEN_FAILED, file_to_embed);
-
-		embed_data(in_fd, tmp_fd, file_to_embed_fd, NULL, result);
-		close(file_to_embed_fd);
 	} else if (!message) {
 		// if no message was given, take from stdin
 		char tmp_input_file_name_template[] = "/tmp/steg-png_XXXXXX";
-		int tmp_in_fd = mkstemp(tmp_input_file_name_template);
-		if (tmp_in_fd < 0)
+		data_fd = mkstemp(tmp_input_file_name_template);
+		if (data_fd < 0)
 			FATAL("unable to create temporary file");
 		if (unlink(tmp_input_file_name_template) < 0)
 			FATAL("failed to unlink temporary file from filesystem");
@@ -174,119 +378,96 @@ static int embed(const char *input_file, const char *output_file,
 		char buffer[BUFF_LEN];
 		ssize_t bytes_read = 0;
 		while ((bytes_read = recoverable_read(STDIN_FILENO, buffer, BUFF_LEN)) > 0)
-			if (recoverable_write(tmp_in_fd, buffer, bytes_read) != bytes_read)
+			if (recoverable_write(data_fd, buffer, bytes_read) != bytes_read)
 				FATAL("failed to write to temporary outfile file");
 
 		if (bytes_read < 0)
 			FATAL("unable to read message from stdin");
 
-		if (lseek(tmp_in_fd, 0, SEEK_SET) < 0)
+		if (lseek(data_fd, 0, SEEK_SET) < 0)
 			FATAL("failed to set the file offset for temporary file");
-
-		embed_data(in_fd, tmp_fd, tmp_in_fd, NULL, result);
-		close(tmp_in_fd);
 	} else {
-		struct strbuf message_buf;
-		strbuf_init(&message_buf);
-
 		strbuf_attach_str(&message_buf, message);
-
-		embed_data(in_fd, tmp_fd, -1, &message_buf, result);
-		strbuf_release(&message_buf);
 	}
 
-	close(in_fd);
-
-	if (lseek(tmp_fd, 0, SEEK_SET) < 0)
-		FATAL("failed to set the file offset for temporary file");
+	struct strbuf *data = data_fd < 0 && !archive ? &message_buf : NULL;
+	if (!output_file) {
+		embed_tail_in_place(in_fd, data_fd, data, result);
+	} else if (replace) {
+		embed_replace(in_fd, output_file, st.st_mode, data_fd, data, result);
+	} else {
+		struct atomic_file out;
+		if (atomic_file_open(&out, output_file, st.st_mode))
+			DIE(FILE_OPEN_FAILED, output_file);
 
-	int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode);
-	if (out_fd < 0)
-		DIE(FILE_OPEN_FAILED, output_file);
+		embed_data(in_fd, out.fd, data_fd, data, result);
 
-	fstat(tmp_fd, &st);
-	ssize_t file_size = st.st_size;
+		if (atomic_file_commit(&out))
+			FATAL("failed to write output file '%s'", output_file);
+	}
 
-	if (copy_file_fd(out_fd, tmp_fd) != file_size)
-		FATAL("failed to write temporary file to destination %s", output_file);
+	if (data_fd >= 0)
+		close(data_fd);
+	strbuf_release(&message_buf);
 
-	close(tmp_fd);
-	close(out_fd);
+	if (in_fd != STDIN_FILENO && close(in_fd))
+		FATAL("failed to write to file '%s'", input_file);
 
 	return 0;
 }
 
 /**
- * Write arbitrary data to a given file descriptor, and return an updated CRC.
- * */
-static inline u_int32_t write_and_update_crc(int fd, const void *data, size_t length, u_int32_t crc)
-{
-	if (recoverable_write(fd, data, length) != length)
-		FATAL("failed to write new chunk to output file descriptor %d", fd);
-
-	return crc32_z(crc, data, length);
-}
-
-/**
- * Write the entire chunk from the current chunk_iterator context to a file
- * with the given file descriptor.
+ * Write the entire chunk from the current chunk_iterator context through the
+ * chunk writer, verifying the CRC of the chunk along the way.
  * */
-void write_chunk_to_file_from_ctx(int dest_fd, struct chunk_iterator_ctx *ctx)
+void write_chunk_to_file_from_ctx(struct chunk_writer *writer, struct chunk_iterator_ctx *ctx)
 {
 	struct png_chunk_detail chunk = ctx->current_chunk;
-	unsigned char temporary_buffer[BUFF_LEN];
+	unsigned char temporary_buffer[DEFLATE_STREAM_BUFFER_SIZE];
 
-	// write the chunk data length to output file
-	u_int32_t data_len_net_order = htonl(chunk.data_length);
-	if (recoverable_write(dest_fd, &data_len_net_order, sizeof(u_int32_t)) != sizeof(u_int32_t))
-		FATAL("failed to write data length field to output file");
+	if (chunk_writer_begin_chunk(writer, chunk.chunk_type, chunk.data_length))
+		FATAL("failed to write chunk to output file");
 
-	// write the chunk type to output file
-	u_int32_t chunk_crc = 0;
-	chunk_crc = write_and_update_crc(dest_fd, chunk.chunk_type,
-			sizeof(char) * CHUNK_TYPE_LENGTH, chunk_crc);
+	// write the chunk data to output file, straight from the mapping if possible
+	const unsigned char *mapped_data = chunk_iterator_get_chunk_data(ctx);
+	if (mapped_data && chunk_writer_write_data(writer, mapped_data, chunk.data_length))
+		FATAL("failed to write chunk to output file");
 
-	// write the chunk data to output file
-	while (1) {
-		ssize_t bytes_read = chunk_iterator_read_data(ctx, temporary_buffer, BUFF_LEN);
+	while (!mapped_data) {
+		ssize_t bytes_read = chunk_iterator_read_data(ctx, temporary_buffer, DEFLATE_STREAM_BUFFER_SIZE);
 		if (bytes_read < 0)
 			FATAL("unexpected error while parsing input file");
 		if (bytes_read == 0)
 			break;
 
-		chunk_crc = write_and_update_crc(dest_fd, temporary_buffer, bytes_read, chunk_crc);
+		// the buffer is reused on the next pass, so it must be written out now
+		if (chunk_writer_write_data(writer, temporary_buffer, bytes_read) || chunk_writer_flush(writer))
+			FATAL("failed to write chunk to output file");
 	}
 
-	if (chunk_crc != chunk.chunk_crc)
-		WARN("%.*s chunk at file offset %d has invalid CRC -- file may be corrupted",
-			 CHUNK_TYPE_LENGTH, chunk.chunk_type, ctx->chunk_file_offset);
+	// the CRC is cheap to fetch now that the chunk data has been consumed
+	if (chunk_iterator_get_chunk_crc(ctx, &chunk.chunk_crc))
+		FATAL("unexpected error while parsing input file");
+
+	if (chunk_writer_get_crc(writer) != chunk.chunk_crc)
+		WARN("%.*s chunk at file offset %lld has invalid CRC -- file may be corrupted",
+			 CHUNK_TYPE_LENGTH, chunk.chunk_type, (long long int) ctx->chunk_file_offset);
 
-	// write the chunk CRC to output file
-	u_int32_t crc_net_order = htonl(chunk.chunk_crc);
-	if (recoverable_write(dest_fd, &crc_net_order, sizeof(u_int32_t)) != sizeof(u_int32_t))
+	// write the original chunk CRC to output file
+	if (chunk_writer_end_chunk(writer, chunk.chunk_crc))
 		FATAL("failed to write CRC field to output file");
 }
 
-void write_steg_chunk_to_file_from_buffer(int dest_fd, void *buffer, size_t length)
+/**
+ * Write a stEG chunk with the given data through the chunk writer, and record
+ * its location in the index.
+ * */
+void write_steg_chunk_to_file_from_buffer(struct chunk_writer *writer, struct steg_index *index,
+		void *buffer, size_t length)
 {
-	u_int32_t crc = 0;
-
-	// write length
-	u_int32_t len_net_order = htonl((u_int32_t) length);
-	if (recoverable_write(dest_fd, &len_net_order, sizeof(u_int32_t)) != sizeof(u_int32_t))
-		FATAL("failed to write data length field to output file");
-
-	// write type
-	char chunk_type[] = { 's', 't', 'E', 'G' };
-	crc = write_and_update_crc(dest_fd, chunk_type, CHUNK_TYPE_LENGTH, crc);
-
-	// write data
-	crc = write_and_update_crc(dest_fd, buffer, length, crc);
-
-	// write crc
-	u_int32_t crc_net_order = htonl(crc);
-	if (recoverable_write(dest_fd, &crc_net_order, sizeof(u_int32_t)) != sizeof(u_int32_t))
-		FATAL("failed to write CRC field to output file");
+	steg_index_add(index, writer->offset, (u_int32_t) length);
+	if (chunk_writer_write_chunk(writer, STEG_CHUNK_TYPE, buffer, (u_int32_t) length))
+		FATAL("failed to write stEG chunk to output file");
 }
 
 /**
@@ -297,14 +478,227 @@ void write_steg_chunk_to_file_from_buffer(int dest_fd, void *buffer, size_t leng
  * but it's close enough for most situations.
  *
  * A value of 0 indicates that embedded chunks should not be sparse, (i.e. localized).
+ * This is always the case if the length of the source file is unknown, or if there
+ * is no data to embed.
  * */
 static inline unsigned int compute_sparcity(off_t source_file_len, off_t data_len)
 {
+	if (source_file_len <= 0 || data_len <= 0)
+		return 0;
+
 	double data_length_factor = (unsigned int)((source_file_len / data_len) % UINT_MAX);
 	return (unsigned)(data_length_factor / DEFLATE_CHUNK_DATA_LENGTH);
 }
 
-static size_t single_pass_deflate(struct z_stream_s *, unsigned char *, int, int);
+static ssize_t single_pass_deflate(struct z_stream_s *, unsigned char *,
+		struct chunk_writer *, struct steg_index *, int);
+static size_t single_pass_parallel_deflate(struct parallel_deflate *, size_t, int,
+		unsigned char *, size_t *, struct chunk_writer *, struct steg_index *);
+static size_t write_stream_data(const unsigned char *, size_t, int, unsigned char *, size_t *,
+		struct chunk_writer *, struct steg_index *);
+static void archive_round(struct payload_deflater *, struct chunk_writer *, struct steg_index *,
+		struct chunk_summary *);
+static int write_index(int, off_t, off_t, struct steg_index *, unsigned char *);
+static size_t fill_input_buffer(unsigned char *, size_t, int, struct strbuf *);
+static void payload_deflater_init(struct payload_deflater *, int, struct strbuf *);
+static void payload_deflater_round(struct payload_deflater *, struct chunk_writer *,
+		struct steg_index *, struct chunk_summary *);
+static void payload_deflater_destroy(struct payload_deflater *);
+static off_t locate_head_index(struct chunk_iterator_ctx *, size_t *);
+static void update_head_index(int, off_t, size_t, const struct steg_index *);
+static void finish_tail_payload(int, struct chunk_writer *, struct steg_index *, off_t, size_t);
+static inline int is_payload_chunk(struct chunk_iterator_ctx *);
+
+/**
+ * Set up the compressor for a payload taken from the strbuf `data` if non-null,
+ * or otherwise from the file descriptor `data_fd`. When embedding an archive,
+ * neither is defined, since the payload is taken from the files to embed.
+ * */
+static void payload_deflater_init(struct payload_deflater *deflater, int data_fd, struct strbuf *data)
+{
+	if (data && data_fd != -1)
+		BUG("either data or data_fd must be defined, not both");
+	if (!data && data_fd == -1 && !archive)
+		BUG("either data or data_fd must be defined");
+
+	deflater->data_fd = data_fd;
+	deflater->data = data;
+	deflater->flush = Z_NO_FLUSH;
+
+	// allocate buffers for deflate input/output
+	deflater->input_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+	if (!deflater->input_buffer)
+		FATAL(MEM_ALLOC_FAILED);
+
+	deflater->output_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+	if (!deflater->output_buffer)
+		FATAL(MEM_ALLOC_FAILED);
+
+	// set up zlib for deflate
+	struct z_stream_s *strm = &deflater->strm;
+	strm->zalloc = Z_NULL;
+	strm->zfree = Z_NULL;
+	strm->opaque = Z_NULL;
+
+	int ret = deflateInit(strm, compression_level);
+	if (ret != Z_OK)
+		FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+
+	strm->avail_out = DEFLATE_STREAM_BUFFER_SIZE;
+	strm->next_out = deflater->output_buffer;
+
+	/*
+	 * With more than one thread, or when writing a segmented stream, the
+	 * payload is compressed in blocks on a pool of workers instead. Compressed
+	 * data that doesn't fill a whole stEG chunk is carried over in the output
+	 * buffer until the next round.
+	 * */
+	deflater->carry_len = 0;
+	deflater->use_parallel_deflate = threads > 1 || segmented;
+	if (segmented)
+		parallel_deflate_init_segmented(&deflater->pd, codec, compression_level, (unsigned int) threads);
+	else if (threads > 1)
+		parallel_deflate_init(&deflater->pd, compression_level, (unsigned int) threads);
+
+	deflater->archive = archive;
+	deflater->member = 0;
+	deflater->stream_len = 0;
+	steg_archive_init(&deflater->toc);
+	if (archive)
+		deflater->pd.stream_flags = STEG_STREAM_FLAG_ARCHIVE;
+}
+
+/**
+ * Returns non-zero once the whole payload has been compressed and written.
+ * */
+static inline int payload_deflater_finished(struct payload_deflater *deflater)
+{
+	return deflater->flush == Z_FINISH;
+}
+
+/**
+ * Compress the next portion of the payload, and write the compressed data as
+ * stEG chunks through the chunk writer, recording them in the index.
+ * */
+static void payload_deflater_round(struct payload_deflater *deflater, struct chunk_writer *writer,
+		struct steg_index *index, struct chunk_summary *result)
+{
+	struct strbuf *data = deflater->data;
+
+	if (deflater->archive) {
+		archive_round(deflater, writer, index, result);
+		return;
+	}
+
+	if (deflater->use_parallel_deflate) {
+		size_t capacity;
+		unsigned char *round_buffer = parallel_deflate_input(&deflater->pd, &capacity);
+		size_t len = fill_input_buffer(round_buffer, capacity, deflater->data_fd, data);
+		if (len < capacity)
+			deflater->flush = Z_FINISH;
+
+		result->bytes_in += len;
+
+		size_t bytes = single_pass_parallel_deflate(&deflater->pd, len, deflater->flush,
+				deflater->output_buffer, &deflater->carry_len, writer, index);
+		result->chunks_written += (unsigned)((bytes + DEFLATE_CHUNK_DATA_LENGTH - 1) / DEFLATE_CHUNK_DATA_LENGTH);
+		result->bytes_out += bytes;
+		return;
+	}
+
+	/*
+	 * Copy the input data (from given strbuf or file) into data
+	 * buffer for zlib deflate.
+	 * */
+	struct z_stream_s *strm = &deflater->strm;
+	if (data) {
+		// if only a portion of chunk is remaining, use length of buffer
+		size_t len = DEFLATE_STREAM_BUFFER_SIZE;
+		if (data->len < DEFLATE_STREAM_BUFFER_SIZE) {
+			len = data->len;
+			deflater->flush = Z_FINISH;
+		}
+
+		// move from data buffer to input buffer
+		memcpy(deflater->input_buffer, data->buff, len);
+		strbuf_remove(data, 0, len);
+
+		strm->avail_in = len;
+	} else {
+		ssize_t bytes_read = recoverable_read(deflater->data_fd, deflater->input_buffer, DEFLATE_STREAM_BUFFER_SIZE);
+		if (bytes_read < 0)
+			FATAL("failed to read from data input file");
+
+		strm->avail_in = bytes_read;
+		if (bytes_read < DEFLATE_STREAM_BUFFER_SIZE)
+			deflater->flush = Z_FINISH;
+	}
+
+	strm->next_in = deflater->input_buffer;
+	result->bytes_in += strm->avail_in;
+
+	// run a single pass of DEFLATE, flushing if necessary
+	ssize_t bytes = single_pass_deflate(strm, deflater->output_buffer, writer, index, deflater->flush);
+	if (bytes < 0)
+		FATAL("failed to write stEG chunks to output file");
+
+	// multiples of 8192, plus one if reached end of file and last chunk size less than 8192
+	unsigned chunks_written = (unsigned)(bytes / DEFLATE_CHUNK_DATA_LENGTH);
+	if (bytes % DEFLATE_CHUNK_DATA_LENGTH != 0)
+		chunks_written++;
+
+	result->chunks_written += chunks_written;
+	result->bytes_out += bytes;
+}
+
+/**
+ * Release any resources held by the compressor.
+ * */
+static void payload_deflater_destroy(struct payload_deflater *deflater)
+{
+	if (deflater->use_parallel_deflate)
+		parallel_deflate_destroy(&deflater->pd);
+	if (deflater->archive && deflater->data_fd >= 0)
+		close(deflater->data_fd);
+
+	steg_archive_release(&deflater->toc);
+
+	(void)deflateEnd(&deflater->strm);
+	free(deflater->input_buffer);
+	free(deflater->output_buffer);
+}
+
+/**
+ * Get the length of the payload that will be embedded. The length of an
+ * archive includes its table of contents, and allows for every member but the
+ * first ending with a short segment.
+ * */
+static off_t payload_length(int data_fd, struct strbuf *data)
+{
+	if (data)
+		return (off_t) data->len;
+
+	if (archive) {
+		off_t len = STEG_ARCHIVE_HEADER_LENGTH + STEG_ARCHIVE_TRAILER_LENGTH;
+		for (size_t i = 0; i < files_to_embed.len; i++) {
+			const char *path = files_to_embed.entries[i].string;
+			struct stat member_st;
+			if (stat(path, &member_st))
+				DIE(FILE_OPEN_FAILED, path);
+
+			len += member_st.st_size + STEG_ARCHIVE_ENTRY_LENGTH + (off_t) strlen(archive_member_name(path));
+			len += STEG_SEGMENT_HEADER_LENGTH + 64;
+		}
+
+		return len;
+	}
+
+	struct stat data_st;
+	if (fstat(data_fd, &data_st) && errno == ENOENT)
+		FATAL("failed to stat tmp file with descriptor %d'", data_fd);
+
+	return data_st.st_size;
+}
 
 /**
  * Embed arbitrary data from a file or string to a PNG file.
@@ -322,56 +716,76 @@ static size_t single_pass_deflate(struct z_stream_s *, unsigned char *, int, int
 static int embed_data(int in_fd, int out_fd, int data_fd, struct strbuf *data,
 		struct chunk_summary *result)
 {
-	if (data && data_fd != -1)
-		BUG("either data or data_fd must be defined, not both");
-	if (!data && data_fd == -1)
-		BUG("either data or data_fd must be defined");
-
 	struct chunk_iterator_ctx ctx;
-	int status = chunk_iterator_init_ctx(&ctx, in_fd);
+	int status = chunk_iterator_init_mmap_ctx(&ctx, in_fd);
 	if (status < 0)
 		FATAL("failed to read from file descriptor");
 	else if(status > 0)
 		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
 	// write PNG header signature to output file
-	if (recoverable_write(out_fd, PNG_SIG, SIGNATURE_LENGTH) != SIGNATURE_LENGTH)
-		FATAL("failed to write PNG file signature to output file");
-
-	// allocate buffers for deflate input/output
-	unsigned char *input_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
-	if (!input_buffer)
-		FATAL(MEM_ALLOC_FAILED);
-
-	unsigned char *output_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
-	if (!output_buffer)
-		FATAL(MEM_ALLOC_FAILED);
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, out_fd);
+
+	// one pool serves the CRCs of every chunk, rather than one per chunk
+	struct thread_pool crc_pool;
+	if (threads > 1) {
+		thread_pool_init(&crc_pool, (unsigned int) threads);
+		chunk_writer_set_pool(&writer, &crc_pool);
+	}
 
-	// set up zlib for deflate
-	struct z_stream_s strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
+	/*
+	 * Rather than reading both images again to summarize them, hash the input
+	 * image as the iterator walks its mapping, and the output image as it's
+	 * written. The index isn't known until the end, so hashing the output is
+	 * deferred once room for it is reserved (see chunk_writer_defer_digest()).
+	 * */
+	struct digest_ctx in_digest, out_digest;
+	digest_init(&in_digest, digest_type);
+	digest_init(&out_digest, digest_type);
+	digest_set_threads(&in_digest, (unsigned int) threads);
+	digest_set_threads(&out_digest, (unsigned int) threads);
+
+	int digests = result->want_digests && !chunk_iterator_begin_digest(&ctx, &in_digest);
+	if (digests)
+		chunk_writer_begin_digest(&writer, &out_digest, in_fd, ctx.map, ctx.map_len);
+
+	if (chunk_writer_write_raw(&writer, PNG_SIG, SIGNATURE_LENGTH))
+		FATAL("failed to write PNG file signature to output file");
 
-	int ret, flush = Z_NO_FLUSH;
-	ret = deflateInit(&strm, compression_level);
-	if (ret != Z_OK)
-		FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+	struct payload_deflater deflater;
+	payload_deflater_init(&deflater, data_fd, data);
 
 	struct stat st;
 	if (fstat(in_fd, &st) && errno == ENOENT)
 		FATAL("failed to stat tmp file with descriptor %s'", in_fd);
+	if (!S_ISREG(st.st_mode))
+		st.st_size = 0;
 
 	// compute the sparcity
-	unsigned int sparcity;
-	if (data) {
-		sparcity = compute_sparcity(st.st_size, data->len);
-	} else {
-		struct stat data_st;
-		if (fstat(data_fd, &data_st) && errno == ENOENT)
-			FATAL("failed to stat tmp file with descriptor %s'", in_fd);
-
-		sparcity = compute_sparcity(st.st_size, data_st.st_size);
+	off_t data_len = payload_length(data_fd, data);
+	unsigned int sparcity = compute_sparcity(st.st_size, data_len);
+
+	/*
+	 * Unless disabled, an index of the stEG chunks is written right after the
+	 * IHDR chunk, so that they can be found without walking the whole file.
+	 * The chunk offsets aren't known until the payload has been written, so
+	 * room for the index is reserved up front and filled in once complete,
+	 * which requires an output file that can be written at arbitrary offsets.
+	 * */
+	struct steg_index index;
+	off_t index_base = no_index ? -1 : lseek(out_fd, 0, SEEK_CUR);
+	size_t index_capacity = 0;
+	if (index_base >= 0 && data_len > 0)
+		index_capacity = steg_index_capacity(data_len, DEFLATE_CHUNK_DATA_LENGTH);
+	steg_index_init(&index, index_capacity);
+
+	unsigned char *index_data = NULL;
+	off_t index_offset = -1;
+	if (index_capacity) {
+		index_data = (unsigned char *) calloc(steg_index_data_length(index_capacity), sizeof(unsigned char));
+		if (!index_data)
+			FATAL(MEM_ALLOC_FAILED);
 	}
 
 	struct timeval time;
@@ -392,64 +806,64 @@ static int embed_data(int in_fd, int out_fd, int data_fd, struct strbuf *data,
 		if (!memcmp(ctx.current_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
 			IEND_found++;
 
-		// deflate input file/buffer
-		strm.avail_out = DEFLATE_STREAM_BUFFER_SIZE;
-		strm.next_out = output_buffer;
-		while (flush != Z_FINISH) {
-			if (!IHDR_found || (!IEND_found && sparcity && (random() % sparcity != 0)))
+		// deflate input file/buffer, unless the chunks belong elsewhere
+		while (!payload_deflater_finished(&deflater)) {
+			if (!IHDR_found || (!IEND_found && (tail || (sparcity && (random() % sparcity != 0)))))
 				break;
 
-			/*
-			 * Copy the input data (from given strbuf or file) into data
-			 * buffer for zlib deflate.
-			 * */
-			if (data) {
-				// if only a portion of chunk is remaining, use length of buffer
-				size_t len = DEFLATE_STREAM_BUFFER_SIZE;
-				if (data->len < DEFLATE_STREAM_BUFFER_SIZE) {
-					len = data->len;
-					flush = Z_FINISH;
-				}
-
-				// move from data buffer to input buffer
-				memcpy(input_buffer, data->buff, len);
-				strbuf_remove(data, 0, len);
-
-				strm.avail_in = len;
-			} else {
-				ssize_t bytes_read = recoverable_read(data_fd, input_buffer, DEFLATE_STREAM_BUFFER_SIZE);
-				if (bytes_read < 0)
-					FATAL("failed to read from data input file");
-
-				strm.avail_in = bytes_read;
-				if (bytes_read < DEFLATE_STREAM_BUFFER_SIZE)
-					flush = Z_FINISH;
-			}
+			payload_deflater_round(&deflater, &writer, &index, result);
+		}
+
+		// an index carried over from the input file would be stale, so drop it
+		if (!memcmp(ctx.current_chunk.chunk_type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			continue;
+
+		// when replacing the payload, the old one is dropped too
+		if (replace && is_payload_chunk(&ctx))
+			continue;
 
-			strm.next_in = input_buffer;
-			result->bytes_in += strm.avail_in;
+		/*
+		 * Unless asked to verify CRCs (which requires reading every byte), or
+		 * reading from a stream that can't be copied by range, let the kernel
+		 * copy the chunk to the output file.
+		 * */
+		if (verify_crc || chunk_iterator_is_stream(&ctx))
+			write_chunk_to_file_from_ctx(&writer, &ctx);
+		else if (chunk_writer_copy_range(&writer, in_fd, ctx.chunk_file_offset,
+				CHUNK_LENGTH(ctx.current_chunk.data_length)))
+			FATAL("failed to copy chunks from input file to output file");
 
-			// run a single pass of DEFLATE, flushing if necessary
-			size_t bytes = single_pass_deflate(&strm, output_buffer, out_fd, flush);
+		if (!memcmp(ctx.current_chunk.chunk_type, IHDR_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			IHDR_found++;
 
-			// multiples of 8192, plus one if reached end of file and last chunk size less than 8192
-			unsigned chunks_written = (unsigned)(bytes / DEFLATE_CHUNK_DATA_LENGTH);
-			if (bytes % DEFLATE_CHUNK_DATA_LENGTH != 0)
-				chunks_written++;
+		// reserve room for the index, which is filled in later
+		if (index_data && IHDR_found == 1 && index_offset < 0) {
+			if (digests)
+				chunk_writer_defer_digest(&writer, CHUNK_LENGTH(steg_index_data_length(index_capacity)));
 
-			result->chunks_written += chunks_written;
-			result->bytes_out += bytes;
+			index_offset = writer.offset;
+			if (chunk_writer_write_chunk(&writer, STEG_INDEX_CHUNK_TYPE, index_data,
+					(u_int32_t) steg_index_data_length(index_capacity)))
+				FATAL("failed to write stIX chunk to output file");
 		}
+	}
 
-		write_chunk_to_file_from_ctx(out_fd, &ctx);
+	if (chunk_writer_flush(&writer))
+		FATAL("failed to write chunks to output file");
 
-		if (!memcmp(ctx.current_chunk.chunk_type, IHDR_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
-			IHDR_found++;
+	if (index_offset >= 0 && write_index(out_fd, index_base, index_offset, &index, index_data))
+		FATAL("failed to write stIX chunk to output file");
+
+	if (digests) {
+		chunk_iterator_finish_digest(&ctx, result->in_digest);
+		result->has_digests = !chunk_writer_finish_digest(&writer, result->out_digest);
 	}
 
-	(void)deflateEnd(&strm);
-	free(input_buffer);
-	free(output_buffer);
+	payload_deflater_destroy(&deflater);
+	free(index_data);
+	steg_index_release(&index);
+	if (threads > 1)
+		thread_pool_destroy(&crc_pool);
 
 	result->compression_ratio = result->bytes_out == 0 ? 0.0 : (float)result->bytes_out / (float)result->bytes_in;
 
@@ -463,95 +877,1392 @@ static int embed_data(int in_fd, int out_fd, int data_fd, struct strbuf *data,
 }
 
 /**
- * Run zlib deflate on input data while the output buffer is not full.
- * If the output buffer is full, or we reached the end of the input data,
- * the output buffer is written as stEG chunks to the output file in chunks
- * of 8192 bytes in length.
+ * Append the payload to the end of the PNG file open for reading and writing as
+ * in_fd, without rewriting the rest of the image.
  *
- * Returns the number of (defalted) bytes written to the file. A return value of
- * zero indicates that the output buffer was not filled, and as a result no data
- * was written to the file.
+ * IEND is located from the end of the file, rather than by walking the chunks
+ * before it. The file is truncated at IEND, and the stEG chunks are appended,
+ * followed by a tail index (see steg-index.h) and a new IEND. The payload is
+ * appended as a new stream after any embedded before (see steg-stream.h), which
+ * are kept.
+ *
+ * The index must list every stEG chunk in the file, old and new alike. The
+ * chunks of earlier payloads are taken from the stIX chunk following IHDR, or
+ * from a tail index appended before, which is dropped in favour of the new one.
+ * If the image has no usable index, earlier stEG chunks could be anywhere, and
+ * finding them would take a walk of the whole file, so no index is written and
+ * readers walk the file instead. A stIX chunk following IHDR is updated to list
+ * all of the chunks, or marked unusable if they don't fit.
  * */
-static size_t single_pass_deflate(struct z_stream_s *strm, unsigned char *output_buffer,
-		int out_fd, int flush)
+static int embed_tail_in_place(int in_fd, int data_fd, struct strbuf *data,
+		struct chunk_summary *result)
 {
-	int ret;
-	unsigned pending = 0;
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_ctx(&ctx, in_fd);
+	if (status < 0)
+		FATAL("failed to read from file descriptor");
+	else if(status > 0)
+		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
-	size_t bytes_out = 0;
-	size_t data_to_write, chunk_size;
-	do {
-		ret = deflate(strm, flush);
-		if (ret == Z_STREAM_ERROR)
-			FATAL("zlib DEFLATE failed with unexpected error: input file may be corrupted.\n"
-				  "zlib: %s", zError(ret));
+	// remember where the stIX chunk after IHDR is, if any, so it can be updated
+	struct steg_index old_index;
+	int index_status = steg_index_read_head(&old_index, &ctx);
+	size_t head_index_capacity;
+	off_t head_index_offset = locate_head_index(&ctx, &head_index_capacity);
+
+	off_t tail_index_offset = -1;
+	if (index_status) {
+		steg_index_release(&old_index);
+		index_status = steg_index_read_tail(&old_index, &ctx);
+		if (!index_status)
+			tail_index_offset = ctx.chunk_file_offset;
+	}
 
-		// if we filled the output buffer or reached end of input data, write chunks
-		if (strm->avail_out == 0 || flush == Z_FINISH) {
-			data_to_write = DEFLATE_STREAM_BUFFER_SIZE - strm->avail_out;
+	// the new chunks replace IEND, along with any tail index before it
+	status = chunk_iterator_find_iend(&ctx);
+	if (status < 0)
+		FATAL("failed to read from file descriptor");
+	else if (status > 0)
+		DIE("non-compliant input file; IEND chunk is not the last chunk in the file (does not conform to RFC 2083)");
 
-			do {
-				// chunk size is minimum of DEFLATE_CHUNK_DATA_LENGTH and data_to_write
-				chunk_size = data_to_write > DEFLATE_CHUNK_DATA_LENGTH ? DEFLATE_CHUNK_DATA_LENGTH : data_to_write;
+	off_t append_offset = tail_index_offset >= 0 ? tail_index_offset : ctx.chunk_file_offset;
+	chunk_iterator_destroy_ctx(&ctx);
 
-				write_steg_chunk_to_file_from_buffer(out_fd, output_buffer, chunk_size);
-				bytes_out += chunk_size;
+	// an index that is incomplete or too large to write is left unusable
+	size_t new_capacity = steg_index_capacity(payload_length(data_fd, data), DEFLATE_CHUNK_DATA_LENGTH);
+	size_t capacity = !index_status && new_capacity ? old_index.len + new_capacity : 0;
+	if (steg_index_data_length(capacity) > STEG_INDEX_MAX_LENGTH)
+		capacity = 0;
 
-				data_to_write -= chunk_size;
+	struct steg_index index;
+	steg_index_init(&index, capacity);
+	for (size_t i = 0; i < old_index.len; i++)
+		steg_index_add(&index, old_index.entries[i].offset, old_index.entries[i].len);
+	steg_index_release(&old_index);
 
-				// shift data in output buffer to beginning of buffer
-				memmove(output_buffer, output_buffer + chunk_size, DEFLATE_STREAM_BUFFER_SIZE - chunk_size);
+	if (ftruncate(in_fd, append_offset) || lseek(in_fd, append_offset, SEEK_SET) < 0)
+		FATAL("failed to truncate input file");
 
-				// update zlib stream state
-				strm->avail_out = DEFLATE_STREAM_BUFFER_SIZE - data_to_write;
-				strm->next_out = output_buffer + data_to_write;
-			} while (data_to_write >= DEFLATE_CHUNK_DATA_LENGTH || (data_to_write > 0 && flush == Z_FINISH));
-		}
+	// chunks are recorded in the index by file offset
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, in_fd);
+	writer.offset = append_offset;
 
-		/*
-		 * Even though we may have fully consumed the output buffer, zlib may still have some pending
-		 * data that it is waiting to write to the output buffer. If so (determined by deflatePending),
-		 * run deflate again to write it to the output buffer.
-		 * */
-		ret = deflatePending(strm, &pending, Z_NULL);
-		if (ret != Z_OK)
-			FATAL("zlib DEFLATE failed with unexpected error: input file may be corrupted.\n"
-				  "zlib: %s", zError(ret));
-	} while (strm->avail_out == 0 || pending);
+	struct payload_deflater deflater;
+	payload_deflater_init(&deflater, data_fd, data);
+	while (!payload_deflater_finished(&deflater))
+		payload_deflater_round(&deflater, &writer, &index, result);
+	payload_deflater_destroy(&deflater);
 
-	return bytes_out;
+	finish_tail_payload(in_fd, &writer, &index, head_index_offset, head_index_capacity);
+	steg_index_release(&index);
+
+	result->compression_ratio = result->bytes_out == 0 ? 0.0 : (float)result->bytes_out / (float)result->bytes_in;
+
+	return 0;
 }
 
 /**
- * Print a summary of a embedded chunk operation.
- *
- * Prints the input file and output file to stdout in the following format:
- * in  <filename> <file mode> <file length> <md5 hash>
- * out <filename> <file mode> <file length> <md5 hash>
+ * If the current chunk of the iterator is a stIX chunk following IHDR, as left
+ * by steg_index_read_head(), get its file offset and the number of entries it
+ * has room for. An index listing more entries can't be written in its place.
  *
- * summary:
- * compression factor: x.xx (xxxx in, xxxx out)
- * chunks embedded in file: xxx
+ * Returns the file offset of the stIX chunk, or -1 if there isn't one.
  * */
-static void print_summary(const char *original_file_path,
-		const char *new_file_path, struct chunk_summary *result)
+static off_t locate_head_index(struct chunk_iterator_ctx *ctx, size_t *capacity)
 {
-	const char *filename_from = strrchr(original_file_path, '/');
-	filename_from = !filename_from ? original_file_path : filename_from + 1;
-	const char *filename_to = strrchr(new_file_path, '/');
-	filename_to = !filename_to ? new_file_path : filename_to + 1;
+	*capacity = 0;
+	if (memcmp(ctx->current_chunk.chunk_type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+		return -1;
+
+	u_int32_t len = ctx->current_chunk.data_length;
+	if (len < STEG_INDEX_HEADER_LENGTH)
+		return -1;
+
+	*capacity = (len - STEG_INDEX_HEADER_LENGTH) / STEG_INDEX_ENTRY_LENGTH;
+	if (!*capacity || steg_index_data_length(*capacity) != len) {
+		*capacity = 0;
+		return -1;
+	}
+
+	return ctx->chunk_file_offset;
+}
+
+/**
+ * Rewrite the stIX chunk following IHDR at `head_index_offset` in the file open
+ * as fd, which has room for `head_index_capacity` entries, to list the chunks
+ * in `index`. If they don't all fit, the index is marked unusable.
+ * */
+static void update_head_index(int fd, off_t head_index_offset, size_t head_index_capacity,
+		const struct steg_index *index)
+{
+	struct steg_index head_index;
+	steg_index_init(&head_index, head_index_capacity);
+	for (size_t i = 0; i < index->len; i++)
+		steg_index_add(&head_index, index->entries[i].offset, index->entries[i].len);
+	if (index->overflow)
+		head_index.overflow = 1;
+
+	unsigned char *index_data = (unsigned char *) malloc(sizeof(unsigned char) * steg_index_data_length(head_index_capacity));
+	if (!index_data)
+		FATAL(MEM_ALLOC_FAILED);
+
+	if (write_index(fd, 0, head_index_offset, &head_index, index_data))
+		FATAL("failed to write stIX chunk to output file");
+	free(index_data);
+	steg_index_release(&head_index);
+}
+
+/**
+ * Complete a payload appended at the end of the file open as fd: write the tail
+ * index and IEND through the writer, which follows the last stEG chunk, and
+ * update the stIX chunk following IHDR, if any.
+ *
+ * A tail index is only needed if there's no stIX chunk after IHDR that can list
+ * the new chunks.
+ * */
+static void finish_tail_payload(int fd, struct chunk_writer *writer, struct steg_index *index,
+		off_t head_index_offset, size_t head_index_capacity)
+{
+	unsigned char *index_data = NULL;
+	int head_index_fits = head_index_offset >= 0 && !index->overflow && index->len <= head_index_capacity;
+	if (index->len && !index->overflow && !head_index_fits) {
+		size_t len = steg_index_data_length(index->len) + STEG_INDEX_TRAILER_LENGTH;
+		index_data = (unsigned char *) malloc(sizeof(unsigned char) * len);
+		if (!index_data)
+			FATAL(MEM_ALLOC_FAILED);
+
+		steg_index_encode_tail(index, index_data);
+		if (chunk_writer_write_chunk(writer, STEG_INDEX_CHUNK_TYPE, index_data, (u_int32_t) len))
+			FATAL("failed to write stIX chunk to input file");
+	}
+
+	if (chunk_writer_write_chunk(writer, IEND_CHUNK_TYPE, NULL, 0) || chunk_writer_flush(writer))
+		FATAL("failed to write IEND chunk to input file");
+
+	free(index_data);
+
+	if (head_index_offset >= 0)
+		update_head_index(fd, head_index_offset, head_index_capacity, index);
+}
+
+/**
+ * A run of adjacent stEG and stFL chunks in the image. The run can be reused to
+ * hold any sequence of chunks of the same total length, without moving any
+ * other chunk in the file.
+ * */
+struct footprint_region {
+	off_t offset;
+	off_t len;
+};
+
+/**
+ * The space taken up by the payload embedded in an image, in file order.
+ * */
+struct steg_footprint {
+	struct footprint_region *regions;
+	size_t len;
+	size_t alloc;
+
+	// the payload ends just before IEND, or the tail index preceding it
+	unsigned int at_tail: 1;
+	unsigned int has_tail_index: 1;
+
+	off_t head_index_offset;
+	size_t head_index_capacity;
+};
+
+/**
+ * Add a chunk at file offset `offset` spanning `len` bytes to the footprint,
+ * merging it with the previous region if the two are adjacent.
+ * */
+static void footprint_add(struct steg_footprint *footprint, off_t offset, off_t len)
+{
+	if (footprint->len) {
+		struct footprint_region *last = &footprint->regions[footprint->len - 1];
+		if (last->offset + last->len == offset) {
+			last->len += len;
+			return;
+		}
+	}
+
+	if (footprint->len == footprint->alloc) {
+		footprint->alloc = footprint->alloc ? footprint->alloc * 2 : 16;
+		footprint->regions = (struct footprint_region *) realloc(footprint->regions,
+				sizeof(struct footprint_region) * footprint->alloc);
+		if (!footprint->regions)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	footprint->regions[footprint->len].offset = offset;
+	footprint->regions[footprint->len].len = len;
+	footprint->len++;
+}
+
+/**
+ * Returns non-zero if the current chunk of the iterator belongs to an embedded
+ * payload, and can be overwritten by a new one.
+ * */
+static inline int is_payload_chunk(struct chunk_iterator_ctx *ctx)
+{
+	return !memcmp(ctx->current_chunk.chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) ||
+			!memcmp(ctx->current_chunk.chunk_type, STEG_FILLER_CHUNK_TYPE, CHUNK_TYPE_LENGTH);
+}
+
+/**
+ * Collect the footprint from the stEG chunks listed in the index, along with
+ * any stFL chunks following them, which are found by peeking at the chunk
+ * after each listed chunk. The rest of the file is never walked. `end_offset`
+ * is the file offset of the chunk that must follow the payload for it to be
+ * at the tail of the image.
+ *
+ * Returns zero if successful, and -1 if the index doesn't match the file.
+ * */
+static int collect_indexed_footprint(struct steg_footprint *footprint, struct steg_index *index,
+		struct chunk_iterator_ctx *ctx, off_t end_offset)
+{
+	for (size_t i = 0; i < index->len; i++) {
+		const struct steg_index_entry *entry = &index->entries[i];
+		if (steg_index_seek(index, i, ctx))
+			return -1;
+
+		off_t offset = entry->offset + (off_t) CHUNK_LENGTH(entry->len);
+		off_t next_offset = i + 1 < index->len ? index->entries[i + 1].offset : end_offset;
+		footprint_add(footprint, entry->offset, (off_t) CHUNK_LENGTH(entry->len));
+
+		while (offset < next_offset) {
+			int status = chunk_iterator_seek(ctx, offset);
+			if (status < 0 || (!status && chunk_iterator_next(ctx)))
+				return -1;
+			if (status || memcmp(ctx->current_chunk.chunk_type, STEG_FILLER_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+				break;
+
+			footprint_add(footprint, offset, (off_t) CHUNK_LENGTH(ctx->current_chunk.data_length));
+			offset += (off_t) CHUNK_LENGTH(ctx->current_chunk.data_length);
+		}
+	}
+
+	const struct footprint_region *last = &footprint->regions[footprint->len - 1];
+	footprint->at_tail = last->offset + last->len == end_offset;
+	return 0;
+}
+
+/**
+ * Collect the footprint by walking the headers of every chunk in the file.
+ * */
+static void collect_walked_footprint(struct steg_footprint *footprint, struct chunk_iterator_ctx *ctx)
+{
+	if (chunk_iterator_seek(ctx, SIGNATURE_LENGTH))
+		FATAL("unexpected error while parsing input file");
+
+	off_t tail_index_offset = -1, iend_offset = -1;
+	int has_next_chunk;
+	while ((has_next_chunk = chunk_iterator_has_next(ctx)) != 0) {
+		if (has_next_chunk < 0 || chunk_iterator_next(ctx))
+			DIE("unable to parse input file: file does not appear to represent a valid PNG file, or may be corrupted.");
+
+		if (!memcmp(ctx->current_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH)) {
+			iend_offset = ctx->chunk_file_offset;
+			break;
+		}
+
+		if (is_payload_chunk(ctx))
+			footprint_add(footprint, ctx->chunk_file_offset, (off_t) CHUNK_LENGTH(ctx->current_chunk.data_length));
+
+		// a stIX chunk just before IEND, other than the one after IHDR, is a tail index
+		tail_index_offset = -1;
+		if (!memcmp(ctx->current_chunk.chunk_type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH) &&
+				ctx->chunk_file_offset != footprint->head_index_offset)
+			tail_index_offset = ctx->chunk_file_offset;
+	}
+
+	if (iend_offset < 0)
+		DIE("non-compliant input file; IEND chunk is missing (does not conform to RFC 2083)");
+
+	footprint->has_tail_index = tail_index_offset >= 0;
+	if (footprint->len) {
+		const struct footprint_region *last = &footprint->regions[footprint->len - 1];
+		off_t end_offset = footprint->has_tail_index ? tail_index_offset : iend_offset;
+		footprint->at_tail = last->offset + last->len == end_offset;
+	}
+}
+
+/**
+ * Find the space taken up by the payload embedded in the image open as in_fd.
+ * If the image carries a usable index, only the chunks it lists (and the chunks
+ * following them) are read. Otherwise, every chunk header is walked.
+ * */
+static void locate_footprint(int in_fd, struct steg_footprint *footprint)
+{
+	footprint->regions = NULL;
+	footprint->len = 0;
+	footprint->alloc = 0;
+	footprint->at_tail = 0;
+	footprint->has_tail_index = 0;
+
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_ctx(&ctx, in_fd);
+	if (status < 0)
+		FATAL("failed to read from file descriptor");
+	else if(status > 0)
+		DIE("input file is not a PNG (does not conform to RFC 2083)");
+
+	struct steg_index index;
+	int index_status = steg_index_read_head(&index, &ctx);
+	footprint->head_index_offset = locate_head_index(&ctx, &footprint->head_index_capacity);
+
+	off_t end_offset = -1;
+	if (index_status > 0) {
+		steg_index_release(&index);
+		index_status = steg_index_read_tail(&index, &ctx);
+		if (!index_status) {
+			footprint->has_tail_index = 1;
+			end_offset = ctx.chunk_file_offset;
+		}
+	} else if (!index_status) {
+		int iend_status = chunk_iterator_find_iend(&ctx);
+		if (iend_status < 0)
+			FATAL("unexpected error while parsing input file");
+		if (!iend_status)
+			end_offset = ctx.chunk_file_offset;
+	}
+
+	if (index_status || end_offset < 0 || collect_indexed_footprint(footprint, &index, &ctx, end_offset)) {
+		footprint->len = 0;
+		footprint->at_tail = 0;
+		footprint->has_tail_index = 0;
+		collect_walked_footprint(footprint, &ctx);
+	}
+
+	steg_index_release(&index);
+	chunk_iterator_destroy_ctx(&ctx);
+}
+
+/**
+ * Compress the whole payload into stEG chunks in a temporary file next to the
+ * image at `path`, which begins with a PNG signature so that it can be read
+ * back with a chunk iterator. The chunks are recorded in `chunks` by their
+ * offset in the temporary file.
+ *
+ * The temporary file is opened as `staging` and is never committed; the caller
+ * rolls it back once done. Keeping it on the same filesystem as the image
+ * avoids a round-trip through /tmp, and lets the chunks be copied into the
+ * image with copy_file_range().
+ *
+ * Returns a file descriptor for the temporary file.
+ * */
+static int compress_to_tmp_file(struct atomic_file *staging, const char *path, int data_fd,
+		struct strbuf *data, struct steg_index *chunks, struct chunk_summary *result)
+{
+	if (atomic_file_open(staging, path, S_IRUSR | S_IWUSR))
+		FATAL("unable to create temporary file next to '%s'", path);
+
+	int tmp_fd = staging->fd;
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, tmp_fd);
+	if (chunk_writer_write_raw(&writer, PNG_SIG, SIGNATURE_LENGTH))
+		FATAL("failed to write to temporary file");
+
+	steg_index_init(chunks, steg_index_capacity(payload_length(data_fd, data), DEFLATE_CHUNK_DATA_LENGTH));
+
+	struct payload_deflater deflater;
+	payload_deflater_init(&deflater, data_fd, data);
+	while (!payload_deflater_finished(&deflater))
+		payload_deflater_round(&deflater, &writer, chunks, result);
+	payload_deflater_destroy(&deflater);
+
+	if (chunk_writer_flush(&writer))
+		FATAL("failed to write to temporary file");
+
+	return tmp_fd;
+}
+
+/**
+ * Read the next `len` bytes of compressed data from the stEG chunks of the
+ * temporary file, continuing across chunk boundaries.
+ * */
+static void read_compressed_data(struct chunk_iterator_ctx *ctx, unsigned char *buffer, size_t len)
+{
+	while (len) {
+		ssize_t bytes_read = chunk_iterator_read_data(ctx, buffer, len);
+		if (bytes_read < 0)
+			FATAL("failed to read from temporary file");
+
+		if (!bytes_read) {
+			if (chunk_iterator_has_next(ctx) <= 0 || chunk_iterator_next(ctx))
+				BUG("compressed payload ended early");
+			continue;
+		}
+
+		buffer += bytes_read;
+		len -= bytes_read;
+	}
+}
+
+/**
+ * Lay out up to `remaining` bytes of compressed data over a region of the
+ * footprint as stEG chunks, and fill the space left over with a stFL chunk.
+ * Since a chunk takes up at least CHUNK_LENGTH(0) bytes, the data is split so
+ * that the space left over is either zero or large enough for a stFL chunk.
+ *
+ * If `writer` is NULL, nothing is written, which is useful to check whether a
+ * payload fits. Otherwise, the writer must be positioned at the region, and the
+ * data is taken from `src`. Chunks written are recorded in the index.
+ *
+ * Returns the number of bytes of compressed data laid out over the region.
+ * */
+static off_t fill_region(const struct footprint_region *region, off_t remaining,
+		struct chunk_iterator_ctx *src, struct chunk_writer *writer, struct steg_index *index,
+		struct chunk_summary *result)
+{
+	static const unsigned char zeros[DEFLATE_STREAM_BUFFER_SIZE];
+	unsigned char buffer[DEFLATE_CHUNK_DATA_LENGTH];
+	off_t space = region->len, placed = 0;
+
+	while (remaining > 0 && space > (off_t) CHUNK_LENGTH(0)) {
+		off_t len = space - (off_t) CHUNK_LENGTH(0);
+		len = len > remaining ? remaining : len;
+		len = len > DEFLATE_CHUNK_DATA_LENGTH ? DEFLATE_CHUNK_DATA_LENGTH : len;
+
+		// leave room for a stFL chunk after this one
+		off_t left = space - (off_t) CHUNK_LENGTH(len);
+		if (left > 0 && left < (off_t) CHUNK_LENGTH(0))
+			len -= (off_t) CHUNK_LENGTH(0) - left;
+		if (len <= 0)
+			break;
+
+		if (writer) {
+			read_compressed_data(src, buffer, (size_t) len);
+			write_steg_chunk_to_file_from_buffer(writer, index, buffer, (size_t) len);
+			if (chunk_writer_flush(writer))
+				FATAL("failed to write stEG chunk to input file");
+
+			result->chunks_written++;
+		}
+
+		remaining -= len;
+		space -= (off_t) CHUNK_LENGTH(len);
+		placed += len;
+	}
+
+	// fill the rest of the region, scrubbing the data embedded before
+	if (writer && space > 0) {
+		u_int32_t filler_len = (u_int32_t) (space - (off_t) CHUNK_LENGTH(0));
+		if (chunk_writer_begin_chunk(writer, STEG_FILLER_CHUNK_TYPE, filler_len))
+			FATAL("failed to write stFL chunk to input file");
+
+		for (u_int32_t written = 0; written < filler_len; ) {
+			size_t len = filler_len - written > sizeof(zeros) ? sizeof(zeros) : filler_len - written;
+			if (chunk_writer_write_data(writer, zeros, len))
+				FATAL("failed to write stFL chunk to input file");
+
+			written += len;
+		}
+
+		if (chunk_writer_end_chunk(writer, chunk_writer_get_crc(writer)) || chunk_writer_flush(writer))
+			FATAL("failed to write stFL chunk to input file");
+	}
+
+	return placed;
+}
+
+/**
+ * Overwrite the footprint of the old payload with the compressed payload held
+ * in the temporary file, `len` bytes in length, which must fit. Only the
+ * footprint, and the stIX chunk following IHDR, are written.
+ * */
+static void overwrite_footprint(int in_fd, const struct steg_footprint *footprint, int tmp_fd,
+		off_t len, struct chunk_summary *result)
+{
+	struct chunk_iterator_ctx src;
+	if (chunk_iterator_init_ctx(&src, tmp_fd) || chunk_iterator_has_next(&src) <= 0 || chunk_iterator_next(&src))
+		FATAL("failed to read from temporary file");
+
+	struct steg_index index;
+	steg_index_init(&index, footprint->head_index_capacity);
+
+	result->chunks_written = 0;
+	for (size_t i = 0; i < footprint->len; i++) {
+		const struct footprint_region *region = &footprint->regions[i];
+		if (lseek(in_fd, region->offset, SEEK_SET) < 0)
+			FATAL("failed to set the file offset for input file");
+
+		struct chunk_writer writer;
+		chunk_writer_init(&writer, in_fd);
+		writer.offset = region->offset;
+
+		len -= fill_region(region, len, &src, &writer, &index, result);
+	}
+
+	if (len)
+		BUG("compressed payload doesn't fit the space of the old payload");
+
+	if (footprint->head_index_offset >= 0)
+		update_head_index(in_fd, footprint->head_index_offset, footprint->head_index_capacity, &index);
+
+	steg_index_release(&index);
+	chunk_iterator_destroy_ctx(&src);
+}
+
+/**
+ * Append the compressed payload held in the temporary file in place of the old
+ * payload at the tail of the image, which begins at `append_offset`. The stEG
+ * chunks are copied from the temporary file as-is.
+ * */
+static void append_footprint(int in_fd, const struct steg_footprint *footprint, int tmp_fd,
+		struct steg_index *chunks, off_t append_offset)
+{
+	struct stat st;
+	if (fstat(tmp_fd, &st))
+		FATAL("failed to stat temporary file");
+
+	if (ftruncate(in_fd, append_offset) || lseek(in_fd, append_offset, SEEK_SET) < 0)
+		FATAL("failed to truncate input file");
+
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, in_fd);
+	writer.offset = append_offset;
+	if (chunk_writer_copy_range(&writer, tmp_fd, SIGNATURE_LENGTH, (size_t) (st.st_size - SIGNATURE_LENGTH)))
+		FATAL("failed to write stEG chunks to input file");
+
+	// the chunks were recorded by their offset in the temporary file
+	for (size_t i = 0; i < chunks->len; i++)
+		chunks->entries[i].offset += append_offset - SIGNATURE_LENGTH;
+
+	finish_tail_payload(in_fd, &writer, chunks, footprint->head_index_offset, footprint->head_index_capacity);
+}
+
+/**
+ * Replace the payload embedded in the PNG file open for reading and writing as
+ * in_fd, with the file path `path`, doing as little I/O as possible.
+ *
+ * The new payload is compressed up front, and then:
+ * - if the old payload is in one piece at the tail of the image, the file is
+ *   truncated and the new payload appended in its place (see
+ *   embed_tail_in_place()),
+ * - if the new payload fits in the space taken up by the old one, the old stEG
+ *   chunks are overwritten in place, and any space left over is taken up by a
+ *   stFL filler chunk,
+ * - otherwise, the image is rewritten without the old payload, just like a
+ *   regular embed.
+ *
+ * Only in the last case are the chunks of the image itself read or written.
+ * */
+static int embed_replace(int in_fd, const char *path, mode_t mode, int data_fd,
+		struct strbuf *data, struct chunk_summary *result)
+{
+	struct steg_footprint footprint;
+	locate_footprint(in_fd, &footprint);
+
+	// the payload is needed again if the image must be rewritten
+	struct strbuf data_copy;
+	strbuf_init(&data_copy);
+	if (data)
+		strbuf_attach_bytes(&data_copy, data->buff, data->len);
+
+	struct atomic_file staging;
+	struct steg_index chunks;
+	int tmp_fd = compress_to_tmp_file(&staging, path, data_fd, data ? &data_copy : NULL, &chunks, result);
+	off_t len = (off_t) result->bytes_out;
+
+	off_t capacity = len;
+	for (size_t i = 0; i < footprint.len && capacity > 0; i++)
+		capacity -= fill_region(&footprint.regions[i], capacity, NULL, NULL, NULL, NULL);
+
+	if (footprint.at_tail && footprint.len == 1) {
+		append_footprint(in_fd, &footprint, tmp_fd, &chunks, footprint.regions[footprint.len - 1].offset);
+	} else if (footprint.len && !footprint.has_tail_index && !capacity) {
+		overwrite_footprint(in_fd, &footprint, tmp_fd, len, result);
+	} else {
+		if (data_fd >= 0 && lseek(data_fd, 0, SEEK_SET) < 0)
+			FATAL("failed to set the file offset for payload file");
+
+		result->bytes_in = 0;
+		result->bytes_out = 0;
+		result->chunks_written = 0;
+
+		struct atomic_file out;
+		if (atomic_file_open(&out, path, mode))
+			DIE(FILE_OPEN_FAILED, path);
+
+		embed_data(in_fd, out.fd, data_fd, data, result);
+
+		if (atomic_file_commit(&out))
+			FATAL("failed to write output file '%s'", path);
+	}
+
+	atomic_file_rollback(&staging);
+	steg_index_release(&chunks);
+	strbuf_release(&data_copy);
+	free(footprint.regions);
+
+	result->compression_ratio = result->bytes_out == 0 ? 0.0 : (float)result->bytes_out / (float)result->bytes_in;
+
+	return 0;
+}
+
+/**
+ * Run zlib deflate on input data while the output buffer is not full.
+ * If the output buffer is full, or we reached the end of the input data,
+ * the output buffer is written as stEG chunks to the output file in chunks
+ * of 8192 bytes in length.
+ *
+ * Returns the number of (defalted) bytes written to the file. A return value of
+ * zero indicates that the output buffer was not filled, and as a result no data
+ * was written to the file. Returns -1 if the chunks could not be written.
+ * */
+static ssize_t single_pass_deflate(struct z_stream_s *strm, unsigned char *output_buffer,
+		struct chunk_writer *writer, struct steg_index *index, int flush)
+{
+	int ret;
+	unsigned pending = 0;
+
+	size_t bytes_out = 0;
+	size_t data_to_write, chunk_size;
+	do {
+		ret = deflate(strm, flush);
+		if (ret == Z_STREAM_ERROR)
+			FATAL("zlib DEFLATE failed with unexpected error: input file may be corrupted.\n"
+				  "zlib: %s", zError(ret));
+
+		// if we filled the output buffer or reached end of input data, write chunks
+		if (strm->avail_out == 0 || flush == Z_FINISH) {
+			data_to_write = DEFLATE_STREAM_BUFFER_SIZE - strm->avail_out;
+
+			/*
+			 * Queue as many stEG chunks as the output buffer holds, and write
+			 * them all at once before the buffer is reused.
+			 * */
+			size_t data_written = 0;
+			do {
+				// chunk size is minimum of DEFLATE_CHUNK_DATA_LENGTH and data_to_write
+				chunk_size = data_to_write > DEFLATE_CHUNK_DATA_LENGTH ? DEFLATE_CHUNK_DATA_LENGTH : data_to_write;
+
+				steg_index_add(index, writer->offset, (u_int32_t) chunk_size);
+				if (chunk_writer_write_chunk(writer, STEG_CHUNK_TYPE, output_buffer + data_written, (u_int32_t) chunk_size))
+					return -1;
+
+				bytes_out += chunk_size;
+
+				data_written += chunk_size;
+				data_to_write -= chunk_size;
+			} while (data_to_write >= DEFLATE_CHUNK_DATA_LENGTH || (data_to_write > 0 && flush == Z_FINISH));
+
+			if (chunk_writer_flush(writer))
+				return -1;
+
+			// shift remaining data in output buffer to beginning of buffer
+			memmove(output_buffer, output_buffer + data_written, data_to_write);
+
+			// update zlib stream state
+			strm->avail_out = DEFLATE_STREAM_BUFFER_SIZE - data_to_write;
+			strm->next_out = output_buffer + data_to_write;
+		}
+
+		/*
+		 * Even though we may have fully consumed the output buffer, zlib may still have some pending
+		 * data that it is waiting to write to the output buffer. If so (determined by deflatePending),
+		 * run deflate again to write it to the output buffer.
+		 * */
+		ret = deflatePending(strm, &pending, Z_NULL);
+		if (ret != Z_OK)
+			FATAL("zlib DEFLATE failed with unexpected error: input file may be corrupted.\n"
+				  "zlib: %s", zError(ret));
+	} while (strm->avail_out == 0 || pending);
+
+	return (ssize_t) bytes_out;
+}
+
+/**
+ * Run a single round of parallel DEFLATE on the first `len` bytes of the input
+ * buffer of `pd`, and write the compressed data as stEG chunks of 8192 bytes.
+ *
+ * Compressed data that doesn't fill a whole chunk is carried over to the next
+ * round in `carry`, which must be at least DEFLATE_CHUNK_DATA_LENGTH bytes in
+ * length and holds `carry_len` bytes. When `flush` is Z_FINISH, the remaining
+ * data is written as a final, shorter chunk.
+ *
+ * Returns the number of (deflated) bytes written to the file.
+ * */
+static size_t single_pass_parallel_deflate(struct parallel_deflate *pd, size_t len, int flush,
+		unsigned char *carry, size_t *carry_len, struct chunk_writer *writer, struct steg_index *index)
+{
+	const unsigned char *out;
+	size_t out_len;
+	if (parallel_deflate_round(pd, len, flush == Z_FINISH, &out, &out_len))
+		FATAL("zlib DEFLATE failed with unexpected error while compressing in parallel");
+
+	return write_stream_data(out, out_len, flush == Z_FINISH, carry, carry_len, writer, index);
+}
+
+/**
+ * Write the next `len` bytes of the steg stream as stEG chunks of 8192 bytes,
+ * carrying data that doesn't fill a whole chunk over in `carry` like
+ * single_pass_parallel_deflate(). If `last` is non-zero, this is the end of the
+ * stream, and the remaining data is written as a final, shorter chunk.
+ *
+ * Returns the number of bytes written to the file.
+ * */
+static size_t write_stream_data(const unsigned char *out, size_t out_len, int last,
+		unsigned char *carry, size_t *carry_len, struct chunk_writer *writer, struct steg_index *index)
+{
+	size_t bytes_out = 0;
+
+	// top up and write the chunk carried over from the previous round
+	if (*carry_len) {
+		size_t top_up = DEFLATE_CHUNK_DATA_LENGTH - *carry_len;
+		top_up = top_up > out_len ? out_len : top_up;
+		memcpy(carry + *carry_len, out, top_up);
+		*carry_len += top_up;
+		out += top_up;
+		out_len -= top_up;
+
+		if (*carry_len < DEFLATE_CHUNK_DATA_LENGTH && !last)
+			return 0;
+
+		write_steg_chunk_to_file_from_buffer(writer, index, carry, *carry_len);
+		bytes_out += *carry_len;
+		*carry_len = 0;
+	}
+
+	// write whole chunks straight from the compressed output
+	while (out_len >= DEFLATE_CHUNK_DATA_LENGTH || (out_len > 0 && last)) {
+		size_t chunk_size = out_len > DEFLATE_CHUNK_DATA_LENGTH ? DEFLATE_CHUNK_DATA_LENGTH : out_len;
+		write_steg_chunk_to_file_from_buffer(writer, index, (void *) out, chunk_size);
+		bytes_out += chunk_size;
+		out += chunk_size;
+		out_len -= chunk_size;
+	}
+
+	if (chunk_writer_flush(writer))
+		FATAL("failed to write stEG chunks to output file");
+
+	memcpy(carry, out, out_len);
+	*carry_len = out_len;
+
+	return bytes_out;
+}
+
+/**
+ * Compress the next portion of an archive, and write it as stEG chunks just
+ * like payload_deflater_round().
+ *
+ * Members are opened one at a time. Each member ends with a round that doesn't
+ * fill the input buffer, even if empty, so the next member begins with a new
+ * segment, and the offset of that segment is recorded in the table of
+ * contents. Once the last member has been compressed, the table of contents is
+ * written after the end of the stream.
+ * */
+static void archive_round(struct payload_deflater *deflater, struct chunk_writer *writer,
+		struct steg_index *index, struct chunk_summary *result)
+{
+	if (deflater->data_fd < 0) {
+		const char *path = files_to_embed.entries[deflater->member].string;
+		deflater->data_fd = open(path, O_RDONLY);
+		if (deflater->data_fd < 0)
+			DIE(FILE_OPEN_FAILED, path);
+
+		// the stream header precedes the first member
+		off_t offset = deflater->stream_len ? deflater->stream_len : STEG_STREAM_HEADER_LENGTH;
+		steg_archive_add(&deflater->toc, archive_member_name(path), offset, 0);
+	}
+
+	size_t capacity;
+	unsigned char *round_buffer = parallel_deflate_input(&deflater->pd, &capacity);
+	size_t len = fill_input_buffer(round_buffer, capacity, deflater->data_fd, NULL);
+	deflater->toc.members[deflater->toc.len - 1].len += (off_t) len;
+	result->bytes_in += len;
+
+	int last = 0;
+	if (len < capacity) {
+		close(deflater->data_fd);
+		deflater->data_fd = -1;
+		last = ++deflater->member == files_to_embed.len;
+	}
+
+	const unsigned char *out;
+	size_t out_len;
+	if (parallel_deflate_round(&deflater->pd, len, last, &out, &out_len))
+		FATAL("zlib DEFLATE failed with unexpected error while compressing in parallel");
+
+	deflater->stream_len += (off_t) out_len;
+	size_t bytes = write_stream_data(out, out_len, 0, deflater->output_buffer,
+			&deflater->carry_len, writer, index);
+
+	if (last) {
+		size_t toc_len = steg_archive_encoded_length(&deflater->toc);
+		unsigned char *toc = (unsigned char *) malloc(sizeof(unsigned char) * toc_len);
+		if (!toc)
+			FATAL(MEM_ALLOC_FAILED);
+
+		steg_archive_encode(&deflater->toc, toc);
+		bytes += write_stream_data(toc, toc_len, 1, deflater->output_buffer,
+				&deflater->carry_len, writer, index);
+		deflater->flush = Z_FINISH;
+		free(toc);
+	}
+
+	result->chunks_written += (unsigned)((bytes + DEFLATE_CHUNK_DATA_LENGTH - 1) / DEFLATE_CHUNK_DATA_LENGTH);
+	result->bytes_out += bytes;
+}
+
+/**
+ * Fill in the stIX chunk reserved at `index_offset` bytes into the PNG, which
+ * begins at file offset `base` in the output file. `buffer` must be large
+ * enough to hold the data of the reserved chunk.
+ *
+ * Returns zero if successful, and -1 if the chunk could not be written.
+ * */
+static int write_index(int out_fd, off_t base, off_t index_offset, struct steg_index *index,
+		unsigned char *buffer)
+{
+	size_t len = steg_index_data_length(index->capacity);
+	steg_index_encode(index, buffer);
+
+	u_int32_t crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char *) STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH);
+	crc = crc32(crc, buffer, (uInt) len);
+	crc = htonl(crc);
+
+	off_t data_offset = base + index_offset + CHUNK_HEADER_LENGTH;
+	if (recoverable_pwrite(out_fd, buffer, len, data_offset) != (ssize_t) len)
+		return -1;
+	if (recoverable_pwrite(out_fd, &crc, sizeof(crc), data_offset + len) != sizeof(crc))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Fill the buffer with up to `len` bytes of payload, from the strbuf `data` if
+ * non-null, or otherwise from the file descriptor `data_fd`. Bytes taken from
+ * `data` are removed from it.
+ *
+ * Returns the number of bytes placed in the buffer, which is less than `len`
+ * only if the payload has been exhausted.
+ * */
+static size_t fill_input_buffer(unsigned char *buffer, size_t len, int data_fd, struct strbuf *data)
+{
+	if (data) {
+		len = data->len < len ? data->len : len;
+		memcpy(buffer, data->buff, len);
+		strbuf_remove(data, 0, len);
+
+		return len;
+	}
+
+	size_t total_read = 0;
+	while (total_read < len) {
+		ssize_t bytes_read = recoverable_read(data_fd, buffer + total_read, len - total_read);
+		if (bytes_read < 0)
+			FATAL("failed to read from data input file");
+		if (bytes_read == 0)
+			break;
+
+		total_read += bytes_read;
+	}
+
+	return total_read;
+}
+
+/**
+ * The manifest of an embed --batch. Rows are read by the workers as they need
+ * them, so the manifest is never held in memory, and results are printed as
+ * rows finish.
+ * */
+struct batch_manifest {
+	FILE *stream;
+	unsigned long rows;
+	unsigned long failed;
+	unsigned int read_error: 1;
+
+	pthread_mutex_t read_lock;
+	pthread_mutex_t output_lock;
+};
+
+/**
+ * State owned by a single batch worker. The zlib stream and buffers are set up
+ * once and reused for every row the worker processes.
+ * */
+struct batch_worker {
+	struct batch_manifest *manifest;
+
+	// the row being processed
+	unsigned long row;
+	char *buffers[BATCH_MANIFEST_FIELDS];
+	size_t buffer_alloc[BATCH_MANIFEST_FIELDS];
+	const char *fields[BATCH_MANIFEST_FIELDS];
+
+	struct z_stream_s strm;
+	unsigned char *input_buffer;
+	unsigned char *output_buffer;
+
+	unsigned char *index_data;
+	size_t index_data_alloc;
+};
+
+static void run_batch_worker(void *);
+
+/**
+ * Embed a payload into every image listed in the manifest at the path
+ * `manifest_path`, or read from stdin if "-".
+ *
+ * Each row of the manifest names a carrier image, the file to embed into it and
+ * the output file, separated by tabs and ending with a newline. If
+ * `null_terminated` is set, every field is instead terminated by a NUL byte, so
+ * that paths may hold any character. Blank lines are ignored.
+ *
+ * Rows are processed concurrently on `threads` workers. Once a row has been
+ * processed, a result is printed to stdout:
+ * <row> TAB ok TAB <output> TAB <bytes in> TAB <bytes out> [TAB <digest>]
+ * <row> TAB error TAB <output> TAB <message>
+ * where rows are numbered from 1 in manifest order, but results are printed as
+ * rows finish. The digest of the output image is only printed if an algorithm
+ * was selected with --digest, and is computed as the image is written. With
+ * `null_terminated`, result fields are likewise terminated by NUL bytes.
+ *
+ * Returns zero if every row was embedded successfully, and 1 otherwise.
+ * */
+static int embed_batch(const char *manifest_path)
+{
+	struct batch_manifest manifest = {
+			.stream = stdin,
+			.rows = 0,
+			.failed = 0,
+			.read_error = 0
+	};
+
+	if (strcmp(manifest_path, "-") != 0) {
+		manifest.stream = fopen(manifest_path, "r");
+		if (!manifest.stream)
+			DIE(FILE_OPEN_FAILED, manifest_path);
+	}
+
+	if (pthread_mutex_init(&manifest.read_lock, NULL) || pthread_mutex_init(&manifest.output_lock, NULL))
+		FATAL("failed to initialize batch manifest lock");
+
+	struct timeval time;
+	if (gettimeofday(&time, NULL))
+		FATAL("unable to seed PRNG; gettimeofday failed unexpectedly");
+
+	srandom((unsigned)time.tv_sec ^ (unsigned)time.tv_usec);
+
+	struct batch_worker *workers = (struct batch_worker *) calloc((size_t) threads, sizeof(struct batch_worker));
+	if (!workers)
+		FATAL(MEM_ALLOC_FAILED);
+
+	for (long i = 0; i < threads; i++) {
+		struct batch_worker *worker = &workers[i];
+		worker->manifest = &manifest;
+
+		worker->input_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+		worker->output_buffer = malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+		if (!worker->input_buffer || !worker->output_buffer)
+			FATAL(MEM_ALLOC_FAILED);
+
+		worker->strm.zalloc = Z_NULL;
+		worker->strm.zfree = Z_NULL;
+		worker->strm.opaque = Z_NULL;
+
+		int ret = deflateInit(&worker->strm, compression_level);
+		if (ret != Z_OK)
+			FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+	}
+
+	// each worker pulls rows from the manifest until it runs out
+	struct thread_pool pool;
+	thread_pool_init(&pool, (unsigned int) threads);
+	for (long i = 0; i < threads; i++)
+		thread_pool_submit(&pool, run_batch_worker, &workers[i]);
+
+	thread_pool_wait(&pool);
+	thread_pool_destroy(&pool);
+
+	for (long i = 0; i < threads; i++) {
+		struct batch_worker *worker = &workers[i];
+		for (size_t j = 0; j < BATCH_MANIFEST_FIELDS; j++)
+			free(worker->buffers[j]);
+
+		(void)deflateEnd(&worker->strm);
+		free(worker->input_buffer);
+		free(worker->output_buffer);
+		free(worker->index_data);
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&manifest.read_lock);
+	pthread_mutex_destroy(&manifest.output_lock);
+
+	if (manifest.read_error)
+		FATAL("failed to read batch manifest '%s'", manifest_path);
+	if (manifest.stream != stdin)
+		fclose(manifest.stream);
+	if (fflush(stdout))
+		FATAL("failed to write batch results to stdout");
+
+	return manifest.failed ? 1 : 0;
+}
+
+/**
+ * Read the next row of the manifest into the fields of the worker, and number
+ * it. Must be called with the read lock of the manifest held.
+ *
+ * Returns 1 if a row was read, and zero at the end of the manifest. If the row
+ * is malformed, `error` describes the problem.
+ * */
+static int batch_read_row(struct batch_worker *worker, const char **error)
+{
+	struct batch_manifest *manifest = worker->manifest;
+	*error = NULL;
+
+	if (null_terminated) {
+		for (size_t i = 0; i < BATCH_MANIFEST_FIELDS; i++) {
+			if (getdelim(&worker->buffers[i], &worker->buffer_alloc[i], '\0', manifest->stream) < 0) {
+				if (!i)
+					return 0;
+
+				*error = "manifest ends in the middle of a row";
+				break;
+			}
+
+			worker->fields[i] = worker->buffers[i];
+		}
+
+		worker->row = ++manifest->rows;
+		return 1;
+	}
+
+	ssize_t len;
+	do {
+		len = getline(&worker->buffers[0], &worker->buffer_alloc[0], manifest->stream);
+		if (len < 0)
+			return 0;
+	} while (len == 1 && worker->buffers[0][0] == '\n');
+
+	char *line = worker->buffers[0];
+	if (line[len - 1] == '\n')
+		line[len - 1] = '\0';
+
+	// split the line in place
+	for (size_t i = 0; i < BATCH_MANIFEST_FIELDS; i++) {
+		worker->fields[i] = line;
+		line = strchr(line, '\t');
+		if (!line && i < BATCH_MANIFEST_FIELDS - 1) {
+			*error = "row must have a carrier, a payload and an output field";
+			break;
+		}
+
+		if (line)
+			*line++ = '\0';
+	}
+
+	if (!*error && line)
+		*error = "row must have a carrier, a payload and an output field";
+
+	worker->row = ++manifest->rows;
+	return 1;
+}
+
+static const char *batch_embed_row(struct batch_worker *, struct chunk_summary *);
+
+/**
+ * Process rows of the manifest until it has been exhausted. Runs on a worker of
+ * the thread pool, so errors are reported as results rather than exiting.
+ * */
+static void run_batch_worker(void *arg)
+{
+	struct batch_worker *worker = (struct batch_worker *) arg;
+	struct batch_manifest *manifest = worker->manifest;
+
+	while (1) {
+		const char *error;
+		pthread_mutex_lock(&manifest->read_lock);
+		int has_row = !manifest->read_error && batch_read_row(worker, &error);
+		if (!has_row && ferror(manifest->stream))
+			manifest->read_error = 1;
+		pthread_mutex_unlock(&manifest->read_lock);
+
+		if (!has_row)
+			break;
+
+		struct chunk_summary result = {
+				.chunks_written = 0,
+				.bytes_in = 0,
+				.bytes_out = 0,
+				.compression_ratio = 0,
+				.want_digests = digest_selected,
+				.has_digests = 0
+		};
+
+		if (!error)
+			error = batch_embed_row(worker, &result);
+
+		const char *output = error && !worker->fields[2] ? "" : worker->fields[2];
+		char separator = null_terminated ? '\0' : '\t';
+		char terminator = null_terminated ? '\0' : '\n';
+
+		pthread_mutex_lock(&manifest->output_lock);
+		if (error) {
+			manifest->failed++;
+			printf("%lu%cerror%c%s%c%s%c", worker->row, separator, separator, output, separator,
+					error, terminator);
+		} else {
+			printf("%lu%cok%c%s%c%lu%c%lu", worker->row, separator, separator, output, separator,
+					result.bytes_in, separator, result.bytes_out);
+			if (result.has_digests) {
+				putchar(separator);
+				print_digest(stdout, digest_type, result.out_digest);
+			}
+			putchar(terminator);
+		}
+		pthread_mutex_unlock(&manifest->output_lock);
+
+		for (size_t i = 0; i < BATCH_MANIFEST_FIELDS; i++)
+			worker->fields[i] = NULL;
+	}
+}
+
+static const char *batch_embed_image(struct batch_worker *, int, off_t, int, off_t, int,
+		struct chunk_summary *);
+
+/**
+ * Embed the payload of the current row of the worker into its carrier image,
+ * and write the output file atomically.
+ *
+ * Returns zero if successful, and otherwise a message describing why the row
+ * couldn't be embedded.
+ * */
+static const char *batch_embed_row(struct batch_worker *worker, struct chunk_summary *result)
+{
+	const char *carrier = worker->fields[0];
+	const char *payload = worker->fields[1];
+	const char *output = worker->fields[2];
+	if (!*carrier || !*payload || !*output)
+		return "row must have a carrier, a payload and an output field";
+	if (!strcmp(output, "-"))
+		return "output cannot be written to stdout in a batch";
+
+	struct stat st, data_st;
+	int in_fd = open(carrier, O_RDONLY);
+	if (in_fd < 0)
+		return "failed to open carrier image";
+	if (fstat(in_fd, &st) || !S_ISREG(st.st_mode)) {
+		close(in_fd);
+		return "carrier image is not a regular file";
+	}
+
+	int data_fd = open(payload, O_RDONLY);
+	if (data_fd < 0) {
+		close(in_fd);
+		return "failed to open payload";
+	}
+	if (fstat(data_fd, &data_st) || !S_ISREG(data_st.st_mode)) {
+		close(data_fd);
+		close(in_fd);
+		return "payload is not a regular file";
+	}
+
+	const char *error = NULL;
+	struct atomic_file out;
+	if (atomic_file_open(&out, output, st.st_mode)) {
+		error = "failed to open output file";
+	} else {
+		error = batch_embed_image(worker, in_fd, st.st_size, data_fd, data_st.st_size, out.fd, result);
+		if (error)
+			atomic_file_rollback(&out);
+		else if (atomic_file_commit(&out))
+			error = "failed to write output file";
+	}
+
+	close(data_fd);
+	close(in_fd);
+	return error;
+}
+
+/**
+ * Embed the payload open as `data_fd` into the image open as `in_fd`, writing
+ * the output image to `out_fd`, just like embed_data(). The payload is
+ * compressed as a single zlib stream on the worker's own zlib stream, which is
+ * reset rather than reinitialized for each row.
+ *
+ * Returns zero if successful, and otherwise a message describing the problem.
+ * */
+static const char *batch_embed_image(struct batch_worker *worker, int in_fd, off_t image_len,
+		int data_fd, off_t data_len, int out_fd, struct chunk_summary *result)
+{
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_mmap_ctx(&ctx, in_fd);
+	if (status < 0)
+		return "failed to read carrier image";
+	else if (status > 0)
+		return "carrier image is not a PNG (does not conform to RFC 2083)";
+
+	struct z_stream_s *strm = &worker->strm;
+	if (deflateReset(strm) != Z_OK)
+		BUG("failed to reset zlib stream for DEFLATE");
+
+	strm->avail_out = DEFLATE_STREAM_BUFFER_SIZE;
+	strm->next_out = worker->output_buffer;
+
+	// reserve room for the index in the worker's buffer, which only ever grows
+	struct steg_index index;
+	size_t index_capacity = no_index || !data_len ? 0 : steg_index_capacity(data_len, DEFLATE_CHUNK_DATA_LENGTH);
+	size_t index_len = steg_index_data_length(index_capacity);
+	steg_index_init(&index, index_capacity);
+	if (index_capacity && index_len > worker->index_data_alloc) {
+		free(worker->index_data);
+		worker->index_data = (unsigned char *) malloc(sizeof(unsigned char) * index_len);
+		if (!worker->index_data)
+			FATAL(MEM_ALLOC_FAILED);
+
+		worker->index_data_alloc = index_len;
+	}
+	if (index_capacity)
+		memset(worker->index_data, 0, index_len);
+
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, out_fd);
+
+	// the digest is hashed on the worker's own thread, since the workers already fill the processors
+	struct digest_ctx out_digest;
+	if (result->want_digests) {
+		digest_init(&out_digest, digest_type);
+		chunk_writer_begin_digest(&writer, &out_digest, in_fd, ctx.map, ctx.map_len);
+	}
+
+	const char *error = NULL;
+	if (chunk_writer_write_raw(&writer, PNG_SIG, SIGNATURE_LENGTH))
+		error = "failed to write output file";
+
+	unsigned int sparcity = compute_sparcity(image_len, data_len);
+	int flush = Z_NO_FLUSH;
+	off_t index_offset = -1;
+	int has_next_chunk, IEND_found = 0, IHDR_found = 0;
+	while (!error && (has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
+		if (has_next_chunk < 0 || chunk_iterator_next(&ctx) != 0) {
+			error = "carrier image does not appear to represent a valid PNG file, or may be corrupted";
+			break;
+		}
+
+		if (!memcmp(ctx.current_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			IEND_found++;
+
+		// deflate the payload, unless the chunks belong elsewhere
+		while (!error && flush != Z_FINISH) {
+			if (!IHDR_found || (!IEND_found && (tail || (sparcity && (random() % sparcity != 0)))))
+				break;
+
+			ssize_t bytes_read = recoverable_read(data_fd, worker->input_buffer, DEFLATE_STREAM_BUFFER_SIZE);
+			if (bytes_read < 0) {
+				error = "failed to read payload";
+				break;
+			}
+
+			strm->avail_in = bytes_read;
+			strm->next_in = worker->input_buffer;
+			if (bytes_read < DEFLATE_STREAM_BUFFER_SIZE)
+				flush = Z_FINISH;
+
+			result->bytes_in += bytes_read;
+			ssize_t bytes = single_pass_deflate(strm, worker->output_buffer, &writer, &index, flush);
+			if (bytes < 0)
+				error = "failed to write output file";
+			else
+				result->bytes_out += bytes;
+		}
+
+		if (error)
+			break;
+
+		// an index carried over from the carrier would be stale, so drop it
+		if (!memcmp(ctx.current_chunk.chunk_type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			continue;
+
+		if (chunk_writer_copy_range(&writer, in_fd, ctx.chunk_file_offset,
+				CHUNK_LENGTH(ctx.current_chunk.data_length))) {
+			error = "failed to write output file";
+			break;
+		}
+
+		if (!memcmp(ctx.current_chunk.chunk_type, IHDR_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			IHDR_found++;
+
+		if (index_capacity && IHDR_found == 1 && index_offset < 0) {
+			if (result->want_digests)
+				chunk_writer_defer_digest(&writer, CHUNK_LENGTH(index_len));
+
+			index_offset = writer.offset;
+			if (chunk_writer_write_chunk(&writer, STEG_INDEX_CHUNK_TYPE, worker->index_data, (u_int32_t) index_len))
+				error = "failed to write output file";
+		}
+	}
+
+	if (!error && chunk_writer_flush(&writer))
+		error = "failed to write output file";
+	if (!error && IHDR_found != 1)
+		error = "IHDR chunk must be defined exactly once (does not conform to RFC 2083)";
+	if (!error && IEND_found != 1)
+		error = "IEND chunk must be defined exactly once (does not conform to RFC 2083)";
+	if (!error && index_offset >= 0 && write_index(out_fd, 0, index_offset, &index, worker->index_data))
+		error = "failed to write output file";
+	if (result->want_digests) {
+		result->has_digests = !chunk_writer_finish_digest(&writer, result->out_digest);
+		if (!error && !result->has_digests)
+			error = "failed to compute digest of output file";
+	}
+
+	steg_index_release(&index);
+	chunk_iterator_destroy_ctx(&ctx);
+
+	return error;
+}
+
+/**
+ * Print a summary of a embedded chunk operation.
+ *
+ * Prints the input file and output file to stdout in the following format:
+ * in  <filename> <file mode> <file length> <digest>
+ * out <filename> <file mode> <file length> <digest>
+ *
+ * summary:
+ * compression factor: x.xx (xxxx in, xxxx out)
+ * chunks embedded in file: xxx
+ *
+ * The digests computed while embedding are used where available, and the files
+ * are only read again to hash them otherwise.
+ * */
+static void print_summary(const char *original_file_path,
+		const char *new_file_path, struct chunk_summary *result)
+{
+	const char *filename_from = strrchr(original_file_path, '/');
+	filename_from = !filename_from ? original_file_path : filename_from + 1;
+	const char *filename_to = strrchr(new_file_path, '/');
+	filename_to = !filename_to ? new_file_path : filename_to + 1;
 
 	// compute table boundaries
 	size_t filename_from_len = strlen(filename_from);
 	size_t filename_to_len = strlen(filename_to);
 	size_t max_filename_len = (filename_from_len >= filename_to_len) ? (filename_from_len) : (filename_to_len);
 
-	// print input and output file details
-	printf("%-3s ", "in");
-	print_file_summary(original_file_path, (int)(max_filename_len - filename_from_len + 1));
+	/*
+	 * Print input and output file details. An image read from stdin can't be
+	 * summarized, and an image modified in place was overwritten.
+	 * */
+	if (strcmp(original_file_path, "-") != 0 && strcmp(original_file_path, new_file_path) != 0) {
+		printf("%-3s ", "in");
+		if (result->has_digests)
+			print_file_summary_with_digest(original_file_path, digest_type, result->in_digest,
+					(int)(max_filename_len - filename_from_len + 1));
+		else
+			print_file_summary(original_file_path, digest_type, (int)(max_filename_len - filename_from_len + 1));
+	}
 
 	printf("%-3s ", "out");
-	print_file_summary(new_file_path, (int)(max_filename_len - filename_to_len + 1));
+	if (result->has_digests)
+		print_file_summary_with_digest(new_file_path, digest_type, result->out_digest,
+				(int)(max_filename_len - filename_to_len + 1));
+	else
+		print_file_summary(new_file_path, digest_type, (int)(max_filename_len - filename_to_len + 1));
 
 	printf("\nsummary:\n");
 	printf("compression factor: %.2f (%lu in, %lu out)\n",
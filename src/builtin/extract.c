@@ -1,50 +1,131 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "strbuf.h"
 #include "parse-options.h"
+#include "async-walk.h"
+#include "atomic-file.h"
+#include "inflate-index.h"
+#include "io-ring.h"
+#include "payload-sink.h"
 #include "png-chunk-processor.h"
+#include "steg-archive.h"
+#include "steg-index.h"
+#include "steg-stream.h"
+#include "thread-pool.h"
 #include "utils.h"
-#include "zlib.h"
 
 #define DEFLATE_STREAM_BUFFER_SIZE 16384
 
+struct steg_ranges {
+	struct steg_stream_range *entries;
+	size_t len;
+	size_t alloc;
+};
+
+static long threads = 1;
+static int has_range = 0;
+static off_t range_offset = 0;
+static off_t range_len = 0;
+static const char *index_file = NULL;
+static const char *member_name = NULL;
+static int list_members = 0;
+static int list_streams = 0;
+static long stream_number = 0;
+static int all_streams = 0;
+static int recursive = 0;
+
+/**
+ * A single stream of an image holding several, extracted to its own file by a
+ * thread pool worker.
+ * */
+struct stream_job {
+	unsigned int number;
+	struct steg_stream_map map;
+	struct payload_sink sink;
+	struct strbuf path;
+	const char *error;
+};
+
 static int extract(const char *, const char *, int);
-static void print_hex_dump(int fd);
+static void push_range(struct steg_ranges *, const struct steg_stream_range *);
+static void decode_ranges(int, struct steg_ranges *, struct steg_stream_decoder *,
+		struct payload_sink *, unsigned char *);
+static void decode_chunk_data(struct steg_stream_decoder *, struct payload_sink *,
+		const unsigned char *, size_t);
+static void extract_legacy_range(const struct steg_stream_map *, struct payload_sink *);
+static void extract_archive(const struct steg_stream_map *, struct payload_sink *);
+static void select_stream(const struct steg_stream_map *, struct steg_stream_map *);
+static void list_embedded_streams(int, struct steg_ranges *);
+static int extract_all_streams(int, struct steg_ranges *, const char *, mode_t);
+static void warn_trailing_streams(const struct steg_stream_map *);
+static int extract_recursive(const char *, const char *);
+static int parse_range(const char *, off_t *, off_t *);
+static int collect_indexed_ranges(struct chunk_iterator_ctx *, struct steg_ranges *);
 
 int cmd_extract(int argc, char *argv[])
 {
 	const char *output_file = NULL;
+	const char *range = NULL;
+	const char *stream = NULL;
+	const char *output_dir = NULL;
 	int hexdump = 0;
 	int help = 0;
 
 	const struct usage_string extract_cmd_usage[] = {
-			USAGE("steg-png extract [-o | --output <file>] <file>"),
-			USAGE("steg-png extract [--hexdump] <file>"),
+			USAGE("steg-png extract [-o | --output <file>] [--threads <n>] (<file> | -)"),
+			USAGE("steg-png extract [--hexdump] (<file> | -)"),
+			USAGE("steg-png extract [--range <offset>:<len> [--index <file>]] [-o | --output <file>] <file>"),
+			USAGE("steg-png extract --member <name> [--range <offset>:<len>] [-o | --output <file>] <file>"),
+			USAGE("steg-png extract --list-members <file>"),
+			USAGE("steg-png extract --list <file>"),
+			USAGE("steg-png extract --stream <n> [--member <name>] [--range <offset>:<len>] [-o | --output <file>] <file>"),
+			USAGE("steg-png extract --stream all [--threads <n>] [-o | --output <prefix>] <file>"),
+			USAGE("steg-png extract --recursive <dir> --output-dir <dir> [--threads <n>]"),
 			USAGE("steg-png extract (-h | --help)"),
 			USAGE_END()
 	};
 
 	const struct command_option extract_cmd_options[] = {
-			OPT_STRING('o', "output", "file", "alternate output file path", &output_file),
+			OPT_STRING('o', "output", "file", "alternate output file path, or '-' for stdout", &output_file),
 			OPT_LONG_BOOL("hexdump", "print a canonical hex+ASCII of the embedded data", &hexdump),
+			OPT_LONG_STRING("range", "offset:len", "extract only <len> bytes of the embedded data, starting at <offset>", &range),
+			OPT_LONG_STRING("index", "file", "with --range, cache an index of the embedded data in <file> to speed up later reads", &index_file),
+			OPT_LONG_STRING("member", "name", "extract only the member <name> of an embedded archive", &member_name),
+			OPT_LONG_BOOL("list-members", "list the length and name of each member of an embedded archive", &list_members),
+			OPT_LONG_BOOL("list", "list the streams embedded in the image, for images embedded into more than once", &list_streams),
+			OPT_LONG_STRING("stream", "n", "extract only stream <n> (see --list), or 'all' to extract each stream to its own file", &stream),
+			OPT_LONG_BOOL("recursive", "extract the payload of every image in a directory tree, see --output-dir", &recursive),
+			OPT_LONG_STRING("output-dir", "dir", "with --recursive, write payloads to <dir>, mirroring the layout of the input tree", &output_dir),
+			OPT_LONG_INT("threads", "inflate segmented payloads using <n> threads (0 for one per processor, default 1)", &threads),
 			OPT_BOOL('h', "help", "show help and exit", &help),
 			OPT_END()
 	};
 
 	argc = parse_options(argc, argv, extract_cmd_options, 0, 1);
+
+	// options may also follow the image (or with --recursive, the directory)
+	int positional_first = argc > 1 && (argv[0][0] != '-' || !argv[0][1]);
+	if (positional_first)
+		argc = parse_options(argc - 1, argv + 1, extract_cmd_options, 0, 1) + 1;
+
 	if (help) {
 		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 0, NULL);
 		return 0;
 	}
 
 	if (argc > 1) {
-		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "unknown option '%s'", argv[0]);
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "unknown option '%s'",
+				positional_first ? argv[1] : argv[0]);
 		return 1;
 	}
 
@@ -53,6 +134,80 @@ int cmd_extract(int argc, char *argv[])
 		return 1;
 	}
 
+	if (hexdump && output_file && !strcmp(output_file, "-")) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "cannot mix --hexdump and --output to stdout");
+		return 1;
+	}
+
+	if (threads < 0) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "invalid number of threads %ld", threads);
+		return 1;
+	}
+
+	if (range && parse_range(range, &range_offset, &range_len)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "invalid range '%s'", range);
+		return 1;
+	}
+
+	if (index_file && !range) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--index requires --range");
+		return 1;
+	}
+
+	if (index_file && member_name) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "cannot mix --index and --member");
+		return 1;
+	}
+
+	if (list_members && (member_name || range || hexdump || output_file)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--list-members cannot be combined with other output options");
+		return 1;
+	}
+
+	if (stream && !strcmp(stream, "all")) {
+		all_streams = 1;
+	} else if (stream) {
+		char *end = NULL;
+		errno = 0;
+		stream_number = strtol(stream, &end, 10);
+		if (errno || end == stream || *end || stream_number < 1) {
+			show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "invalid stream '%s'", stream);
+			return 1;
+		}
+	}
+
+	if (list_streams && (stream || member_name || list_members || range || hexdump || output_file)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--list cannot be combined with other output options");
+		return 1;
+	}
+
+	if (all_streams && (member_name || list_members || range || hexdump)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--stream all extracts whole streams only");
+		return 1;
+	}
+
+	if (all_streams && output_file && !strcmp(output_file, "-")) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--stream all cannot write to stdout");
+		return 1;
+	}
+
+	if (recursive != (output_dir != NULL)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--recursive and --output-dir must be used together");
+		return 1;
+	}
+
+	if (recursive && (output_file || hexdump || range || member_name || list_members || list_streams || stream)) {
+		show_usage_with_options(extract_cmd_usage, extract_cmd_options, 1, "--recursive extracts whole payloads to --output-dir only");
+		return 1;
+	}
+
+	has_range = range != NULL;
+	if (!threads)
+		threads = thread_pool_cpu_count();
+
+	if (recursive)
+		return extract_recursive(argv[0], output_dir);
+
 	return extract(argv[0], output_file, hexdump);
 }
 
@@ -62,160 +217,1232 @@ static int extract(const char *input_file, const char *output_file, int show_hex
 	strbuf_init(&output_file_path);
 	if (output_file)
 		strbuf_attach_str(&output_file_path, output_file);
+	else if (!strcmp(input_file, "-"))
+		strbuf_attach_str(&output_file_path, "-");
 	else
 		strbuf_attach_fmt(&output_file_path, "%s.out", input_file);
 
-	int in_fd = open(input_file, O_RDONLY);
-	if (in_fd < 0)
-		DIE(FILE_OPEN_FAILED, input_file);
+	// an image read from stdin is extracted to stdout, unless told otherwise
+	struct stat input_file_st;
+	int in_fd = STDIN_FILENO;
+	if (!strcmp(input_file, "-")) {
+		input_file_st.st_mode = 0666;
+	} else {
+		if (lstat(input_file, &input_file_st) && errno == ENOENT)
+			FATAL("failed to stat %s'", input_file);
 
-	// create and unlink a temporary file
-	char tmp_file_name_template[] = "/tmp/steg-png_XXXXXX";
-	int tmp_fd = mkstemp(tmp_file_name_template);
-	if (tmp_fd < 0)
-		FATAL("unable to create temporary file");
-	if (unlink(tmp_file_name_template) < 0)
-		FATAL("failed to unlink temporary file from filesystem");
+		in_fd = open(input_file, O_RDONLY);
+		if (in_fd < 0)
+			DIE(FILE_OPEN_FAILED, input_file);
+	}
 
 	struct chunk_iterator_ctx ctx;
-	int status = chunk_iterator_init_ctx(&ctx, in_fd);
+	int status = chunk_iterator_init_mmap_ctx(&ctx, in_fd);
 	if (status < 0)
 		FATAL("failed to read from file descriptor");
 	else if(status > 0)
 		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
-	// allocate buffers for inflate input/output
+	/*
+	 * Inflated data is delivered straight to its final destination(s): the
+	 * output file (or stdout), and/or a hexdump.
+	 * */
+	struct payload_sink sink;
+	payload_sink_init(&sink);
+	if (show_hexdump)
+		payload_sink_hexdump(&sink, stdout);
+	if (!list_members && !list_streams && !all_streams && (!show_hexdump || output_file)) {
+		if (payload_sink_open_file(&sink, output_file_path.buff,
+				input_file_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)))
+			DIE(FILE_OPEN_FAILED, output_file_path.buff);
+	}
+
+	struct steg_stream_decoder decoder;
+	steg_stream_decoder_init(&decoder, &sink);
+
+	/*
+	 * When extracting with several threads, extracting a range or reading an
+	 * archive, only the locations of the stEG chunks are collected while
+	 * walking the file, since the stream is then read out of order once all
+	 * chunks are known.
+	 * */
+	struct steg_ranges ranges = { NULL, 0, 0 };
+	int select_streams = list_streams || stream_number || all_streams;
+	int random_access = has_range || member_name || list_members || select_streams;
+	int collect_ranges = (threads > 1 || random_access) && !chunk_iterator_is_stream(&ctx);
+	if (select_streams && !collect_ranges)
+		DIE("%s requires a seekable input file", list_streams ? "--list" : "--stream");
+	if (random_access && !collect_ranges)
+		DIE("%s requires a seekable input file", list_members ? "--list-members" : member_name ? "--member" : "--range");
+
 	unsigned char *input_buffer = (unsigned char *) malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
 	if (!input_buffer)
 		FATAL(MEM_ALLOC_FAILED);
 
-	unsigned char *output_buffer = (unsigned char *) malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
-	if (!output_buffer)
-		FATAL(MEM_ALLOC_FAILED);
+	/*
+	 * If the image carries a valid index of its stEG chunks, jump straight to
+	 * them rather than walking every chunk in the file. The chunks are then
+	 * decoded just like collected ranges. An index only lists the chunks of
+	 * the payload embedded last, so it's no use when selecting streams.
+	 * */
+	unsigned steg_chunks_found = 0;
+	int indexed = !chunk_iterator_is_stream(&ctx) && !select_streams && collect_indexed_ranges(&ctx, &ranges);
+	if (indexed) {
+		collect_ranges = 1;
+		steg_chunks_found = ranges.len;
+	} else {
+		int has_next_chunk, IEND_found = 0;
+		while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
+			if (has_next_chunk < 0)
+				FATAL("unexpected error while parsing input file");
+
+			if (chunk_iterator_next(&ctx) != 0)
+				FATAL("unexpected error while parsing input file");
+
+			if (IEND_found)
+				DIE("non-compliant input file with IEND chunk defined twice (does not conform to RFC 2083)");
+
+			// if this chunk is our stEG chunk, decode the data into the sink
+			if (!memcmp(ctx.current_chunk.chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH)) {
+				steg_chunks_found++;
+
+				const unsigned char *mapped_data = chunk_iterator_get_chunk_data(&ctx);
+				if (collect_ranges) {
+					struct steg_stream_range range = {
+						.offset = ctx.chunk_file_offset + CHUNK_HEADER_LENGTH,
+						.len = ctx.current_chunk.data_length,
+						.data = mapped_data
+					};
+
+					push_range(&ranges, &range);
+				} else if (mapped_data) {
+					// if the file is memory mapped, decode the chunk data in place
+					decode_chunk_data(&decoder, &sink, mapped_data, ctx.current_chunk.data_length);
+				} else {
+					ssize_t bytes_read = 0;
+					while ((bytes_read = chunk_iterator_read_data(&ctx, input_buffer, DEFLATE_STREAM_BUFFER_SIZE)) > 0)
+						decode_chunk_data(&decoder, &sink, input_buffer, bytes_read);
+				}
+			}
+
+			if (!memcmp(ctx.current_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+				IEND_found = 1;
+		}
+
+		if (!IEND_found)
+			DIE("non-compliant input file with no IEND chunk defined (does not conform to RFC 2083)");
+	}
+
+	// check that the input file actually contained embedded stEG chunks
+	if (!steg_chunks_found) {
+		payload_sink_rollback(&sink);
+		DIE("input file is clean; embedded data could not be found.");
+	}
+
+	int ret = 0;
+	if (list_streams)
+		list_embedded_streams(in_fd, &ranges);
+	else if (all_streams)
+		ret = extract_all_streams(in_fd, &ranges, output_file_path.buff,
+				input_file_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+	else if (collect_ranges)
+		decode_ranges(in_fd, &ranges, &decoder, &sink, input_buffer);
+
+	if (steg_stream_decoder_finish(&decoder)) {
+		payload_sink_rollback(&sink);
+		DIE("failed to extract embedded data: %s", decoder.error);
+	}
+
+	if (decoder.trailing_len && !stream_number) {
+		errno = 0;
+		WARN("image holds more than one embedded stream; only the first was extracted (see --list)");
+	}
+
+	steg_stream_decoder_destroy(&decoder);
+	free(ranges.entries);
+	free(input_buffer);
+	chunk_iterator_destroy_ctx(&ctx);
+	if (in_fd != STDIN_FILENO)
+		close(in_fd);
 
-	// set up zlib for deflate
-	struct z_stream_s strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-
-	int ret = inflateInit(&strm);
-	if (ret != Z_OK)
-		FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
-
-	const char steg_chunk_type[] = {'s', 't', 'E', 'G' };
-	int has_next_chunk, IEND_found = 0;
-	while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
-		if (has_next_chunk < 0)
+	if (payload_sink_commit(&sink))
+		FATAL("failed to write to file %s", output_file_path.buff);
+
+	strbuf_release(&output_file_path);
+
+	return ret;
+}
+
+/**
+ * Append a stEG chunk location to the list of ranges, growing it as needed.
+ * */
+static void push_range(struct steg_ranges *ranges, const struct steg_stream_range *range)
+{
+	if (ranges->len == ranges->alloc) {
+		ranges->alloc = ranges->alloc ? ranges->alloc * 2 : 64;
+		ranges->entries = (struct steg_stream_range *) realloc(ranges->entries,
+				sizeof(struct steg_stream_range) * ranges->alloc);
+		if (!ranges->entries)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	ranges->entries[ranges->len++] = *range;
+}
+
+/**
+ * Collect the locations of the stEG chunks listed in the stIX index chunk of the
+ * image, verifying each against the file along the way.
+ *
+ * Returns 1 if the ranges were collected from the index. Returns 0 if the image
+ * has no usable index, or the index is corrupt or doesn't match the file, in
+ * which case the iterator is rewound to the first chunk so that the file can be
+ * walked instead.
+ * */
+static int collect_indexed_ranges(struct chunk_iterator_ctx *ctx, struct steg_ranges *ranges)
+{
+	struct steg_index index;
+	int ret = steg_index_read(&index, ctx);
+	if (ret < 0)
+		WARN("stIX chunk is corrupt; falling back to reading the whole file");
+
+	for (size_t i = 0; !ret && i < index.len; i++) {
+		if (steg_index_seek(&index, i, ctx)) {
+			WARN("stIX chunk doesn't match the file; falling back to reading the whole file");
+			ranges->len = 0;
+			ret = -1;
+			break;
+		}
+
+		struct steg_stream_range range = {
+			.offset = ctx->chunk_file_offset + CHUNK_HEADER_LENGTH,
+			.len = ctx->current_chunk.data_length,
+			.data = chunk_iterator_get_chunk_data(ctx)
+		};
+
+		push_range(ranges, &range);
+	}
+
+	steg_index_release(&index);
+	if (!ret)
+		return 1;
+
+	if (chunk_iterator_seek(ctx, SIGNATURE_LENGTH) < 0)
+		FATAL("unexpected error while parsing input file");
+
+	return 0;
+}
+
+/**
+ * Decode the stEG chunks collected while walking the file. If an archive member
+ * was requested, only that member is extracted (see extract_archive()). If a
+ * range was requested, only that range of the payload is extracted. Otherwise,
+ * segmented streams are inflated concurrently, and legacy streams are decoded
+ * serially, as usual.
+ * */
+static void decode_ranges(int fd, struct steg_ranges *ranges, struct steg_stream_decoder *decoder,
+		struct payload_sink *sink, unsigned char *buffer)
+{
+	struct steg_stream_map chunks, map;
+	steg_stream_map_init(&chunks, fd, ranges->entries, ranges->len);
+	if (stream_number)
+		select_stream(&chunks, &map);
+	else
+		steg_stream_map_slice(&map, &chunks, 0, steg_stream_map_length(&chunks));
+
+	unsigned char first_byte = 0;
+	off_t stream_len = steg_stream_map_length(&map);
+	if (stream_len && steg_stream_map_read(&map, 0, &first_byte, 1))
+		FATAL("unexpected error while parsing input file");
+
+	const char *error = NULL;
+	int segmented = steg_stream_detect_format(&first_byte, stream_len ? 1 : 0) == STEG_FORMAT_SEGMENTED;
+	if (member_name || list_members) {
+		extract_archive(&map, sink);
+	} else if (has_range && segmented) {
+		if (steg_stream_extract_segment_range(&map, range_offset, range_len, sink, &error)) {
+			payload_sink_rollback(sink);
+			DIE("failed to extract embedded data: %s", error);
+		}
+	} else if (has_range) {
+		extract_legacy_range(&map, sink);
+	} else if (segmented) {
+		struct thread_pool pool;
+		thread_pool_init(&pool, (unsigned int) threads);
+
+		if (steg_stream_inflate_segments(&map, sink, &pool, &error)) {
+			payload_sink_rollback(sink);
+			DIE("failed to extract embedded data: %s", error);
+		}
+
+		thread_pool_destroy(&pool);
+		if (!stream_number)
+			warn_trailing_streams(&map);
+	} else {
+		for (off_t pos = 0; pos < stream_len; ) {
+			size_t len = stream_len - pos > DEFLATE_STREAM_BUFFER_SIZE ? DEFLATE_STREAM_BUFFER_SIZE : stream_len - pos;
+			if (steg_stream_map_read(&map, pos, buffer, len))
+				FATAL("unexpected error while parsing input file");
+
+			decode_chunk_data(decoder, sink, buffer, len);
+			pos += len;
+		}
+	}
+
+	steg_stream_map_release(&map);
+	steg_stream_map_release(&chunks);
+}
+
+/**
+ * Select the stream requested with --stream from the stEG chunk data of an
+ * image holding several, and initialize `stream` as a slice of `chunks` that
+ * begins with it. The streams preceding it must be delimited to find where it
+ * begins (see steg_stream_delimit()).
+ *
+ * Segmented streams are cheap to delimit, so the slice ends with the stream.
+ * A legacy stream is decoded until its own end anyway, so rather than inflating
+ * it twice, its slice runs to the end of the data.
+ * */
+static void select_stream(const struct steg_stream_map *chunks, struct steg_stream_map *stream)
+{
+	const char *error = NULL;
+	struct steg_stream_info info;
+	off_t offset = 0;
+	for (long i = 1; ; i++) {
+		unsigned char first_byte = 0;
+		if (offset < steg_stream_map_length(chunks) && steg_stream_map_read(chunks, offset, &first_byte, 1))
 			FATAL("unexpected error while parsing input file");
 
-		if (chunk_iterator_next(&ctx) != 0)
+		int last_legacy = i == stream_number &&
+				steg_stream_detect_format(&first_byte, 1) == STEG_FORMAT_LEGACY;
+		int status = last_legacy ? 0 : steg_stream_delimit(chunks, offset, &info, NULL, &error);
+		if (status < 0)
+			DIE("failed to read embedded stream %ld: %s", i, error);
+		if (status > 0 || offset >= steg_stream_map_length(chunks))
+			DIE("image holds only %ld embedded streams", i - 1);
+
+		if (i == stream_number) {
+			off_t len = last_legacy ? steg_stream_map_length(chunks) - offset : info.len;
+			steg_stream_map_slice(stream, chunks, offset, len);
+			return;
+		}
+
+		offset += info.len;
+	}
+}
+
+/**
+ * Print the number, format, length and payload length of each stream embedded
+ * in the image, one per line. Legacy streams are inflated to find where they
+ * end, but the inflated data is discarded.
+ * */
+static void list_embedded_streams(int fd, struct steg_ranges *ranges)
+{
+	struct steg_stream_map map;
+	steg_stream_map_init(&map, fd, ranges->entries, ranges->len);
+
+	const char *error = NULL;
+	struct steg_stream_info info;
+	off_t offset = 0;
+	for (unsigned int i = 1; ; i++) {
+		int status = steg_stream_delimit(&map, offset, &info, NULL, &error);
+		if (status > 0)
+			break;
+		if (status < 0)
+			DIE("failed to read embedded stream %u: %s", i, error);
+
+		const char *format = info.archive ? "archive" :
+				info.format == STEG_FORMAT_SEGMENTED ? "segmented" : "zlib";
+		printf("%u %s %lld %lld\n", i, format, (long long int) info.len, (long long int) info.payload_len);
+		offset += info.len;
+	}
+
+	steg_stream_map_release(&map);
+}
+
+/**
+ * Thread pool job that decodes a single stream into its own sink.
+ * */
+static void extract_stream(void *arg)
+{
+	struct stream_job *job = (struct stream_job *) arg;
+
+	unsigned char *buffer = (unsigned char *) malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+	if (!buffer)
+		FATAL(MEM_ALLOC_FAILED);
+
+	struct steg_stream_decoder decoder;
+	steg_stream_decoder_init(&decoder, &job->sink);
+
+	off_t stream_len = steg_stream_map_length(&job->map);
+	for (off_t pos = 0; pos < stream_len && !job->error; ) {
+		size_t len = stream_len - pos > DEFLATE_STREAM_BUFFER_SIZE ? DEFLATE_STREAM_BUFFER_SIZE : stream_len - pos;
+		if (steg_stream_map_read(&job->map, pos, buffer, len))
+			job->error = "failed to read embedded data";
+		else if (steg_stream_decoder_write(&decoder, buffer, len))
+			job->error = decoder.error;
+
+		pos += len;
+	}
+
+	if (!job->error && steg_stream_decoder_finish(&decoder))
+		job->error = decoder.error;
+
+	steg_stream_decoder_destroy(&decoder);
+	free(buffer);
+}
+
+/**
+ * Extract every stream embedded in the image to its own file, named after
+ * `prefix` and the number of the stream.
+ *
+ * Segmented streams are delimited by their segment headers alone, and handed
+ * to a pool of workers to be inflated concurrently. A legacy stream must be
+ * inflated to find where the next stream begins, so it is extracted while it
+ * is delimited, alongside the workers.
+ *
+ * Returns zero if every stream was extracted, and 1 otherwise.
+ * */
+static int extract_all_streams(int fd, struct steg_ranges *ranges, const char *prefix, mode_t mode)
+{
+	struct steg_stream_map chunks;
+	steg_stream_map_init(&chunks, fd, ranges->entries, ranges->len);
+
+	struct thread_pool pool;
+	thread_pool_init(&pool, (unsigned int) threads);
+
+	struct stream_job **jobs = NULL;
+	size_t jobs_len = 0;
+	off_t offset = 0;
+	int ret = 0;
+
+	while (offset < steg_stream_map_length(&chunks)) {
+		unsigned char first_byte;
+		if (steg_stream_map_read(&chunks, offset, &first_byte, 1))
 			FATAL("unexpected error while parsing input file");
 
-		if (IEND_found)
-			DIE("non-compliant input file with IEND chunk defined twice (does not conform to RFC 2083)");
-
-		/*
-		 * If this chunk is our stEG chunk, inflate the data and write to the
-		 * temporary file.
-		 * */
-		if (!memcmp(ctx.current_chunk.chunk_type, steg_chunk_type, CHUNK_TYPE_LENGTH)) {
-			ssize_t bytes_read = 0;
-
-			while ((bytes_read = chunk_iterator_read_data(&ctx, input_buffer, DEFLATE_STREAM_BUFFER_SIZE)) > 0) {
-				strm.avail_in = bytes_read;
-				strm.next_in = input_buffer;
-
-				// fully consume the input buffer data
-				do {
-					strm.avail_out = DEFLATE_STREAM_BUFFER_SIZE;
-					strm.next_out = output_buffer;
-
-					ret = inflate(&strm, Z_NO_FLUSH);
-					switch (ret) {
-						case Z_STREAM_ERROR:
-						case Z_NEED_DICT:
-						case Z_DATA_ERROR:
-						case Z_MEM_ERROR:
-							FATAL("zlib INFLATE failed with unexpected error: %s", zError(ret));
-						default:
-							break;
-					}
-
-					size_t data_to_write = DEFLATE_STREAM_BUFFER_SIZE - strm.avail_out;
-					if (recoverable_write(tmp_fd, output_buffer, data_to_write) != data_to_write)
-						FATAL("failed to write inflated data to temporary file.");
-				} while (strm.avail_out == 0);
+		struct stream_job *job = (struct stream_job *) calloc(1, sizeof(struct stream_job));
+		jobs = (struct stream_job **) realloc(jobs, sizeof(struct stream_job *) * (jobs_len + 1));
+		if (!job || !jobs)
+			FATAL(MEM_ALLOC_FAILED);
+
+		jobs[jobs_len++] = job;
+		job->number = (unsigned int) jobs_len;
+		strbuf_init(&job->path);
+		strbuf_attach_fmt(&job->path, "%s.%u", prefix, job->number);
+		payload_sink_init(&job->sink);
+
+		int legacy = steg_stream_detect_format(&first_byte, 1) == STEG_FORMAT_LEGACY;
+		if (payload_sink_open_file(&job->sink, job->path.buff, mode))
+			DIE(FILE_OPEN_FAILED, job->path.buff);
+
+		struct steg_stream_info info;
+		if (steg_stream_delimit(&chunks, offset, &info, legacy ? &job->sink : NULL, &job->error))
+			break;
+
+		steg_stream_map_slice(&job->map, &chunks, offset, info.len);
+		offset += info.len;
+
+		if (info.archive)
+			job->error = "embedded data is an archive; extract its members with --stream and --member";
+		else if (!legacy)
+			thread_pool_submit(&pool, extract_stream, job);
+	}
+
+	thread_pool_wait(&pool);
+	thread_pool_destroy(&pool);
+
+	for (size_t i = 0; i < jobs_len; i++) {
+		struct stream_job *job = jobs[i];
+		if (job->error) {
+			errno = 0;
+			WARN("failed to extract embedded stream %u: %s", job->number, job->error);
+			payload_sink_rollback(&job->sink);
+			ret = 1;
+		} else if (payload_sink_commit(&job->sink)) {
+			FATAL("failed to write to file %s", job->path.buff);
+		}
+
+		strbuf_release(&job->path);
+		free(job);
+	}
+
+	free(jobs);
+	steg_stream_map_release(&chunks);
+
+	return ret;
+}
+
+/**
+ * Warn if the segmented stream described by `map` is followed by other
+ * streams, which were not extracted.
+ * */
+static void warn_trailing_streams(const struct steg_stream_map *map)
+{
+	const char *error = NULL;
+	struct steg_stream_info info;
+	if (!steg_stream_delimit(map, 0, &info, NULL, &error) && info.len < steg_stream_map_length(map)) {
+		errno = 0;
+		WARN("image holds more than one embedded stream; only the first was extracted (see --list)");
+	}
+}
+
+/**
+ * Extract the requested range of the payload from a legacy steg stream.
+ *
+ * If an index file was given, the inflate index is loaded from it, or built
+ * and saved to it if missing or stale, so inflation can begin at the nearest
+ * checkpoint. Otherwise, the stream is inflated from the beginning.
+ * */
+static void extract_legacy_range(const struct steg_stream_map *map, struct payload_sink *sink)
+{
+	const char *error = NULL;
+	struct inflate_index index;
+	inflate_index_init(&index);
+
+	if (index_file) {
+		int status = 1;
+		int index_fd = open(index_file, O_RDONLY);
+		if (index_fd >= 0) {
+			status = inflate_index_load(&index, map, index_fd);
+			close(index_fd);
+		} else if (errno != ENOENT) {
+			DIE(FILE_OPEN_FAILED, index_file);
+		}
+
+		if (status < 0)
+			FATAL("failed to read index file '%s'", index_file);
+
+		if (status > 0) {
+			if (inflate_index_build(&index, map, &error)) {
+				payload_sink_rollback(sink);
+				DIE("failed to extract embedded data: %s", error);
 			}
+
+			struct atomic_file out;
+			if (atomic_file_open(&out, index_file, 0666))
+				DIE(FILE_OPEN_FAILED, index_file);
+			if (inflate_index_save(&index, out.fd) || atomic_file_commit(&out))
+				FATAL("failed to write index file '%s'", index_file);
+		}
+	}
+
+	if (inflate_index_extract(&index, map, range_offset, range_len, sink, &error)) {
+		payload_sink_rollback(sink);
+		DIE("failed to extract embedded data: %s", error);
+	}
+
+	inflate_index_release(&index);
+}
+
+/**
+ * Read the table of contents of an embedded archive, and either list its
+ * members, or extract the requested member (or range of it). Only the segments
+ * of that member are read and inflated.
+ * */
+static void extract_archive(const struct steg_stream_map *map, struct payload_sink *sink)
+{
+	const char *error = NULL;
+	struct steg_archive archive;
+	int status = steg_archive_read(&archive, map, &error);
+	if (status) {
+		payload_sink_rollback(sink);
+		if (status > 0)
+			DIE("embedded data is not an archive");
+		DIE("failed to extract embedded data: %s", error);
+	}
+
+	if (list_members) {
+		for (size_t i = 0; i < archive.len; i++)
+			printf("%lld\t%s\n", (long long int) archive.members[i].len, archive.members[i].name);
+	} else {
+		const struct steg_archive_member *member = steg_archive_find(&archive, member_name);
+		if (!member) {
+			payload_sink_rollback(sink);
+			DIE("embedded archive has no member '%s'", member_name);
+		}
+
+		off_t offset = has_range ? range_offset : 0;
+		off_t len = has_range ? range_len : member->len;
+		if (steg_stream_extract_member(map, member->stream_offset, member->len, offset, len, sink, &error)) {
+			payload_sink_rollback(sink);
+			DIE("failed to extract embedded data: %s", error);
+		}
+	}
+
+	steg_archive_release(&archive);
+}
+
+#define RECURSIVE_QUEUE_DEPTH ASYNC_WALK_MAX_DEPTH
+#define RECURSIVE_RESERVED_FDS 3
+
+/**
+ * State of an extract --recursive. The directory tree is walked on the main
+ * thread, and images are handed to the workers of the pool in jobs of up to
+ * `batch_len` images. At most `max_in_flight` jobs are queued or being
+ * extracted at any time, so memory use doesn't grow with the size of the tree.
+ *
+ * Where io_uring is available, each job reads its images together through an
+ * io_ring (see struct async_extract), and holds as many images as the ring
+ * holds reads. Otherwise, each job holds a single image, read synchronously.
+ * */
+struct recursive_extract {
+	struct thread_pool pool;
+	int use_io_ring;
+	size_t batch_len;
+
+	// the job being filled by the walk, submitted once full
+	struct recursive_job *pending;
+
+	// rings set up by earlier jobs, reused by later ones
+	struct async_extract *idle;
+
+	pthread_mutex_t lock;
+	pthread_cond_t slot_free;
+	unsigned long in_flight;
+	unsigned long max_in_flight;
+	unsigned long corrupt;
+};
+
+/**
+ * A batch of images of the tree, extracted by a worker of the pool.
+ * */
+struct recursive_job {
+	struct recursive_extract *state;
+	char *image_paths[RECURSIVE_QUEUE_DEPTH];
+	char *output_paths[RECURSIVE_QUEUE_DEPTH];
+	size_t len;
+};
+
+enum extract_status {
+	EXTRACT_OK,
+	EXTRACT_CLEAN,
+	EXTRACT_CORRUPT,
+	EXTRACT_SKIPPED
+};
+
+/**
+ * The extraction of an image whose chunks are being read through an
+ * async_walk, kept alongside the file in the slot of the same index.
+ * */
+struct extract_slot {
+	const char *output_path;
+	const char *error;
+	int IEND_found;
+	int sink_open;
+	struct payload_sink sink;
+	struct steg_stream_decoder decoder;
+};
+
+/**
+ * Images being extracted asynchronously by a single worker (see async-walk.h).
+ * The data of each stEG chunk is read a buffer at a time, and each image has
+ * at most one read in flight, so its chunks are decoded in order.
+ * */
+struct async_extract {
+	struct recursive_extract *state;
+	struct async_walk walk;
+	struct extract_slot slots[RECURSIVE_QUEUE_DEPTH];
+
+	// output path of the image being added, picked up once its walk begins
+	const char *output_path;
+
+	struct async_extract *next;
+};
+
+static void walk_directory(struct recursive_extract *, struct strbuf *, struct strbuf *);
+static void submit_pending(struct recursive_extract *);
+static void async_extract_destroy(struct async_extract *);
+
+/**
+ * Extract the payload of every image in the directory tree `input_dir` to the
+ * same relative path under `output_dir`, with ".out" appended, just as extract
+ * names its output by default. Images are extracted concurrently on `threads`
+ * workers.
+ *
+ * A status line is printed to stdout for every PNG image in the tree, once
+ * extracted:
+ * ok TAB <image>
+ * clean TAB <image>
+ * corrupt TAB <image> TAB <message>
+ * Files that aren't PNG images are skipped silently, and clean images produce
+ * no output file.
+ *
+ * Returns zero if successful, and 1 if any image was corrupt or unreadable.
+ * */
+static int extract_recursive(const char *input_dir, const char *output_dir)
+{
+	struct stat st;
+	if (stat(input_dir, &st))
+		DIE("unable to read directory '%s'", input_dir);
+	if (!S_ISDIR(st.st_mode))
+		DIE("'%s' is not a directory", input_dir);
+
+	struct recursive_extract state = {
+			.pending = NULL,
+			.idle = NULL,
+			.in_flight = 0,
+			.max_in_flight = (unsigned long) threads * 2,
+			.corrupt = 0
+	};
+
+	if (pthread_mutex_init(&state.lock, NULL) || pthread_cond_init(&state.slot_free, NULL))
+		FATAL("failed to initialize recursive extract lock");
+
+	// when io_uring is unavailable, every image is extracted synchronously
+	struct io_ring probe;
+	state.use_io_ring = !io_ring_init(&probe, 1);
+	io_ring_destroy(&probe);
+	errno = 0;
+
+	/*
+	 * Every image being extracted asynchronously holds a descriptor for itself
+	 * and one for its output file, so limit the batch such that every worker,
+	 * and the main thread walking the tree, stays within RLIMIT_NOFILE.
+	 * */
+	struct rlimit limit;
+	state.batch_len = RECURSIVE_QUEUE_DEPTH;
+	if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+		rlim_t per_thread = limit.rlim_cur / (rlim_t) (threads + 1);
+		per_thread = per_thread > RECURSIVE_RESERVED_FDS ? (per_thread - RECURSIVE_RESERVED_FDS) / 2 : 0;
+		if (per_thread < state.batch_len)
+			state.batch_len = (size_t) per_thread;
+	}
+
+	if (state.batch_len < 2)
+		state.use_io_ring = 0;
+	if (!state.use_io_ring)
+		state.batch_len = 1;
+
+	struct strbuf image_path, output_path;
+	strbuf_init(&image_path);
+	strbuf_init(&output_path);
+	strbuf_attach_str(&image_path, input_dir);
+	strbuf_attach_str(&output_path, output_dir);
+
+	thread_pool_init(&state.pool, (unsigned int) threads);
+	walk_directory(&state, &image_path, &output_path);
+	submit_pending(&state);
+	thread_pool_wait(&state.pool);
+	thread_pool_destroy(&state.pool);
+
+	while (state.idle) {
+		struct async_extract *async = state.idle;
+		state.idle = async->next;
+		async_extract_destroy(async);
+	}
+
+	strbuf_release(&image_path);
+	strbuf_release(&output_path);
+	pthread_cond_destroy(&state.slot_free);
+	pthread_mutex_destroy(&state.lock);
+
+	if (fflush(stdout))
+		FATAL("failed to write to stdout");
+
+	return state.corrupt ? 1 : 0;
+}
+
+/**
+ * Create the directories leading up to the file at `path`, as with mkdir -p.
+ * Directories that already exist, perhaps created by another worker, are fine.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+static int make_leading_directories(const char *path)
+{
+	struct strbuf dir;
+	strbuf_init(&dir);
+	strbuf_attach_str(&dir, path);
+
+	int ret = 0;
+	for (char *slash = strchr(dir.buff + 1, '/'); slash && !ret; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(dir.buff, 0777) && errno != EEXIST)
+			ret = -1;
+		*slash = '/';
+	}
+
+	strbuf_release(&dir);
+	return ret;
+}
+
+/**
+ * Create the output file of an image at `output_path`, along with the
+ * directories leading up to it, once the first stEG chunk is found.
+ *
+ * Returns zero if successful, and -1 otherwise.
+ * */
+static int open_image_output(struct payload_sink *sink, const char *output_path, mode_t mode)
+{
+	if (make_leading_directories(output_path))
+		return -1;
+
+	return payload_sink_open_file(sink, output_path, mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+/**
+ * Complete the extraction of an image once all of its chunks have been walked,
+ * or an error was found, committing or rolling back its output file. The
+ * decoder is left for the caller to destroy.
+ *
+ * Returns the status of the image. If corrupt, `error` describes the problem.
+ * */
+static enum extract_status finish_image(struct payload_sink *sink, struct steg_stream_decoder *decoder,
+		int sink_open, int IEND_found, const char **error)
+{
+	enum extract_status ret = EXTRACT_OK;
+	if (!*error && IEND_found != 1)
+		*error = "IEND chunk must be defined exactly once (does not conform to RFC 2083)";
+	if (!*error && !sink_open)
+		ret = EXTRACT_CLEAN;
+	else if (!*error && steg_stream_decoder_finish(decoder))
+		*error = decoder->error;
+
+	if (*error) {
+		payload_sink_rollback(sink);
+		ret = EXTRACT_CORRUPT;
+	} else if (sink_open && payload_sink_commit(sink)) {
+		*error = "failed to write output file";
+		ret = EXTRACT_CORRUPT;
+	}
+
+	return ret;
+}
+
+/**
+ * Print the status line of an image of the tree, and count it if corrupt.
+ * */
+static void report_image(struct recursive_extract *state, const char *image_path,
+		enum extract_status status, const char *error)
+{
+	pthread_mutex_lock(&state->lock);
+	if (status == EXTRACT_OK)
+		printf("ok\t%s\n", image_path);
+	else if (status == EXTRACT_CLEAN)
+		printf("clean\t%s\n", image_path);
+	else if (status == EXTRACT_CORRUPT)
+		printf("corrupt\t%s\t%s\n", image_path, error);
+
+	if (status == EXTRACT_CORRUPT)
+		state->corrupt++;
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Extract the payload of the image at `image_path` to `output_path`. The image
+ * is read through a buffered chunk iterator and inflated a buffer at a time, so
+ * a worker only ever holds a fixed amount of memory, whatever the size of the
+ * image. The output file is only created once a stEG chunk is found.
+ *
+ * Returns the status of the image. If corrupt, `error` describes the problem.
+ * */
+static enum extract_status extract_image(const char *image_path, const char *output_path,
+		unsigned char *buffer, const char **error)
+{
+	struct stat st;
+	int fd = open(image_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		*error = "failed to open image";
+		if (fd >= 0)
+			close(fd);
+		return EXTRACT_CORRUPT;
+	}
+
+	// files that aren't PNG images are none of our business
+	struct chunk_iterator_ctx ctx;
+	int status = st.st_size < SIGNATURE_LENGTH ? 1 : chunk_iterator_init_ctx(&ctx, fd);
+	if (status) {
+		close(fd);
+		*error = "failed to read image";
+		return status > 0 ? EXTRACT_SKIPPED : EXTRACT_CORRUPT;
+	}
+
+	struct payload_sink sink;
+	payload_sink_init(&sink);
+
+	struct steg_stream_decoder decoder;
+	steg_stream_decoder_init(&decoder, &sink);
+
+	*error = NULL;
+	int has_next_chunk, sink_open = 0, IEND_found = 0;
+	while (!*error && (has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
+		if (has_next_chunk < 0 || chunk_iterator_next(&ctx)) {
+			*error = "image does not appear to represent a valid PNG file, or may be corrupted";
+			break;
 		}
 
 		if (!memcmp(ctx.current_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
-			IEND_found = 1;
+			IEND_found++;
+		if (memcmp(ctx.current_chunk.chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+			continue;
+
+		if (!sink_open) {
+			if (open_image_output(&sink, output_path, st.st_mode)) {
+				*error = "failed to open output file";
+				break;
+			}
+
+			sink_open = 1;
+		}
+
+		ssize_t bytes_read;
+		while (!*error && (bytes_read = chunk_iterator_read_data(&ctx, buffer, DEFLATE_STREAM_BUFFER_SIZE)) > 0) {
+			if (steg_stream_decoder_write(&decoder, buffer, bytes_read))
+				*error = decoder.error;
+		}
+
+		if (!*error && bytes_read < 0)
+			*error = "failed to read image";
 	}
 
-	(void)inflateEnd(&strm);
-	free(input_buffer);
-	free(output_buffer);
+	enum extract_status ret = finish_image(&sink, &decoder, sink_open, IEND_found, error);
+
+	steg_stream_decoder_destroy(&decoder);
 	chunk_iterator_destroy_ctx(&ctx);
+	close(fd);
 
-	if (!IEND_found)
-		DIE("non-compliant input file with no IEND chunk defined (does not conform to RFC 2083)");
+	return ret;
+}
 
-	// check that the input file actually contained embedded stEG chunks
-	struct stat tmp_file_st;
-	if (fstat(tmp_fd, &tmp_file_st) && errno == ENOENT)
-		FATAL("failed to stat tmp file with descriptor %s'", tmp_fd);
-	if (!tmp_file_st.st_size)
-		DIE("input file is clean; embedded data could not be found.");
+/**
+ * Set up the extraction of an image once its walk begins.
+ * */
+static void start_extract_slot(struct async_walk *walk, struct async_walk_file *file)
+{
+	struct async_extract *async = (struct async_extract *) walk->data;
+	struct extract_slot *slot = &async->slots[file->index];
+
+	slot->output_path = async->output_path;
+	slot->error = NULL;
+	slot->IEND_found = 0;
+	slot->sink_open = 0;
+	payload_sink_init(&slot->sink);
+	steg_stream_decoder_init(&slot->decoder, &slot->sink);
+}
+
+/**
+ * Count IEND chunks, and have the data of stEG chunks read, creating the output
+ * file of the image at the first.
+ * */
+static enum async_walk_action handle_extract_chunk(struct async_walk *walk, struct async_walk_file *file,
+		const struct png_chunk_detail *chunk)
+{
+	struct async_extract *async = (struct async_extract *) walk->data;
+	struct extract_slot *slot = &async->slots[file->index];
+
+	if (!memcmp(chunk->chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+		slot->IEND_found++;
+	if (memcmp(chunk->chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+		return ASYNC_WALK_NEXT;
 
-	if (show_hexdump) {
-		off_t offset = lseek(tmp_fd, 0, SEEK_SET);
-		if (offset < 0)
-			return -1;
+	if (!slot->sink_open) {
+		if (open_image_output(&slot->sink, slot->output_path, file->mode)) {
+			slot->error = "failed to open output file";
+			return ASYNC_WALK_STOP;
+		}
 
-		print_hex_dump(tmp_fd);
+		slot->sink_open = 1;
 	}
 
-	// write file to final destination
-	if (!show_hexdump || output_file) {
-		off_t offset = lseek(tmp_fd, 0, SEEK_SET);
-		if (offset < 0)
-			return -1;
+	return ASYNC_WALK_READ_DATA;
+}
 
-		struct stat input_file_st;
-		if (lstat(input_file, &input_file_st) && errno == ENOENT)
-			FATAL("failed to stat %s'", input_file);
+/**
+ * Decode a piece of stEG chunk data read from an image.
+ * */
+static int handle_extract_data(struct async_walk *walk, struct async_walk_file *file,
+		const unsigned char *data, size_t len)
+{
+	struct async_extract *async = (struct async_extract *) walk->data;
+	struct extract_slot *slot = &async->slots[file->index];
 
-		int out_fd = open(output_file_path.buff,  O_WRONLY | O_CREAT | O_TRUNC,
-				input_file_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
-		if (out_fd < 0)
-			DIE(FILE_OPEN_FAILED, output_file);
+	if (steg_stream_decoder_write(&slot->decoder, data, len)) {
+		slot->error = slot->decoder.error;
+		return 1;
+	}
 
-		if (copy_file_fd(out_fd, tmp_fd) != tmp_file_st.st_size)
-			FATAL("Failed to write to file %s", output_file_path.buff);
+	return 0;
+}
+
+/**
+ * Finish extracting an image once its walk has ended, and report its status,
+ * with the same result as extract_image() would have given.
+ * */
+static void finish_extract_slot(struct async_walk *walk, struct async_walk_file *file,
+		enum async_walk_status status)
+{
+	struct async_extract *async = (struct async_extract *) walk->data;
+	struct extract_slot *slot = &async->slots[file->index];
+
+	enum extract_status ret = EXTRACT_OK;
+	const char *error = NULL;
+	if (status == ASYNC_WALK_STOPPED)
+		error = slot->error;
+	else if (status == ASYNC_WALK_READ_FAILED)
+		error = "failed to read image";
+	else if (status == ASYNC_WALK_CORRUPT)
+		error = "image does not appear to represent a valid PNG file, or may be corrupted";
+
+	// files that aren't PNG images are none of our business
+	if (status == ASYNC_WALK_NOT_PNG) {
+		payload_sink_rollback(&slot->sink);
+		ret = EXTRACT_SKIPPED;
+	} else {
+		errno = 0;
+		ret = finish_image(&slot->sink, &slot->decoder, slot->sink_open, slot->IEND_found, &error);
 	}
 
-	close(in_fd);
-	close(tmp_fd);
-	strbuf_release(&output_file_path);
+	report_image(async->state, file->path.buff, ret, error);
+	steg_stream_decoder_destroy(&slot->decoder);
+}
 
-	return 0;
+static const struct async_walk_ops extract_walk_ops = {
+		.start = start_extract_slot,
+		.chunk = handle_extract_chunk,
+		.data = handle_extract_data,
+		.finish = finish_extract_slot
+};
+
+/**
+ * Set up an asynchronous extraction on the calling worker, with room for
+ * `depth` images at once.
+ *
+ * Returns NULL if io_uring is unavailable, in which case images must be
+ * extracted with extract_image() instead.
+ * */
+static struct async_extract *async_extract_new(struct recursive_extract *state, size_t depth)
+{
+	struct async_extract *async = (struct async_extract *) malloc(sizeof(struct async_extract));
+	if (!async)
+		FATAL(MEM_ALLOC_FAILED);
+
+	async->state = state;
+	if (async_walk_init(&async->walk, depth, DEFLATE_STREAM_BUFFER_SIZE, &extract_walk_ops, async)) {
+		free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+/**
+ * Begin extracting an image asynchronously. If every slot is taken, this waits
+ * for one of the images being extracted to finish first. The output path must
+ * remain valid until the image is finished.
+ * */
+static void async_extract_add(struct async_extract *async, const char *image_path, const char *output_path)
+{
+	// files too short to hold a signature aren't PNGs
+	async->output_path = output_path;
+	if (async_walk_add(&async->walk, image_path) < 0)
+		report_image(async->state, image_path, EXTRACT_CORRUPT, "failed to open image");
+}
+
+/**
+ * Tear down the walk. Every image must have been finished first.
+ * */
+static void async_extract_destroy(struct async_extract *async)
+{
+	async_walk_destroy(&async->walk);
+	free(async);
+}
+
+/**
+ * Thread pool job that extracts a batch of images of the tree, prints the
+ * status of each, and frees up its slot. The images are read through an
+ * io_ring if possible, and synchronously otherwise.
+ * */
+static void run_recursive_job(void *arg)
+{
+	struct recursive_job *job = (struct recursive_job *) arg;
+	struct recursive_extract *state = job->state;
+
+	// rings are set up once per worker at most, rather than once per job
+	struct async_extract *async = NULL;
+	if (state->use_io_ring && job->len > 1) {
+		pthread_mutex_lock(&state->lock);
+		async = state->idle;
+		if (async)
+			state->idle = async->next;
+		pthread_mutex_unlock(&state->lock);
+
+		if (!async)
+			async = async_extract_new(state, state->batch_len);
+	}
+
+	if (async) {
+		for (size_t i = 0; i < job->len; i++)
+			async_extract_add(async, job->image_paths[i], job->output_paths[i]);
+		async_walk_finish(&async->walk);
+
+		pthread_mutex_lock(&state->lock);
+		async->next = state->idle;
+		state->idle = async;
+		pthread_mutex_unlock(&state->lock);
+	} else {
+		unsigned char *buffer = (unsigned char *) malloc(sizeof(unsigned char) * DEFLATE_STREAM_BUFFER_SIZE);
+		if (!buffer)
+			FATAL(MEM_ALLOC_FAILED);
+
+		for (size_t i = 0; i < job->len; i++) {
+			const char *error = NULL;
+			enum extract_status status = extract_image(job->image_paths[i], job->output_paths[i], buffer, &error);
+			report_image(state, job->image_paths[i], status, error);
+		}
+
+		free(buffer);
+	}
+
+	pthread_mutex_lock(&state->lock);
+	state->in_flight--;
+	pthread_cond_signal(&state->slot_free);
+	pthread_mutex_unlock(&state->lock);
+
+	for (size_t i = 0; i < job->len; i++) {
+		free(job->image_paths[i]);
+		free(job->output_paths[i]);
+	}
+	free(job);
+}
+
+/**
+ * Queue the job being filled by the walk, if any, first waiting for a slot if
+ * too many jobs are already in flight.
+ * */
+static void submit_pending(struct recursive_extract *state)
+{
+	struct recursive_job *job = state->pending;
+	if (!job)
+		return;
+
+	state->pending = NULL;
+
+	pthread_mutex_lock(&state->lock);
+	while (state->in_flight >= state->max_in_flight)
+		pthread_cond_wait(&state->slot_free, &state->lock);
+	state->in_flight++;
+	pthread_mutex_unlock(&state->lock);
+
+	thread_pool_submit(&state->pool, run_recursive_job, job);
+}
+
+/**
+ * Add the image at `image_path` to the job being filled by the walk, and queue
+ * the job once full.
+ * */
+static void submit_image(struct recursive_extract *state, const char *image_path, const char *output_path)
+{
+	struct recursive_job *job = state->pending;
+	if (!job) {
+		job = (struct recursive_job *) malloc(sizeof(struct recursive_job));
+		if (!job)
+			FATAL(MEM_ALLOC_FAILED);
+
+		job->state = state;
+		job->len = 0;
+		state->pending = job;
+	}
+
+	struct strbuf path;
+	strbuf_init(&path);
+	strbuf_attach_fmt(&path, "%s.out", output_path);
+
+	job->output_paths[job->len] = strbuf_detach(&path);
+	job->image_paths[job->len] = strdup(image_path);
+	if (!job->image_paths[job->len++])
+		FATAL(MEM_ALLOC_FAILED);
+
+	if (job->len >= state->batch_len)
+		submit_pending(state);
 }
 
 /**
- * Print a hexdump of a given open file. The hexdump is formatted similar to
- * the hexdump tool.
+ * Walk the directory `image_dir`, submitting every regular file for extraction
+ * and descending into subdirectories. `output_dir` is the matching directory of
+ * the output tree. Both are restored before returning. Symbolic links are never
+ * followed, so that the walk can't loop.
  * */
-static void print_hex_dump(int fd)
+static void walk_directory(struct recursive_extract *state, struct strbuf *image_dir, struct strbuf *output_dir)
 {
-	unsigned char buffer[4096];
+	DIR *dir = opendir(image_dir->buff);
+	if (!dir) {
+		WARN("unable to read directory '%s'", image_dir->buff);
+		pthread_mutex_lock(&state->lock);
+		state->corrupt++;
+		pthread_mutex_unlock(&state->lock);
+		return;
+	}
+
+	size_t image_dir_len = image_dir->len;
+	size_t output_dir_len = output_dir->len;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		strbuf_remove(image_dir, image_dir_len, image_dir->len - image_dir_len);
+		strbuf_remove(output_dir, output_dir_len, output_dir->len - output_dir_len);
+		if (image_dir_len && image_dir->buff[image_dir_len - 1] != '/')
+			strbuf_attach_chr(image_dir, '/');
+		if (output_dir_len && output_dir->buff[output_dir_len - 1] != '/')
+			strbuf_attach_chr(output_dir, '/');
+		strbuf_attach_str(image_dir, entry->d_name);
+		strbuf_attach_str(output_dir, entry->d_name);
+
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(image_dir->buff, &st))
+				continue;
+
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR)
+			walk_directory(state, image_dir, output_dir);
+		else if (type == DT_REG)
+			submit_image(state, image_dir->buff, output_dir->buff);
+	}
+
+	strbuf_remove(image_dir, image_dir_len, image_dir->len - image_dir_len);
+	strbuf_remove(output_dir, output_dir_len, output_dir->len - output_dir_len);
+	closedir(dir);
+}
 
-	off_t file_offset = 0;
-	ssize_t bytes_read = 0;
-	while ((bytes_read = recoverable_read(fd, buffer, 4096)) > 0) {
-		hex_dump(stdout, file_offset, buffer, bytes_read);
-		file_offset += bytes_read;
+/**
+ * Parse a range of the form OFFSET:LEN, where both are non-negative integers.
+ *
+ * Returns zero if successful, and -1 if the range is malformed.
+ * */
+static int parse_range(const char *range, off_t *offset, off_t *len)
+{
+	char *end = NULL;
+
+	errno = 0;
+	long long value = strtoll(range, &end, 0);
+	if (errno || end == range || *end != ':' || value < 0)
+		return -1;
+	*offset = (off_t) value;
+
+	range = end + 1;
+	value = strtoll(range, &end, 0);
+	if (errno || end == range || *end || value < 0)
+		return -1;
+	*len = (off_t) value;
+
+	return 0;
+}
+
+/**
+ * Decode a piece of stEG chunk data into the sink, dying if the embedded data
+ * is corrupt.
+ * */
+static void decode_chunk_data(struct steg_stream_decoder *decoder, struct payload_sink *sink,
+		const unsigned char *data, size_t len)
+{
+	if (steg_stream_decoder_write(decoder, data, len)) {
+		payload_sink_rollback(sink);
+		DIE("failed to extract embedded data: %s", decoder->error);
 	}
 }
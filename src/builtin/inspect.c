@@ -6,12 +6,15 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 
+#include "digest.h"
 #include "parse-options.h"
 #include "str-array.h"
 #include "png-chunk-processor.h"
+#include "steg-index.h"
+#include "thread-pool.h"
 #include "utils.h"
 
-static int print_png_summary(const char *, struct str_array *, int, int, int);
+static int print_png_summary(const char *, struct str_array *, int, int, int, enum digest_type);
 static int print_machine_friendly_summary(const char *, struct str_array *, int, int, int);
 
 int cmd_inspect(int argc, char *argv[])
@@ -20,12 +23,13 @@ int cmd_inspect(int argc, char *argv[])
 	int ancillary = 0, critical = 0;
 	int machine = 0, nul = 0;
 	int help = 0;
+	const char *digest_algorithm = NULL;
 
 	struct str_array filter_list;
 	str_array_init(&filter_list);
 
 	const struct usage_string inspect_cmd_usage[] = {
-			USAGE("steg-png inspect [(--filter <chunk type>)...] [--critical] [--ancillary] [--hexdump] <file>"),
+			USAGE("steg-png inspect [(--filter <chunk type>)...] [--critical] [--ancillary] [--hexdump] [--digest <algorithm>] <file>"),
 			USAGE("steg-png inspect (-i | --interactive) <file>"),
 			USAGE("steg-png inspect (-h | --help)"),
 			USAGE_END()
@@ -38,6 +42,7 @@ int cmd_inspect(int argc, char *argv[])
 			OPT_LONG_BOOL("ancillary", "show ancillary chunks", &ancillary),
 			OPT_LONG_BOOL("machine-readable", "show output in machine-readable format", &machine),
 			OPT_BOOL('z', "nul", "terminate lines with NUL byte instead of line feed", &nul),
+			OPT_LONG_STRING("digest", "algorithm", "summarize the file with an md5 (default), xxh3 or blake3 digest", &digest_algorithm),
 			OPT_BOOL('h', "help", "show help and exit", &help),
 			OPT_END()
 	};
@@ -73,11 +78,24 @@ int cmd_inspect(int argc, char *argv[])
 		return 1;
 	}
 
+	if (machine && digest_algorithm) {
+		show_usage_with_options(inspect_cmd_usage, inspect_cmd_options, 1, "--digest has no effect with --machine-readable");
+		str_array_release(&filter_list);
+		return 1;
+	}
+
+	enum digest_type digest_type = DIGEST_MD5;
+	if (digest_algorithm && digest_type_from_name(digest_algorithm, &digest_type)) {
+		show_usage_with_options(inspect_cmd_usage, inspect_cmd_options, 1, "unknown digest algorithm '%s'", digest_algorithm);
+		str_array_release(&filter_list);
+		return 1;
+	}
+
 	int ret;
 	if (machine)
 		ret = print_machine_friendly_summary(argv[0], &filter_list, critical, ancillary, nul);
 	else
-		ret = print_png_summary(argv[0], &filter_list, hexdump, critical, ancillary);
+		ret = print_png_summary(argv[0], &filter_list, hexdump, critical, ancillary, digest_type);
 
 	str_array_release(&filter_list);
 
@@ -85,12 +103,15 @@ int cmd_inspect(int argc, char *argv[])
 }
 
 static int chunk_filtered(struct chunk_iterator_ctx *, struct str_array *, int, int);
-static void get_chunk_types(int, struct str_array *);
+static int get_chunk_types(int, struct str_array *, enum digest_type, unsigned char []);
 static void print_filter_summary(struct str_array *, int, int);
+static int read_steg_index(struct chunk_iterator_ctx *, struct steg_index *,
+		struct str_array *, int, int);
+static int advance_chunk(struct chunk_iterator_ctx *, struct steg_index *, size_t *);
 
 /**
  * png file summary:
- * <filename> <file mode> <file length> <md5 hash>
+ * <filename> <file mode> <file length> <digest>
  * chunks: <>, ...
  *
  * showing chunks that [have the type (...)], and [are critical] [or ancillary]
@@ -105,11 +126,8 @@ static void print_filter_summary(struct str_array *, int, int);
  * ...
  * */
 static int print_png_summary(const char *file_path, struct str_array *types,
-		int hexdump, int show_critical, int show_ancillary)
+		int hexdump, int show_critical, int show_ancillary, enum digest_type digest_type)
 {
-	fprintf(stdout, "png file summary:\n");
-	print_file_summary(file_path, 0);
-
 	int fd = open(file_path, O_RDONLY);
 	if (fd < 0)
 		DIE(FILE_OPEN_FAILED, file_path);
@@ -118,7 +136,15 @@ static int print_png_summary(const char *file_path, struct str_array *types,
 	str_array_init(&chunks);
 	chunks.free_data = 1;
 
-	get_chunk_types(fd, &chunks);
+	// the file is hashed while its chunk types are tallied, if it can be mapped
+	unsigned char hash[DIGEST_MAX_SIZE];
+	int hashed = get_chunk_types(fd, &chunks, digest_type, hash);
+
+	fprintf(stdout, "png file summary:\n");
+	if (hashed)
+		print_file_summary_with_digest(file_path, digest_type, hash, 0);
+	else
+		print_file_summary(file_path, digest_type, 0);
 
 	fprintf(stdout, "chunks: ");
 	for (size_t i = 0; i < chunks.len; i++) {
@@ -143,20 +169,17 @@ static int print_png_summary(const char *file_path, struct str_array *types,
 		FATAL("failed to set the file offset for temporary file");
 
 	struct chunk_iterator_ctx ctx;
-	int ret = chunk_iterator_init_ctx(&ctx, fd);
+	int ret = chunk_iterator_init_mmap_ctx(&ctx, fd);
 	if (ret < 0)
 		FATAL("failed to read from file descriptor");
 	else if(ret > 0)
 		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
-	int has_next_chunk;
-	while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
-		if (has_next_chunk < 0)
-			DIE("unable to parse input file: file does not appear to represent a valid PNG file, or may be corrupted.");
-
-		if (chunk_iterator_next(&ctx) != 0)
-			FATAL("unable to advance png chunk iterator: inconsistent state, possibly corrupted file.");
+	struct steg_index index;
+	int indexed = read_steg_index(&ctx, &index, types, show_critical, show_ancillary);
 
+	size_t visited = 0;
+	while (advance_chunk(&ctx, indexed ? &index : NULL, &visited)) {
 		if (chunk_filtered(&ctx, types, show_critical, show_ancillary))
 			continue;
 
@@ -190,6 +213,7 @@ static int print_png_summary(const char *file_path, struct str_array *types,
 		fprintf(stdout, "\n");
 	}
 
+	steg_index_release(&index);
 	chunk_iterator_destroy_ctx(&ctx);
 
 	close(fd);
@@ -206,19 +230,17 @@ static int print_machine_friendly_summary(const char *file_path, struct str_arra
 		DIE(FILE_OPEN_FAILED, file_path);
 
 	struct chunk_iterator_ctx ctx;
-	int ret = chunk_iterator_init_ctx(&ctx, fd);
+	int ret = chunk_iterator_init_mmap_ctx(&ctx, fd);
 	if (ret < 0)
 		FATAL("failed to read from file descriptor");
 	else if(ret > 0)
 		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
-	int has_next_chunk;
-	while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
-		if (has_next_chunk < 0)
-			DIE("unable to parse input file: file does not appear to represent a valid PNG file, or may be corrupted.");
-		if (chunk_iterator_next(&ctx) != 0)
-			FATAL("unable to advance png chunk iterator: inconsistent state, possibly corrupted file.");
+	struct steg_index index;
+	int indexed = read_steg_index(&ctx, &index, types, show_critical, show_ancillary);
 
+	size_t visited = 0;
+	while (advance_chunk(&ctx, indexed ? &index : NULL, &visited)) {
 		if (chunk_filtered(&ctx, types, show_critical, show_ancillary))
 			continue;
 
@@ -236,6 +258,7 @@ static int print_machine_friendly_summary(const char *file_path, struct str_arra
 		fprintf(stdout, "%c", nul_term ? 0 : '\n');
 	}
 
+	steg_index_release(&index);
 	chunk_iterator_destroy_ctx(&ctx);
 
 	close(fd);
@@ -266,15 +289,101 @@ static int chunk_filtered(struct chunk_iterator_ctx *ctx, struct str_array *type
 	return filtered;
 }
 
-static void get_chunk_types(int fd, struct str_array *types)
+/**
+ * If only stEG chunks are to be shown, and the image carries a stIX chunk
+ * listing them, read the index so that those chunks can be visited directly
+ * instead of walking the whole file. Every entry is checked against the file
+ * before anything is shown.
+ *
+ * Returns 1 if the index should be used. Otherwise, returns 0 and rewinds the
+ * iterator to the first chunk. The index must be released in either case.
+ * */
+static int read_steg_index(struct chunk_iterator_ctx *ctx, struct steg_index *index,
+		struct str_array *types, int show_critical, int show_ancillary)
+{
+	steg_index_init(index, 0);
+
+	int only_steg_chunks = types->len > 0 && !(show_critical && !show_ancillary);
+	for (size_t i = 0; i < types->len; i++) {
+		if (strcmp(str_array_get(types, i), "stEG") != 0)
+			only_steg_chunks = 0;
+	}
+
+	if (!only_steg_chunks || chunk_iterator_is_stream(ctx))
+		return 0;
+
+	int ret = steg_index_read(index, ctx);
+	if (ret < 0)
+		WARN("stIX chunk is corrupt; falling back to reading the whole file");
+
+	for (size_t i = 0; !ret && i < index->len; i++) {
+		if (steg_index_seek(index, i, ctx)) {
+			WARN("stIX chunk doesn't match the file; falling back to reading the whole file");
+			ret = -1;
+		}
+	}
+
+	if (!ret)
+		return 1;
+
+	if (chunk_iterator_seek(ctx, SIGNATURE_LENGTH) < 0)
+		FATAL("unable to advance png chunk iterator: inconsistent state, possibly corrupted file.");
+
+	return 0;
+}
+
+/**
+ * Advance the iterator to the next chunk to show. If `index` is non-null, only
+ * the chunks listed in the index are visited, and `visited` tracks the number
+ * of entries visited so far.
+ *
+ * Returns 1 if the iterator was advanced, and 0 once there are no chunks left.
+ * */
+static int advance_chunk(struct chunk_iterator_ctx *ctx, struct steg_index *index, size_t *visited)
+{
+	if (index) {
+		if (*visited == index->len)
+			return 0;
+		if (steg_index_seek(index, (*visited)++, ctx))
+			FATAL("unable to advance png chunk iterator: inconsistent state, possibly corrupted file.");
+
+		return 1;
+	}
+
+	int has_next_chunk = chunk_iterator_has_next(ctx);
+	if (has_next_chunk < 0)
+		DIE("unable to parse input file: file does not appear to represent a valid PNG file, or may be corrupted.");
+	if (!has_next_chunk)
+		return 0;
+
+	if (chunk_iterator_next(ctx) != 0)
+		FATAL("unable to advance png chunk iterator: inconsistent state, possibly corrupted file.");
+
+	return 1;
+}
+
+/**
+ * Tally the types of the chunks of the image open as `fd`. If the image can be
+ * mapped, it's hashed along the way with the given algorithm, and its digest
+ * written to `hash`.
+ *
+ * Returns 1 if the image was hashed, and zero otherwise.
+ * */
+static int get_chunk_types(int fd, struct str_array *types, enum digest_type digest_type,
+		unsigned char hash[])
 {
 	struct chunk_iterator_ctx ctx;
-	int ret = chunk_iterator_init_ctx(&ctx, fd);
+	int ret = chunk_iterator_init_mmap_ctx(&ctx, fd);
 	if (ret < 0)
 		FATAL("failed to read from file descriptor");
 	else if(ret > 0)
 		DIE("input file is not a PNG (does not conform to RFC 2083)");
 
+	struct digest_ctx digest;
+	digest_init(&digest, digest_type);
+	digest_set_threads(&digest, thread_pool_cpu_count());
+	int hashed = !chunk_iterator_begin_digest(&ctx, &digest);
+
 	char type[CHUNK_TYPE_LENGTH + 1] = {0};
 	int has_next_chunk;
 	while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
@@ -309,7 +418,11 @@ static void get_chunk_types(int fd, struct str_array *types)
 		}
 	}
 
+	if (hashed)
+		chunk_iterator_finish_digest(&ctx, hash);
+
 	chunk_iterator_destroy_ctx(&ctx);
+	return hashed;
 }
 
 static void print_filter_summary(struct str_array *types, int show_critical, int show_ancillary)
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "async-walk.h"
+#include "digest.h"
+#include "io-ring.h"
+#include "md5-mb.h"
+#include "parse-options.h"
+#include "png-chunk-processor.h"
+#include "steg-index.h"
+#include "strbuf.h"
+#include "thread-pool.h"
+#include "utils.h"
+
+/**
+ * State shared by every worker of a scan. Matching paths are printed as they
+ * are found (or as each batch is hashed, with a digest), so output and
+ * counters are guarded by the same lock.
+ * */
+struct scan_state {
+	struct thread_pool pool;
+	int use_io_ring;
+	size_t queue_depth;
+
+	// if set, matching files are hashed, and printed with their digest
+	int digest_selected;
+	enum digest_type digest_type;
+	size_t digest_batch;
+
+	pthread_mutex_t lock;
+	unsigned long files_scanned;
+	unsigned long files_matched;
+	unsigned long errors;
+};
+
+/**
+ * A directory waiting to be walked by one of the workers.
+ * */
+struct scan_dir_job {
+	struct scan_state *state;
+	char *path;
+};
+
+#define SCAN_QUEUE_DEPTH ASYNC_WALK_MAX_DEPTH
+#define SCAN_RESERVED_FDS 3
+
+/**
+ * Matching files waiting to be hashed. Each thread collects up to
+ * `digest_batch` of them before hashing them together with
+ * compute_file_digests(), so that MD5 digests are computed in lockstep.
+ * */
+struct scan_matches {
+	size_t len;
+	int fds[MD5_MB_LANES];
+	char *paths[MD5_MB_LANES];
+};
+
+/**
+ * Files being scanned asynchronously by a single thread (see async-walk.h).
+ * Only chunk headers are read, and each walk stops at the first stEG chunk.
+ * */
+struct async_scan {
+	struct scan_state *state;
+	struct scan_matches *matches;
+	struct async_walk walk;
+};
+
+static int quiet = 0;
+
+static void submit_directory(struct scan_state *, const char *);
+static void scan_file(struct scan_state *, struct scan_matches *, const char *);
+static void flush_matches(struct scan_state *, struct scan_matches *);
+static struct async_scan *async_scan_new(struct scan_state *, struct scan_matches *);
+static void async_scan_add(struct async_scan *, const char *);
+static void async_scan_finish(struct async_scan *);
+
+int cmd_scan(int argc, char *argv[])
+{
+	long threads = 0;
+	int help = 0;
+	const char *digest_algorithm = NULL;
+
+	const struct usage_string scan_cmd_usage[] = {
+			USAGE("steg-png scan [--threads <n>] [--digest <algorithm>] [(-q | --quiet)] <path>..."),
+			USAGE("steg-png scan (-h | --help)"),
+			USAGE_END()
+	};
+
+	const struct command_option scan_cmd_options[] = {
+			OPT_LONG_INT("threads", "scan using <n> threads (0 for one per processor, default 0)", &threads),
+			OPT_LONG_STRING("digest", "algorithm", "print the md5, xxh3 or blake3 digest of each matching file", &digest_algorithm),
+			OPT_BOOL('q', "quiet", "don't report the scan rate to stderr", &quiet),
+			OPT_BOOL('h', "help", "show help and exit", &help),
+			OPT_END()
+	};
+
+	argc = parse_options(argc, argv, scan_cmd_options, 0, 1);
+	if (help) {
+		show_usage_with_options(scan_cmd_usage, scan_cmd_options, 0, NULL);
+		return 0;
+	}
+
+	if (argc < 1) {
+		show_usage_with_options(scan_cmd_usage, scan_cmd_options, 1, "nothing to do");
+		return 1;
+	}
+
+	if (threads < 0) {
+		show_usage_with_options(scan_cmd_usage, scan_cmd_options, 1, "invalid number of threads %ld", threads);
+		return 1;
+	}
+
+	enum digest_type digest_type = DIGEST_MD5;
+	if (digest_algorithm && digest_type_from_name(digest_algorithm, &digest_type)) {
+		show_usage_with_options(scan_cmd_usage, scan_cmd_options, 1, "unknown digest algorithm '%s'", digest_algorithm);
+		return 1;
+	}
+
+	if (!threads)
+		threads = thread_pool_cpu_count();
+
+	struct timeval start, end;
+	if (gettimeofday(&start, NULL))
+		FATAL("gettimeofday failed unexpectedly");
+
+	struct scan_state state = {
+			.digest_selected = digest_algorithm != NULL,
+			.digest_type = digest_type,
+			.digest_batch = digest_type == DIGEST_MD5 ? MD5_MB_LANES : 1,
+			.files_scanned = 0,
+			.files_matched = 0,
+			.errors = 0
+	};
+
+	if (pthread_mutex_init(&state.lock, NULL))
+		FATAL("failed to initialize scan lock");
+
+	// when io_uring is unavailable, every file is scanned synchronously
+	struct io_ring probe;
+	state.use_io_ring = !io_ring_init(&probe, 1);
+	io_ring_destroy(&probe);
+	errno = 0;
+
+	/*
+	 * Every file being scanned asynchronously holds a descriptor, so limit the
+	 * queue depth such that every worker, and the main thread, can fill its
+	 * queue without running out of descriptors. Each also needs one for its
+	 * ring, one for the directory it's walking, and one for each matching file
+	 * waiting to be hashed.
+	 * */
+	struct rlimit limit;
+	state.queue_depth = SCAN_QUEUE_DEPTH;
+	if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY) {
+		rlim_t reserved = SCAN_RESERVED_FDS + (state.digest_selected ? state.digest_batch : 0);
+		rlim_t per_thread = limit.rlim_cur / (rlim_t) (threads + 1);
+		per_thread = per_thread > reserved ? per_thread - reserved : 0;
+		if (per_thread < state.queue_depth)
+			state.queue_depth = (size_t) per_thread;
+	}
+
+	if (state.queue_depth < 2)
+		state.use_io_ring = 0;
+
+	/*
+	 * Every directory is walked by a job on the pool, which queues a new job
+	 * for each subdirectory it finds, so the walk fans out across the workers.
+	 * Files named on the command line are scanned up front.
+	 * */
+	thread_pool_init(&state.pool, (unsigned int) threads);
+	struct async_scan *scan = NULL;
+	struct scan_matches matches = { .len = 0 };
+	for (int i = 0; i < argc; i++) {
+		struct stat st;
+		if (stat(argv[i], &st)) {
+			WARN("unable to scan '%s'", argv[i]);
+			pthread_mutex_lock(&state.lock);
+			state.errors++;
+			pthread_mutex_unlock(&state.lock);
+		} else if (S_ISDIR(st.st_mode)) {
+			submit_directory(&state, argv[i]);
+		} else if (S_ISREG(st.st_mode)) {
+			if (!scan)
+				scan = async_scan_new(&state, &matches);
+			if (scan)
+				async_scan_add(scan, argv[i]);
+			else
+				scan_file(&state, &matches, argv[i]);
+		}
+	}
+
+	if (scan)
+		async_scan_finish(scan);
+	flush_matches(&state, &matches);
+
+	thread_pool_wait(&state.pool);
+	thread_pool_destroy(&state.pool);
+	pthread_mutex_destroy(&state.lock);
+
+	if (fflush(stdout))
+		FATAL("failed to write to stdout");
+	if (gettimeofday(&end, NULL))
+		FATAL("gettimeofday failed unexpectedly");
+
+	double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_usec - start.tv_usec) / 1e6;
+	if (!quiet)
+		fprintf(stderr, "scanned %lu files in %.2f seconds (%.0f files/s), %lu with embedded data\n",
+				state.files_scanned, elapsed, elapsed > 0 ? (double) state.files_scanned / elapsed : 0.0,
+				state.files_matched);
+
+	return state.errors ? 1 : 0;
+}
+
+/**
+ * Walk the chunk headers of the PNG image open as `fd`, stopping at the first
+ * stEG chunk. Chunk data is never read.
+ *
+ * Returns 1 if the image carries a stEG chunk, zero if it doesn't or isn't a
+ * PNG at all, and -1 if it couldn't be read. Malformed images are reported and
+ * treated as carrying no stEG chunk.
+ * */
+static int find_steg_chunk(int fd, const char *path)
+{
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_header_ctx(&ctx, fd);
+	if (status)
+		return status < 0 ? -1 : 0;
+
+	int ret = 0, has_next_chunk;
+	while ((has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
+		if (has_next_chunk < 0 || chunk_iterator_next(&ctx)) {
+			errno = 0;
+			WARN("'%s' does not appear to represent a valid PNG file, or may be corrupted", path);
+			break;
+		}
+
+		if (!memcmp(ctx.current_chunk.chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH)) {
+			ret = 1;
+			break;
+		}
+	}
+
+	chunk_iterator_destroy_ctx(&ctx);
+	return ret;
+}
+
+/**
+ * Record the result of scanning a file, as returned by find_steg_chunk(), and
+ * print its path, terminated by a NUL byte, if it carries embedded data. If a
+ * digest was selected, the file open as `fd` is instead added to `matches`,
+ * to be hashed and printed once the batch is full (see flush_matches()).
+ * */
+static void report_file(struct scan_state *state, struct scan_matches *matches, const char *path,
+		int fd, int ret)
+{
+	if (ret > 0 && state->digest_selected) {
+		int match_fd = dup(fd);
+		if (match_fd >= 0 && lseek(match_fd, 0, SEEK_SET) >= 0) {
+			matches->fds[matches->len] = match_fd;
+			matches->paths[matches->len] = strdup(path);
+			if (!matches->paths[matches->len++])
+				FATAL(MEM_ALLOC_FAILED);
+
+			pthread_mutex_lock(&state->lock);
+			state->files_scanned++;
+			pthread_mutex_unlock(&state->lock);
+
+			if (matches->len >= state->digest_batch)
+				flush_matches(state, matches);
+			return;
+		}
+
+		if (match_fd >= 0)
+			close(match_fd);
+		ret = -1;
+	}
+
+	if (ret < 0)
+		WARN("unable to scan '%s'", path);
+
+	pthread_mutex_lock(&state->lock);
+	state->files_scanned++;
+	if (ret < 0)
+		state->errors++;
+	if (ret > 0) {
+		state->files_matched++;
+		fwrite(path, 1, strlen(path) + 1, stdout);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Hash the matching files waiting in `matches`, and print each path, terminated
+ * by a NUL byte, after its digest and two spaces, like the output of md5sum.
+ * */
+static void flush_matches(struct scan_state *state, struct scan_matches *matches)
+{
+	if (!matches->len)
+		return;
+
+	unsigned char hashes[MD5_MB_LANES][DIGEST_MAX_SIZE];
+	int failed[MD5_MB_LANES];
+	compute_file_digests(matches->fds, matches->len, state->digest_type, hashes, failed);
+
+	for (size_t i = 0; i < matches->len; i++) {
+		close(matches->fds[i]);
+		if (failed[i])
+			WARN("unable to scan '%s'", matches->paths[i]);
+	}
+
+	pthread_mutex_lock(&state->lock);
+	for (size_t i = 0; i < matches->len; i++) {
+		if (failed[i]) {
+			state->errors++;
+			continue;
+		}
+
+		state->files_matched++;
+		print_digest(stdout, state->digest_type, hashes[i]);
+		fputs("  ", stdout);
+		fwrite(matches->paths[i], 1, strlen(matches->paths[i]) + 1, stdout);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	for (size_t i = 0; i < matches->len; i++)
+		free(matches->paths[i]);
+	matches->len = 0;
+}
+
+/**
+ * Scan a single file synchronously.
+ * */
+static void scan_file(struct scan_state *state, struct scan_matches *matches, const char *path)
+{
+	int ret = -1;
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		// files too short to hold a signature aren't PNGs, rather than unreadable
+		struct stat st;
+		if (!fstat(fd, &st))
+			ret = st.st_size < SIGNATURE_LENGTH ? 0 : find_steg_chunk(fd, path);
+	}
+
+	report_file(state, matches, path, fd, ret);
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * Stop the walk of a file being scanned asynchronously at its first stEG chunk.
+ * */
+static enum async_walk_action handle_scan_chunk(struct async_walk *walk, struct async_walk_file *file,
+		const struct png_chunk_detail *chunk)
+{
+	if (!memcmp(chunk->chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+		return ASYNC_WALK_STOP;
+
+	return ASYNC_WALK_NEXT;
+}
+
+/**
+ * Report a file scanned asynchronously, with the same result as
+ * find_steg_chunk() would have given.
+ * */
+static void finish_scan_file(struct async_walk *walk, struct async_walk_file *file,
+		enum async_walk_status status)
+{
+	struct async_scan *scan = (struct async_scan *) walk->data;
+
+	int ret = 0;
+	if (status == ASYNC_WALK_STOPPED)
+		ret = 1;
+	else if (status == ASYNC_WALK_READ_FAILED)
+		ret = -1;
+	else if (status == ASYNC_WALK_CORRUPT)
+		WARN("'%s' does not appear to represent a valid PNG file, or may be corrupted", file->path.buff);
+
+	report_file(scan->state, scan->matches, file->path.buff, file->fd, ret);
+}
+
+static const struct async_walk_ops scan_walk_ops = {
+		.chunk = handle_scan_chunk,
+		.finish = finish_scan_file
+};
+
+/**
+ * Set up an asynchronous scan on the calling thread.
+ *
+ * Returns NULL if io_uring is unavailable, in which case files must be scanned
+ * with scan_file() instead.
+ * */
+static struct async_scan *async_scan_new(struct scan_state *state, struct scan_matches *matches)
+{
+	if (!state->use_io_ring)
+		return NULL;
+
+	struct async_scan *scan = (struct async_scan *) malloc(sizeof(struct async_scan));
+	if (!scan)
+		FATAL(MEM_ALLOC_FAILED);
+
+	scan->state = state;
+	scan->matches = matches;
+	if (async_walk_init(&scan->walk, state->queue_depth, 0, &scan_walk_ops, scan)) {
+		free(scan);
+		return NULL;
+	}
+
+	return scan;
+}
+
+/**
+ * Begin scanning a file asynchronously. If every slot is taken, this waits for
+ * one of the files being scanned to finish first.
+ * */
+static void async_scan_add(struct async_scan *scan, const char *path)
+{
+	int ret = async_walk_add(&scan->walk, path);
+	if (ret)
+		report_file(scan->state, scan->matches, path, -1, ret < 0 ? -1 : 0);
+}
+
+/**
+ * Wait for every file being scanned to finish, and tear down the scan.
+ * */
+static void async_scan_finish(struct async_scan *scan)
+{
+	async_walk_finish(&scan->walk);
+	async_walk_destroy(&scan->walk);
+	free(scan);
+}
+
+/**
+ * Walk a directory, scanning the regular files it holds and queueing its
+ * subdirectories. Symbolic links are never followed, so that the walk can't
+ * loop. Files are scanned asynchronously where io_uring is available (see
+ * struct async_scan). Runs on a worker of the pool.
+ * */
+static void scan_directory(void *arg)
+{
+	struct scan_dir_job *job = (struct scan_dir_job *) arg;
+	struct scan_state *state = job->state;
+
+	DIR *dir = opendir(job->path);
+	if (!dir) {
+		WARN("unable to scan '%s'", job->path);
+		pthread_mutex_lock(&state->lock);
+		state->errors++;
+		pthread_mutex_unlock(&state->lock);
+
+		free(job->path);
+		free(job);
+		return;
+	}
+
+	struct strbuf path;
+	strbuf_init(&path);
+
+	// the scan is only set up once the directory turns out to hold files
+	struct async_scan *scan = NULL;
+	struct scan_matches matches = { .len = 0 };
+	int use_io_ring = state->use_io_ring;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		strbuf_clear(&path);
+		strbuf_attach_str(&path, job->path);
+		if (path.len && path.buff[path.len - 1] != '/')
+			strbuf_attach_chr(&path, '/');
+		strbuf_attach_str(&path, entry->d_name);
+
+		// only stat entries whose type the filesystem doesn't report
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(path.buff, &st))
+				continue;
+
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			submit_directory(state, path.buff);
+		} else if (type == DT_REG) {
+			if (!scan && use_io_ring)
+				use_io_ring = (scan = async_scan_new(state, &matches)) != NULL;
+
+			if (scan)
+				async_scan_add(scan, path.buff);
+			else
+				scan_file(state, &matches, path.buff);
+		}
+	}
+
+	if (scan)
+		async_scan_finish(scan);
+	flush_matches(state, &matches);
+
+	strbuf_release(&path);
+	closedir(dir);
+	free(job->path);
+	free(job);
+}
+
+/**
+ * Queue a directory to be walked by one of the workers.
+ * */
+static void submit_directory(struct scan_state *state, const char *path)
+{
+	struct scan_dir_job *job = (struct scan_dir_job *) malloc(sizeof(struct scan_dir_job));
+	if (!job)
+		FATAL(MEM_ALLOC_FAILED);
+
+	job->state = state;
+	job->path = strdup(path);
+	if (!job->path)
+		FATAL(MEM_ALLOC_FAILED);
+
+	thread_pool_submit(&state->pool, scan_directory, job);
+}
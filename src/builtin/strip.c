@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "parse-options.h"
+#include "atomic-file.h"
+#include "png-chunk-processor.h"
+#include "png-chunk-writer.h"
+#include "steg-index.h"
+#include "utils.h"
+
+struct byte_range {
+	off_t offset;
+	off_t len;
+};
+
+/**
+ * The result of walking an image: the byte ranges of the file to keep, and
+ * what removing everything else would save.
+ * */
+struct strip_plan {
+	struct byte_range *keep;
+	size_t len;
+	size_t alloc;
+
+	off_t file_len;
+	off_t iend_offset;
+	off_t bytes_removed;
+	unsigned chunks_removed;
+};
+
+static int dry_run = 0;
+static int quiet = 0;
+
+static int strip(const char *, const char *, off_t *);
+
+int cmd_strip(int argc, char *argv[])
+{
+	const char *output_file = NULL;
+	int help = 0;
+
+	const struct usage_string strip_cmd_usage[] = {
+			USAGE("steg-png strip [(-n | --dry-run)] [(-q | --quiet)] <file>..."),
+			USAGE("steg-png strip (-o | --output <file>) <file>"),
+			USAGE("steg-png strip (-h | --help)"),
+			USAGE_END()
+	};
+
+	const struct command_option strip_cmd_options[] = {
+			OPT_STRING('o', "output", "file", "write the stripped image to <file> rather than modifying it in place", &output_file),
+			OPT_BOOL('n', "dry-run", "only report what would be removed", &dry_run),
+			OPT_BOOL('q', "quiet", "only report files that could not be stripped", &quiet),
+			OPT_BOOL('h', "help", "show help and exit", &help),
+			OPT_END()
+	};
+
+	argc = parse_options(argc, argv, strip_cmd_options, 0, 1);
+	if (help) {
+		show_usage_with_options(strip_cmd_usage, strip_cmd_options, 0, NULL);
+		return 0;
+	}
+
+	if (argc < 1) {
+		show_usage_with_options(strip_cmd_usage, strip_cmd_options, 1, "nothing to do");
+		return 1;
+	}
+
+	if (output_file && argc > 1) {
+		show_usage_with_options(strip_cmd_usage, strip_cmd_options, 1, "--output requires a single file");
+		return 1;
+	}
+
+	int ret = 0;
+	unsigned files_stripped = 0;
+	off_t total_saved = 0;
+	for (int i = 0; i < argc; i++) {
+		off_t saved = 0;
+		int status = strip(argv[i], output_file, &saved);
+		if (status < 0)
+			ret = 1;
+		else if (status > 0)
+			files_stripped++;
+
+		total_saved += saved;
+	}
+
+	if (!quiet && argc > 1)
+		printf("%s %u of %d files, %lld bytes saved\n", dry_run ? "would strip" : "stripped",
+				files_stripped, argc, (long long int) total_saved);
+
+	return ret;
+}
+
+/**
+ * Append a range of the input file to keep, merging it with the previous range
+ * if the two are adjacent.
+ * */
+static void keep_range(struct strip_plan *plan, off_t offset, off_t len)
+{
+	if (plan->len) {
+		struct byte_range *last = &plan->keep[plan->len - 1];
+		if (last->offset + last->len == offset) {
+			last->len += len;
+			return;
+		}
+	}
+
+	if (plan->len == plan->alloc) {
+		plan->alloc = plan->alloc ? plan->alloc * 2 : 16;
+		plan->keep = (struct byte_range *) realloc(plan->keep, sizeof(struct byte_range) * plan->alloc);
+		if (!plan->keep)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	plan->keep[plan->len].offset = offset;
+	plan->keep[plan->len].len = len;
+	plan->len++;
+}
+
+/**
+ * Walk the chunk headers of the image open as in_fd, and work out which ranges
+ * of the file to keep. Only headers are read; the data of the chunks is never
+ * touched. stEG chunks, along with the stIX and stFL chunks accompanying them,
+ * are dropped, and everything else is kept verbatim, including any data
+ * trailing IEND.
+ *
+ * Returns zero if successful, and otherwise a message describing why the image
+ * can't be stripped.
+ * */
+static const char *plan_strip(int in_fd, struct strip_plan *plan)
+{
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_ctx(&ctx, in_fd);
+	if (status < 0)
+		return "failed to read from file";
+	else if (status > 0)
+		return "file is not a PNG (does not conform to RFC 2083)";
+
+	keep_range(plan, 0, SIGNATURE_LENGTH);
+
+	const char *error = NULL;
+	off_t end_of_chunks = SIGNATURE_LENGTH;
+	int has_next_chunk, IHDR_found = 0;
+	while (!error && (has_next_chunk = chunk_iterator_has_next(&ctx)) != 0) {
+		if (has_next_chunk < 0 || chunk_iterator_next(&ctx) != 0) {
+			error = "file does not appear to represent a valid PNG file, or may be corrupted";
+			break;
+		}
+
+		const char *type = ctx.current_chunk.chunk_type;
+		off_t len = (off_t) CHUNK_LENGTH(ctx.current_chunk.data_length);
+		end_of_chunks = ctx.chunk_file_offset + len;
+
+		if (!memcmp(type, IHDR_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			IHDR_found++;
+		if (plan->iend_offset >= 0)
+			error = "IEND chunk is not the last chunk (does not conform to RFC 2083)";
+		else if (!memcmp(type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH))
+			plan->iend_offset = ctx.chunk_file_offset;
+
+		if (!memcmp(type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) ||
+				!memcmp(type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH) ||
+				!memcmp(type, STEG_FILLER_CHUNK_TYPE, CHUNK_TYPE_LENGTH)) {
+			plan->chunks_removed++;
+			plan->bytes_removed += len;
+			continue;
+		}
+
+		keep_range(plan, ctx.chunk_file_offset, len);
+	}
+
+	chunk_iterator_destroy_ctx(&ctx);
+
+	if (!error && IHDR_found != 1)
+		error = "IHDR chunk must be defined exactly once (does not conform to RFC 2083)";
+	if (!error && plan->iend_offset < 0)
+		error = "IEND chunk is missing (does not conform to RFC 2083)";
+	if (!error && end_of_chunks < plan->file_len)
+		keep_range(plan, end_of_chunks, plan->file_len - end_of_chunks);
+
+	return error;
+}
+
+/**
+ * Returns non-zero if every removed chunk sits between the first kept range and
+ * the IEND chunk ending the file, in which case the image can be stripped by
+ * moving IEND up and truncating the file.
+ * */
+static int removed_chunks_at_tail(const struct strip_plan *plan)
+{
+	if (plan->len != 2)
+		return 0;
+
+	const struct byte_range *iend = &plan->keep[1];
+	return iend->offset == plan->iend_offset && iend->len == (off_t) CHUNK_LENGTH(0) &&
+			iend->offset + iend->len == plan->file_len;
+}
+
+/**
+ * Strip the image in place by copying the IEND chunk over the first removed
+ * chunk, and truncating the file after it. IEND is written before the file is
+ * truncated, so an interrupted strip leaves a valid image followed by stale
+ * data rather than an image with no IEND chunk.
+ * */
+static int truncate_in_place(int fd, const struct strip_plan *plan)
+{
+	unsigned char iend[CHUNK_LENGTH(0)];
+	off_t new_iend_offset = plan->keep[0].len;
+
+	if (recoverable_pread(fd, iend, sizeof(iend), plan->iend_offset) != sizeof(iend))
+		return -1;
+	if (recoverable_pwrite(fd, iend, sizeof(iend), new_iend_offset) != sizeof(iend))
+		return -1;
+
+	return ftruncate(fd, new_iend_offset + (off_t) sizeof(iend));
+}
+
+/**
+ * Write the kept ranges of the input file to `output_file`. The ranges are
+ * copied by the kernel where possible (see copy_file_range_fd()), so on
+ * filesystems supporting reflinks, the data is shared rather than copied.
+ * */
+static int copy_kept_ranges(int in_fd, const char *output_file, mode_t mode,
+		const struct strip_plan *plan)
+{
+	struct atomic_file out;
+	if (atomic_file_open(&out, output_file, mode))
+		DIE(FILE_OPEN_FAILED, output_file);
+
+	struct chunk_writer writer;
+	chunk_writer_init(&writer, out.fd);
+	for (size_t i = 0; i < plan->len; i++) {
+		if (chunk_writer_copy_range(&writer, in_fd, plan->keep[i].offset, (size_t) plan->keep[i].len)) {
+			atomic_file_rollback(&out);
+			return -1;
+		}
+	}
+
+	if (chunk_writer_flush(&writer)) {
+		atomic_file_rollback(&out);
+		return -1;
+	}
+
+	return atomic_file_commit(&out);
+}
+
+/**
+ * Remove the stEG and stIX chunks from the image with the file path
+ * `input_file`. The image is modified in place, unless `output_file` is given.
+ * Images that carry no embedded data are left untouched.
+ *
+ * Returns 1 if chunks were removed (or would be, in a dry run), zero if there
+ * was nothing to remove, and -1 if the image could not be stripped. `saved` is
+ * set to the number of bytes removed.
+ * */
+static int strip(const char *input_file, const char *output_file, off_t *saved)
+{
+	int in_place = !output_file && !dry_run;
+	int in_fd = open(input_file, in_place ? O_RDWR : O_RDONLY);
+	if (in_fd < 0) {
+		WARN(FILE_OPEN_FAILED, input_file);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(in_fd, &st) || !S_ISREG(st.st_mode)) {
+		errno = 0;
+		WARN("'%s' is not a regular file", input_file);
+		close(in_fd);
+		return -1;
+	}
+
+	struct strip_plan plan = {
+			.keep = NULL,
+			.len = 0,
+			.alloc = 0,
+			.file_len = st.st_size,
+			.iend_offset = -1,
+			.bytes_removed = 0,
+			.chunks_removed = 0
+	};
+
+	int ret = 0;
+	const char *error = plan_strip(in_fd, &plan);
+	if (error) {
+		errno = 0;
+		WARN("unable to strip '%s': %s", input_file, error);
+		ret = -1;
+	} else if (!plan.chunks_removed) {
+		if (output_file && copy_kept_ranges(in_fd, output_file, st.st_mode, &plan))
+			FATAL("failed to write output file '%s'", output_file);
+	} else if (!dry_run) {
+		if (in_place && removed_chunks_at_tail(&plan)) {
+			if (truncate_in_place(in_fd, &plan))
+				FATAL("failed to truncate '%s'", input_file);
+		} else if (copy_kept_ranges(in_fd, output_file ? output_file : input_file, st.st_mode, &plan)) {
+			FATAL("failed to write output file '%s'", output_file ? output_file : input_file);
+		}
+	}
+
+	if (!ret && plan.chunks_removed) {
+		*saved = plan.bytes_removed;
+		ret = 1;
+	}
+
+	if (!quiet && ret >= 0) {
+		if (plan.chunks_removed)
+			printf("%s: %s %u chunks, %lld bytes saved\n", input_file, dry_run ? "would remove" : "removed",
+					plan.chunks_removed, (long long int) plan.bytes_removed);
+		else
+			printf("%s: nothing to strip\n", input_file);
+	}
+
+	free(plan.keep);
+	if (close(in_fd))
+		FATAL("failed to write to file '%s'", input_file);
+
+	return ret;
+}
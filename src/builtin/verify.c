@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "parse-options.h"
+#include "payload-sink.h"
+#include "png-chunk-processor.h"
+#include "steg-archive.h"
+#include "steg-index.h"
+#include "steg-stream.h"
+#include "strbuf.h"
+#include "thread-pool.h"
+#include "utils.h"
+#include "zlib.h"
+
+/*
+ * Below this many bytes of chunks per thread, starting the threads costs more
+ * than checking the CRCs on a single one.
+ * */
+#define VERIFY_PARALLEL_MIN_LEN (4 * 1024 * 1024)
+#define VERIFY_READ_BUFFER_SIZE (1024 * 1024)
+
+enum verify_status {
+	VERIFY_OK = 0,
+	VERIFY_CORRUPT = 1,
+	VERIFY_UNREADABLE = 2
+};
+
+/**
+ * A chunk of the image being verified, and the CRC recorded in the file.
+ * */
+struct verify_chunk {
+	char type[CHUNK_TYPE_LENGTH];
+	off_t offset;
+	u_int32_t data_length;
+	u_int32_t crc;
+};
+
+/**
+ * A contiguous piece of the bytes covered by the CRC of a chunk (its type and
+ * data). Large chunks are split into several pieces, so that the CRCs of the
+ * pieces can be computed on different threads and merged afterwards.
+ * */
+struct verify_piece {
+	size_t chunk;
+	off_t offset;
+	size_t len;
+	u_int32_t crc;
+};
+
+/**
+ * A run of consecutive pieces whose CRCs are computed by one thread.
+ * */
+struct verify_crc_job {
+	int fd;
+	const unsigned char *map;
+	struct verify_piece *pieces;
+	size_t len;
+	int failed;
+};
+
+/**
+ * An image being verified. Problems found are collected in `report`, one line
+ * apiece, so that they're printed together once the image is done.
+ * */
+struct verify_image {
+	const char *path;
+	int fd;
+	const unsigned char *map;
+	off_t file_len;
+
+	struct verify_chunk *chunks;
+	size_t chunks_len;
+	size_t chunks_alloc;
+
+	struct strbuf report;
+	enum verify_status status;
+};
+
+/**
+ * State shared by every worker. Workers take the next file from `paths` until
+ * none are left, and print each result as it finishes.
+ * */
+struct verify_state {
+	char **paths;
+	size_t paths_len;
+	size_t next_path;
+	unsigned int crc_threads;
+
+	pthread_mutex_t lock;
+	unsigned long files_ok;
+	unsigned long files_corrupt;
+	unsigned long files_unreadable;
+};
+
+static int trial_inflate = 0;
+static int quiet = 0;
+
+static void run_verify_worker(void *);
+
+int cmd_verify(int argc, char *argv[])
+{
+	long threads = 0;
+	int help = 0;
+
+	const struct usage_string verify_cmd_usage[] = {
+			USAGE("steg-png verify [--threads <n>] [--inflate] [(-q | --quiet)] <file>..."),
+			USAGE("steg-png verify (-h | --help)"),
+			USAGE_END()
+	};
+
+	const struct command_option verify_cmd_options[] = {
+			OPT_LONG_INT("threads", "verify using <n> threads (0 for one per processor, default 0)", &threads),
+			OPT_LONG_BOOL("inflate", "also inflate embedded data, discarding the result", &trial_inflate),
+			OPT_BOOL('q', "quiet", "only report files that fail verification", &quiet),
+			OPT_BOOL('h', "help", "show help and exit", &help),
+			OPT_END()
+	};
+
+	argc = parse_options(argc, argv, verify_cmd_options, 0, 1);
+	if (help) {
+		show_usage_with_options(verify_cmd_usage, verify_cmd_options, 0, NULL);
+		return 0;
+	}
+
+	if (argc < 1) {
+		show_usage_with_options(verify_cmd_usage, verify_cmd_options, 1, "nothing to do");
+		return VERIFY_UNREADABLE;
+	}
+
+	if (threads < 0) {
+		show_usage_with_options(verify_cmd_usage, verify_cmd_options, 1, "invalid number of threads %ld", threads);
+		return VERIFY_UNREADABLE;
+	}
+
+	if (!threads)
+		threads = thread_pool_cpu_count();
+
+	/*
+	 * Files are verified concurrently, one per worker. With fewer files than
+	 * threads, the threads left over are shared between the workers, which
+	 * split the CRCs of each image across them.
+	 * */
+	size_t workers = (size_t) threads < (size_t) argc ? (size_t) threads : (size_t) argc;
+	struct verify_state state = {
+			.paths = argv,
+			.paths_len = (size_t) argc,
+			.next_path = 0,
+			.crc_threads = (unsigned int) ((size_t) threads / workers),
+			.files_ok = 0,
+			.files_corrupt = 0,
+			.files_unreadable = 0
+	};
+
+	if (pthread_mutex_init(&state.lock, NULL))
+		FATAL("failed to initialize verify lock");
+
+	struct thread_pool pool;
+	thread_pool_init(&pool, (unsigned int) workers);
+	for (size_t i = 0; i < workers; i++)
+		thread_pool_submit(&pool, run_verify_worker, &state);
+
+	thread_pool_wait(&pool);
+	thread_pool_destroy(&pool);
+	pthread_mutex_destroy(&state.lock);
+
+	if (fflush(stdout))
+		FATAL("failed to write to stdout");
+
+	if (!quiet && argc > 1)
+		fprintf(stderr, "verified %d files: %lu ok, %lu corrupt, %lu unreadable\n", argc,
+				state.files_ok, state.files_corrupt, state.files_unreadable);
+
+	if (state.files_unreadable)
+		return VERIFY_UNREADABLE;
+
+	return state.files_corrupt ? VERIFY_CORRUPT : VERIFY_OK;
+}
+
+/**
+ * Record a problem with the image. An image that couldn't be read stays
+ * unreadable, rather than corrupt.
+ * */
+static void report_problem(struct verify_image *image, enum verify_status status, const char *fmt, ...)
+{
+	va_list varargs;
+	char message[512];
+
+	va_start(varargs, fmt);
+	vsnprintf(message, sizeof(message), fmt, varargs);
+	va_end(varargs);
+
+	strbuf_attach_fmt(&image->report, "%s: %s\n", image->path, message);
+	if (status > image->status)
+		image->status = status;
+}
+
+/**
+ * Append a chunk to the list of chunks of the image, growing it as needed.
+ * */
+static void push_chunk(struct verify_image *image, const struct verify_chunk *chunk)
+{
+	if (image->chunks_len == image->chunks_alloc) {
+		image->chunks_alloc = image->chunks_alloc ? image->chunks_alloc * 2 : 64;
+		image->chunks = (struct verify_chunk *) realloc(image->chunks,
+				sizeof(struct verify_chunk) * image->chunks_alloc);
+		if (!image->chunks)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	image->chunks[image->chunks_len++] = *chunk;
+}
+
+/**
+ * Walk the chunk headers of the image, recording every chunk, and check the
+ * layout of the file: IHDR must come first, and a single IEND must end it.
+ *
+ * Returns zero if the chunks were walked, and -1 if the image couldn't be
+ * read, in which case there's nothing more to verify.
+ * */
+static int walk_chunks(struct verify_image *image, struct chunk_iterator_ctx *ctx)
+{
+	image->map = ctx->map;
+	image->file_len = ctx->file_len;
+
+	off_t end_of_chunks = SIGNATURE_LENGTH;
+	int has_next_chunk, IHDR_found = 0, IEND_found = 0;
+	while ((has_next_chunk = chunk_iterator_has_next(ctx)) != 0) {
+		struct verify_chunk chunk;
+		if (has_next_chunk < 0 || chunk_iterator_next(ctx) || chunk_iterator_get_chunk_crc(ctx, &chunk.crc)) {
+			report_problem(image, VERIFY_UNREADABLE, "failed to read from file");
+			return -1;
+		}
+
+		memcpy(chunk.type, ctx->current_chunk.chunk_type, CHUNK_TYPE_LENGTH);
+		chunk.offset = ctx->chunk_file_offset;
+		chunk.data_length = ctx->current_chunk.data_length;
+		end_of_chunks = chunk.offset + (off_t) CHUNK_LENGTH(chunk.data_length);
+
+		int is_IHDR = !memcmp(chunk.type, IHDR_CHUNK_TYPE, CHUNK_TYPE_LENGTH);
+		if (!image->chunks_len && !is_IHDR)
+			report_problem(image, VERIFY_CORRUPT, "first chunk is %.4s, not IHDR (does not conform to RFC 2083)",
+					chunk.type);
+		if (is_IHDR && IHDR_found++ == 1)
+			report_problem(image, VERIFY_CORRUPT, "IHDR chunk defined more than once (does not conform to RFC 2083)");
+
+		if (IEND_found == 1)
+			report_problem(image, VERIFY_CORRUPT, "%.4s chunk at file offset %lld follows IEND (does not conform to RFC 2083)",
+					chunk.type, (long long int) chunk.offset);
+		if (!memcmp(chunk.type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH) && IEND_found++ == 1)
+			report_problem(image, VERIFY_CORRUPT, "IEND chunk defined more than once (does not conform to RFC 2083)");
+
+		push_chunk(image, &chunk);
+	}
+
+	// the walk ends early at a chunk header that's corrupt, or a chunk that's cut short
+	if (!IEND_found)
+		report_problem(image, VERIFY_CORRUPT, "IEND chunk is missing (does not conform to RFC 2083)");
+	if (end_of_chunks < image->file_len && !IEND_found)
+		report_problem(image, VERIFY_CORRUPT, "chunk at file offset %lld is truncated or corrupt",
+				(long long int) end_of_chunks);
+	else if (end_of_chunks < image->file_len)
+		report_problem(image, VERIFY_CORRUPT, "%lld bytes of data follow the IEND chunk",
+				(long long int) (image->file_len - end_of_chunks));
+
+	return 0;
+}
+
+static void run_crc_job(void *arg)
+{
+	struct verify_crc_job *job = (struct verify_crc_job *) arg;
+	unsigned char *buffer = NULL;
+
+	for (size_t i = 0; i < job->len; i++) {
+		struct verify_piece *piece = &job->pieces[i];
+		if (job->map) {
+			piece->crc = crc32_update(0, job->map + piece->offset, piece->len);
+			continue;
+		}
+
+		if (!buffer && !(buffer = (unsigned char *) malloc(VERIFY_READ_BUFFER_SIZE)))
+			FATAL(MEM_ALLOC_FAILED);
+
+		piece->crc = 0;
+		for (size_t pos = 0; pos < piece->len; ) {
+			size_t len = piece->len - pos < VERIFY_READ_BUFFER_SIZE ? piece->len - pos : VERIFY_READ_BUFFER_SIZE;
+			if (recoverable_pread(job->fd, buffer, len, piece->offset + (off_t) pos) != (ssize_t) len) {
+				job->failed = 1;
+				break;
+			}
+
+			piece->crc = crc32_update(piece->crc, buffer, len);
+			pos += len;
+		}
+	}
+
+	free(buffer);
+}
+
+/**
+ * Check the CRC of every chunk of the image.
+ *
+ * The bytes covered by the CRCs of all chunks are split into one run per worker
+ * of `pool`, each of about the same length, regardless of where chunks begin
+ * and end, so that images of many small chunks and images of a few huge ones
+ * are split alike.
+ * The CRCs of the pieces of each chunk are then merged with crc32_combine().
+ * */
+static void verify_crcs(struct verify_image *image, struct thread_pool *pool)
+{
+	off_t total = 0;
+	for (size_t i = 0; i < image->chunks_len; i++)
+		total += CHUNK_TYPE_LENGTH + (off_t) image->chunks[i].data_length;
+
+	size_t parts = (size_t) (total / VERIFY_PARALLEL_MIN_LEN);
+	if (parts > pool->worker_count)
+		parts = pool->worker_count;
+	if (parts < 1)
+		parts = 1;
+
+	off_t run_len = (total + (off_t) parts - 1) / (off_t) parts;
+	if (!run_len)
+		run_len = 1;
+
+	// every run boundary may split a chunk in two
+	struct verify_piece *pieces = (struct verify_piece *) malloc(sizeof(struct verify_piece)
+			* (image->chunks_len + parts));
+	struct verify_crc_job *jobs = (struct verify_crc_job *) calloc(parts, sizeof(struct verify_crc_job));
+	if (!pieces || !jobs)
+		FATAL(MEM_ALLOC_FAILED);
+
+	size_t pieces_len = 0;
+	off_t pos = 0;
+	for (size_t i = 0; i < image->chunks_len; i++) {
+		off_t offset = image->chunks[i].offset + (off_t) sizeof(u_int32_t);
+		off_t remaining = CHUNK_TYPE_LENGTH + (off_t) image->chunks[i].data_length;
+		while (remaining) {
+			size_t run = (size_t) (pos / run_len);
+			off_t len = (off_t) (run + 1) * run_len - pos;
+			len = len < remaining ? len : remaining;
+
+			struct verify_piece *piece = &pieces[pieces_len++];
+			piece->chunk = i;
+			piece->offset = offset;
+			piece->len = (size_t) len;
+
+			if (!jobs[run].pieces)
+				jobs[run].pieces = piece;
+			jobs[run].len++;
+
+			offset += len;
+			remaining -= len;
+			pos += len;
+		}
+	}
+
+	for (size_t i = 0; i < parts; i++) {
+		jobs[i].fd = image->fd;
+		jobs[i].map = image->map;
+	}
+
+	if (parts == 1) {
+		run_crc_job(&jobs[0]);
+	} else {
+		for (size_t i = 0; i < parts; i++)
+			thread_pool_submit(pool, run_crc_job, &jobs[i]);
+		thread_pool_wait(pool);
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < parts; i++)
+		failed |= jobs[i].failed;
+
+	if (failed) {
+		report_problem(image, VERIFY_UNREADABLE, "failed to read from file");
+	} else {
+		size_t next_piece = 0;
+		for (size_t i = 0; i < image->chunks_len; i++) {
+			u_int32_t crc = 0;
+			while (next_piece < pieces_len && pieces[next_piece].chunk == i) {
+				crc = (u_int32_t) crc32_combine(crc, pieces[next_piece].crc, (z_off_t) pieces[next_piece].len);
+				next_piece++;
+			}
+
+			const struct verify_chunk *chunk = &image->chunks[i];
+			if (crc != chunk->crc)
+				report_problem(image, VERIFY_CORRUPT, "%.4s chunk at file offset %lld has invalid CRC",
+						chunk->type, (long long int) chunk->offset);
+		}
+	}
+
+	free(jobs);
+	free(pieces);
+}
+
+/**
+ * Inflate every member of the embedded archive described by `map`.
+ *
+ * Returns zero if successful, and -1 otherwise, in which case `error`
+ * describes the problem.
+ * */
+static int inflate_archive(const struct steg_stream_map *map, struct payload_sink *sink, const char **error)
+{
+	struct steg_archive archive;
+	if (steg_archive_read(&archive, map, error))
+		return -1;
+
+	int ret = 0;
+	for (size_t i = 0; !ret && i < archive.len; i++) {
+		const struct steg_archive_member *member = &archive.members[i];
+		ret = steg_stream_extract_member(map, member->stream_offset, member->len, 0, member->len, sink, error);
+	}
+
+	steg_archive_release(&archive);
+	return ret;
+}
+
+/**
+ * Inflate every steg stream embedded in the image, discarding the payload, to
+ * make sure that each can be extracted. Legacy streams are inflated as they're
+ * delimited; segmented streams are inflated on a thread pool, and archives one
+ * member at a time.
+ * */
+static void verify_payload(struct verify_image *image, struct thread_pool *pool)
+{
+	struct steg_stream_range *ranges = NULL;
+	size_t ranges_len = 0;
+	for (size_t i = 0; i < image->chunks_len; i++) {
+		const struct verify_chunk *chunk = &image->chunks[i];
+		if (memcmp(chunk->type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+			continue;
+
+		ranges = (struct steg_stream_range *) realloc(ranges, sizeof(struct steg_stream_range) * (ranges_len + 1));
+		if (!ranges)
+			FATAL(MEM_ALLOC_FAILED);
+
+		off_t data_offset = chunk->offset + (off_t) CHUNK_HEADER_LENGTH;
+		ranges[ranges_len].offset = data_offset;
+		ranges[ranges_len].len = chunk->data_length;
+		ranges[ranges_len].data = image->map ? image->map + data_offset : NULL;
+		ranges_len++;
+	}
+
+	if (!ranges_len)
+		return;
+
+	struct steg_stream_map chunks;
+	steg_stream_map_init(&chunks, image->fd, ranges, ranges_len);
+
+	// a sink with no destinations discards everything written to it
+	struct payload_sink sink;
+	payload_sink_init(&sink);
+
+	off_t offset = 0;
+	for (unsigned stream = 1; offset < steg_stream_map_length(&chunks); stream++) {
+		const char *error = NULL;
+		struct steg_stream_info info;
+		int status = steg_stream_delimit(&chunks, offset, &info, NULL, &error);
+		if (status > 0)
+			break;
+
+		if (!status && info.format == STEG_FORMAT_SEGMENTED) {
+			struct steg_stream_map slice;
+			steg_stream_map_slice(&slice, &chunks, offset, info.len);
+			if (info.archive)
+				status = inflate_archive(&slice, &sink, &error);
+			else
+				status = steg_stream_inflate_segments(&slice, &sink, pool, &error);
+			steg_stream_map_release(&slice);
+		}
+
+		// a corrupt stream can't be delimited, so the streams after it can't be found
+		if (status) {
+			report_problem(image, VERIFY_CORRUPT, "embedded stream %u: %s", stream, error);
+			break;
+		}
+
+		offset += info.len;
+	}
+
+	payload_sink_rollback(&sink);
+	steg_stream_map_release(&chunks);
+	free(ranges);
+}
+
+/**
+ * Verify a single image, using the workers of `pool` for its CRCs and payload.
+ * */
+static void verify_image(struct verify_image *image, struct thread_pool *pool)
+{
+	image->fd = open(image->path, O_RDONLY);
+	if (image->fd < 0) {
+		report_problem(image, VERIFY_UNREADABLE, "unable to open file: %s", strerror(errno));
+		return;
+	}
+
+	// files too short to hold a signature aren't PNGs, rather than unreadable
+	struct stat st;
+	if (!fstat(image->fd, &st) && st.st_size < SIGNATURE_LENGTH) {
+		report_problem(image, VERIFY_CORRUPT, "file is not a PNG (does not conform to RFC 2083)");
+		close(image->fd);
+		return;
+	}
+
+	struct chunk_iterator_ctx ctx;
+	int status = chunk_iterator_init_mmap_ctx(&ctx, image->fd);
+	if (status) {
+		if (status < 0)
+			report_problem(image, VERIFY_UNREADABLE, "failed to read from file");
+		else
+			report_problem(image, VERIFY_CORRUPT, "file is not a PNG (does not conform to RFC 2083)");
+
+		close(image->fd);
+		return;
+	}
+
+	if (!walk_chunks(image, &ctx)) {
+		verify_crcs(image, pool);
+		if (trial_inflate && image->status == VERIFY_OK)
+			verify_payload(image, pool);
+	}
+
+	chunk_iterator_destroy_ctx(&ctx);
+	close(image->fd);
+}
+
+/**
+ * Verify files until none are left, printing the result of each:
+ * <file>: ok
+ * <file>: <problem>
+ * with one line for every problem found.
+ * */
+static void run_verify_worker(void *arg)
+{
+	struct verify_state *state = (struct verify_state *) arg;
+
+	// the threads left over for each image are started once, for all of them
+	struct thread_pool pool;
+	thread_pool_init(&pool, state->crc_threads);
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		size_t index = state->next_path++;
+		pthread_mutex_unlock(&state->lock);
+		if (index >= state->paths_len)
+			break;
+
+		struct verify_image image = {
+				.path = state->paths[index],
+				.fd = -1,
+				.map = NULL,
+				.file_len = 0,
+				.chunks = NULL,
+				.chunks_len = 0,
+				.chunks_alloc = 0,
+				.status = VERIFY_OK
+		};
+		strbuf_init(&image.report);
+
+		verify_image(&image, &pool);
+
+		pthread_mutex_lock(&state->lock);
+		if (image.status == VERIFY_OK) {
+			state->files_ok++;
+			if (!quiet)
+				printf("%s: ok\n", image.path);
+		} else {
+			if (image.status == VERIFY_UNREADABLE)
+				state->files_unreadable++;
+			else
+				state->files_corrupt++;
+
+			fputs(image.report.buff, stdout);
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		strbuf_release(&image.report);
+		free(image.chunks);
+	}
+
+	thread_pool_destroy(&pool);
+}
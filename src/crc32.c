@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32.h"
+#include "thread-pool.h"
+#include "utils.h"
+#include "zlib.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_CRC32_PCLMUL
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define HAVE_CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/*
+ * Below this many bytes per worker, handing the pieces to the pool and
+ * combining their CRCs costs more than computing the CRC on a single thread.
+ * */
+#define CRC32_PARALLEL_MIN_LEN (4 * 1024 * 1024)
+
+typedef u_int32_t (*crc32_engine_fn)(u_int32_t, const unsigned char *, size_t);
+
+static u_int32_t crc32_zlib(u_int32_t, const unsigned char *, size_t);
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static crc32_engine_fn engine = crc32_zlib;
+static const char *engine_name = "zlib";
+
+static void select_engine(void);
+
+/**
+ * A piece of a buffer whose CRC is computed on a thread pool.
+ * */
+struct crc32_job {
+	const unsigned char *data;
+	size_t len;
+	u_int32_t crc;
+};
+
+u_int32_t crc32_update(u_int32_t crc, const void *data, size_t len)
+{
+	if (!len)
+		return crc;
+
+	pthread_once(&engine_once, select_engine);
+	return engine(crc, (const unsigned char *) data, len);
+}
+
+static void run_crc32_job(void *arg)
+{
+	struct crc32_job *job = (struct crc32_job *) arg;
+	job->crc = crc32_update(0, job->data, job->len);
+}
+
+u_int32_t crc32_update_parallel(u_int32_t crc, const void *data, size_t len, struct thread_pool *pool)
+{
+	size_t parts = len / CRC32_PARALLEL_MIN_LEN;
+	if (!pool)
+		parts = 1;
+	else if (parts > pool->worker_count)
+		parts = pool->worker_count;
+	if (parts < 2)
+		return crc32_update(crc, data, len);
+
+	struct crc32_job *jobs = (struct crc32_job *) calloc(parts, sizeof(struct crc32_job));
+	if (!jobs)
+		FATAL(MEM_ALLOC_FAILED);
+
+	// the last piece takes whatever doesn't divide evenly
+	size_t part_len = len / parts;
+	for (size_t i = 0; i < parts; i++) {
+		jobs[i].data = (const unsigned char *) data + i * part_len;
+		jobs[i].len = i == parts - 1 ? len - i * part_len : part_len;
+	}
+
+	for (size_t i = 0; i < parts; i++)
+		thread_pool_submit(pool, run_crc32_job, &jobs[i]);
+	thread_pool_wait(pool);
+
+	for (size_t i = 0; i < parts; i++)
+		crc = (u_int32_t) crc32_combine(crc, jobs[i].crc, (z_off_t) jobs[i].len);
+
+	free(jobs);
+	return crc;
+}
+
+const char *crc32_engine(void)
+{
+	pthread_once(&engine_once, select_engine);
+	return engine_name;
+}
+
+static u_int32_t crc32_zlib(u_int32_t crc, const unsigned char *data, size_t len)
+{
+	return (u_int32_t) crc32_z(crc, data, len);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+
+/**
+ * Compute the CRC of `len` bytes by folding, as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction". Four
+ * 128-bit accumulators are each folded forward by 512 bits per iteration, then
+ * folded together into one, which is reduced to 32 bits with a Barrett
+ * reduction. The constants are those for the bit-reflected PNG polynomial.
+ *
+ * `len` must be a multiple of 16, and at least 64. Unlike crc32_update(), the
+ * CRC is neither taken nor returned inverted.
+ * */
+__attribute__((target("pclmul,sse4.1")))
+static u_int32_t crc32_fold(u_int32_t crc, const unsigned char *data, size_t len)
+{
+	static const uint64_t k1k2[] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+	x0 = _mm_load_si128((const __m128i *) k1k2);
+
+	data += 64;
+	len -= 64;
+
+	// fold 64 bytes at a time into the four accumulators
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (data + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (data + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (data + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (data + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		data += 64;
+		len -= 64;
+	}
+
+	// fold the four accumulators into one
+	x0 = _mm_load_si128((const __m128i *) k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// fold any remaining 16 byte blocks
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *) data);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		data += 16;
+		len -= 16;
+	}
+
+	// fold 128 bits down to 64
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *) poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (u_int32_t) _mm_extract_epi32(x1, 1);
+}
+
+static u_int32_t crc32_pclmul(u_int32_t crc, const unsigned char *data, size_t len)
+{
+	// short buffers, and the tail of longer ones, are left to zlib
+	if (len >= 64) {
+		size_t folded = len & ~(size_t) 15;
+		crc = ~crc32_fold(~crc, data, folded);
+		data += folded;
+		len -= folded;
+	}
+
+	return crc32_zlib(crc, data, len);
+}
+
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+
+__attribute__((target("+crc")))
+static u_int32_t crc32_armv8(u_int32_t crc, const unsigned char *data, size_t len)
+{
+	crc = ~crc;
+	while (len && ((uintptr_t) data & 7)) {
+		crc = __crc32b(crc, *data++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc = __crc32d(crc, word);
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *data++);
+
+	return ~crc;
+}
+
+#endif
+
+static void select_engine(void)
+{
+	if (getenv("STEG_PNG_NO_SIMD"))
+		return;
+
+#if defined(HAVE_CRC32_PCLMUL)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		engine = crc32_pclmul;
+		engine_name = "pclmul";
+	}
+#elif defined(HAVE_CRC32_ARMV8)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		engine = crc32_armv8;
+		engine_name = "armv8";
+	}
+#endif
+}
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "digest.h"
+#include "utils.h"
+
+static const char *const digest_names[] = {
+		[DIGEST_MD5] = "md5",
+		[DIGEST_XXH3] = "xxh3",
+		[DIGEST_BLAKE3] = "blake3"
+};
+
+int digest_type_from_name(const char *name, enum digest_type *type)
+{
+	for (size_t i = 0; i < sizeof(digest_names) / sizeof(digest_names[0]); i++) {
+		if (!strcmp(name, digest_names[i])) {
+			*type = (enum digest_type) i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *digest_name(enum digest_type type)
+{
+	return digest_names[type];
+}
+
+size_t digest_size(enum digest_type type)
+{
+	switch (type) {
+		case DIGEST_MD5:
+			return MD5_DIGEST_SIZE;
+		case DIGEST_XXH3:
+			return XXH3_DIGEST_SIZE;
+		case DIGEST_BLAKE3:
+			return BLAKE3_DIGEST_SIZE;
+	}
+
+	BUG("unknown digest type %d", (int) type);
+}
+
+void digest_init(struct digest_ctx *ctx, enum digest_type type)
+{
+	ctx->type = type;
+	switch (type) {
+		case DIGEST_MD5:
+			md5_init_ctx(&ctx->state.md5);
+			return;
+		case DIGEST_XXH3:
+			xxh3_init(&ctx->state.xxh3);
+			return;
+		case DIGEST_BLAKE3:
+			blake3_init(&ctx->state.blake3);
+			return;
+	}
+
+	BUG("unknown digest type %d", (int) type);
+}
+
+void digest_set_threads(struct digest_ctx *ctx, unsigned int threads)
+{
+	if (ctx->type == DIGEST_BLAKE3)
+		blake3_set_threads(&ctx->state.blake3, threads);
+}
+
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len)
+{
+	switch (ctx->type) {
+		case DIGEST_MD5:
+			md5_process_bytes(data, len, &ctx->state.md5);
+			return;
+		case DIGEST_XXH3:
+			xxh3_update(&ctx->state.xxh3, data, len);
+			return;
+		case DIGEST_BLAKE3:
+			blake3_update(&ctx->state.blake3, data, len);
+			return;
+	}
+}
+
+void digest_final(struct digest_ctx *ctx, unsigned char digest[])
+{
+	switch (ctx->type) {
+		case DIGEST_MD5:
+			md5_finish_ctx(&ctx->state.md5, digest);
+			return;
+		case DIGEST_XXH3:
+			xxh3_final(&ctx->state.xxh3, digest);
+			return;
+		case DIGEST_BLAKE3:
+			blake3_final(&ctx->state.blake3, digest);
+			return;
+	}
+}
+
+void print_digest(FILE *stream, enum digest_type type, const unsigned char digest[])
+{
+	size_t len = digest_size(type);
+	for (size_t i = 0; i < len; i++)
+		fprintf(stream, "%02x", digest[i]);
+}
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "inflate-index.h"
+#include "utils.h"
+#include "zlib.h"
+
+#define INFLATE_INDEX_MAGIC "\211STGIDX\n"
+#define INFLATE_INDEX_MAGIC_LENGTH 8
+#define INFLATE_INDEX_VERSION 1
+#define INFLATE_INDEX_BUFFER_SIZE 16384
+
+static void add_checkpoint(struct inflate_index *, int, off_t, off_t, unsigned int,
+		const unsigned char *);
+static int read_trailer(const struct steg_stream_map *, off_t, u_int32_t *);
+
+void inflate_index_init(struct inflate_index *index)
+{
+	index->points = NULL;
+	index->len = 0;
+	index->alloc = 0;
+	index->stream_len = 0;
+	index->trailer = 0;
+}
+
+int inflate_index_build(struct inflate_index *index, const struct steg_stream_map *map,
+		const char **error)
+{
+	inflate_index_release(index);
+
+	unsigned char input[INFLATE_INDEX_BUFFER_SIZE];
+	unsigned char window[INFLATE_INDEX_WINDOW_SIZE];
+
+	struct z_stream_s strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	strm.avail_out = 0;
+	if (inflateInit(&strm) != Z_OK)
+		FATAL("failed to initialize zlib for DEFLATE");
+
+	off_t stream_len = steg_stream_map_length(map);
+	off_t total_in = 0, total_out = 0, last = 0, pos = 0;
+	int ret = Z_OK;
+
+	/*
+	 * Inflate the whole stream one DEFLATE block at a time into a circular
+	 * window, stopping at block boundaries to take checkpoints.
+	 * */
+	while (ret != Z_STREAM_END) {
+		size_t len = stream_len - pos > INFLATE_INDEX_BUFFER_SIZE ? INFLATE_INDEX_BUFFER_SIZE : stream_len - pos;
+		if (!len || steg_stream_map_read(map, pos, input, len)) {
+			*error = "embedded data is truncated; the compressed stream ends early";
+			ret = Z_DATA_ERROR;
+			break;
+		}
+
+		pos += len;
+		strm.avail_in = len;
+		strm.next_in = input;
+
+		do {
+			if (!strm.avail_out) {
+				strm.avail_out = INFLATE_INDEX_WINDOW_SIZE;
+				strm.next_out = window;
+			}
+
+			total_in += strm.avail_in;
+			total_out += strm.avail_out;
+			ret = inflate(&strm, Z_BLOCK);
+			total_in -= strm.avail_in;
+			total_out -= strm.avail_out;
+
+			if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR) {
+				*error = strm.msg ? strm.msg : zError(ret);
+				break;
+			}
+			if (ret == Z_STREAM_END)
+				break;
+
+			// at the end of a block header, but not the last block
+			if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+					(total_out == 0 || total_out - last > INFLATE_INDEX_SPAN)) {
+				add_checkpoint(index, strm.data_type & 7, total_in, total_out, strm.avail_out, window);
+				last = total_out;
+			}
+		} while (strm.avail_in);
+
+		if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+			break;
+	}
+
+	(void) inflateEnd(&strm);
+	if (ret != Z_STREAM_END) {
+		inflate_index_release(index);
+		return -1;
+	}
+
+	index->stream_len = total_in;
+	if (read_trailer(map, total_in, &index->trailer)) {
+		*error = "embedded data is truncated; the compressed stream ends early";
+		inflate_index_release(index);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline void put_u32(unsigned char *buffer, u_int32_t value)
+{
+	buffer[0] = (unsigned char) (value >> 24);
+	buffer[1] = (unsigned char) (value >> 16);
+	buffer[2] = (unsigned char) (value >> 8);
+	buffer[3] = (unsigned char) value;
+}
+
+static inline u_int32_t get_u32(const unsigned char *buffer)
+{
+	return ((u_int32_t) buffer[0] << 24) | ((u_int32_t) buffer[1] << 16) |
+			((u_int32_t) buffer[2] << 8) | (u_int32_t) buffer[3];
+}
+
+static inline void put_u64(unsigned char *buffer, u_int64_t value)
+{
+	put_u32(buffer, (u_int32_t) (value >> 32));
+	put_u32(buffer + 4, (u_int32_t) value);
+}
+
+static inline u_int64_t get_u64(const unsigned char *buffer)
+{
+	return ((u_int64_t) get_u32(buffer) << 32) | get_u32(buffer + 4);
+}
+
+/**
+ * An index file consists of a header:
+ * magic (8), version (4), window size (4), stream length (8), trailer (4), count (4)
+ *
+ * followed by `count` checkpoints:
+ * compressed offset (8), inflated offset (8), bits (4), window (window size)
+ * */
+#define INDEX_HEADER_LENGTH (INFLATE_INDEX_MAGIC_LENGTH + 24)
+#define INDEX_CHECKPOINT_LENGTH 20
+
+int inflate_index_save(struct inflate_index *index, int fd)
+{
+	unsigned char header[INDEX_HEADER_LENGTH];
+	memcpy(header, INFLATE_INDEX_MAGIC, INFLATE_INDEX_MAGIC_LENGTH);
+	put_u32(header + 8, INFLATE_INDEX_VERSION);
+	put_u32(header + 12, INFLATE_INDEX_WINDOW_SIZE);
+	put_u64(header + 16, (u_int64_t) index->stream_len);
+	put_u32(header + 24, index->trailer);
+	put_u32(header + 28, (u_int32_t) index->len);
+
+	if (recoverable_write(fd, header, INDEX_HEADER_LENGTH) != INDEX_HEADER_LENGTH)
+		return -1;
+
+	for (size_t i = 0; i < index->len; i++) {
+		const struct inflate_checkpoint *point = &index->points[i];
+
+		unsigned char fields[INDEX_CHECKPOINT_LENGTH];
+		put_u64(fields, (u_int64_t) point->in);
+		put_u64(fields + 8, (u_int64_t) point->out);
+		put_u32(fields + 16, (u_int32_t) point->bits);
+
+		struct iovec iov[2] = {
+			{ .iov_base = fields, .iov_len = INDEX_CHECKPOINT_LENGTH },
+			{ .iov_base = point->window, .iov_len = INFLATE_INDEX_WINDOW_SIZE }
+		};
+		if (recoverable_writev(fd, iov, 2) != INDEX_CHECKPOINT_LENGTH + INFLATE_INDEX_WINDOW_SIZE)
+			return -1;
+	}
+
+	return 0;
+}
+
+int inflate_index_load(struct inflate_index *index, const struct steg_stream_map *map, int fd)
+{
+	inflate_index_release(index);
+
+	unsigned char header[INDEX_HEADER_LENGTH];
+	ssize_t bytes_read = recoverable_read(fd, header, INDEX_HEADER_LENGTH);
+	if (bytes_read < 0)
+		return -1;
+	if (bytes_read != INDEX_HEADER_LENGTH)
+		return 1;
+
+	if (memcmp(header, INFLATE_INDEX_MAGIC, INFLATE_INDEX_MAGIC_LENGTH) != 0 ||
+			get_u32(header + 8) != INFLATE_INDEX_VERSION ||
+			get_u32(header + 12) != INFLATE_INDEX_WINDOW_SIZE)
+		return 1;
+
+	// the index must have been built from this very stream
+	off_t stream_len = (off_t) get_u64(header + 16);
+	u_int32_t trailer;
+	if (stream_len < 4 || stream_len > steg_stream_map_length(map) ||
+			read_trailer(map, stream_len, &trailer) || trailer != get_u32(header + 24))
+		return 1;
+
+	size_t count = get_u32(header + 28);
+	for (size_t i = 0; i < count; i++) {
+		unsigned char fields[INDEX_CHECKPOINT_LENGTH];
+		unsigned char window[INFLATE_INDEX_WINDOW_SIZE];
+
+		if ((bytes_read = recoverable_read(fd, fields, INDEX_CHECKPOINT_LENGTH)) == INDEX_CHECKPOINT_LENGTH)
+			bytes_read = recoverable_read(fd, window, INFLATE_INDEX_WINDOW_SIZE);
+
+		if (bytes_read < 0) {
+			inflate_index_release(index);
+			return -1;
+		}
+
+		off_t in = (off_t) get_u64(fields);
+		off_t out = (off_t) get_u64(fields + 8);
+		int bits = (int) get_u32(fields + 16);
+		if (bytes_read != INFLATE_INDEX_WINDOW_SIZE || bits > 7 || in > stream_len ||
+				(index->len && out <= index->points[index->len - 1].out)) {
+			inflate_index_release(index);
+			return 1;
+		}
+
+		add_checkpoint(index, bits, in, out, 0, window);
+	}
+
+	index->stream_len = stream_len;
+	index->trailer = trailer;
+
+	return 0;
+}
+
+int inflate_index_extract(struct inflate_index *index, const struct steg_stream_map *map,
+		off_t offset, off_t len, struct payload_sink *sink, const char **error)
+{
+	unsigned char input[INFLATE_INDEX_BUFFER_SIZE];
+	unsigned char output[INFLATE_INDEX_BUFFER_SIZE];
+
+	// find the last checkpoint at or before the offset
+	struct inflate_checkpoint *point = NULL;
+	size_t lo = 0, hi = index->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index->points[mid].out <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo)
+		point = &index->points[lo - 1];
+
+	struct z_stream_s strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+
+	/*
+	 * Without a checkpoint, inflate the zlib stream from the beginning.
+	 * Otherwise, resume raw inflate at the checkpoint, feeding it the bits of
+	 * the block that begin partway through the preceding byte, and the window
+	 * of data preceding the block.
+	 * */
+	off_t pos = 0, skip = offset;
+	int ret = point ? inflateInit2(&strm, -15) : inflateInit(&strm);
+	if (ret != Z_OK)
+		FATAL("failed to initialize zlib for DEFLATE");
+
+	if (point) {
+		pos = point->in;
+		skip = offset - point->out;
+
+		if (point->bits) {
+			unsigned char byte;
+			if (steg_stream_map_read(map, pos - 1, &byte, 1)) {
+				*error = "embedded data is truncated; the compressed stream ends early";
+				(void) inflateEnd(&strm);
+				return -1;
+			}
+
+			(void) inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+		}
+
+		if (point->out)
+			(void) inflateSetDictionary(&strm, point->window, INFLATE_INDEX_WINDOW_SIZE);
+	}
+
+	off_t stream_len = steg_stream_map_length(map);
+	ret = Z_OK;
+	while (len > 0 && ret != Z_STREAM_END) {
+		if (!strm.avail_in) {
+			size_t in_len = stream_len - pos > INFLATE_INDEX_BUFFER_SIZE ? INFLATE_INDEX_BUFFER_SIZE : stream_len - pos;
+			if (!in_len || steg_stream_map_read(map, pos, input, in_len)) {
+				*error = "embedded data is truncated; the compressed stream ends early";
+				ret = Z_DATA_ERROR;
+				break;
+			}
+
+			pos += in_len;
+			strm.avail_in = in_len;
+			strm.next_in = input;
+		}
+
+		strm.avail_out = INFLATE_INDEX_BUFFER_SIZE;
+		strm.next_out = output;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR) {
+			*error = strm.msg ? strm.msg : zError(ret);
+			break;
+		}
+
+		// discard data preceding the range, and write the rest
+		size_t have = INFLATE_INDEX_BUFFER_SIZE - strm.avail_out;
+		size_t discard = (off_t) have > skip ? (size_t) skip : have;
+		skip -= discard;
+
+		size_t piece = have - discard;
+		piece = (off_t) piece > len ? (size_t) len : piece;
+		if (payload_sink_write(sink, output + discard, piece)) {
+			*error = "failed to write inflated data to output file";
+			ret = Z_ERRNO;
+			break;
+		}
+
+		len -= piece;
+	}
+
+	(void) inflateEnd(&strm);
+	return ret == Z_OK || ret == Z_BUF_ERROR || ret == Z_STREAM_END ? 0 : -1;
+}
+
+void inflate_index_release(struct inflate_index *index)
+{
+	for (size_t i = 0; i < index->len; i++)
+		free(index->points[i].window);
+
+	free(index->points);
+	inflate_index_init(index);
+}
+
+/**
+ * Append a checkpoint to the index. The circular window holds the most recent
+ * inflated data, wrapping at the position `INFLATE_INDEX_WINDOW_SIZE - left`;
+ * the checkpoint stores it unwrapped, oldest byte first.
+ * */
+static void add_checkpoint(struct inflate_index *index, int bits, off_t in, off_t out,
+		unsigned int left, const unsigned char *window)
+{
+	if (index->len == index->alloc) {
+		index->alloc = index->alloc ? index->alloc * 2 : 16;
+		index->points = (struct inflate_checkpoint *) realloc(index->points,
+				sizeof(struct inflate_checkpoint) * index->alloc);
+		if (!index->points)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	struct inflate_checkpoint *point = &index->points[index->len++];
+	point->bits = bits;
+	point->in = in;
+	point->out = out;
+	point->window = (unsigned char *) malloc(sizeof(unsigned char) * INFLATE_INDEX_WINDOW_SIZE);
+	if (!point->window)
+		FATAL(MEM_ALLOC_FAILED);
+
+	if (left)
+		memcpy(point->window, window + INFLATE_INDEX_WINDOW_SIZE - left, left);
+	if (left < INFLATE_INDEX_WINDOW_SIZE)
+		memcpy(point->window + left, window, INFLATE_INDEX_WINDOW_SIZE - left);
+}
+
+/**
+ * Read the zlib trailer (the Adler-32 of the payload) of a stream of the given
+ * length. Returns zero if successful, and -1 otherwise.
+ * */
+static int read_trailer(const struct steg_stream_map *map, off_t stream_len, u_int32_t *trailer)
+{
+	unsigned char buffer[4];
+	if (stream_len < 4 || steg_stream_map_read(map, stream_len - 4, buffer, 4))
+		return -1;
+
+	*trailer = get_u32(buffer);
+	return 0;
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "io-ring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * The rings are shared with the kernel, so the head and tail indices must be
+ * accessed with acquire/release semantics.
+ * */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static void unmap_rings(struct io_ring *);
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(struct io_ring));
+	ring->fd = -1;
+
+	if (getenv("STEG_PNG_NO_IO_URING")) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(struct io_uring_params));
+
+	int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return -1;
+
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+
+	ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// newer kernels share a single mapping between both rings
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+		ring->cq_map_len = ring->sq_map_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring->sq_map = NULL;
+		io_ring_destroy(ring);
+		return -1;
+	}
+
+	ring->cq_map = ring->sq_map;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				fd, IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring->cq_map = NULL;
+			io_ring_destroy(ring);
+			return -1;
+		}
+	}
+
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		io_ring_destroy(ring);
+		return -1;
+	}
+
+	unsigned char *sq = (unsigned char *) ring->sq_map;
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+
+	unsigned char *cq = (unsigned char *) ring->cq_map;
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+int io_ring_queue_read(struct io_ring *ring, int fd, void *buffer, size_t len, off_t offset,
+		u_int64_t tag)
+{
+	// bounding the reads in flight by the ring size keeps the completion ring from overflowing
+	if (ring->in_flight == ring->entries)
+		return -1;
+
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (u_int64_t) (uintptr_t) buffer;
+	sqe->len = (u_int32_t) len;
+	sqe->off = (u_int64_t) offset;
+	sqe->user_data = tag;
+
+	ring->sq_array[index] = index;
+	store_release(ring->sq_tail, tail + 1);
+
+	ring->pending++;
+	ring->in_flight++;
+
+	return 0;
+}
+
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr)
+{
+	if (wait_nr > ring->in_flight)
+		wait_nr = ring->in_flight;
+
+	while (ring->pending || wait_nr) {
+		unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+		int submitted = (int) syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait_nr, flags, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			return -1;
+		}
+
+		ring->pending -= (unsigned int) submitted;
+		if (!ring->pending)
+			break;
+	}
+
+	return 0;
+}
+
+int io_ring_reap(struct io_ring *ring, u_int64_t *tag, int *res)
+{
+	unsigned int head = *ring->cq_head;
+	if (head == load_acquire(ring->cq_tail))
+		return 0;
+
+	const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+
+	store_release(ring->cq_head, head + 1);
+	ring->in_flight--;
+
+	return 1;
+}
+
+void io_ring_destroy(struct io_ring *ring)
+{
+	unmap_rings(ring);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	ring->fd = -1;
+	ring->in_flight = 0;
+	ring->pending = 0;
+}
+
+static void unmap_rings(struct io_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_map_len);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_len);
+
+	ring->sqes = NULL;
+	ring->cq_map = NULL;
+	ring->sq_map = NULL;
+}
+
+#else
+
+/*
+ * Without io_uring headers, the engine is never available, and callers always
+ * take the synchronous path.
+ * */
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(struct io_ring));
+	ring->fd = -1;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int io_ring_queue_read(struct io_ring *ring, int fd, void *buffer, size_t len, off_t offset,
+		u_int64_t tag)
+{
+	return -1;
+}
+
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr)
+{
+	return -1;
+}
+
+int io_ring_reap(struct io_ring *ring, u_int64_t *tag, int *res)
+{
+	return 0;
+}
+
+void io_ring_destroy(struct io_ring *ring)
+{
+	ring->fd = -1;
+}
+
+#endif
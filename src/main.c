@@ -1,12 +1,17 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "parse-options.h"
 #include "builtin.h"
+#include "png-chunk-processor.h"
 
 static struct steg_png_builtin builtins[] = {
 		{ "embed", &cmd_embed },
 		{ "extract", &cmd_extract },
 		{ "inspect", &cmd_inspect },
+		{ "strip", &cmd_strip },
+		{ "scan", &cmd_scan },
+		{ "verify", &cmd_verify },
 		{ NULL, NULL }
 };
 
@@ -27,6 +32,9 @@ int main(int argc, char *argv[])
 			OPT_CMD("embed", "embed a message in a PNG image", NULL),
 			OPT_CMD("extract", "extract a message in a PNG image", NULL),
 			OPT_CMD("inspect", "inspect the contents of a PNG image", NULL),
+			OPT_CMD("strip", "remove embedded data from PNG images", NULL),
+			OPT_CMD("scan", "find PNG images carrying embedded data", NULL),
+			OPT_CMD("verify", "check the structure and CRCs of PNG images", NULL),
 			OPT_GROUP("options"),
 			OPT_BOOL('h', "help", "show help and exit", &help),
 			OPT_END()
@@ -38,6 +46,14 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	/*
+	 * Builtins map images where they can. Defining STEG_PNG_NO_MMAP in the
+	 * environment makes them read through the file descriptor instead, so
+	 * that the tests can exercise both paths.
+	 * */
+	if (getenv("STEG_PNG_NO_MMAP"))
+		chunk_iterator_disable_mmap();
+
 	if (argc) {
 		struct steg_png_builtin *builtin = find_builtin(argc, argv);
 		if (builtin)
@@ -0,0 +1,291 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "md5-mb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_MD5_MB_VECTOR
+#endif
+
+/*
+ * A vector engine hashes every lane whether or not it's in use, so with fewer
+ * lanes than this, hashing each in turn is faster.
+ * */
+#define MD5_MB_MIN_VECTOR_LANES 3
+
+/*
+ * The state of every lane, one row per MD5 state word (A, B, C and D), so
+ * that each row can be loaded into a vector as is.
+ * */
+typedef uint32_t lane_state[4][MD5_MB_LANES];
+
+typedef void (*md5_mb_engine_fn)(lane_state, const unsigned char *const [], size_t, size_t);
+
+static void process_scalar(lane_state, const unsigned char *const [], size_t, size_t);
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static md5_mb_engine_fn engine = process_scalar;
+static const char *engine_name = "scalar";
+
+static void select_engine(void);
+
+void md5_mb_process_blocks(struct md5_ctx *ctx[], const unsigned char *const buffers[], size_t lanes,
+		size_t blocks)
+{
+	if (!lanes || !blocks)
+		return;
+
+	pthread_once(&engine_once, select_engine);
+
+	// unused lanes hash a copy of the first, and their results are dropped
+	lane_state state;
+	const unsigned char *lane_buffers[MD5_MB_LANES];
+	for (size_t i = 0; i < MD5_MB_LANES; i++) {
+		size_t src = i < lanes ? i : 0;
+		state[0][i] = ctx[src]->A;
+		state[1][i] = ctx[src]->B;
+		state[2][i] = ctx[src]->C;
+		state[3][i] = ctx[src]->D;
+		lane_buffers[i] = buffers[src];
+	}
+
+	if (lanes < MD5_MB_MIN_VECTOR_LANES)
+		process_scalar(state, lane_buffers, lanes, blocks);
+	else
+		engine(state, lane_buffers, lanes, blocks);
+
+	size_t len = blocks * MD5_MB_BLOCK_SIZE;
+	uint32_t lolen = (uint32_t) len;
+	for (size_t i = 0; i < lanes; i++) {
+		ctx[i]->A = state[0][i];
+		ctx[i]->B = state[1][i];
+		ctx[i]->C = state[2][i];
+		ctx[i]->D = state[3][i];
+
+		// the same double word increment as md5_process_block()
+		ctx[i]->total[0] += lolen;
+		ctx[i]->total[1] += (uint32_t) (len >> 31 >> 1) + (ctx[i]->total[0] < lolen);
+	}
+}
+
+const char *md5_mb_engine(void)
+{
+	pthread_once(&engine_once, select_engine);
+	return engine_name;
+}
+
+/**
+ * Hash each lane in turn with md5_process_block(), for processors without a
+ * vector engine.
+ * */
+static void process_scalar(lane_state state, const unsigned char *const buffers[], size_t lanes,
+		size_t blocks)
+{
+	for (size_t i = 0; i < lanes; i++) {
+		struct md5_ctx ctx;
+		md5_init_ctx(&ctx);
+		ctx.A = state[0][i];
+		ctx.B = state[1][i];
+		ctx.C = state[2][i];
+		ctx.D = state[3][i];
+
+		md5_process_block(buffers[i], blocks * MD5_MB_BLOCK_SIZE, &ctx);
+
+		state[0][i] = ctx.A;
+		state[1][i] = ctx.B;
+		state[2][i] = ctx.C;
+		state[3][i] = ctx.D;
+	}
+}
+
+#ifdef HAVE_MD5_MB_VECTOR
+
+/*
+ * Eight 32-bit lanes, using the GCC vector extensions rather than intrinsics.
+ * The compiler lowers operations on this type to whatever the target of the
+ * enclosing function provides: one AVX2 instruction each in process_avx2(), or
+ * the baseline instruction set in process_generic().
+ * */
+typedef uint32_t md5_vec __attribute__((vector_size(MD5_MB_LANES * sizeof(uint32_t))));
+
+static const uint32_t T[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+		0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+		0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+		0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+		0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+		0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+		0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+		0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+		0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+#define F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))
+#define H(b, c, d) ((b) ^ (c) ^ (d))
+#define I(b, c, d) ((c) ^ ((b) | ~(d)))
+
+#define STEP(f, a, b, c, d, k, s, i) \
+	do { \
+		a += f(b, c, d) + m[k] + T[i]; \
+		a = (a << (s)) | (a >> (32 - (s))); \
+		a += b; \
+	} while (0)
+
+/**
+ * Hash `blocks` blocks of every lane. Always inlined into the engines below,
+ * so that it's compiled once for each instruction set.
+ * */
+static inline __attribute__((always_inline)) void process_vector(lane_state state,
+		const unsigned char *const buffers[], size_t blocks)
+{
+	md5_vec a, b, c, d;
+	memcpy(&a, state[0], sizeof(md5_vec));
+	memcpy(&b, state[1], sizeof(md5_vec));
+	memcpy(&c, state[2], sizeof(md5_vec));
+	memcpy(&d, state[3], sizeof(md5_vec));
+
+	for (size_t block = 0; block < blocks; block++) {
+		/*
+		 * Transpose the next block of every lane, so that each message word is
+		 * a vector. x86 is little-endian, like MD5, so words are copied as is.
+		 * */
+		uint32_t words[16][MD5_MB_LANES];
+		for (size_t lane = 0; lane < MD5_MB_LANES; lane++) {
+			uint32_t lane_words[16];
+			memcpy(lane_words, buffers[lane] + block * MD5_MB_BLOCK_SIZE, MD5_MB_BLOCK_SIZE);
+			for (size_t j = 0; j < 16; j++)
+				words[j][lane] = lane_words[j];
+		}
+
+		md5_vec m[16];
+		memcpy(m, words, sizeof(m));
+
+		md5_vec a_save = a, b_save = b, c_save = c, d_save = d;
+
+		STEP(F, a, b, c, d, 0, 7, 0);
+		STEP(F, d, a, b, c, 1, 12, 1);
+		STEP(F, c, d, a, b, 2, 17, 2);
+		STEP(F, b, c, d, a, 3, 22, 3);
+		STEP(F, a, b, c, d, 4, 7, 4);
+		STEP(F, d, a, b, c, 5, 12, 5);
+		STEP(F, c, d, a, b, 6, 17, 6);
+		STEP(F, b, c, d, a, 7, 22, 7);
+		STEP(F, a, b, c, d, 8, 7, 8);
+		STEP(F, d, a, b, c, 9, 12, 9);
+		STEP(F, c, d, a, b, 10, 17, 10);
+		STEP(F, b, c, d, a, 11, 22, 11);
+		STEP(F, a, b, c, d, 12, 7, 12);
+		STEP(F, d, a, b, c, 13, 12, 13);
+		STEP(F, c, d, a, b, 14, 17, 14);
+		STEP(F, b, c, d, a, 15, 22, 15);
+
+		STEP(G, a, b, c, d, 1, 5, 16);
+		STEP(G, d, a, b, c, 6, 9, 17);
+		STEP(G, c, d, a, b, 11, 14, 18);
+		STEP(G, b, c, d, a, 0, 20, 19);
+		STEP(G, a, b, c, d, 5, 5, 20);
+		STEP(G, d, a, b, c, 10, 9, 21);
+		STEP(G, c, d, a, b, 15, 14, 22);
+		STEP(G, b, c, d, a, 4, 20, 23);
+		STEP(G, a, b, c, d, 9, 5, 24);
+		STEP(G, d, a, b, c, 14, 9, 25);
+		STEP(G, c, d, a, b, 3, 14, 26);
+		STEP(G, b, c, d, a, 8, 20, 27);
+		STEP(G, a, b, c, d, 13, 5, 28);
+		STEP(G, d, a, b, c, 2, 9, 29);
+		STEP(G, c, d, a, b, 7, 14, 30);
+		STEP(G, b, c, d, a, 12, 20, 31);
+
+		STEP(H, a, b, c, d, 5, 4, 32);
+		STEP(H, d, a, b, c, 8, 11, 33);
+		STEP(H, c, d, a, b, 11, 16, 34);
+		STEP(H, b, c, d, a, 14, 23, 35);
+		STEP(H, a, b, c, d, 1, 4, 36);
+		STEP(H, d, a, b, c, 4, 11, 37);
+		STEP(H, c, d, a, b, 7, 16, 38);
+		STEP(H, b, c, d, a, 10, 23, 39);
+		STEP(H, a, b, c, d, 13, 4, 40);
+		STEP(H, d, a, b, c, 0, 11, 41);
+		STEP(H, c, d, a, b, 3, 16, 42);
+		STEP(H, b, c, d, a, 6, 23, 43);
+		STEP(H, a, b, c, d, 9, 4, 44);
+		STEP(H, d, a, b, c, 12, 11, 45);
+		STEP(H, c, d, a, b, 15, 16, 46);
+		STEP(H, b, c, d, a, 2, 23, 47);
+
+		STEP(I, a, b, c, d, 0, 6, 48);
+		STEP(I, d, a, b, c, 7, 10, 49);
+		STEP(I, c, d, a, b, 14, 15, 50);
+		STEP(I, b, c, d, a, 5, 21, 51);
+		STEP(I, a, b, c, d, 12, 6, 52);
+		STEP(I, d, a, b, c, 3, 10, 53);
+		STEP(I, c, d, a, b, 10, 15, 54);
+		STEP(I, b, c, d, a, 1, 21, 55);
+		STEP(I, a, b, c, d, 8, 6, 56);
+		STEP(I, d, a, b, c, 15, 10, 57);
+		STEP(I, c, d, a, b, 6, 15, 58);
+		STEP(I, b, c, d, a, 13, 21, 59);
+		STEP(I, a, b, c, d, 4, 6, 60);
+		STEP(I, d, a, b, c, 11, 10, 61);
+		STEP(I, c, d, a, b, 2, 15, 62);
+		STEP(I, b, c, d, a, 9, 21, 63);
+
+		a += a_save;
+		b += b_save;
+		c += c_save;
+		d += d_save;
+	}
+
+	memcpy(state[0], &a, sizeof(md5_vec));
+	memcpy(state[1], &b, sizeof(md5_vec));
+	memcpy(state[2], &c, sizeof(md5_vec));
+	memcpy(state[3], &d, sizeof(md5_vec));
+}
+
+__attribute__((target("avx2")))
+static void process_avx2(lane_state state, const unsigned char *const buffers[], size_t lanes,
+		size_t blocks)
+{
+	process_vector(state, buffers, blocks);
+}
+
+/**
+ * Portable fallback for processors without AVX2: the same vector extension
+ * code, compiled for the baseline target rather than hand-written for any
+ * particular instruction set. The compiler splits each operation across
+ * whatever vector registers the baseline provides.
+ * */
+static void process_generic(lane_state state, const unsigned char *const buffers[], size_t lanes,
+		size_t blocks)
+{
+	process_vector(state, buffers, blocks);
+}
+
+#endif
+
+static void select_engine(void)
+{
+	if (getenv("STEG_PNG_NO_SIMD"))
+		return;
+
+#ifdef HAVE_MD5_MB_VECTOR
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		engine = process_avx2;
+		engine_name = "avx2";
+	} else {
+		engine = process_generic;
+		engine_name = "generic";
+	}
+#endif
+}
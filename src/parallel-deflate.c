@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "parallel-deflate.h"
+#include "steg-stream.h"
+#include "utils.h"
+
+#define ZLIB_HEADER_LENGTH 2
+#define ZLIB_TRAILER_LENGTH 4
+
+static void init_compressor(struct parallel_deflate *, int, unsigned int, int, enum steg_codec);
+static void compress_block(void *);
+static size_t write_zlib_header(unsigned char *, int);
+
+void parallel_deflate_init(struct parallel_deflate *pd, int level, unsigned int threads)
+{
+	init_compressor(pd, level, threads, 0, STEG_CODEC_ZLIB);
+}
+
+void parallel_deflate_init_segmented(struct parallel_deflate *pd, enum steg_codec codec, int level,
+		unsigned int threads)
+{
+	init_compressor(pd, level, threads, 1, codec);
+}
+
+/**
+ * Initialize the compressor, producing a segmented steg stream compressed with
+ * `codec` if `segmented` is non-zero, and a single zlib stream otherwise.
+ * */
+static void init_compressor(struct parallel_deflate *pd, int level, unsigned int threads, int segmented,
+		enum steg_codec codec)
+{
+	if (!threads)
+		BUG("parallel deflate requires at least one thread");
+
+	thread_pool_init(&pd->pool, threads);
+	pd->level = level;
+	pd->codec = codec;
+	pd->segmented = segmented;
+	pd->stream_flags = 0;
+
+	pd->block_size = segmented ? PARALLEL_DEFLATE_SEGMENT_SIZE : PARALLEL_DEFLATE_BLOCK_SIZE;
+	pd->input_capacity = (size_t) threads * pd->block_size;
+	pd->input = (unsigned char *) malloc(sizeof(unsigned char) * pd->input_capacity);
+	if (!pd->input)
+		FATAL(MEM_ALLOC_FAILED);
+
+	pd->block_count = threads;
+	pd->blocks = (struct parallel_deflate_block *) calloc(threads, sizeof(struct parallel_deflate_block));
+	if (!pd->blocks)
+		FATAL(MEM_ALLOC_FAILED);
+
+	size_t output_capacity = segmented ? STEG_STREAM_HEADER_LENGTH + STEG_SEGMENT_HEADER_LENGTH
+			: ZLIB_HEADER_LENGTH + ZLIB_TRAILER_LENGTH;
+	for (unsigned int i = 0; i < threads; i++) {
+		struct parallel_deflate_block *block = &pd->blocks[i];
+		block->level = level;
+		block->segmented = segmented;
+		block->strm.zalloc = Z_NULL;
+		block->strm.zfree = Z_NULL;
+		block->strm.opaque = Z_NULL;
+
+		/*
+		 * Segments are compressed independently with the codec of the stream.
+		 * Otherwise, blocks are raw deflate, and the zlib header and trailer
+		 * are written around them.
+		 * */
+		size_t bound;
+		if (segmented) {
+			steg_codec_encoder_init(&block->encoder, codec, level);
+			bound = steg_codec_compress_bound(&block->encoder, pd->block_size);
+		} else {
+			int ret = deflateInit2(&block->strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+			if (ret != Z_OK)
+				FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+
+			bound = deflateBound(&block->strm, pd->block_size);
+		}
+
+		// leave room for the sync flush marker or segment header of the block
+		block->out_capacity = bound + 16;
+		block->out = (unsigned char *) malloc(sizeof(unsigned char) * block->out_capacity);
+		if (!block->out)
+			FATAL(MEM_ALLOC_FAILED);
+
+		output_capacity += block->out_capacity + STEG_SEGMENT_HEADER_LENGTH;
+	}
+
+	pd->output_capacity = output_capacity;
+	pd->output = (unsigned char *) malloc(sizeof(unsigned char) * pd->output_capacity);
+	if (!pd->output)
+		FATAL(MEM_ALLOC_FAILED);
+
+	pd->dictionary_len = 0;
+	pd->adler = adler32(0L, Z_NULL, 0);
+	pd->header_written = 0;
+	pd->finished = 0;
+}
+
+unsigned char *parallel_deflate_input(struct parallel_deflate *pd, size_t *capacity)
+{
+	*capacity = pd->input_capacity;
+	return pd->input;
+}
+
+int parallel_deflate_round(struct parallel_deflate *pd, size_t len, int finish,
+		const unsigned char **out, size_t *out_len)
+{
+	if (pd->finished)
+		BUG("parallel deflate stream already finished");
+	if (!finish && len != pd->input_capacity && !pd->segmented)
+		BUG("only the last round of parallel deflate may be partially filled");
+
+	/*
+	 * Split the input into blocks. Unless segmented, the last round always has
+	 * at least one block, even if empty, since the final block must be marked
+	 * as such.
+	 * */
+	unsigned int blocks = (unsigned int) ((len + pd->block_size - 1) / pd->block_size);
+	if (!blocks && !pd->segmented)
+		blocks = 1;
+
+	for (unsigned int i = 0; i < blocks; i++) {
+		struct parallel_deflate_block *block = &pd->blocks[i];
+		size_t offset = (size_t) i * pd->block_size;
+
+		block->in = pd->input + offset;
+		block->in_len = len - offset > pd->block_size ? pd->block_size : len - offset;
+		block->last = finish && i == blocks - 1;
+
+		// prime with the input preceding this block, unless independent
+		if (pd->segmented) {
+			block->dict = NULL;
+			block->dict_len = 0;
+		} else if (i == 0) {
+			block->dict = pd->dictionary;
+			block->dict_len = pd->dictionary_len;
+		} else {
+			block->dict = block->in - PARALLEL_DEFLATE_DICT_SIZE;
+			block->dict_len = PARALLEL_DEFLATE_DICT_SIZE;
+		}
+
+		thread_pool_submit(&pd->pool, compress_block, block);
+	}
+
+	thread_pool_wait(&pd->pool);
+
+	// stitch the blocks together, combining the checksum as we go
+	size_t total = 0;
+	if (!pd->header_written && pd->segmented) {
+		steg_stream_encode_header(pd->output, (unsigned char) pd->codec, pd->stream_flags);
+		total += STEG_STREAM_HEADER_LENGTH;
+		pd->header_written = 1;
+	} else if (!pd->header_written) {
+		total += write_zlib_header(pd->output, pd->level);
+		pd->header_written = 1;
+	}
+
+	for (unsigned int i = 0; i < blocks; i++) {
+		struct parallel_deflate_block *block = &pd->blocks[i];
+		if (block->status)
+			return -1;
+
+		if (pd->segmented) {
+			struct steg_segment_header header = {
+				.compressed_len = (u_int32_t) block->out_len,
+				.uncompressed_len = (u_int32_t) block->in_len,
+				.crc = (u_int32_t) block->crc
+			};
+
+			steg_segment_encode_header(pd->output + total, &header);
+			total += STEG_SEGMENT_HEADER_LENGTH;
+		}
+
+		memcpy(pd->output + total, block->out, block->out_len);
+		total += block->out_len;
+
+		if (!pd->segmented)
+			pd->adler = adler32_combine(pd->adler, block->adler, (z_off_t) block->in_len);
+	}
+
+	if (finish && pd->segmented) {
+		// a segment header of zeros marks the end of the stream
+		memset(pd->output + total, 0, STEG_SEGMENT_HEADER_LENGTH);
+		total += STEG_SEGMENT_HEADER_LENGTH;
+		pd->finished = 1;
+	} else if (finish) {
+		pd->output[total++] = (unsigned char) (pd->adler >> 24);
+		pd->output[total++] = (unsigned char) (pd->adler >> 16);
+		pd->output[total++] = (unsigned char) (pd->adler >> 8);
+		pd->output[total++] = (unsigned char) pd->adler;
+		pd->finished = 1;
+	} else if (!pd->segmented) {
+		memcpy(pd->dictionary, pd->input + len - PARALLEL_DEFLATE_DICT_SIZE, PARALLEL_DEFLATE_DICT_SIZE);
+		pd->dictionary_len = PARALLEL_DEFLATE_DICT_SIZE;
+	}
+
+	*out = pd->output;
+	*out_len = total;
+
+	return 0;
+}
+
+void parallel_deflate_destroy(struct parallel_deflate *pd)
+{
+	thread_pool_destroy(&pd->pool);
+
+	for (unsigned int i = 0; i < pd->block_count; i++) {
+		if (pd->segmented)
+			steg_codec_encoder_destroy(&pd->blocks[i].encoder);
+		else
+			(void) deflateEnd(&pd->blocks[i].strm);
+
+		free(pd->blocks[i].out);
+	}
+
+	free(pd->blocks);
+	free(pd->input);
+	free(pd->output);
+}
+
+/**
+ * Thread pool job that compresses a single block as raw DEFLATE. All blocks but
+ * the last end with a sync flush so the next block starts on a byte boundary.
+ *
+ * Segments are instead compressed whole with the codec of the stream, without
+ * a dictionary, and their CRC-32 is computed for the segment header.
+ * */
+static void compress_block(void *arg)
+{
+	struct parallel_deflate_block *block = (struct parallel_deflate_block *) arg;
+	struct z_stream_s *strm = &block->strm;
+
+	block->status = -1;
+	block->out_len = 0;
+	if (block->segmented) {
+		block->crc = crc32_update(0, block->in, block->in_len);
+		block->status = steg_codec_compress(&block->encoder, block->in, block->in_len,
+				block->out, block->out_capacity, &block->out_len);
+		return;
+	}
+
+	block->adler = adler32(adler32(0L, Z_NULL, 0), block->in, (uInt) block->in_len);
+
+	if (deflateReset(strm) != Z_OK)
+		return;
+	if (block->dict_len && deflateSetDictionary(strm, block->dict, (uInt) block->dict_len) != Z_OK)
+		return;
+
+	strm->next_in = (unsigned char *) block->in;
+	strm->avail_in = (uInt) block->in_len;
+	strm->next_out = block->out;
+	strm->avail_out = (uInt) block->out_capacity;
+
+	int ret = deflate(strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (block->last ? ret != Z_STREAM_END : ret != Z_OK)
+		return;
+
+	// the output buffer is sized to hold the whole block
+	if (strm->avail_in || !strm->avail_out)
+		return;
+
+	block->out_len = block->out_capacity - strm->avail_out;
+	block->status = 0;
+}
+
+/**
+ * Write the two byte zlib header for a stream compressed at the given level into
+ * the buffer, and return its length.
+ * */
+static size_t write_zlib_header(unsigned char *buffer, int level)
+{
+	// deflate with a 32 KiB window
+	unsigned int cmf = 0x78;
+
+	// compression level hint, as written by zlib
+	unsigned int flevel = 2;
+	if (level == Z_DEFAULT_COMPRESSION || level == 6)
+		flevel = 2;
+	else if (level < 2)
+		flevel = 0;
+	else if (level < 6)
+		flevel = 1;
+	else
+		flevel = 3;
+
+	unsigned int flg = flevel << 6;
+	flg += 31 - ((cmf << 8) + flg) % 31;
+
+	buffer[0] = (unsigned char) cmf;
+	buffer[1] = (unsigned char) flg;
+
+	return ZLIB_HEADER_LENGTH;
+}
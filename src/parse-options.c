@@ -40,8 +40,9 @@ int parse_options(int argc, char *argv[], const struct command_option options[],
 		if (!strncmp(arg, "--", 2)) {
 			// if argument is prefixed with `--`, it is a long argument
 			shifted_args = parse_long_option(new_len, argv, arg_index, options);
-		} else if (arg[0] == '-') {
+		} else if (arg[0] == '-' && arg[1]) {
 			// if argument is prefixed by `-`, it is short argument (may be multiple args combined combined)
+			// a lone `-` is not an option; it typically refers to stdin or stdout
 			shifted_args = parse_short_option(new_len, argv, arg_index, options);
 		} else {
 			// if argument is not an option, check to see if it is a valid command
@@ -315,7 +316,7 @@ void show_options(const struct command_option opts[], int err)
 				printed_chars += fprintf(fp, ", --%s=<n>", opt.l_flag);
 			else if (opt.l_flag)
 				printed_chars += fprintf(fp, "--%s=<n>", opt.l_flag);
-		} else if (opt.type == OPTION_STRING_T) {
+		} else if (opt.type == OPTION_STRING_T || opt.type == OPTION_STRING_LIST_T) {
 			if (opt.s_flag)
 				printed_chars += fprintf(fp, "-%c", opt.s_flag);
 
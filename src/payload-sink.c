@@ -0,0 +1,123 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "payload-sink.h"
+#include "utils.h"
+
+void payload_sink_init(struct payload_sink *sink)
+{
+	sink->len = 0;
+	sink->to_file = 0;
+	sink->to_hexdump = 0;
+	sink->hexdump_stream = NULL;
+	sink->hexdump_line_len = 0;
+}
+
+int payload_sink_open_file(struct payload_sink *sink, const char *path, mode_t mode)
+{
+	if (atomic_file_open(&sink->file, path, mode))
+		return -1;
+
+	sink->to_file = 1;
+	return 0;
+}
+
+void payload_sink_hexdump(struct payload_sink *sink, FILE *stream)
+{
+	sink->to_hexdump = 1;
+	sink->hexdump_stream = stream;
+}
+
+/**
+ * Print the hexdump of the given data, holding back any trailing partial line
+ * until more data arrives so that lines are not broken between writes.
+ * */
+static void write_hexdump(struct payload_sink *sink, const unsigned char *data, size_t len)
+{
+	off_t offset = sink->len - sink->hexdump_line_len;
+
+	// complete the partial line from the last write first
+	if (sink->hexdump_line_len) {
+		size_t fill = HEXDUMP_LINE_LENGTH - sink->hexdump_line_len;
+		fill = fill > len ? len : fill;
+
+		memcpy(sink->hexdump_line + sink->hexdump_line_len, data, fill);
+		sink->hexdump_line_len += fill;
+		data += fill;
+		len -= fill;
+
+		if (sink->hexdump_line_len < HEXDUMP_LINE_LENGTH)
+			return;
+
+		hex_dump(sink->hexdump_stream, offset, sink->hexdump_line, HEXDUMP_LINE_LENGTH);
+		offset += HEXDUMP_LINE_LENGTH;
+		sink->hexdump_line_len = 0;
+	}
+
+	size_t whole_lines = len - (len % HEXDUMP_LINE_LENGTH);
+	hex_dump(sink->hexdump_stream, offset, (unsigned char *) data, whole_lines);
+
+	sink->hexdump_line_len = len - whole_lines;
+	memcpy(sink->hexdump_line, data + whole_lines, sink->hexdump_line_len);
+}
+
+int payload_sink_write(struct payload_sink *sink, const void *data, size_t len)
+{
+	if (!len)
+		return 0;
+
+	if (sink->to_file && recoverable_write(sink->file.fd, data, len) != (ssize_t) len)
+		return -1;
+
+	if (sink->to_hexdump)
+		write_hexdump(sink, data, len);
+	sink->len += len;
+
+	return 0;
+}
+
+int payload_sink_is_seekable(struct payload_sink *sink)
+{
+	return sink->to_file && !sink->to_hexdump && !atomic_file_is_stdout(&sink->file);
+}
+
+int payload_sink_pwrite(struct payload_sink *sink, const void *data, size_t len, off_t offset)
+{
+	if (!payload_sink_is_seekable(sink))
+		BUG("positioned write to a payload sink that is not seekable");
+
+	if (recoverable_pwrite(sink->file.fd, data, len, offset) != (ssize_t) len)
+		return -1;
+
+	return 0;
+}
+
+void payload_sink_set_length(struct payload_sink *sink, off_t len)
+{
+	sink->len = len;
+}
+
+int payload_sink_commit(struct payload_sink *sink)
+{
+	if (sink->to_hexdump && sink->hexdump_line_len) {
+		hex_dump(sink->hexdump_stream, sink->len - sink->hexdump_line_len,
+				sink->hexdump_line, sink->hexdump_line_len);
+		sink->hexdump_line_len = 0;
+	}
+
+	if (sink->to_file) {
+		sink->to_file = 0;
+		return atomic_file_commit(&sink->file);
+	}
+
+	return 0;
+}
+
+void payload_sink_rollback(struct payload_sink *sink)
+{
+	if (sink->to_file)
+		atomic_file_rollback(&sink->file);
+
+	sink->to_file = 0;
+	sink->hexdump_line_len = 0;
+}
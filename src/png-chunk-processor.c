@@ -1,8 +1,12 @@
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
+#include "digest.h"
 #include "png-chunk-processor.h"
 #include "utils.h"
 
@@ -16,137 +20,243 @@ const char PLTE_CHUNK_TYPE[] = {'P', 'L', 'T', 'E'};
 const char IDAT_CHUNK_TYPE[] = {'I', 'D', 'A', 'T'};
 const char IEND_CHUNK_TYPE[] = {'I', 'E', 'N', 'D'};
 
-static int construct_png_chunk_detail(int, struct png_chunk_detail *);
+#define CHUNK_ITERATOR_BUFFER_SIZE 65536
+#define CHUNK_ITERATOR_DIGEST_BATCH (4 * 1024 * 1024)
+
+static int init_buffered_ctx(struct chunk_iterator_ctx *, int, size_t);
+static void reset_ctx(struct chunk_iterator_ctx *, int);
+static const unsigned char *peek(struct chunk_iterator_ctx *, off_t, size_t, int *);
+static const unsigned char *peek_cached(struct chunk_iterator_ctx *, off_t, size_t);
+static const unsigned char *peek_stream(struct chunk_iterator_ctx *, off_t, size_t, int *);
+static ssize_t read_direct(struct chunk_iterator_ctx *, unsigned char *, size_t);
+static int load_lookahead(struct chunk_iterator_ctx *);
+static int load_header(struct chunk_iterator_ctx *, off_t);
+static int load_crc(struct chunk_iterator_ctx *, int);
+static void digest_through(struct chunk_iterator_ctx *, off_t);
+
+// set through chunk_iterator_disable_mmap()
+static int mmap_disabled;
 
 int chunk_iterator_init_ctx(struct chunk_iterator_ctx *ctx, int fd)
 {
-	off_t offset = lseek(fd, 0, SEEK_SET);
-	if (offset < 0)
+	return init_buffered_ctx(ctx, fd, CHUNK_ITERATOR_BUFFER_SIZE);
+}
+
+int chunk_iterator_init_header_ctx(struct chunk_iterator_ctx *ctx, int fd)
+{
+	// a buffer holding exactly one chunk header never picks up chunk data
+	return init_buffered_ctx(ctx, fd, CHUNK_HEADER_LENGTH);
+}
+
+/**
+ * Initialize a context backed by the file descriptor, reading through a buffer
+ * of `capacity` bytes, which must hold at least a chunk header.
+ * */
+static int init_buffered_ctx(struct chunk_iterator_ctx *ctx, int fd, size_t capacity)
+{
+	reset_ctx(ctx, fd);
+	ctx->buffer_capacity = capacity;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
 		return -1;
+	if (S_ISREG(st.st_mode))
+		ctx->file_len = st.st_size;
+
+	// pipes, FIFOs and sockets can only be read front to back
+	if (lseek(fd, 0, SEEK_CUR) < 0) {
+		if (errno != ESPIPE)
+			return -1;
+
+		errno = 0;
+		ctx->is_stream = 1;
+	}
 
-	unsigned char signature[SIGNATURE_LENGTH];
-	if (recoverable_read(fd, signature, SIGNATURE_LENGTH) != SIGNATURE_LENGTH)
+	ctx->buffer = (unsigned char *) malloc(sizeof(unsigned char) * ctx->buffer_capacity);
+	if (!ctx->buffer)
+		FATAL(MEM_ALLOC_FAILED);
+
+	int err = 0;
+	const unsigned char *signature = peek(ctx, 0, SIGNATURE_LENGTH, &err);
+	if (!signature) {
+		chunk_iterator_destroy_ctx(ctx);
 		return -1;
+	}
 
-	if (memcmp(PNG_SIG, signature, SIGNATURE_LENGTH * sizeof(unsigned char)) != 0)
+	if (memcmp(PNG_SIG, signature, SIGNATURE_LENGTH * sizeof(unsigned char)) != 0) {
+		chunk_iterator_destroy_ctx(ctx);
 		return 1;
-
-	ctx->fd = fd;
-	ctx->initialized = 0;
-	ctx->current_chunk = (struct png_chunk_detail) {
-		.chunk_type = {0, 0, 0, 0},
-		.data_length = 0,
-		.chunk_crc = 0
-	};
+	}
 
 	return 0;
 }
 
-int chunk_iterator_has_next(struct chunk_iterator_ctx *ctx)
+void chunk_iterator_disable_mmap(void)
 {
-	// get the current file offset
-	off_t file_offset = lseek(ctx->fd, 0, SEEK_CUR);
-	if (file_offset < 0)
-		return -1;
-	if (file_offset < SIGNATURE_LENGTH)
+	mmap_disabled = 1;
+}
+
+int chunk_iterator_init_mmap_ctx(struct chunk_iterator_ctx *ctx, int fd)
+{
+	if (mmap_disabled)
+		return chunk_iterator_init_ctx(ctx, fd);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
 		return -1;
+	if (!S_ISREG(st.st_mode) || st.st_size < SIGNATURE_LENGTH)
+		return chunk_iterator_init_ctx(ctx, fd);
 
-	// move the file offset to the beginning of the next chunk
-	struct png_chunk_detail current_chunk = ctx->current_chunk;
-	if (ctx->initialized) {
-		off_t next_chunk_offset = ctx->chunk_file_offset;
-		next_chunk_offset += sizeof(u_int32_t);
-		next_chunk_offset += sizeof(char) * CHUNK_TYPE_LENGTH;
-		next_chunk_offset += sizeof(unsigned char) * current_chunk.data_length;
-		next_chunk_offset += sizeof(u_int32_t);
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return chunk_iterator_init_ctx(ctx, fd);
 
-		if (lseek(ctx->fd, next_chunk_offset, SEEK_SET) < 0)
-			return -1;
+	if (memcmp(PNG_SIG, map, SIGNATURE_LENGTH * sizeof(unsigned char)) != 0) {
+		munmap(map, st.st_size);
+		return 1;
 	}
 
-	// try to construct the png_chunk_detail, but simply throw away the result
-	struct png_chunk_detail detail;
-	int ret = construct_png_chunk_detail(ctx->fd, &detail);
-	if (ret == -1)
-		return -1;
-	if (ret == 1)
-		return 0;
+	// chunks are walked front to back, so let the kernel read ahead aggressively
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-	// reset fd offset to where it was initially
-	if (lseek(ctx->fd, file_offset, SEEK_SET) < 0)
-		return -1;
+	reset_ctx(ctx, fd);
+	ctx->file_len = st.st_size;
+	ctx->map = map;
+	ctx->map_len = st.st_size;
 
-	return 1;
+	return 0;
 }
 
-int chunk_iterator_next(struct chunk_iterator_ctx *ctx)
+int png_chunk_decode_header(const unsigned char *header, off_t offset, off_t file_len,
+		struct png_chunk_detail *chunk)
 {
-	// move the file offset to the beginning of the next chunk
-	struct png_chunk_detail current_chunk = ctx->current_chunk;
-	if (ctx->initialized) {
-		off_t next_chunk_offset = ctx->chunk_file_offset;
-		next_chunk_offset += sizeof(u_int32_t);
-		next_chunk_offset += sizeof(char) * CHUNK_TYPE_LENGTH;
-		next_chunk_offset += sizeof(unsigned char) * current_chunk.data_length;
-		next_chunk_offset += sizeof(u_int32_t);
-
-		off_t offset = lseek(ctx->fd, next_chunk_offset, SEEK_SET);
-		if (offset < 0)
-			return -1;
+	// read chunk data length and convert from network byte order to host byte order
+	memcpy(&chunk->data_length, header, sizeof(u_int32_t));
+	chunk->data_length = ntohl(chunk->data_length);
+
+	// read chunk type and ensure valid asccii characters
+	memcpy(chunk->chunk_type, header + sizeof(u_int32_t), CHUNK_TYPE_LENGTH);
+	for (size_t i = 0; i < CHUNK_TYPE_LENGTH; i++) {
+		if (!isascii(chunk->chunk_type[i]))
+			return 1;
 	}
 
-	// read the current file offset from the file descriptor
-	off_t file_offset = lseek(ctx->fd, 0, SEEK_CUR);
-	if (file_offset < 0)
+	// if the file length is known, make sure the whole chunk is there
+	if (file_len >= 0 && file_len - offset < (off_t) CHUNK_LENGTH(chunk->data_length))
+		return 1;
+
+	chunk->chunk_crc = 0;
+	return 0;
+}
+
+int chunk_iterator_has_next(struct chunk_iterator_ctx *ctx)
+{
+	int ret = load_lookahead(ctx);
+	if (ret < 0)
 		return -1;
-	if (file_offset < SIGNATURE_LENGTH)
+
+	return !ret;
+}
+
+int chunk_iterator_next(struct chunk_iterator_ctx *ctx)
+{
+	if (load_lookahead(ctx))
 		return -1;
 
-	// try to construct the png_chunk_detail
 	ctx->initialized = 1;
-	ctx->chunk_file_offset = lseek(ctx->fd, 0, SEEK_CUR);
-	if (ctx->chunk_file_offset < 0)
-		return -1;
+	ctx->lookahead_valid = 0;
+	ctx->chunk_file_offset = ctx->next_chunk_file_offset;
+	ctx->current_chunk = ctx->next_chunk;
+	ctx->data_offset = ctx->chunk_file_offset + CHUNK_HEADER_LENGTH;
 
-	int ret = construct_png_chunk_detail(ctx->fd, &ctx->current_chunk);
-	if (ret != 0)
-		return ret;
+	// pick up the CRC for free if it's already in memory
+	ctx->crc_valid = 0;
+	load_crc(ctx, 0);
 
-	// seek fd file offset to beginning of data portion
-	off_t data_offset = file_offset + sizeof(u_int32_t) + (sizeof(char) * CHUNK_TYPE_LENGTH);
-	if (lseek(ctx->fd, data_offset, SEEK_SET) < 0)
-		return -1;
+	// hash a few megabytes at a time, rather than one small chunk at a time
+	off_t chunk_end = ctx->chunk_file_offset + CHUNK_LENGTH(ctx->current_chunk.data_length);
+	if (ctx->digest && chunk_end - ctx->digest_offset >= CHUNK_ITERATOR_DIGEST_BATCH)
+		digest_through(ctx, chunk_end);
 
 	return 0;
 }
 
+int chunk_iterator_seek(struct chunk_iterator_ctx *ctx, off_t offset)
+{
+	if (offset < SIGNATURE_LENGTH)
+		return 1;
+
+	ctx->lookahead_valid = 0;
+	return load_header(ctx, offset);
+}
+
+int chunk_iterator_find_iend(struct chunk_iterator_ctx *ctx)
+{
+	if (ctx->is_stream || ctx->file_len < SIGNATURE_LENGTH + (off_t) CHUNK_LENGTH(0))
+		return 1;
+
+	int ret = chunk_iterator_seek(ctx, ctx->file_len - CHUNK_LENGTH(0));
+	if (ret)
+		return ret;
+
+	if (ctx->next_chunk.data_length || memcmp(ctx->next_chunk.chunk_type, IEND_CHUNK_TYPE, CHUNK_TYPE_LENGTH)) {
+		ctx->lookahead_valid = 0;
+		return 1;
+	}
+
+	return chunk_iterator_next(ctx) ? -1 : 0;
+}
+
 ssize_t chunk_iterator_read_data(struct chunk_iterator_ctx *ctx, unsigned char* buffer, size_t length)
 {
 	if (!ctx->initialized)
 		return -1;
 
-	off_t file_offset = lseek(ctx->fd, 0, SEEK_CUR);
-	if (file_offset < 0)
-		return -1;
-	if (file_offset < SIGNATURE_LENGTH)
-		return -1;
-
-	off_t data_segment_start = ctx->chunk_file_offset
-			+ sizeof(u_int32_t) + (sizeof(char) * CHUNK_TYPE_LENGTH);
-	if (file_offset < data_segment_start)
-		return -1;
-	if (file_offset >= (data_segment_start + ctx->current_chunk.data_length))
+	off_t data_end = ctx->chunk_file_offset + CHUNK_HEADER_LENGTH + ctx->current_chunk.data_length;
+	size_t bytes_left_to_read = data_end - ctx->data_offset;
+	bytes_left_to_read = bytes_left_to_read > length ? length : bytes_left_to_read;
+	if (!bytes_left_to_read)
 		return 0;
 
-	size_t bytes_left_to_read = data_segment_start + ctx->current_chunk.data_length
-			- file_offset;
-	bytes_left_to_read = bytes_left_to_read > length ? length : bytes_left_to_read;
-	if (recoverable_read(ctx->fd, buffer, bytes_left_to_read) != bytes_left_to_read)
-		return -1;
+	/*
+	 * Large reads that miss the buffer go straight into the caller's buffer.
+	 * Anything else is served from (and if necessary, refills) the buffer.
+	 * */
+	const unsigned char *data = peek_cached(ctx, ctx->data_offset, 1);
+	if (!data && bytes_left_to_read >= ctx->buffer_capacity) {
+		if (read_direct(ctx, buffer, bytes_left_to_read) != bytes_left_to_read)
+			return -1;
+	} else {
+		int err = 0;
+		if (!data && !(data = peek(ctx, ctx->data_offset, 1, &err)))
+			return -1;
+
+		size_t cached = ctx->map ? bytes_left_to_read
+				: (size_t) (ctx->buffer_offset + ctx->buffer_len - ctx->data_offset);
+		bytes_left_to_read = bytes_left_to_read > cached ? cached : bytes_left_to_read;
+		memcpy(buffer, data, bytes_left_to_read);
+	}
+
+	ctx->data_offset += bytes_left_to_read;
+	if (ctx->data_offset == data_end)
+		load_crc(ctx, 0);
 
 	return bytes_left_to_read;
 }
 
+int chunk_iterator_is_stream(struct chunk_iterator_ctx *ctx)
+{
+	return ctx->is_stream;
+}
+
+const unsigned char *chunk_iterator_get_chunk_data(struct chunk_iterator_ctx *ctx)
+{
+	if (!ctx->initialized || !ctx->map)
+		return NULL;
+
+	return ctx->map + ctx->chunk_file_offset + CHUNK_HEADER_LENGTH;
+}
+
 int chunk_iterator_get_chunk_data_length(struct chunk_iterator_ctx *ctx, u_int32_t *len)
 {
 	if (!ctx->initialized)
@@ -169,6 +279,8 @@ int chunk_iterator_get_chunk_crc(struct chunk_iterator_ctx *ctx, u_int32_t *crc)
 {
 	if (!ctx->initialized)
 		return 1;
+	if (load_crc(ctx, 1))
+		return 1;
 
 	*crc = ctx->current_chunk.chunk_crc;
 	return 0;
@@ -199,60 +311,295 @@ int chunk_iterator_is_ancillary(struct chunk_iterator_ctx *ctx)
 	return !chunk_iterator_is_critical(ctx);
 }
 
+int chunk_iterator_begin_digest(struct chunk_iterator_ctx *ctx, struct digest_ctx *digest)
+{
+	if (!ctx->map)
+		return -1;
+
+	ctx->digest = digest;
+	ctx->digest_offset = 0;
+
+	return 0;
+}
+
+void chunk_iterator_finish_digest(struct chunk_iterator_ctx *ctx, unsigned char hash[])
+{
+	if (!ctx->digest)
+		BUG("no digest was begun for the chunk iterator");
+
+	digest_through(ctx, (off_t) ctx->map_len);
+	digest_final(ctx->digest, hash);
+	ctx->digest = NULL;
+}
+
 void chunk_iterator_destroy_ctx(struct chunk_iterator_ctx *ctx)
 {
-	ctx->fd = -1;
-	ctx->current_chunk = (struct png_chunk_detail) {
-			.chunk_type = {0, 0, 0, 0},
-			.data_length = 0,
-			.chunk_crc = 0
+	if (ctx->map)
+		munmap(ctx->map, ctx->map_len);
+
+	free(ctx->buffer);
+	reset_ctx(ctx, -1);
+}
+
+/**
+ * Reset every field of the context to its initial state, without releasing any
+ * resources.
+ * */
+static void reset_ctx(struct chunk_iterator_ctx *ctx, int fd)
+{
+	const struct png_chunk_detail empty_chunk = {
+		.chunk_type = {0, 0, 0, 0},
+		.data_length = 0,
+		.chunk_crc = 0
 	};
+
+	ctx->fd = fd;
+	ctx->initialized = 0;
+	ctx->chunk_file_offset = 0;
+	ctx->current_chunk = empty_chunk;
+	ctx->lookahead_valid = 0;
+	ctx->crc_valid = 0;
+	ctx->next_chunk_file_offset = SIGNATURE_LENGTH;
+	ctx->next_chunk = empty_chunk;
+	ctx->data_offset = 0;
+	ctx->file_len = -1;
+	ctx->is_stream = 0;
+	ctx->buffer = NULL;
+	ctx->buffer_capacity = 0;
+	ctx->buffer_len = 0;
+	ctx->buffer_offset = 0;
+	ctx->map = NULL;
+	ctx->map_len = 0;
+	ctx->digest = NULL;
+	ctx->digest_offset = 0;
+}
+
+/**
+ * Get a pointer to `len` bytes of the file at the given offset, but only if
+ * those bytes are already in memory (mapped or buffered). No I/O is performed.
+ *
+ * Returns NULL if the bytes are not available in memory.
+ * */
+static const unsigned char *peek_cached(struct chunk_iterator_ctx *ctx, off_t offset, size_t len)
+{
+	if (ctx->map) {
+		if (offset < 0 || (size_t) offset > ctx->map_len || ctx->map_len - offset < len)
+			return NULL;
+
+		return ctx->map + offset;
+	}
+
+	if (offset < ctx->buffer_offset)
+		return NULL;
+	if (offset + (off_t) len > ctx->buffer_offset + (off_t) ctx->buffer_len)
+		return NULL;
+
+	return ctx->buffer + (offset - ctx->buffer_offset);
 }
 
 /**
- * Attempt to construct a struct png_chunk_detail from a given position in a file.
+ * Get a pointer to `len` bytes of the file at the given offset, refilling the
+ * buffer from that offset if necessary. `len` must not exceed the size of the
+ * buffer.
  *
- * The given file descriptor fd must be open and seekable, and must be positioned
- * at the first byte of the png file chunk. The file offset is mutated after a
- * call to this function, so the caller must reposition the file offset with
- * lseek(), as needed.
+ * Returns NULL if the bytes could not be read. If the failure was caused by an
+ * unexpected I/O error rather than reaching the end of the file, `err` is set
+ * to a non-zero value.
+ * */
+static const unsigned char *peek(struct chunk_iterator_ctx *ctx, off_t offset,
+		size_t len, int *err)
+{
+	const unsigned char *data = peek_cached(ctx, offset, len);
+	if (data || ctx->map)
+		return data;
+	if (ctx->is_stream)
+		return peek_stream(ctx, offset, len, err);
+
+	ssize_t bytes_read = recoverable_pread(ctx->fd, ctx->buffer,
+			ctx->buffer_capacity, offset);
+	if (bytes_read < 0) {
+		ctx->buffer_len = 0;
+		*err = 1;
+		return NULL;
+	}
+
+	ctx->buffer_offset = offset;
+	ctx->buffer_len = bytes_read;
+
+	return peek_cached(ctx, offset, len);
+}
+
+/**
+ * peek() for contexts reading from a stream. The stream is only ever read
+ * forwards, so the buffer always ends at the current position of the stream.
+ * Any bytes between the end of the buffer and `offset` are read and discarded,
+ * and bytes before `offset` are dropped from the buffer.
  *
- * Returns zero if the chunk was processed successfully. Otherwise, if the given
- * file descriptor does not appear to represent a valid png chunk, returns 1. If
- * an unexpected error occurs, returns -1.
+ * Returns NULL if `offset` lies before the start of the buffer, since those
+ * bytes can no longer be read.
  * */
-static int construct_png_chunk_detail(int fd, struct png_chunk_detail *new_chunk)
+static const unsigned char *peek_stream(struct chunk_iterator_ctx *ctx, off_t offset,
+		size_t len, int *err)
 {
-	// read and set the chunk's file offset
-	off_t file_offset = lseek(fd, 0, SEEK_CUR);
-	if (file_offset < 0)
-		return -1;
+	off_t buffer_end = ctx->buffer_offset + ctx->buffer_len;
+	if (offset < ctx->buffer_offset) {
+		*err = 1;
+		return NULL;
+	}
 
-	// read chunk data length and convert from network byte order to host byte order
-	if (recoverable_read(fd, &new_chunk->data_length, sizeof(u_int32_t)) != sizeof(u_int32_t))
-		return 1;
-	new_chunk->data_length = ntohl(new_chunk->data_length);
+	if (offset >= buffer_end) {
+		ctx->buffer_offset = buffer_end;
+		ctx->buffer_len = 0;
+
+		while (ctx->buffer_offset < offset) {
+			size_t skip = offset - ctx->buffer_offset;
+			skip = skip > ctx->buffer_capacity ? ctx->buffer_capacity : skip;
+
+			ssize_t bytes_read = recoverable_read(ctx->fd, ctx->buffer, skip);
+			if (bytes_read <= 0) {
+				*err = bytes_read < 0;
+				return NULL;
+			}
+
+			ctx->buffer_offset += bytes_read;
+		}
+	} else {
+		size_t keep = buffer_end - offset;
+		memmove(ctx->buffer, ctx->buffer + (offset - ctx->buffer_offset), keep);
+		ctx->buffer_offset = offset;
+		ctx->buffer_len = keep;
+	}
 
-	// read chunk type and ensure valid asccii characters
-	if (recoverable_read(fd, new_chunk->chunk_type, CHUNK_TYPE_LENGTH) != CHUNK_TYPE_LENGTH)
-		return 1;
-	for (size_t i = 0; i < CHUNK_TYPE_LENGTH; i++) {
-		if (!isascii(new_chunk->chunk_type[i]))
-			return 1;
+	while (ctx->buffer_len < len) {
+		ssize_t bytes_read = recoverable_read(ctx->fd, ctx->buffer + ctx->buffer_len,
+				ctx->buffer_capacity - ctx->buffer_len);
+		if (bytes_read <= 0) {
+			*err = bytes_read < 0;
+			return NULL;
+		}
+
+		ctx->buffer_len += bytes_read;
 	}
 
-	// seek to and read CRC and convert from network byte order to host byte order
-	off_t crc_offset = file_offset;
-	crc_offset += sizeof(u_int32_t);
-	crc_offset += sizeof(char) * CHUNK_TYPE_LENGTH;
-	crc_offset += sizeof(unsigned char) * new_chunk->data_length;
+	return ctx->buffer;
+}
+
+/**
+ * Read `len` bytes of chunk data at the current data offset directly into the
+ * given buffer, bypassing the context buffer. For streams, the data offset
+ * must be positioned at the end of the context buffer.
+ *
+ * Returns the number of bytes read, which is less than `len` only if the end of
+ * the file was reached, or -1 if an error occurred.
+ * */
+static ssize_t read_direct(struct chunk_iterator_ctx *ctx, unsigned char *buffer, size_t len)
+{
+	if (!ctx->is_stream)
+		return recoverable_pread(ctx->fd, buffer, len, ctx->data_offset);
 
-	if (lseek(fd, crc_offset, SEEK_SET) < 0)
+	if (ctx->data_offset != ctx->buffer_offset + (off_t) ctx->buffer_len)
 		return -1;
-	if (recoverable_read(fd, &new_chunk->chunk_crc, sizeof(u_int32_t)) != sizeof(u_int32_t))
+
+	size_t total_read = 0;
+	while (total_read < len) {
+		ssize_t bytes_read = recoverable_read(ctx->fd, buffer + total_read, len - total_read);
+		if (bytes_read < 0)
+			return -1;
+		if (bytes_read == 0)
+			break;
+
+		total_read += bytes_read;
+	}
+
+	// the buffer is now behind the stream, so drop its contents
+	ctx->buffer_offset += ctx->buffer_len + total_read;
+	ctx->buffer_len = 0;
+
+	return total_read;
+}
+
+/**
+ * Decode the header of the chunk following the current chunk into the context
+ * lookahead, unless this was already done.
+ *
+ * Returns zero if the lookahead is valid. Otherwise, if no valid png chunk
+ * follows the current chunk, returns 1. If an unexpected error occurs,
+ * returns -1.
+ * */
+static int load_lookahead(struct chunk_iterator_ctx *ctx)
+{
+	if (ctx->lookahead_valid)
+		return 0;
+
+	off_t offset = SIGNATURE_LENGTH;
+	if (ctx->initialized)
+		offset = ctx->chunk_file_offset + CHUNK_LENGTH(ctx->current_chunk.data_length);
+
+	return load_header(ctx, offset);
+}
+
+/**
+ * Decode the header of the chunk at the given file offset into the context
+ * lookahead.
+ *
+ * Return values are identical to load_lookahead().
+ * */
+static int load_header(struct chunk_iterator_ctx *ctx, off_t offset)
+{
+	int err = 0;
+	const unsigned char *header = peek(ctx, offset, CHUNK_HEADER_LENGTH, &err);
+	if (!header)
+		return err ? -1 : 1;
+
+	if (png_chunk_decode_header(header, offset, ctx->file_len, &ctx->next_chunk))
+		return 1;
+
+	ctx->next_chunk_file_offset = offset;
+	ctx->lookahead_valid = 1;
+
+	return 0;
+}
+
+/**
+ * Read the CRC of the current chunk and convert from network byte order to
+ * host byte order, unless this was already done. If `allow_io` is zero, the CRC
+ * is loaded only if it is already in memory.
+ *
+ * Returns zero if the CRC was loaded, and non-zero otherwise.
+ * */
+static int load_crc(struct chunk_iterator_ctx *ctx, int allow_io)
+{
+	if (ctx->crc_valid)
+		return 0;
+
+	off_t crc_offset = ctx->chunk_file_offset + CHUNK_HEADER_LENGTH
+			+ ctx->current_chunk.data_length;
+
+	int err = 0;
+	const unsigned char *crc = peek_cached(ctx, crc_offset, sizeof(u_int32_t));
+	if (!crc && allow_io)
+		crc = peek(ctx, crc_offset, sizeof(u_int32_t), &err);
+	if (!crc)
 		return 1;
 
-	new_chunk->chunk_crc = ntohl(new_chunk->chunk_crc);
+	memcpy(&ctx->current_chunk.chunk_crc, crc, sizeof(u_int32_t));
+	ctx->current_chunk.chunk_crc = ntohl(ctx->current_chunk.chunk_crc);
+	ctx->crc_valid = 1;
 
 	return 0;
 }
+
+/**
+ * Hash the mapped file up to (but excluding) the given offset, picking up where
+ * the digest left off.
+ * */
+static void digest_through(struct chunk_iterator_ctx *ctx, off_t offset)
+{
+	if (offset > (off_t) ctx->map_len)
+		offset = (off_t) ctx->map_len;
+	if (offset <= ctx->digest_offset)
+		return;
+
+	digest_update(ctx->digest, ctx->map + ctx->digest_offset, (size_t) (offset - ctx->digest_offset));
+	ctx->digest_offset = offset;
+}
@@ -0,0 +1,387 @@
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "crc32.h"
+#include "digest.h"
+#include "png-chunk-writer.h"
+#include "utils.h"
+
+static unsigned char *claim_field(struct chunk_writer *);
+static int queue_iov(struct chunk_writer *, const void *, size_t);
+static int flush_iov(struct chunk_writer *);
+static int flush_copy(struct chunk_writer *);
+static void digest_bytes(struct chunk_writer *, off_t, const unsigned char *, size_t, int);
+static void record_extent(struct chunk_writer *, const unsigned char *, size_t, int);
+
+void chunk_writer_init(struct chunk_writer *writer, int fd)
+{
+	writer->fd = fd;
+	writer->iov_count = 0;
+	writer->chunk_count = 0;
+	writer->crc = 0;
+	writer->crc_pool = NULL;
+	writer->copy_fd = -1;
+	writer->copy_offset = 0;
+	writer->copy_len = 0;
+	writer->offset = 0;
+	writer->written = 0;
+	writer->digest = NULL;
+	writer->digest_deferred = 0;
+	writer->digest_failed = 0;
+	writer->digest_base = 0;
+	writer->placeholder_offset = 0;
+	writer->placeholder_len = 0;
+	writer->source_fd = -1;
+	writer->source_map = NULL;
+	writer->source_len = 0;
+	writer->extents = NULL;
+	writer->extents_len = 0;
+	writer->extents_alloc = 0;
+	writer->retained = NULL;
+	writer->retained_len = 0;
+	writer->retained_alloc = 0;
+}
+
+int chunk_writer_write_raw(struct chunk_writer *writer, const void *data, size_t len)
+{
+	return queue_iov(writer, data, len);
+}
+
+int chunk_writer_copy_range(struct chunk_writer *writer, int src_fd, off_t offset, size_t len)
+{
+	if (!len)
+		return 0;
+	if (flush_iov(writer))
+		return -1;
+
+	int contiguous = writer->copy_fd == src_fd
+			&& writer->copy_offset + (off_t) writer->copy_len == offset;
+	if (writer->copy_len && !contiguous && flush_copy(writer))
+		return -1;
+
+	if (!writer->copy_len) {
+		writer->copy_fd = src_fd;
+		writer->copy_offset = offset;
+	}
+
+	writer->copy_len += len;
+	writer->offset += len;
+
+	return 0;
+}
+
+int chunk_writer_write_chunk(struct chunk_writer *writer, const char type[],
+		const void *data, u_int32_t len)
+{
+	if (chunk_writer_begin_chunk(writer, type, len))
+		return -1;
+	if (chunk_writer_write_data(writer, data, len))
+		return -1;
+
+	return chunk_writer_end_chunk(writer, chunk_writer_get_crc(writer));
+}
+
+int chunk_writer_begin_chunk(struct chunk_writer *writer, const char type[], u_int32_t len)
+{
+	unsigned char *header = claim_field(writer);
+	if (!header)
+		return -1;
+
+	u_int32_t len_net_order = htonl(len);
+	memcpy(header, &len_net_order, sizeof(u_int32_t));
+	memcpy(header + sizeof(u_int32_t), type, CHUNK_TYPE_LENGTH);
+
+	writer->crc = crc32_update(0, type, CHUNK_TYPE_LENGTH);
+
+	return queue_iov(writer, header, CHUNK_HEADER_LENGTH);
+}
+
+int chunk_writer_write_data(struct chunk_writer *writer, const void *data, size_t len)
+{
+	writer->crc = crc32_update_parallel(writer->crc, data, len, writer->crc_pool);
+
+	return queue_iov(writer, data, len);
+}
+
+void chunk_writer_set_pool(struct chunk_writer *writer, struct thread_pool *pool)
+{
+	writer->crc_pool = pool;
+}
+
+u_int32_t chunk_writer_get_crc(struct chunk_writer *writer)
+{
+	return writer->crc;
+}
+
+int chunk_writer_end_chunk(struct chunk_writer *writer, u_int32_t crc)
+{
+	unsigned char *crc_field = claim_field(writer);
+	if (!crc_field)
+		return -1;
+
+	u_int32_t crc_net_order = htonl(crc);
+	memcpy(crc_field, &crc_net_order, sizeof(u_int32_t));
+
+	return queue_iov(writer, crc_field, sizeof(u_int32_t));
+}
+
+int chunk_writer_flush(struct chunk_writer *writer)
+{
+	if (flush_iov(writer))
+		return -1;
+
+	return flush_copy(writer);
+}
+
+void chunk_writer_begin_digest(struct chunk_writer *writer, struct digest_ctx *digest,
+		int source_fd, const unsigned char *source_map, size_t source_len)
+{
+	writer->digest = digest;
+	writer->digest_deferred = 0;
+	writer->digest_failed = 0;
+	writer->source_fd = source_fd;
+	writer->source_map = source_map;
+	writer->source_len = source_map ? source_len : 0;
+}
+
+void chunk_writer_defer_digest(struct chunk_writer *writer, size_t len)
+{
+	// the placeholder is read back relative to where the writer began writing
+	off_t file_offset = lseek(writer->fd, 0, SEEK_CUR);
+	if (file_offset < 0)
+		writer->digest_failed = 1;
+
+	// the placeholder follows whatever is still queued
+	off_t queued = (off_t) writer->copy_len;
+	for (size_t i = 0; i < writer->iov_count; i++)
+		queued += (off_t) writer->iov[i].iov_len;
+
+	writer->digest_base = file_offset - writer->written;
+	writer->placeholder_offset = writer->written + queued;
+	writer->placeholder_len = len;
+	writer->digest_deferred = 1;
+}
+
+int chunk_writer_finish_digest(struct chunk_writer *writer, unsigned char hash[])
+{
+	if (!writer->digest)
+		BUG("no digest was begun for the chunk writer");
+
+	int ret = chunk_writer_flush(writer) || writer->digest_failed ? -1 : 0;
+
+	// the placeholder has since been filled in, so read back what's there now
+	if (!ret && writer->placeholder_len) {
+		unsigned char *placeholder = (unsigned char *) malloc(writer->placeholder_len);
+		if (!placeholder)
+			FATAL(MEM_ALLOC_FAILED);
+
+		if (recoverable_pread(writer->fd, placeholder, writer->placeholder_len,
+				writer->digest_base + writer->placeholder_offset) != (ssize_t) writer->placeholder_len)
+			ret = -1;
+		else
+			digest_update(writer->digest, placeholder, writer->placeholder_len);
+
+		free(placeholder);
+	}
+
+	for (size_t i = 0; !ret && i < writer->extents_len; i++) {
+		const struct chunk_writer_extent *extent = &writer->extents[i];
+		if (extent->data)
+			digest_update(writer->digest, extent->data, extent->len);
+		else
+			digest_update(writer->digest, writer->retained + extent->retained_offset, extent->len);
+	}
+
+	if (!ret)
+		digest_final(writer->digest, hash);
+
+	free(writer->extents);
+	free(writer->retained);
+	writer->extents = NULL;
+	writer->extents_len = 0;
+	writer->extents_alloc = 0;
+	writer->retained = NULL;
+	writer->retained_len = 0;
+	writer->retained_alloc = 0;
+	writer->digest = NULL;
+
+	return ret;
+}
+
+/**
+ * Claim storage for a length/type or CRC field of a chunk. Space for the
+ * corresponding iovec is guaranteed to be available, so the field can be queued
+ * with queue_iov() without the writer being flushed in between.
+ *
+ * Returns NULL if the writer had to be flushed to make room, and the flush failed.
+ * */
+static unsigned char *claim_field(struct chunk_writer *writer)
+{
+	if (writer->chunk_count == CHUNK_WRITER_MAX_CHUNKS || writer->iov_count == CHUNK_WRITER_MAX_IOVECS) {
+		if (flush_iov(writer))
+			return NULL;
+	}
+
+	return writer->headers[writer->chunk_count++];
+}
+
+/**
+ * Queue an iovec for the next writev(), flushing the writer first if there is
+ * a pending copy or the queue is full.
+ * */
+static int queue_iov(struct chunk_writer *writer, const void *data, size_t len)
+{
+	if (!len)
+		return 0;
+	if (flush_copy(writer))
+		return -1;
+	if (writer->iov_count == CHUNK_WRITER_MAX_IOVECS && flush_iov(writer))
+		return -1;
+
+	writer->iov[writer->iov_count].iov_base = (void *) data;
+	writer->iov[writer->iov_count].iov_len = len;
+	writer->iov_count++;
+	writer->offset += len;
+
+	return 0;
+}
+
+static int flush_iov(struct chunk_writer *writer)
+{
+	if (!writer->iov_count)
+		return 0;
+
+	off_t offset = writer->written;
+	for (size_t i = 0; writer->digest && i < writer->iov_count; i++) {
+		digest_bytes(writer, offset, writer->iov[i].iov_base, writer->iov[i].iov_len, 0);
+		offset += (off_t) writer->iov[i].iov_len;
+	}
+
+	ssize_t bytes_written = recoverable_writev(writer->fd, writer->iov, (int) writer->iov_count);
+	writer->iov_count = 0;
+	writer->chunk_count = 0;
+	if (bytes_written < 0)
+		return -1;
+
+	writer->written += bytes_written;
+	return 0;
+}
+
+static int flush_copy(struct chunk_writer *writer)
+{
+	if (!writer->copy_len)
+		return 0;
+
+	if (writer->digest) {
+		// the copied bytes never pass through the writer, so hash them from the mapping
+		int mapped = writer->copy_fd == writer->source_fd && writer->source_map
+				&& writer->copy_offset >= 0 && (size_t) writer->copy_offset <= writer->source_len
+				&& writer->source_len - writer->copy_offset >= writer->copy_len;
+		if (mapped)
+			digest_bytes(writer, writer->written, writer->source_map + writer->copy_offset,
+					writer->copy_len, 1);
+		else
+			writer->digest_failed = 1;
+	}
+
+	ssize_t bytes_written = copy_file_range_fd(writer->fd, writer->copy_fd,
+			writer->copy_offset, writer->copy_len);
+	if (bytes_written != (ssize_t) writer->copy_len)
+		return -1;
+
+	writer->written += bytes_written;
+	writer->copy_offset += writer->copy_len;
+	writer->copy_len = 0;
+
+	return 0;
+}
+
+/**
+ * Hash `len` bytes about to be written at file offset `offset`, or if the digest
+ * is deferred and they follow the placeholder, record them. `mapped` is
+ * non-zero if `data` points into the source mapping, and thus remains valid
+ * after the bytes are written.
+ * */
+static void digest_bytes(struct chunk_writer *writer, off_t offset, const unsigned char *data,
+		size_t len, int mapped)
+{
+	if (writer->digest_failed)
+		return;
+	if (!writer->digest_deferred) {
+		digest_update(writer->digest, data, len);
+		return;
+	}
+
+	// bytes queued before the placeholder can still be hashed right away
+	if (offset < writer->placeholder_offset) {
+		size_t before = (size_t) (writer->placeholder_offset - offset);
+		before = before > len ? len : before;
+		digest_update(writer->digest, data, before);
+
+		data += before;
+		offset += (off_t) before;
+		len -= before;
+	}
+
+	// bytes of the placeholder are hashed once it has been filled in
+	off_t placeholder_end = writer->placeholder_offset + (off_t) writer->placeholder_len;
+	if (offset < placeholder_end) {
+		size_t skip = (size_t) (placeholder_end - offset);
+		if (skip >= len)
+			return;
+
+		data += skip;
+		len -= skip;
+	}
+
+	record_extent(writer, data, len, mapped);
+}
+
+/**
+ * Record bytes written after the placeholder, to be hashed once it has been
+ * filled in. Unless they point into the source mapping, the bytes are copied,
+ * since queued data may be reused as soon as it's written.
+ * */
+static void record_extent(struct chunk_writer *writer, const unsigned char *data, size_t len,
+		int mapped)
+{
+	if (!mapped) {
+		if (writer->retained_alloc - writer->retained_len < len) {
+			size_t alloc = writer->retained_alloc ? writer->retained_alloc : 65536;
+			while (alloc - writer->retained_len < len)
+				alloc *= 2;
+
+			writer->retained = (unsigned char *) realloc(writer->retained, alloc);
+			if (!writer->retained)
+				FATAL(MEM_ALLOC_FAILED);
+			writer->retained_alloc = alloc;
+		}
+
+		memcpy(writer->retained + writer->retained_len, data, len);
+		writer->retained_len += len;
+	}
+
+	if (writer->extents_len) {
+		struct chunk_writer_extent *last = &writer->extents[writer->extents_len - 1];
+		int adjacent = mapped ? last->data && last->data + last->len == data
+				: !last->data && last->retained_offset + last->len == writer->retained_len - len;
+		if (adjacent) {
+			last->len += len;
+			return;
+		}
+	}
+
+	if (writer->extents_len == writer->extents_alloc) {
+		writer->extents_alloc = writer->extents_alloc ? writer->extents_alloc * 2 : 64;
+		writer->extents = (struct chunk_writer_extent *) realloc(writer->extents,
+				sizeof(struct chunk_writer_extent) * writer->extents_alloc);
+		if (!writer->extents)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	struct chunk_writer_extent *extent = &writer->extents[writer->extents_len++];
+	extent->retained_offset = mapped ? 0 : writer->retained_len - len;
+	extent->len = len;
+	extent->data = mapped ? data : NULL;
+}
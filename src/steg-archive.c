@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "steg-archive.h"
+#include "utils.h"
+#include "zlib.h"
+
+static int decode_archive(struct steg_archive *, const unsigned char *, size_t, off_t);
+
+static inline void put_u16(unsigned char *buffer, u_int16_t value)
+{
+	buffer[0] = (unsigned char) (value >> 8);
+	buffer[1] = (unsigned char) value;
+}
+
+static inline u_int16_t get_u16(const unsigned char *buffer)
+{
+	return (u_int16_t) (((u_int16_t) buffer[0] << 8) | (u_int16_t) buffer[1]);
+}
+
+static inline void put_u32(unsigned char *buffer, u_int32_t value)
+{
+	buffer[0] = (unsigned char) (value >> 24);
+	buffer[1] = (unsigned char) (value >> 16);
+	buffer[2] = (unsigned char) (value >> 8);
+	buffer[3] = (unsigned char) value;
+}
+
+static inline u_int32_t get_u32(const unsigned char *buffer)
+{
+	return ((u_int32_t) buffer[0] << 24) | ((u_int32_t) buffer[1] << 16) |
+			((u_int32_t) buffer[2] << 8) | (u_int32_t) buffer[3];
+}
+
+static inline void put_u64(unsigned char *buffer, u_int64_t value)
+{
+	put_u32(buffer, (u_int32_t) (value >> 32));
+	put_u32(buffer + 4, (u_int32_t) value);
+}
+
+static inline u_int64_t get_u64(const unsigned char *buffer)
+{
+	return ((u_int64_t) get_u32(buffer) << 32) | get_u32(buffer + 4);
+}
+
+void steg_archive_init(struct steg_archive *archive)
+{
+	archive->members = NULL;
+	archive->len = 0;
+	archive->alloc = 0;
+}
+
+void steg_archive_add(struct steg_archive *archive, const char *name, off_t stream_offset, off_t len)
+{
+	if (archive->len == archive->alloc) {
+		archive->alloc = archive->alloc ? archive->alloc * 2 : 8;
+		archive->members = (struct steg_archive_member *) realloc(archive->members,
+				sizeof(struct steg_archive_member) * archive->alloc);
+		if (!archive->members)
+			FATAL(MEM_ALLOC_FAILED);
+	}
+
+	struct steg_archive_member *member = &archive->members[archive->len++];
+	member->name = strdup(name);
+	if (!member->name)
+		FATAL(MEM_ALLOC_FAILED);
+
+	member->stream_offset = stream_offset;
+	member->len = len;
+}
+
+const struct steg_archive_member *steg_archive_find(const struct steg_archive *archive, const char *name)
+{
+	for (size_t i = 0; i < archive->len; i++) {
+		if (!strcmp(archive->members[i].name, name))
+			return &archive->members[i];
+	}
+
+	return NULL;
+}
+
+size_t steg_archive_encoded_length(const struct steg_archive *archive)
+{
+	size_t len = STEG_ARCHIVE_HEADER_LENGTH + STEG_ARCHIVE_TRAILER_LENGTH;
+	for (size_t i = 0; i < archive->len; i++)
+		len += STEG_ARCHIVE_ENTRY_LENGTH + strlen(archive->members[i].name);
+
+	return len;
+}
+
+void steg_archive_encode(const struct steg_archive *archive, unsigned char *buffer)
+{
+	unsigned char *pos = buffer;
+	put_u32(pos, (u_int32_t) archive->len);
+	pos += STEG_ARCHIVE_HEADER_LENGTH;
+
+	for (size_t i = 0; i < archive->len; i++) {
+		const struct steg_archive_member *member = &archive->members[i];
+		size_t name_len = strlen(member->name);
+		if (name_len > STEG_ARCHIVE_NAME_MAX)
+			BUG("archive member name exceeds %d bytes", STEG_ARCHIVE_NAME_MAX);
+
+		put_u64(pos, (u_int64_t) member->stream_offset);
+		put_u64(pos + 8, (u_int64_t) member->len);
+		put_u16(pos + 16, (u_int16_t) name_len);
+		memcpy(pos + STEG_ARCHIVE_ENTRY_LENGTH, member->name, name_len);
+		pos += STEG_ARCHIVE_ENTRY_LENGTH + name_len;
+	}
+
+	// the trailer describes the table of contents preceding it
+	size_t toc_len = pos - buffer;
+	put_u32(pos, (u_int32_t) toc_len);
+	put_u32(pos + 4, (u_int32_t) crc32(crc32(0L, Z_NULL, 0), buffer, (uInt) toc_len));
+	memcpy(pos + 8, STEG_ARCHIVE_MAGIC, STEG_ARCHIVE_MAGIC_LENGTH);
+}
+
+int steg_archive_read(struct steg_archive *archive, const struct steg_stream_map *map, const char **error)
+{
+	steg_archive_init(archive);
+
+	unsigned char header[STEG_STREAM_HEADER_LENGTH];
+	off_t stream_len = steg_stream_map_length(map);
+	if (stream_len < STEG_STREAM_HEADER_LENGTH)
+		return 1;
+	if (steg_stream_map_read(map, 0, header, STEG_STREAM_HEADER_LENGTH)) {
+		*error = "failed to read embedded data";
+		return -1;
+	}
+	if (memcmp(header, STEG_STREAM_MAGIC, STEG_STREAM_MAGIC_LENGTH) != 0)
+		return 1;
+	if (!(header[6] & STEG_STREAM_FLAG_ARCHIVE))
+		return 1;
+
+	// the archive must at least hold its end of stream marker and trailer
+	*error = "embedded data is corrupt; archive table of contents is invalid";
+	off_t min_len = STEG_STREAM_HEADER_LENGTH + STEG_SEGMENT_HEADER_LENGTH + STEG_ARCHIVE_TRAILER_LENGTH;
+	if (stream_len < min_len)
+		return -1;
+
+	unsigned char trailer[STEG_ARCHIVE_TRAILER_LENGTH];
+	off_t trailer_offset = stream_len - STEG_ARCHIVE_TRAILER_LENGTH;
+	if (steg_stream_map_read(map, trailer_offset, trailer, STEG_ARCHIVE_TRAILER_LENGTH))
+		return -1;
+	if (memcmp(trailer + 8, STEG_ARCHIVE_MAGIC, STEG_ARCHIVE_MAGIC_LENGTH) != 0)
+		return -1;
+
+	size_t toc_len = get_u32(trailer);
+	if (toc_len < STEG_ARCHIVE_HEADER_LENGTH || toc_len > STEG_ARCHIVE_MAX_LENGTH)
+		return -1;
+	if ((off_t) toc_len > stream_len - min_len)
+		return -1;
+
+	unsigned char *toc = (unsigned char *) malloc(sizeof(unsigned char) * toc_len);
+	if (!toc)
+		FATAL(MEM_ALLOC_FAILED);
+
+	int ret = -1;
+	off_t toc_offset = trailer_offset - (off_t) toc_len;
+	if (!steg_stream_map_read(map, toc_offset, toc, toc_len) &&
+			crc32(crc32(0L, Z_NULL, 0), toc, (uInt) toc_len) == get_u32(trailer + 4)) {
+		// members lie between the stream header and the end of stream marker
+		ret = decode_archive(archive, toc, toc_len, toc_offset - STEG_SEGMENT_HEADER_LENGTH);
+	}
+
+	free(toc);
+	return ret;
+}
+
+int steg_archive_skip_toc(const struct steg_stream_map *map, off_t offset, off_t *end,
+		const char **error)
+{
+	*error = "embedded data is corrupt; archive table of contents is invalid";
+
+	unsigned char buffer[STEG_ARCHIVE_ENTRY_LENGTH];
+	if (steg_stream_map_read(map, offset, buffer, STEG_ARCHIVE_HEADER_LENGTH))
+		return -1;
+
+	// walk the entries, which are of variable length
+	u_int32_t count = get_u32(buffer);
+	off_t pos = offset + STEG_ARCHIVE_HEADER_LENGTH;
+	for (u_int32_t i = 0; i < count; i++) {
+		if (steg_stream_map_read(map, pos, buffer, STEG_ARCHIVE_ENTRY_LENGTH))
+			return -1;
+
+		pos += STEG_ARCHIVE_ENTRY_LENGTH + get_u16(buffer + 16);
+		if (pos - offset > STEG_ARCHIVE_MAX_LENGTH)
+			return -1;
+	}
+
+	// the trailer must agree with the entries
+	if (steg_stream_map_read(map, pos, buffer, STEG_ARCHIVE_TRAILER_LENGTH))
+		return -1;
+	if (memcmp(buffer + 8, STEG_ARCHIVE_MAGIC, STEG_ARCHIVE_MAGIC_LENGTH) != 0)
+		return -1;
+	if (get_u32(buffer) != (u_int32_t) (pos - offset))
+		return -1;
+
+	*end = pos + STEG_ARCHIVE_TRAILER_LENGTH;
+	return 0;
+}
+
+void steg_archive_release(struct steg_archive *archive)
+{
+	for (size_t i = 0; i < archive->len; i++)
+		free(archive->members[i].name);
+
+	free(archive->members);
+	steg_archive_init(archive);
+}
+
+/**
+ * Decode a table of contents of `len` bytes into the archive. The segments of
+ * every member must begin at or before `max_offset` in the steg stream.
+ *
+ * Returns zero if successful, and -1 if the table of contents is malformed.
+ * */
+static int decode_archive(struct steg_archive *archive, const unsigned char *toc, size_t len,
+		off_t max_offset)
+{
+	char name[STEG_ARCHIVE_NAME_MAX + 1];
+
+	u_int32_t count = get_u32(toc);
+	const unsigned char *pos = toc + STEG_ARCHIVE_HEADER_LENGTH;
+	const unsigned char *end = toc + len;
+	for (u_int32_t i = 0; i < count; i++) {
+		if ((size_t) (end - pos) < STEG_ARCHIVE_ENTRY_LENGTH)
+			return -1;
+
+		u_int64_t stream_offset = get_u64(pos);
+		u_int64_t member_len = get_u64(pos + 8);
+		size_t name_len = get_u16(pos + 16);
+		pos += STEG_ARCHIVE_ENTRY_LENGTH;
+
+		if (stream_offset < STEG_STREAM_HEADER_LENGTH || stream_offset > (u_int64_t) max_offset)
+			return -1;
+		if (member_len > INT64_MAX)
+			return -1;
+		if (!name_len || name_len > STEG_ARCHIVE_NAME_MAX || (size_t) (end - pos) < name_len)
+			return -1;
+		if (memchr(pos, '\0', name_len))
+			return -1;
+
+		memcpy(name, pos, name_len);
+		name[name_len] = '\0';
+		pos += name_len;
+
+		steg_archive_add(archive, name, (off_t) stream_offset, (off_t) member_len);
+	}
+
+	return pos == end ? 0 : -1;
+}
@@ -0,0 +1,400 @@
+#include <string.h>
+
+#include "steg-codec.h"
+#include "utils.h"
+
+static const char *const codec_names[] = {
+		[STEG_CODEC_ZLIB] = "zlib",
+		[STEG_CODEC_STORE] = "store",
+		[STEG_CODEC_ZSTD] = "zstd"
+};
+
+static int decompress_in_steps(struct steg_codec_decoder *, const unsigned char *, size_t,
+		unsigned char *, size_t, size_t *, size_t *);
+
+/**
+ * Returns non-zero if the codec is built into steg-png.
+ * */
+static inline int codec_available(enum steg_codec codec)
+{
+	switch (codec) {
+		case STEG_CODEC_ZLIB:
+		case STEG_CODEC_STORE:
+			return 1;
+		case STEG_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+			return 1;
+#else
+			return 0;
+#endif
+	}
+
+	return 0;
+}
+
+int steg_codec_from_name(const char *name, enum steg_codec *codec)
+{
+	for (size_t i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+		if (!strcmp(name, codec_names[i]) && codec_available((enum steg_codec) i)) {
+			*codec = (enum steg_codec) i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int steg_codec_from_id(unsigned int id, enum steg_codec *codec)
+{
+	if (id >= sizeof(codec_names) / sizeof(codec_names[0]) || !codec_available((enum steg_codec) id))
+		return -1;
+
+	*codec = (enum steg_codec) id;
+	return 0;
+}
+
+const char *steg_codec_name(enum steg_codec codec)
+{
+	return codec_names[codec];
+}
+
+void steg_codec_encoder_init(struct steg_codec_encoder *encoder, enum steg_codec codec, int level)
+{
+	encoder->codec = codec;
+	encoder->level = level;
+
+	switch (codec) {
+		case STEG_CODEC_ZLIB: {
+#ifdef HAVE_LIBDEFLATE
+			encoder->state.libdeflate = libdeflate_alloc_compressor(level == Z_DEFAULT_COMPRESSION ? 6 : level);
+			if (!encoder->state.libdeflate)
+				FATAL(MEM_ALLOC_FAILED);
+#else
+			struct z_stream_s *strm = &encoder->state.zlib;
+			strm->zalloc = Z_NULL;
+			strm->zfree = Z_NULL;
+			strm->opaque = Z_NULL;
+
+			int ret = deflateInit(strm, level);
+			if (ret != Z_OK)
+				FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+#endif
+			return;
+		}
+		case STEG_CODEC_STORE:
+			return;
+		case STEG_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+			// zstd levels run much higher than zlib's, but level 0 means the default
+			encoder->level = level == Z_DEFAULT_COMPRESSION ? ZSTD_CLEVEL_DEFAULT : level ? level : 1;
+			encoder->state.zstd = ZSTD_createCCtx();
+			if (!encoder->state.zstd)
+				FATAL(MEM_ALLOC_FAILED);
+			return;
+#else
+			break;
+#endif
+	}
+
+	BUG("codec %d is not available", (int) codec);
+}
+
+size_t steg_codec_compress_bound(struct steg_codec_encoder *encoder, size_t len)
+{
+	switch (encoder->codec) {
+		case STEG_CODEC_ZLIB:
+#ifdef HAVE_LIBDEFLATE
+			return libdeflate_zlib_compress_bound(encoder->state.libdeflate, len);
+#else
+			return deflateBound(&encoder->state.zlib, len);
+#endif
+		case STEG_CODEC_STORE:
+			return len;
+		case STEG_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+			return ZSTD_compressBound(len);
+#else
+			break;
+#endif
+	}
+
+	BUG("codec %d is not available", (int) encoder->codec);
+}
+
+int steg_codec_compress(struct steg_codec_encoder *encoder, const unsigned char *in, size_t len,
+		unsigned char *out, size_t capacity, size_t *out_len)
+{
+	*out_len = 0;
+
+	switch (encoder->codec) {
+		case STEG_CODEC_ZLIB: {
+#ifdef HAVE_LIBDEFLATE
+			*out_len = libdeflate_zlib_compress(encoder->state.libdeflate, in, len, out, capacity);
+			return *out_len ? 0 : -1;
+#else
+			struct z_stream_s *strm = &encoder->state.zlib;
+			if (deflateReset(strm) != Z_OK)
+				return -1;
+
+			strm->next_in = (unsigned char *) in;
+			strm->avail_in = (uInt) len;
+			strm->next_out = out;
+			strm->avail_out = (uInt) capacity;
+			if (deflate(strm, Z_FINISH) != Z_STREAM_END)
+				return -1;
+
+			*out_len = capacity - strm->avail_out;
+			return 0;
+#endif
+		}
+		case STEG_CODEC_STORE:
+			if (len > capacity)
+				return -1;
+
+			memcpy(out, in, len);
+			*out_len = len;
+			return 0;
+		case STEG_CODEC_ZSTD: {
+#ifdef HAVE_ZSTD
+			size_t ret = ZSTD_compressCCtx(encoder->state.zstd, out, capacity, in, len, encoder->level);
+			if (ZSTD_isError(ret))
+				return -1;
+
+			*out_len = ret;
+			return 0;
+#else
+			break;
+#endif
+		}
+	}
+
+	BUG("codec %d is not available", (int) encoder->codec);
+}
+
+void steg_codec_encoder_destroy(struct steg_codec_encoder *encoder)
+{
+	switch (encoder->codec) {
+		case STEG_CODEC_ZLIB:
+#ifdef HAVE_LIBDEFLATE
+			libdeflate_free_compressor(encoder->state.libdeflate);
+#else
+			(void) deflateEnd(&encoder->state.zlib);
+#endif
+			break;
+		case STEG_CODEC_STORE:
+			break;
+		case STEG_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+			ZSTD_freeCCtx(encoder->state.zstd);
+#endif
+			break;
+	}
+}
+
+void steg_codec_decoder_init(struct steg_codec_decoder *decoder, enum steg_codec codec)
+{
+	if (!codec_available(codec))
+		BUG("codec %d is not available", (int) codec);
+
+	decoder->codec = codec;
+	decoder->remaining = 0;
+
+	decoder->zlib.zalloc = Z_NULL;
+	decoder->zlib.zfree = Z_NULL;
+	decoder->zlib.opaque = Z_NULL;
+	decoder->zlib.avail_in = 0;
+	decoder->zlib.next_in = Z_NULL;
+	decoder->zlib_initialized = 0;
+
+	// contexts are allocated once they are needed
+#ifdef HAVE_LIBDEFLATE
+	decoder->libdeflate = NULL;
+#endif
+#ifdef HAVE_ZSTD
+	decoder->zstd = NULL;
+#endif
+}
+
+void steg_codec_decoder_begin(struct steg_codec_decoder *decoder, size_t compressed_len)
+{
+	decoder->remaining = compressed_len;
+
+	switch (decoder->codec) {
+		case STEG_CODEC_ZLIB:
+			if (decoder->zlib_initialized) {
+				if (inflateReset(&decoder->zlib) != Z_OK)
+					FATAL("failed to reset zlib stream");
+				return;
+			}
+
+			int ret = inflateInit(&decoder->zlib);
+			if (ret != Z_OK)
+				FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+
+			decoder->zlib_initialized = 1;
+			return;
+		case STEG_CODEC_STORE:
+			return;
+		case STEG_CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+			if (decoder->zstd) {
+				ZSTD_DCtx_reset(decoder->zstd, ZSTD_reset_session_only);
+				return;
+			}
+
+			decoder->zstd = ZSTD_createDCtx();
+			if (!decoder->zstd)
+				FATAL(MEM_ALLOC_FAILED);
+#endif
+			return;
+	}
+}
+
+int steg_codec_decompress_step(struct steg_codec_decoder *decoder, const unsigned char **next_in,
+		size_t *avail_in, unsigned char **next_out, size_t *avail_out)
+{
+	switch (decoder->codec) {
+		case STEG_CODEC_ZLIB: {
+			struct z_stream_s *strm = &decoder->zlib;
+			strm->next_in = (unsigned char *) *next_in;
+			strm->avail_in = (uInt) *avail_in;
+			strm->next_out = *next_out;
+			strm->avail_out = (uInt) *avail_out;
+
+			int ret = inflate(strm, Z_NO_FLUSH);
+
+			*next_in += *avail_in - strm->avail_in;
+			*avail_in = strm->avail_in;
+			*next_out += *avail_out - strm->avail_out;
+			*avail_out = strm->avail_out;
+
+			if (ret == Z_STREAM_END)
+				return STEG_CODEC_END;
+
+			return ret == Z_OK || ret == Z_BUF_ERROR ? STEG_CODEC_OK : STEG_CODEC_ERROR;
+		}
+		case STEG_CODEC_STORE: {
+			size_t len = *avail_in < *avail_out ? *avail_in : *avail_out;
+			len = len < decoder->remaining ? len : decoder->remaining;
+
+			memcpy(*next_out, *next_in, len);
+			*next_in += len;
+			*avail_in -= len;
+			*next_out += len;
+			*avail_out -= len;
+			decoder->remaining -= len;
+
+			// stored segments end with their compressed data
+			return decoder->remaining ? STEG_CODEC_OK : STEG_CODEC_END;
+		}
+		case STEG_CODEC_ZSTD: {
+#ifdef HAVE_ZSTD
+			ZSTD_inBuffer in = { .src = *next_in, .size = *avail_in, .pos = 0 };
+			ZSTD_outBuffer out = { .dst = *next_out, .size = *avail_out, .pos = 0 };
+
+			size_t ret = ZSTD_decompressStream(decoder->zstd, &out, &in);
+
+			*next_in += in.pos;
+			*avail_in -= in.pos;
+			*next_out += out.pos;
+			*avail_out -= out.pos;
+
+			if (ZSTD_isError(ret))
+				return STEG_CODEC_ERROR;
+
+			// zero once the frame is decoded and flushed in full
+			return ret ? STEG_CODEC_OK : STEG_CODEC_END;
+#else
+			break;
+#endif
+		}
+	}
+
+	BUG("codec %d is not available", (int) decoder->codec);
+}
+
+int steg_codec_decompress(struct steg_codec_decoder *decoder, const unsigned char *in, size_t len,
+		unsigned char *out, size_t capacity, size_t *in_len, size_t *out_len)
+{
+	steg_codec_decoder_begin(decoder, len);
+
+#ifdef HAVE_LIBDEFLATE
+	if (decoder->codec == STEG_CODEC_ZLIB) {
+		if (!decoder->libdeflate)
+			decoder->libdeflate = libdeflate_alloc_decompressor();
+		if (!decoder->libdeflate)
+			FATAL(MEM_ALLOC_FAILED);
+
+		enum libdeflate_result ret = libdeflate_zlib_decompress_ex(decoder->libdeflate, in, len,
+				out, capacity, in_len, out_len);
+		if (ret == LIBDEFLATE_SUCCESS)
+			return STEG_CODEC_END;
+		if (ret != LIBDEFLATE_INSUFFICIENT_SPACE)
+			return STEG_CODEC_ERROR;
+
+		*in_len = 0;
+		*out_len = capacity;
+		return STEG_CODEC_OK;
+	}
+#endif
+
+#ifdef HAVE_ZSTD
+	// a complete frame decompresses faster in one call than through the stream api
+	size_t frame_len;
+	if (decoder->codec == STEG_CODEC_ZSTD && !ZSTD_isError(frame_len = ZSTD_findFrameCompressedSize(in, len))) {
+		size_t ret = ZSTD_decompressDCtx(decoder->zstd, out, capacity, in, frame_len);
+		if (ZSTD_isError(ret))
+			return STEG_CODEC_ERROR;
+
+		*in_len = frame_len;
+		*out_len = ret;
+		return STEG_CODEC_END;
+	}
+#endif
+
+	return decompress_in_steps(decoder, in, len, out, capacity, in_len, out_len);
+}
+
+void steg_codec_decoder_destroy(struct steg_codec_decoder *decoder)
+{
+	if (decoder->zlib_initialized)
+		(void) inflateEnd(&decoder->zlib);
+	decoder->zlib_initialized = 0;
+
+#ifdef HAVE_LIBDEFLATE
+	if (decoder->libdeflate)
+		libdeflate_free_decompressor(decoder->libdeflate);
+	decoder->libdeflate = NULL;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(decoder->zstd);
+	decoder->zstd = NULL;
+#endif
+}
+
+/**
+ * Decompress a whole segment through steg_codec_decompress_step(), until the
+ * segment ends or no more progress can be made.
+ *
+ * Return values are identical to steg_codec_decompress().
+ * */
+static int decompress_in_steps(struct steg_codec_decoder *decoder, const unsigned char *in, size_t len,
+		unsigned char *out, size_t capacity, size_t *in_len, size_t *out_len)
+{
+	const unsigned char *next_in = in;
+	unsigned char *next_out = out;
+	size_t avail_in = len;
+	size_t avail_out = capacity;
+
+	int ret;
+	do {
+		size_t before = avail_in + avail_out;
+		ret = steg_codec_decompress_step(decoder, &next_in, &avail_in, &next_out, &avail_out);
+		if (ret == STEG_CODEC_OK && avail_in + avail_out == before)
+			break;
+	} while (ret == STEG_CODEC_OK);
+
+	*in_len = len - avail_in;
+	*out_len = capacity - avail_out;
+	return ret;
+}
@@ -0,0 +1,316 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "steg-index.h"
+#include "utils.h"
+#include "zlib.h"
+
+const char STEG_CHUNK_TYPE[] = {'s', 't', 'E', 'G'};
+const char STEG_INDEX_CHUNK_TYPE[] = {'s', 't', 'I', 'X'};
+const char STEG_FILLER_CHUNK_TYPE[] = {'s', 't', 'F', 'L'};
+
+static int read_index_chunk(struct steg_index *, struct chunk_iterator_ctx *, int);
+static int decode_index(struct steg_index *, const unsigned char *, size_t, off_t, off_t);
+
+static inline void put_u32(unsigned char *buffer, u_int32_t value)
+{
+	buffer[0] = (unsigned char) (value >> 24);
+	buffer[1] = (unsigned char) (value >> 16);
+	buffer[2] = (unsigned char) (value >> 8);
+	buffer[3] = (unsigned char) value;
+}
+
+static inline u_int32_t get_u32(const unsigned char *buffer)
+{
+	return ((u_int32_t) buffer[0] << 24) | ((u_int32_t) buffer[1] << 16) |
+			((u_int32_t) buffer[2] << 8) | (u_int32_t) buffer[3];
+}
+
+static inline void put_u64(unsigned char *buffer, u_int64_t value)
+{
+	put_u32(buffer, (u_int32_t) (value >> 32));
+	put_u32(buffer + 4, (u_int32_t) value);
+}
+
+static inline u_int64_t get_u64(const unsigned char *buffer)
+{
+	return ((u_int64_t) get_u32(buffer) << 32) | get_u32(buffer + 4);
+}
+
+void steg_index_init(struct steg_index *index, size_t capacity)
+{
+	index->entries = NULL;
+	index->len = 0;
+	index->capacity = capacity;
+	index->overflow = 0;
+
+	if (!capacity)
+		return;
+
+	index->entries = (struct steg_index_entry *) malloc(sizeof(struct steg_index_entry) * capacity);
+	if (!index->entries)
+		FATAL(MEM_ALLOC_FAILED);
+}
+
+size_t steg_index_capacity(off_t payload_len, size_t chunk_len)
+{
+	if (payload_len < 0 || !chunk_len)
+		return 0;
+
+	/*
+	 * Bound the compressed length of the payload, allowing for the zlib bound,
+	 * the sync flush markers written between parallel deflate blocks, and the
+	 * stream and segment headers of segmented streams.
+	 * */
+	u_int64_t len = (u_int64_t) payload_len;
+	u_int64_t bound = len + (len >> 12) + (len >> 14) + (len >> 25) + 13;
+	bound += (len / 65536 + 1) * 32 + 64;
+
+	u_int64_t capacity = bound / chunk_len + 2;
+	if (capacity > (STEG_INDEX_MAX_LENGTH - STEG_INDEX_HEADER_LENGTH) / STEG_INDEX_ENTRY_LENGTH)
+		return 0;
+
+	return (size_t) capacity;
+}
+
+size_t steg_index_data_length(size_t capacity)
+{
+	return STEG_INDEX_HEADER_LENGTH + capacity * STEG_INDEX_ENTRY_LENGTH;
+}
+
+void steg_index_add(struct steg_index *index, off_t offset, u_int32_t len)
+{
+	if (index->len == index->capacity) {
+		index->overflow = 1;
+		return;
+	}
+
+	index->entries[index->len].offset = offset;
+	index->entries[index->len].len = len;
+	index->len++;
+}
+
+void steg_index_encode(const struct steg_index *index, unsigned char *buffer)
+{
+	memset(buffer, 0, steg_index_data_length(index->capacity));
+
+	// an index that's missing entries must not be used
+	size_t count = index->overflow ? 0 : index->len;
+
+	buffer[0] = STEG_INDEX_VERSION;
+	put_u32(buffer + 4, (u_int32_t) count);
+
+	unsigned char *entry = buffer + STEG_INDEX_HEADER_LENGTH;
+	for (size_t i = 0; i < count; i++) {
+		put_u64(entry, (u_int64_t) index->entries[i].offset);
+		put_u32(entry + 8, index->entries[i].len);
+		entry += STEG_INDEX_ENTRY_LENGTH;
+	}
+}
+
+void steg_index_encode_tail(const struct steg_index *index, unsigned char *buffer)
+{
+	size_t len = steg_index_data_length(index->len);
+
+	buffer[0] = STEG_INDEX_VERSION;
+	buffer[1] = STEG_INDEX_FLAG_TAIL;
+	buffer[2] = 0;
+	buffer[3] = 0;
+	put_u32(buffer + 4, (u_int32_t) index->len);
+
+	unsigned char *entry = buffer + STEG_INDEX_HEADER_LENGTH;
+	for (size_t i = 0; i < index->len; i++) {
+		put_u64(entry, (u_int64_t) index->entries[i].offset);
+		put_u32(entry + 8, index->entries[i].len);
+		entry += STEG_INDEX_ENTRY_LENGTH;
+	}
+
+	put_u32(buffer + len, (u_int32_t) (len + STEG_INDEX_TRAILER_LENGTH));
+}
+
+int steg_index_read(struct steg_index *index, struct chunk_iterator_ctx *ctx)
+{
+	int ret = steg_index_read_head(index, ctx);
+	if (ret <= 0)
+		return ret;
+
+	steg_index_release(index);
+	return steg_index_read_tail(index, ctx);
+}
+
+int steg_index_read_head(struct steg_index *index, struct chunk_iterator_ctx *ctx)
+{
+	steg_index_init(index, 0);
+
+	// the index must immediately follow IHDR
+	for (int i = 0; i < 2; i++) {
+		int has_next_chunk = chunk_iterator_has_next(ctx);
+		if (has_next_chunk <= 0)
+			return has_next_chunk < 0 ? -1 : 1;
+		if (chunk_iterator_next(ctx))
+			return -1;
+
+		const char *expected_type = i ? STEG_INDEX_CHUNK_TYPE : IHDR_CHUNK_TYPE;
+		if (memcmp(ctx->current_chunk.chunk_type, expected_type, CHUNK_TYPE_LENGTH) != 0)
+			return 1;
+	}
+
+	return read_index_chunk(index, ctx, 0);
+}
+
+int steg_index_read_tail(struct steg_index *index, struct chunk_iterator_ctx *ctx)
+{
+	steg_index_init(index, 0);
+
+	int ret = chunk_iterator_find_iend(ctx);
+	if (ret)
+		return ret;
+
+	// the index chunk ends with its own data length, just before IEND
+	off_t iend_offset = ctx->chunk_file_offset;
+	unsigned char trailer[STEG_INDEX_TRAILER_LENGTH];
+	off_t trailer_offset = iend_offset - (off_t) (sizeof(u_int32_t) + STEG_INDEX_TRAILER_LENGTH);
+	if (trailer_offset < SIGNATURE_LENGTH)
+		return 1;
+	if (recoverable_pread(ctx->fd, trailer, STEG_INDEX_TRAILER_LENGTH, trailer_offset) != STEG_INDEX_TRAILER_LENGTH)
+		return -1;
+
+	u_int32_t len = get_u32(trailer);
+	if ((off_t) CHUNK_LENGTH(len) > iend_offset - SIGNATURE_LENGTH)
+		return 1;
+
+	ret = chunk_iterator_seek(ctx, iend_offset - CHUNK_LENGTH(len));
+	if (ret)
+		return ret;
+	if (chunk_iterator_next(ctx))
+		return -1;
+
+	if (memcmp(ctx->current_chunk.chunk_type, STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+		return 1;
+	if (ctx->current_chunk.data_length != len)
+		return 1;
+
+	return read_index_chunk(index, ctx, 1);
+}
+
+int steg_index_seek(const struct steg_index *index, size_t i, struct chunk_iterator_ctx *ctx)
+{
+	if (i >= index->len)
+		BUG("steg index entry %lu out of bounds", (unsigned long) i);
+
+	const struct steg_index_entry *entry = &index->entries[i];
+	if (chunk_iterator_seek(ctx, entry->offset) || chunk_iterator_next(ctx))
+		return -1;
+
+	if (memcmp(ctx->current_chunk.chunk_type, STEG_CHUNK_TYPE, CHUNK_TYPE_LENGTH) != 0)
+		return -1;
+	if (ctx->current_chunk.data_length != entry->len)
+		return -1;
+
+	return 0;
+}
+
+void steg_index_release(struct steg_index *index)
+{
+	free(index->entries);
+	steg_index_init(index, 0);
+}
+
+/**
+ * Read the data of the current chunk, which must be a stIX chunk, verify its
+ * CRC, and decode it into the index. `tail` is non-zero if the chunk precedes
+ * IEND, and zero if it follows IHDR.
+ *
+ * Return values are identical to steg_index_read().
+ * */
+static int read_index_chunk(struct steg_index *index, struct chunk_iterator_ctx *ctx, int tail)
+{
+	u_int32_t len = ctx->current_chunk.data_length;
+	size_t trailer_len = tail ? STEG_INDEX_TRAILER_LENGTH : 0;
+	if (len < STEG_INDEX_HEADER_LENGTH + trailer_len || len > STEG_INDEX_MAX_LENGTH)
+		return -1;
+	if ((len - STEG_INDEX_HEADER_LENGTH - trailer_len) % STEG_INDEX_ENTRY_LENGTH)
+		return -1;
+
+	// read the chunk data, straight from the mapping if possible
+	unsigned char *buffer = NULL;
+	const unsigned char *data = chunk_iterator_get_chunk_data(ctx);
+	if (!data) {
+		buffer = (unsigned char *) malloc(sizeof(unsigned char) * len);
+		if (!buffer)
+			FATAL(MEM_ALLOC_FAILED);
+
+		size_t total_read = 0;
+		while (total_read < len) {
+			ssize_t bytes_read = chunk_iterator_read_data(ctx, buffer + total_read, len - total_read);
+			if (bytes_read <= 0)
+				break;
+
+			total_read += bytes_read;
+		}
+
+		if (total_read < len) {
+			free(buffer);
+			return -1;
+		}
+
+		data = buffer;
+	}
+
+	u_int32_t crc = 0;
+	int ret = -1;
+	if (!chunk_iterator_get_chunk_crc(ctx, &crc)) {
+		u_int32_t computed = crc32(0L, Z_NULL, 0);
+		computed = crc32(computed, (const unsigned char *) STEG_INDEX_CHUNK_TYPE, CHUNK_TYPE_LENGTH);
+		computed = crc32(computed, data, len);
+
+		// chunks listed in a tail index precede it, otherwise they follow it
+		off_t min_offset = tail ? SIGNATURE_LENGTH : ctx->chunk_file_offset + (off_t) CHUNK_LENGTH(len);
+		off_t max_offset = tail ? ctx->chunk_file_offset : INT64_MAX;
+		if (computed == crc && (data[1] & STEG_INDEX_FLAG_TAIL) == (tail ? STEG_INDEX_FLAG_TAIL : 0))
+			ret = decode_index(index, data, len - trailer_len, min_offset, max_offset);
+	}
+
+	free(buffer);
+	return ret;
+}
+
+/**
+ * Decode the first `len` bytes of the data of a stIX chunk into the index.
+ * Chunks listed in the index must lie between file offsets `min_offset` and
+ * `max_offset`, and must not overlap.
+ *
+ * Returns zero if successful, 1 if the index is of an unknown version or marked
+ * unusable, and -1 if it is malformed.
+ * */
+static int decode_index(struct steg_index *index, const unsigned char *data, size_t len,
+		off_t min_offset, off_t max_offset)
+{
+	if (data[0] != STEG_INDEX_VERSION)
+		return 1;
+
+	size_t count = get_u32(data + 4);
+	if (!count)
+		return 1;
+	if (count > (len - STEG_INDEX_HEADER_LENGTH) / STEG_INDEX_ENTRY_LENGTH)
+		return -1;
+
+	steg_index_init(index, count);
+
+	const unsigned char *entry = data + STEG_INDEX_HEADER_LENGTH;
+	for (size_t i = 0; i < count; i++) {
+		u_int64_t offset = get_u64(entry);
+		u_int32_t data_len = get_u32(entry + 8);
+		if (offset < (u_int64_t) min_offset || offset > (u_int64_t) max_offset)
+			return -1;
+		if ((u_int64_t) max_offset - offset < CHUNK_LENGTH(data_len))
+			return -1;
+
+		steg_index_add(index, (off_t) offset, data_len);
+		min_offset = (off_t) (offset + CHUNK_LENGTH(data_len));
+		entry += STEG_INDEX_ENTRY_LENGTH;
+	}
+
+	return 0;
+}
@@ -0,0 +1,961 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "steg-archive.h"
+#include "steg-stream.h"
+#include "utils.h"
+
+static int decode_legacy(struct steg_stream_decoder *, const unsigned char *, size_t);
+static size_t decode_segmented(struct steg_stream_decoder *, const unsigned char *, size_t);
+static size_t accumulate_header(struct steg_stream_decoder *, const unsigned char *, size_t, size_t);
+static int inflate_segment_data(struct steg_stream_decoder *, const unsigned char *, size_t);
+
+static inline void put_u32(unsigned char *buffer, u_int32_t value)
+{
+	buffer[0] = (unsigned char) (value >> 24);
+	buffer[1] = (unsigned char) (value >> 16);
+	buffer[2] = (unsigned char) (value >> 8);
+	buffer[3] = (unsigned char) value;
+}
+
+static inline u_int32_t get_u32(const unsigned char *buffer)
+{
+	return ((u_int32_t) buffer[0] << 24) | ((u_int32_t) buffer[1] << 16) |
+			((u_int32_t) buffer[2] << 8) | (u_int32_t) buffer[3];
+}
+
+void steg_stream_encode_header(unsigned char *buffer, unsigned char codec, unsigned char flags)
+{
+	memcpy(buffer, STEG_STREAM_MAGIC, STEG_STREAM_MAGIC_LENGTH);
+	buffer[4] = STEG_STREAM_VERSION;
+	buffer[5] = codec;
+	buffer[6] = flags;
+	buffer[7] = 0;
+}
+
+void steg_segment_encode_header(unsigned char *buffer, const struct steg_segment_header *header)
+{
+	put_u32(buffer, header->compressed_len);
+	put_u32(buffer + 4, header->uncompressed_len);
+	put_u32(buffer + 8, header->crc);
+}
+
+void steg_segment_decode_header(const unsigned char *buffer, struct steg_segment_header *header)
+{
+	header->compressed_len = get_u32(buffer);
+	header->uncompressed_len = get_u32(buffer + 4);
+	header->crc = get_u32(buffer + 8);
+}
+
+enum steg_stream_format steg_stream_detect_format(const unsigned char *data, size_t len)
+{
+	if (!len)
+		return STEG_FORMAT_UNKNOWN;
+
+	// a zlib stream never begins with 0x89, since that isn't a valid method
+	if (data[0] == (unsigned char) STEG_STREAM_MAGIC[0])
+		return STEG_FORMAT_SEGMENTED;
+
+	return STEG_FORMAT_LEGACY;
+}
+
+void steg_stream_decoder_init(struct steg_stream_decoder *decoder, struct payload_sink *sink)
+{
+	decoder->format = STEG_FORMAT_UNKNOWN;
+	decoder->sink = sink;
+
+	decoder->strm.zalloc = Z_NULL;
+	decoder->strm.zfree = Z_NULL;
+	decoder->strm.opaque = Z_NULL;
+	decoder->strm.avail_in = 0;
+	decoder->strm.next_in = Z_NULL;
+	decoder->strm_initialized = 0;
+	decoder->codec_initialized = 0;
+	decoder->finished = 0;
+
+	decoder->state = STEG_DECODER_STREAM_HEADER;
+	decoder->header_len = 0;
+	decoder->segment_in = 0;
+	decoder->segment_out = 0;
+	decoder->segment_crc = 0;
+	decoder->segment_ended = 0;
+	decoder->segments = 0;
+	decoder->trailing_len = 0;
+
+	decoder->output_buffer = (unsigned char *) malloc(sizeof(unsigned char) * STEG_STREAM_BUFFER_SIZE);
+	if (!decoder->output_buffer)
+		FATAL(MEM_ALLOC_FAILED);
+
+	decoder->error = NULL;
+}
+
+int steg_stream_decoder_write(struct steg_stream_decoder *decoder, const unsigned char *data, size_t len)
+{
+	if (decoder->finished) {
+		decoder->trailing_len += (off_t) len;
+		return 0;
+	}
+
+	if (!len)
+		return 0;
+
+	if (decoder->format == STEG_FORMAT_UNKNOWN)
+		decoder->format = steg_stream_detect_format(data, len);
+
+	if (decoder->format == STEG_FORMAT_LEGACY) {
+		if (!decoder->strm_initialized) {
+			int ret = inflateInit(&decoder->strm);
+			if (ret != Z_OK)
+				FATAL("failed to initialize zlib for DEFLATE: %s", zError(ret));
+
+			decoder->strm_initialized = 1;
+		}
+
+		return decode_legacy(decoder, data, len);
+	}
+
+	while (len && !decoder->finished) {
+		size_t consumed = decode_segmented(decoder, data, len);
+		if (decoder->error)
+			return -1;
+
+		data += consumed;
+		len -= consumed;
+	}
+
+	decoder->trailing_len += (off_t) len;
+	return 0;
+}
+
+int steg_stream_decoder_finish(struct steg_stream_decoder *decoder)
+{
+	if (decoder->format == STEG_FORMAT_UNKNOWN || decoder->finished)
+		return 0;
+
+	decoder->error = decoder->format == STEG_FORMAT_LEGACY ?
+			"embedded data is truncated; the compressed stream ends early" :
+			"embedded data is truncated; the segmented stream ends early";
+	return -1;
+}
+
+void steg_stream_decoder_destroy(struct steg_stream_decoder *decoder)
+{
+	if (decoder->strm_initialized)
+		(void) inflateEnd(&decoder->strm);
+	if (decoder->codec_initialized)
+		steg_codec_decoder_destroy(&decoder->codec);
+
+	free(decoder->output_buffer);
+	decoder->output_buffer = NULL;
+	decoder->strm_initialized = 0;
+	decoder->codec_initialized = 0;
+}
+
+/**
+ * Inflate data from a legacy single zlib stream, writing the inflated data to
+ * the sink. Any data following the end of the zlib stream is ignored.
+ * */
+static int decode_legacy(struct steg_stream_decoder *decoder, const unsigned char *data, size_t len)
+{
+	struct z_stream_s *strm = &decoder->strm;
+	strm->avail_in = len;
+	strm->next_in = (unsigned char *) data;
+
+	do {
+		strm->avail_out = STEG_STREAM_BUFFER_SIZE;
+		strm->next_out = decoder->output_buffer;
+
+		int ret = inflate(strm, Z_NO_FLUSH);
+		switch (ret) {
+			case Z_STREAM_ERROR:
+			case Z_NEED_DICT:
+			case Z_DATA_ERROR:
+			case Z_MEM_ERROR:
+				decoder->error = strm->msg ? strm->msg : zError(ret);
+				return -1;
+			case Z_STREAM_END:
+				decoder->finished = 1;
+				break;
+			default:
+				break;
+		}
+
+		size_t data_to_write = STEG_STREAM_BUFFER_SIZE - strm->avail_out;
+		if (payload_sink_write(decoder->sink, decoder->output_buffer, data_to_write)) {
+			decoder->error = "failed to write inflated data to output file";
+			return -1;
+		}
+	} while (strm->avail_out == 0 && !decoder->finished);
+
+	// whatever follows the end of the zlib stream belongs to another stream
+	if (decoder->finished)
+		decoder->trailing_len += strm->avail_in;
+
+	return 0;
+}
+
+/**
+ * Advance the segmented stream decoder by consuming as much of the given data
+ * as the current state allows.
+ *
+ * Returns the number of bytes consumed. If the stream is corrupt, `error` is set.
+ * */
+static size_t decode_segmented(struct steg_stream_decoder *decoder, const unsigned char *data, size_t len)
+{
+	size_t consumed;
+	enum steg_codec codec;
+
+	switch (decoder->state) {
+		case STEG_DECODER_STREAM_HEADER:
+			consumed = accumulate_header(decoder, data, len, STEG_STREAM_HEADER_LENGTH);
+			if (decoder->header_len < STEG_STREAM_HEADER_LENGTH)
+				return consumed;
+
+			if (memcmp(decoder->header, STEG_STREAM_MAGIC, STEG_STREAM_MAGIC_LENGTH) != 0)
+				decoder->error = "embedded data has an unrecognized format";
+			else if (decoder->header[4] != STEG_STREAM_VERSION)
+				decoder->error = "embedded data uses an unsupported format version";
+			else if (steg_codec_from_id(decoder->header[5], &codec))
+				decoder->error = "embedded data uses an unsupported codec";
+			else if (decoder->header[6] & STEG_STREAM_FLAG_ARCHIVE)
+				decoder->error = "embedded data is an archive; extract its members with --member";
+			else if (decoder->header[6])
+				decoder->error = "embedded data uses unsupported format features";
+
+			if (!decoder->error) {
+				steg_codec_decoder_init(&decoder->codec, codec);
+				decoder->codec_initialized = 1;
+			}
+
+			decoder->header_len = 0;
+			decoder->state = STEG_DECODER_SEGMENT_HEADER;
+			return consumed;
+		case STEG_DECODER_SEGMENT_HEADER:
+			consumed = accumulate_header(decoder, data, len, STEG_SEGMENT_HEADER_LENGTH);
+			if (decoder->header_len < STEG_SEGMENT_HEADER_LENGTH)
+				return consumed;
+
+			decoder->header_len = 0;
+			steg_segment_decode_header(decoder->header, &decoder->segment);
+
+			// a header of zeros marks the end of the stream
+			if (!decoder->segment.compressed_len && !decoder->segment.uncompressed_len
+					&& !decoder->segment.crc) {
+				decoder->state = STEG_DECODER_END;
+				decoder->finished = 1;
+				return consumed;
+			}
+
+			if (!decoder->segment.compressed_len) {
+				decoder->error = "embedded data is corrupt; segment has no compressed data";
+				return consumed;
+			}
+
+			steg_codec_decoder_begin(&decoder->codec, decoder->segment.compressed_len);
+
+			decoder->segment_in = 0;
+			decoder->segment_out = 0;
+			decoder->segment_crc = 0;
+			decoder->segment_ended = 0;
+			decoder->state = STEG_DECODER_SEGMENT_DATA;
+			return consumed;
+		case STEG_DECODER_SEGMENT_DATA:
+			consumed = decoder->segment.compressed_len - decoder->segment_in;
+			consumed = consumed > len ? len : consumed;
+
+			if (inflate_segment_data(decoder, data, consumed))
+				return consumed;
+
+			decoder->segment_in += consumed;
+			if (decoder->segment_in < decoder->segment.compressed_len)
+				return consumed;
+
+			// the segment is complete, so it must be intact
+			if (!decoder->segment_ended)
+				decoder->error = "embedded data is corrupt; segment is truncated";
+			else if (decoder->segment_out != decoder->segment.uncompressed_len)
+				decoder->error = "embedded data is corrupt; segment length mismatch";
+			else if (decoder->segment_crc != decoder->segment.crc)
+				decoder->error = "embedded data is corrupt; segment checksum mismatch";
+
+			decoder->segments++;
+			decoder->state = STEG_DECODER_SEGMENT_HEADER;
+			return consumed;
+		default:
+			decoder->finished = 1;
+			return len;
+	}
+}
+
+/**
+ * Copy bytes of a stream or segment header into the header buffer, until it
+ * holds `header_len` bytes. Returns the number of bytes consumed.
+ * */
+static size_t accumulate_header(struct steg_stream_decoder *decoder, const unsigned char *data,
+		size_t len, size_t header_len)
+{
+	size_t needed = header_len - decoder->header_len;
+	needed = needed > len ? len : needed;
+
+	memcpy(decoder->header + decoder->header_len, data, needed);
+	decoder->header_len += needed;
+
+	return needed;
+}
+
+/**
+ * Decompress compressed data belonging to the current segment, writing the
+ * decompressed data to the sink. `segment_ended` is set once the codec reports
+ * the end of the segment.
+ *
+ * Returns zero if successful, and -1 if an error occurred, in which case
+ * `error` is set.
+ * */
+static int inflate_segment_data(struct steg_stream_decoder *decoder, const unsigned char *data, size_t len)
+{
+	size_t avail_out = 0;
+
+	// keep going while output is pending, even once all input is consumed
+	while (len || (!avail_out && !decoder->segment_ended)) {
+		if (decoder->segment_ended) {
+			decoder->error = "embedded data is corrupt; segment has trailing data";
+			return -1;
+		}
+
+		unsigned char *next_out = decoder->output_buffer;
+		avail_out = STEG_STREAM_BUFFER_SIZE;
+
+		int ret = steg_codec_decompress_step(&decoder->codec, &data, &len, &next_out, &avail_out);
+		if (ret == STEG_CODEC_ERROR) {
+			decoder->error = "embedded data is corrupt; segment could not be inflated";
+			return -1;
+		}
+
+		if (ret == STEG_CODEC_END)
+			decoder->segment_ended = 1;
+
+		size_t data_to_write = STEG_STREAM_BUFFER_SIZE - avail_out;
+		if (data_to_write > decoder->segment.uncompressed_len - decoder->segment_out) {
+			decoder->error = "embedded data is corrupt; segment length mismatch";
+			return -1;
+		}
+
+		decoder->segment_out += data_to_write;
+		decoder->segment_crc = crc32_update(decoder->segment_crc, decoder->output_buffer, data_to_write);
+		if (payload_sink_write(decoder->sink, decoder->output_buffer, data_to_write)) {
+			decoder->error = "failed to write inflated data to output file";
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct segment_job {
+	const struct steg_stream_map *map;
+	enum steg_codec codec;
+
+	struct payload_sink *sink;
+	unsigned int direct: 1;
+
+	// location of the compressed segment data within the steg stream
+	off_t stream_offset;
+	struct steg_segment_header header;
+
+	// location of the inflated data within the payload
+	off_t payload_offset;
+	unsigned char *out;
+
+	const char *error;
+};
+
+static int read_stream_header(const struct steg_stream_map *, off_t, unsigned char *, const char **);
+static int check_stream_header(const struct steg_stream_map *, int, enum steg_codec *, const char **);
+static int delimit_legacy_stream(const struct steg_stream_map *, off_t, struct steg_stream_info *,
+		struct payload_sink *, const char **);
+static int delimit_segmented_stream(const struct steg_stream_map *, off_t, struct steg_stream_info *,
+		const char **);
+static int read_segment_header(const struct steg_stream_map *, off_t, struct steg_segment_header *,
+		const char **);
+static int extract_segments(const struct steg_stream_map *, enum steg_codec, off_t, off_t, off_t,
+		struct payload_sink *, const char **);
+static int inflate_segment_buffer(struct segment_job *, unsigned char *);
+static void inflate_segment(void *);
+static int finish_batch(struct segment_job *, size_t, struct thread_pool *, const char **);
+
+void steg_stream_map_init(struct steg_stream_map *map, int fd,
+		const struct steg_stream_range *ranges, size_t count)
+{
+	map->fd = fd;
+	map->ranges = ranges;
+	map->count = count;
+	map->starts = (off_t *) malloc(sizeof(off_t) * (count + 1));
+	if (!map->starts)
+		FATAL(MEM_ALLOC_FAILED);
+
+	map->starts[0] = 0;
+	for (size_t i = 0; i < count; i++)
+		map->starts[i + 1] = map->starts[i] + ranges[i].len;
+
+	map->base = 0;
+	map->len = map->starts[count];
+	map->slice = 0;
+}
+
+void steg_stream_map_slice(struct steg_stream_map *slice, const struct steg_stream_map *map,
+		off_t offset, off_t len)
+{
+	if (offset < 0 || len < 0 || offset > map->len || len > map->len - offset)
+		BUG("steg stream slice out of bounds");
+
+	*slice = *map;
+	slice->base = map->base + offset;
+	slice->len = len;
+	slice->slice = 1;
+}
+
+off_t steg_stream_map_length(const struct steg_stream_map *map)
+{
+	return map->len;
+}
+
+int steg_stream_map_read(const struct steg_stream_map *map, off_t offset,
+		unsigned char *buffer, size_t len)
+{
+	if (offset < 0 || offset > map->len || (off_t) len > map->len - offset)
+		return -1;
+	if (!len)
+		return 0;
+
+	offset += map->base;
+
+	// binary search for the last chunk starting at or before the offset
+	size_t lo = 0, hi = map->count - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo + 1) / 2;
+		if (map->starts[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	offset -= map->starts[lo];
+	for (size_t i = lo; i < map->count && len; i++) {
+		const struct steg_stream_range *range = &map->ranges[i];
+		size_t piece = range->len - offset;
+		piece = piece > len ? len : piece;
+
+		if (range->data)
+			memcpy(buffer, range->data + offset, piece);
+		else if (recoverable_pread(map->fd, buffer, piece, range->offset + offset) != (ssize_t) piece)
+			return -1;
+
+		buffer += piece;
+		len -= piece;
+		offset = 0;
+	}
+
+	return len ? -1 : 0;
+}
+
+void steg_stream_map_release(struct steg_stream_map *map)
+{
+	// slices share the chunk offsets of the map they were taken from
+	if (!map->slice)
+		free(map->starts);
+
+	map->starts = NULL;
+	map->count = 0;
+	map->len = 0;
+}
+
+int steg_stream_delimit(const struct steg_stream_map *map, off_t offset, struct steg_stream_info *info,
+		struct payload_sink *sink, const char **error)
+{
+	info->offset = offset;
+	info->len = 0;
+	info->payload_len = 0;
+	info->format = STEG_FORMAT_UNKNOWN;
+	info->archive = 0;
+
+	if (offset >= map->len)
+		return 1;
+
+	unsigned char first_byte;
+	if (steg_stream_map_read(map, offset, &first_byte, 1)) {
+		*error = "failed to read embedded data";
+		return -1;
+	}
+
+	info->format = steg_stream_detect_format(&first_byte, 1);
+	if (info->format == STEG_FORMAT_SEGMENTED)
+		return delimit_segmented_stream(map, offset, info, error);
+
+	return delimit_legacy_stream(map, offset, info, sink, error);
+}
+
+int steg_stream_inflate_segments(const struct steg_stream_map *map, struct payload_sink *sink,
+		struct thread_pool *pool, const char **error)
+{
+	enum steg_codec codec;
+	if (check_stream_header(map, 0, &codec, error))
+		return -1;
+
+	off_t stream_offset = STEG_STREAM_HEADER_LENGTH;
+
+	/*
+	 * Segments are inflated in batches, which bounds memory usage when the
+	 * segments must be written to the sink in order.
+	 * */
+	size_t batch_capacity = pool->worker_count * 4;
+	struct segment_job *jobs = (struct segment_job *) calloc(batch_capacity, sizeof(struct segment_job));
+	if (!jobs)
+		FATAL(MEM_ALLOC_FAILED);
+
+	int direct = payload_sink_is_seekable(sink);
+	off_t payload_offset = 0;
+	size_t batch_len = 0;
+	int ret = 0;
+
+	while (1) {
+		struct segment_job *job = &jobs[batch_len];
+		int status = read_segment_header(map, stream_offset, &job->header, error);
+		if (status) {
+			ret = status < 0 ? -1 : 0;
+			break;
+		}
+
+		stream_offset += STEG_SEGMENT_HEADER_LENGTH;
+
+		job->map = map;
+		job->codec = codec;
+		job->sink = sink;
+		job->direct = direct;
+		job->stream_offset = stream_offset;
+		job->payload_offset = payload_offset;
+		job->out = NULL;
+		job->error = NULL;
+		thread_pool_submit(pool, inflate_segment, job);
+
+		stream_offset += job->header.compressed_len;
+		payload_offset += job->header.uncompressed_len;
+
+		if (++batch_len == batch_capacity) {
+			ret = finish_batch(jobs, batch_len, pool, error);
+			batch_len = 0;
+			if (ret)
+				break;
+		}
+	}
+
+	// finish whatever was submitted, even if the stream turned out to be corrupt
+	if (finish_batch(jobs, batch_len, pool, ret ? NULL : error))
+		ret = -1;
+
+	free(jobs);
+
+	if (!ret && direct)
+		payload_sink_set_length(sink, payload_offset);
+
+	return ret;
+}
+
+int steg_stream_extract_segment_range(const struct steg_stream_map *map, off_t offset, off_t len,
+		struct payload_sink *sink, const char **error)
+{
+	enum steg_codec codec;
+	if (check_stream_header(map, 0, &codec, error))
+		return -1;
+
+	// a range extending beyond the end of the stream is truncated
+	return extract_segments(map, codec, STEG_STREAM_HEADER_LENGTH, offset, len, sink, error) < 0 ? -1 : 0;
+}
+
+int steg_stream_extract_member(const struct steg_stream_map *map, off_t stream_offset, off_t member_len,
+		off_t offset, off_t len, struct payload_sink *sink, const char **error)
+{
+	enum steg_codec codec;
+	if (check_stream_header(map, 1, &codec, error))
+		return -1;
+
+	if (offset >= member_len)
+		return 0;
+	if (len > member_len - offset)
+		len = member_len - offset;
+
+	int ret = extract_segments(map, codec, stream_offset, offset, len, sink, error);
+	if (ret > 0) {
+		*error = "embedded data is corrupt; archive member is truncated";
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Inflate `len` bytes of payload from the segments beginning at `stream_offset`
+ * in the steg stream, starting `offset` bytes into the data of the first of
+ * those segments, and write them to the sink. Segments that end before the
+ * range begins are skipped using their headers alone.
+ *
+ * Returns zero if successful, one if the stream ended before the range did, and
+ * -1 if the stream is corrupt or the payload could not be written, in which
+ * case `error` describes the problem.
+ * */
+static int extract_segments(const struct steg_stream_map *map, enum steg_codec codec, off_t stream_offset,
+		off_t offset, off_t len, struct payload_sink *sink, const char **error)
+{
+	struct segment_job job = {
+		.map = map,
+		.codec = codec,
+		.sink = sink,
+		.direct = 0,
+		.stream_offset = stream_offset,
+		.payload_offset = 0,
+		.out = NULL,
+		.error = NULL
+	};
+
+	while (len > 0) {
+		int status = read_segment_header(map, job.stream_offset, &job.header, error);
+		if (status)
+			return status;
+
+		job.stream_offset += STEG_SEGMENT_HEADER_LENGTH;
+
+		// skip over segments that end before the range begins
+		off_t segment_end = job.payload_offset + job.header.uncompressed_len;
+		if (segment_end > offset) {
+			unsigned char *out = (unsigned char *) malloc(sizeof(unsigned char) * (job.header.uncompressed_len + 1));
+			if (!out)
+				FATAL(MEM_ALLOC_FAILED);
+
+			off_t start = offset - job.payload_offset;
+			off_t piece = segment_end - offset;
+			piece = piece > len ? len : piece;
+
+			if (inflate_segment_buffer(&job, out)) {
+				*error = job.error;
+				free(out);
+				return -1;
+			}
+
+			int ret = payload_sink_write(sink, out + start, piece);
+			free(out);
+			if (ret) {
+				*error = "failed to write inflated data to output file";
+				return -1;
+			}
+
+			offset += piece;
+			len -= piece;
+		}
+
+		job.stream_offset += job.header.compressed_len;
+		job.payload_offset = segment_end;
+	}
+
+	return 0;
+}
+
+/**
+ * Read the stream header of the segmented steg stream beginning at offset
+ * `offset` of the map into `header`, and verify that it can be decoded.
+ *
+ * Returns zero if successful, and -1 if the header is invalid, in which case
+ * `error` describes the problem.
+ * */
+static int read_stream_header(const struct steg_stream_map *map, off_t offset, unsigned char *header,
+		const char **error)
+{
+	if (steg_stream_map_read(map, offset, header, STEG_STREAM_HEADER_LENGTH)) {
+		*error = "embedded data is truncated; the segmented stream ends early";
+		return -1;
+	}
+	if (memcmp(header, STEG_STREAM_MAGIC, STEG_STREAM_MAGIC_LENGTH) != 0) {
+		*error = "embedded data has an unrecognized format";
+		return -1;
+	}
+	if (header[4] != STEG_STREAM_VERSION) {
+		*error = "embedded data uses an unsupported format version";
+		return -1;
+	}
+	enum steg_codec codec;
+	if (steg_codec_from_id(header[5], &codec)) {
+		*error = "embedded data uses an unsupported codec";
+		return -1;
+	}
+	if (header[6] & ~STEG_STREAM_FLAG_ARCHIVE) {
+		*error = "embedded data uses unsupported format features";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Verify the stream header of a segmented steg stream, which must describe an
+ * archive if `archive` is non-zero, and a plain payload otherwise, and store
+ * the codec of its segments in `codec`.
+ *
+ * Returns zero if successful, and -1 if the header is invalid, in which case
+ * `error` describes the problem.
+ * */
+static int check_stream_header(const struct steg_stream_map *map, int archive, enum steg_codec *codec,
+		const char **error)
+{
+	unsigned char header[STEG_STREAM_HEADER_LENGTH];
+	if (read_stream_header(map, 0, header, error))
+		return -1;
+	if (steg_codec_from_id(header[5], codec))
+		BUG("codec of a verified stream header is unavailable");
+
+	if (!archive != !(header[6] & STEG_STREAM_FLAG_ARCHIVE)) {
+		*error = archive ? "embedded data is not an archive" : "embedded data is an archive; extract its members with --member";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the end of the legacy steg stream beginning at offset `offset` of the
+ * map. A zlib stream carries no length, so this requires inflating the whole
+ * stream. The inflated data is written to the sink if non-null, and discarded
+ * otherwise.
+ *
+ * Return values are identical to steg_stream_delimit().
+ * */
+static int delimit_legacy_stream(const struct steg_stream_map *map, off_t offset,
+		struct steg_stream_info *info, struct payload_sink *sink, const char **error)
+{
+	unsigned char *in = (unsigned char *) malloc(sizeof(unsigned char) * STEG_STREAM_BUFFER_SIZE);
+	unsigned char *out = (unsigned char *) malloc(sizeof(unsigned char) * STEG_STREAM_BUFFER_SIZE);
+	if (!in || !out)
+		FATAL(MEM_ALLOC_FAILED);
+
+	struct z_stream_s strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	if (inflateInit(&strm) != Z_OK)
+		FATAL("failed to initialize zlib for DEFLATE");
+
+	off_t pos = offset;
+	int ret = Z_OK;
+	*error = NULL;
+	while (ret != Z_STREAM_END && !*error) {
+		if (!strm.avail_in) {
+			if (pos >= map->len) {
+				*error = "embedded data is truncated; the compressed stream ends early";
+				break;
+			}
+
+			size_t len = map->len - pos > STEG_STREAM_BUFFER_SIZE ? STEG_STREAM_BUFFER_SIZE : (size_t) (map->len - pos);
+			if (steg_stream_map_read(map, pos, in, len)) {
+				*error = "failed to read embedded data";
+				break;
+			}
+
+			pos += (off_t) len;
+			strm.next_in = in;
+			strm.avail_in = len;
+		}
+
+		strm.next_out = out;
+		strm.avail_out = STEG_STREAM_BUFFER_SIZE;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			*error = strm.msg ? strm.msg : zError(ret);
+			break;
+		}
+
+		size_t data_to_write = STEG_STREAM_BUFFER_SIZE - strm.avail_out;
+		if (sink && payload_sink_write(sink, out, data_to_write))
+			*error = "failed to write inflated data to output file";
+	}
+
+	info->len = pos - (off_t) strm.avail_in - offset;
+	info->payload_len = (off_t) strm.total_out;
+
+	(void) inflateEnd(&strm);
+	free(in);
+	free(out);
+
+	return *error ? -1 : 0;
+}
+
+/**
+ * Find the end of the segmented steg stream beginning at offset `offset` of the
+ * map by walking its segment headers. The segments themselves are never read.
+ * The table of contents following the end of an archive belongs to the stream.
+ *
+ * Return values are identical to steg_stream_delimit().
+ * */
+static int delimit_segmented_stream(const struct steg_stream_map *map, off_t offset,
+		struct steg_stream_info *info, const char **error)
+{
+	unsigned char header[STEG_STREAM_HEADER_LENGTH];
+	if (read_stream_header(map, offset, header, error))
+		return -1;
+
+	info->archive = (header[6] & STEG_STREAM_FLAG_ARCHIVE) != 0;
+
+	struct steg_segment_header segment;
+	off_t pos = offset + STEG_STREAM_HEADER_LENGTH;
+	int status;
+	while (!(status = read_segment_header(map, pos, &segment, error))) {
+		pos += STEG_SEGMENT_HEADER_LENGTH + (off_t) segment.compressed_len;
+		info->payload_len += segment.uncompressed_len;
+	}
+
+	if (status < 0)
+		return -1;
+
+	pos += STEG_SEGMENT_HEADER_LENGTH;
+	if (info->archive && steg_archive_skip_toc(map, pos, &pos, error))
+		return -1;
+
+	info->len = pos - offset;
+	return 0;
+}
+
+/**
+ * Read and validate the segment header at the given offset of the steg stream.
+ *
+ * Returns zero if successful, one if the header marks the end of the stream,
+ * and -1 if the header is invalid, in which case `error` describes the problem.
+ * */
+static int read_segment_header(const struct steg_stream_map *map, off_t stream_offset,
+		struct steg_segment_header *header, const char **error)
+{
+	unsigned char buffer[STEG_SEGMENT_HEADER_LENGTH];
+	if (steg_stream_map_read(map, stream_offset, buffer, STEG_SEGMENT_HEADER_LENGTH)) {
+		*error = "embedded data is truncated; the segmented stream ends early";
+		return -1;
+	}
+
+	steg_segment_decode_header(buffer, header);
+	if (!header->compressed_len && !header->uncompressed_len && !header->crc)
+		return 1;
+
+	if (!header->compressed_len || header->compressed_len > STEG_SEGMENT_MAX_LENGTH
+			|| header->uncompressed_len > STEG_SEGMENT_MAX_LENGTH) {
+		*error = "embedded data is corrupt; segment has an invalid length";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for a batch of segment jobs to finish, and write any segments that were
+ * not written directly to the sink in order. The first error encountered is
+ * stored in `error`, if non-null.
+ *
+ * Returns zero if successful, and -1 if any segment failed.
+ * */
+static int finish_batch(struct segment_job *jobs, size_t len, struct thread_pool *pool,
+		const char **error)
+{
+	thread_pool_wait(pool);
+
+	int ret = 0;
+	for (size_t i = 0; i < len; i++) {
+		struct segment_job *job = &jobs[i];
+		if (!ret && job->error) {
+			if (error)
+				*error = job->error;
+			ret = -1;
+		}
+
+		if (!ret && job->out && payload_sink_write(job->sink, job->out, job->header.uncompressed_len)) {
+			if (error)
+				*error = "failed to write inflated data to output file";
+			ret = -1;
+		}
+
+		free(job->out);
+		job->out = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * Thread pool job that inflates a single segment. The inflated segment is then
+ * written to its offset in the sink, or kept for the caller to write in order.
+ * */
+static void inflate_segment(void *arg)
+{
+	struct segment_job *job = (struct segment_job *) arg;
+	size_t uncompressed_len = job->header.uncompressed_len;
+
+	unsigned char *out = (unsigned char *) malloc(sizeof(unsigned char) * (uncompressed_len + 1));
+	if (!out)
+		FATAL(MEM_ALLOC_FAILED);
+
+	if (inflate_segment_buffer(job, out)) {
+		free(out);
+		return;
+	}
+
+	if (!job->direct) {
+		job->out = out;
+		return;
+	}
+
+	if (payload_sink_pwrite(job->sink, out, uncompressed_len, job->payload_offset))
+		job->error = "failed to write inflated data to output file";
+
+	free(out);
+}
+
+/**
+ * Read a single segment, decompress it in one pass into `out`, which must have
+ * room for one byte more than the uncompressed length of the segment, and
+ * verify its length and checksum.
+ *
+ * Returns zero if successful, and -1 otherwise, in which case the `error` of
+ * the job describes the problem.
+ * */
+static int inflate_segment_buffer(struct segment_job *job, unsigned char *out)
+{
+	size_t compressed_len = job->header.compressed_len;
+	size_t uncompressed_len = job->header.uncompressed_len;
+
+	unsigned char *in = (unsigned char *) malloc(sizeof(unsigned char) * compressed_len);
+	if (!in)
+		FATAL(MEM_ALLOC_FAILED);
+
+	if (steg_stream_map_read(job->map, job->stream_offset, in, compressed_len)) {
+		job->error = "embedded data is truncated; the segmented stream ends early";
+		free(in);
+		return -1;
+	}
+
+	struct steg_codec_decoder decoder;
+	steg_codec_decoder_init(&decoder, job->codec);
+
+	// one spare byte of output space reveals segments longer than advertised
+	size_t in_len, out_len;
+	int ret = steg_codec_decompress(&decoder, in, compressed_len, out, uncompressed_len + 1, &in_len, &out_len);
+	if (ret != STEG_CODEC_END)
+		job->error = ret == STEG_CODEC_ERROR ? "embedded data is corrupt; segment could not be inflated"
+				: "embedded data is corrupt; segment is truncated";
+	else if (in_len != compressed_len)
+		job->error = "embedded data is corrupt; segment has trailing data";
+	else if (out_len != uncompressed_len)
+		job->error = "embedded data is corrupt; segment length mismatch";
+	else if (crc32_update(0, out, uncompressed_len) != job->header.crc)
+		job->error = "embedded data is corrupt; segment checksum mismatch";
+
+	steg_codec_decoder_destroy(&decoder);
+	free(in);
+
+	return job->error ? -1 : 0;
+}
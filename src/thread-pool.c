@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread-pool.h"
+#include "utils.h"
+
+static void *run_worker(void *);
+
+unsigned int thread_pool_cpu_count(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+void thread_pool_init(struct thread_pool *pool, unsigned int threads)
+{
+	if (!threads)
+		BUG("thread pool must have at least one worker");
+
+	pool->workers = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+	if (!pool->workers)
+		FATAL(MEM_ALLOC_FAILED);
+
+	pool->worker_count = 0;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->pending = 0;
+	pool->shutdown = 0;
+
+	if (pthread_mutex_init(&pool->lock, NULL) ||
+			pthread_cond_init(&pool->job_queued, NULL) ||
+			pthread_cond_init(&pool->job_finished, NULL))
+		FATAL("failed to initialize thread pool");
+
+	for (unsigned int i = 0; i < threads; i++) {
+		if (pthread_create(&pool->workers[i], NULL, run_worker, pool))
+			FATAL("failed to create worker thread");
+
+		pool->worker_count++;
+	}
+}
+
+void thread_pool_submit(struct thread_pool *pool, thread_pool_job_fn fn, void *arg)
+{
+	struct thread_pool_job *job = (struct thread_pool_job *) malloc(sizeof(struct thread_pool_job));
+	if (!job)
+		FATAL(MEM_ALLOC_FAILED);
+
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+
+	pool->tail = job;
+	pool->pending++;
+
+	pthread_cond_signal(&pool->job_queued);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->job_finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	thread_pool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->job_queued);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->worker_count; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	pthread_cond_destroy(&pool->job_finished);
+	pthread_cond_destroy(&pool->job_queued);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+
+	pool->workers = NULL;
+	pool->worker_count = 0;
+}
+
+/**
+ * Worker thread routine. Repeatedly takes the oldest job from the queue and
+ * runs it, until the pool is shut down.
+ * */
+static void *run_worker(void *data)
+{
+	struct thread_pool *pool = (struct thread_pool *) data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->head && !pool->shutdown)
+			pthread_cond_wait(&pool->job_queued, &pool->lock);
+
+		if (!pool->head)
+			break;
+
+		struct thread_pool_job *job = pool->head;
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+		job->fn(job->arg);
+		free(job);
+		pthread_mutex_lock(&pool->lock);
+
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->job_finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
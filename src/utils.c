@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -7,11 +9,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdatomic.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include "utils.h"
-#include "md5.h"
+#include "md5-mb.h"
 
 #define BUFF_LEN 1024
+#define DIGEST_LANE_BUFF_LEN (BUFF_LEN * 64)
 
 static void print_message(FILE *output_stream, const char *prefix,
 		const char *fmt, va_list varargs);
@@ -99,6 +106,30 @@ ssize_t recoverable_read(int fd, void *buf, size_t len)
 	return bytes_read;
 }
 
+ssize_t recoverable_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	int errsv = errno;
+
+	size_t total_read = 0;
+	while (total_read < len) {
+		ssize_t bytes_read = pread(fd, (char *) buf + total_read, len - total_read,
+				offset + total_read);
+		if ((bytes_read < 0) && (errno == EAGAIN || errno == EINTR)) {
+			errno = errsv;
+			continue;
+		}
+
+		if (bytes_read < 0)
+			return -1;
+		if (bytes_read == 0)
+			break;
+
+		total_read += bytes_read;
+	}
+
+	return total_read;
+}
+
 ssize_t recoverable_write(int fd, const void *buf, size_t len)
 {
 	int errsv = errno;
@@ -117,6 +148,61 @@ ssize_t recoverable_write(int fd, const void *buf, size_t len)
 	return bytes_written;
 }
 
+ssize_t recoverable_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	int errsv = errno;
+
+	size_t total_written = 0;
+	while (total_written < len) {
+		ssize_t bytes_written = pwrite(fd, (const char *) buf + total_written,
+				len - total_written, offset + total_written);
+		if ((bytes_written < 0) && (errno == EAGAIN || errno == EINTR)) {
+			errno = errsv;
+			continue;
+		}
+
+		if (bytes_written <= 0)
+			return -1;
+
+		total_written += bytes_written;
+	}
+
+	return total_written;
+}
+
+ssize_t recoverable_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	int errsv = errno;
+
+	ssize_t total_written = 0;
+	while (iovcnt > 0) {
+		ssize_t bytes_written = writev(fd, iov, iovcnt);
+		if ((bytes_written < 0) && (errno == EAGAIN || errno == EINTR)) {
+			errno = errsv;
+			continue;
+		}
+
+		if (bytes_written < 0)
+			return -1;
+
+		total_written += bytes_written;
+
+		// skip over the iovecs that were fully written, and trim a partial one
+		while (iovcnt > 0 && (size_t) bytes_written >= iov->iov_len) {
+			bytes_written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + bytes_written;
+			iov->iov_len -= bytes_written;
+		}
+	}
+
+	return total_written;
+}
+
 ssize_t copy_file(const char *dest, const char *src, int mode)
 {
 	int in_fd, out_fd;
@@ -149,6 +235,86 @@ ssize_t copy_file_fd(int dest_fd, int src_fd)
 	return bytes_written;
 }
 
+ssize_t copy_file_range_fd(int dest_fd, int src_fd, off_t offset, size_t len)
+{
+	int errsv = errno;
+	size_t bytes_written = 0;
+
+	/*
+	 * copy_file_range() and sendfile() refuse some combinations of files (e.g.
+	 * across filesystems on some kernels, or to a pipe). When that happens,
+	 * pick up where we left off with the next strategy.
+	 * */
+#ifdef HAVE_COPY_FILE_RANGE
+	/*
+	 * ENOSYS, EXDEV and EOPNOTSUPP mean copy_file_range() won't work for any
+	 * files this process copies, so it's never tried again. EINVAL depends on the
+	 * files, so only the pair refused last is remembered, which is enough for
+	 * callers that copy chunk after chunk between the same files. Both are shared
+	 * by the workers of a batch, which may copy concurrently.
+	 * */
+	static atomic_int copy_file_range_unsupported = 0;
+	static atomic_ullong copy_file_range_refused_pair = 0;
+	unsigned long long pair = ((unsigned long long) (unsigned int) dest_fd + 1) << 32
+			| ((unsigned long long) (unsigned int) src_fd + 1);
+	int refused = atomic_load_explicit(&copy_file_range_unsupported, memory_order_relaxed)
+			|| atomic_load_explicit(&copy_file_range_refused_pair, memory_order_relaxed) == pair;
+	while (!refused && bytes_written < len) {
+		loff_t off_in = offset + bytes_written;
+		ssize_t ret = copy_file_range(src_fd, &off_in, dest_fd, NULL, len - bytes_written, 0);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+			errno = errsv;
+			continue;
+		}
+
+		if (ret < 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP))
+			atomic_store_explicit(&copy_file_range_unsupported, 1, memory_order_relaxed);
+		else if (ret < 0 && errno == EINVAL)
+			atomic_store_explicit(&copy_file_range_refused_pair, pair, memory_order_relaxed);
+		if (ret <= 0) {
+			errno = errsv;
+			break;
+		}
+
+		bytes_written += ret;
+	}
+#endif
+
+#ifdef HAVE_SENDFILE
+	while (bytes_written < len) {
+		off_t off_in = offset + bytes_written;
+		ssize_t ret = sendfile(dest_fd, src_fd, &off_in, len - bytes_written);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+			errno = errsv;
+			continue;
+		}
+
+		if (ret <= 0) {
+			errno = errsv;
+			break;
+		}
+
+		bytes_written += ret;
+	}
+#endif
+
+	char buffer[BUFF_LEN * 16];
+	while (bytes_written < len) {
+		size_t to_read = len - bytes_written;
+		to_read = to_read > sizeof(buffer) ? sizeof(buffer) : to_read;
+
+		ssize_t bytes_read = recoverable_pread(src_fd, buffer, to_read, offset + bytes_written);
+		if (bytes_read <= 0)
+			break;
+		if (recoverable_write(dest_fd, buffer, bytes_read) != bytes_read)
+			break;
+
+		bytes_written += bytes_read;
+	}
+
+	return bytes_written;
+}
+
 void hex_dump(FILE *output_stream, off_t offset, unsigned char *buffer, size_t len)
 {
 	for (size_t i = 0; i < len; i += 16) {
@@ -166,49 +332,167 @@ void hex_dump(FILE *output_stream, off_t offset, unsigned char *buffer, size_t l
 	}
 }
 
-int compute_md5_sum(int fd, unsigned char md5_hash[])
+int compute_file_digest(int fd, enum digest_type type, unsigned char hash[])
 {
-	struct md5_ctx ctx;
+	struct digest_ctx ctx;
 	ssize_t bytes_read = 0;
 
-	md5_init_ctx(&ctx);
+	digest_init(&ctx, type);
 
-	char buffer[BUFF_LEN];
-	while ((bytes_read = recoverable_read(fd, buffer, BUFF_LEN)) > 0)
-		md5_process_bytes(buffer, bytes_read, &ctx);
+	char buffer[BUFF_LEN * 16];
+	while ((bytes_read = recoverable_read(fd, buffer, BUFF_LEN * 16)) > 0)
+		digest_update(&ctx, buffer, bytes_read);
 
 	if (bytes_read < 0)
 		return 1;
 
-	md5_finish_ctx(&ctx, md5_hash);
+	digest_final(&ctx, hash);
 	return 0;
 }
 
-void print_file_summary(const char *file_path, int filename_table_len)
+/**
+ * A file being hashed in one lane of compute_file_digests(). The lane buffer
+ * holds input that has been read but not yet hashed.
+ * */
+struct digest_lane {
+	ssize_t file;
+	int eof;
+	struct md5_ctx ctx;
+	size_t len;
+	unsigned char *buffer;
+};
+
+static void digest_lane_load(struct digest_lane *lane, size_t *next, size_t count)
+{
+	lane->file = *next < count ? (ssize_t) (*next)++ : -1;
+	lane->eof = 0;
+	lane->len = 0;
+	md5_init_ctx(&lane->ctx);
+}
+
+int compute_file_digests(const int fds[], size_t count, enum digest_type type,
+		unsigned char hashes[][DIGEST_MAX_SIZE], int failed[])
 {
-	unsigned char md5_hash[MD5_DIGEST_SIZE];
-	struct stat st;
-	int fd;
+	int failures = 0;
+	if (type != DIGEST_MD5) {
+		for (size_t i = 0; i < count; i++)
+			failures += failed[i] = compute_file_digest(fds[i], type, hashes[i]) != 0;
 
-	// print input file summary
-	if (lstat(file_path, &st) && errno == ENOENT)
-		FATAL("failed to stat %s'", file_path);
+		return failures;
+	}
+
+	struct digest_lane lanes[MD5_MB_LANES];
+	size_t lane_count = count < MD5_MB_LANES ? count : MD5_MB_LANES;
+	size_t next = 0;
+	for (size_t i = 0; i < lane_count; i++) {
+		lanes[i].buffer = (unsigned char *) malloc(DIGEST_LANE_BUFF_LEN);
+		if (!lanes[i].buffer)
+			FATAL(MEM_ALLOC_FAILED);
+
+		digest_lane_load(&lanes[i], &next, count);
+	}
+
+	/*
+	 * Each round tops up the buffer of every lane, hashes as many whole blocks
+	 * as every lane has buffered, and keeps the rest for the next round. A lane
+	 * whose file is exhausted hashes what remains and moves on to the next file.
+	 * */
+	for (;;) {
+		struct md5_ctx *ctx[MD5_MB_LANES];
+		const unsigned char *buffers[MD5_MB_LANES];
+		struct digest_lane *active[MD5_MB_LANES];
+		size_t active_len = 0;
+		size_t blocks = DIGEST_LANE_BUFF_LEN / MD5_MB_BLOCK_SIZE;
+
+		for (size_t i = 0; i < lane_count; i++) {
+			struct digest_lane *lane = &lanes[i];
+			while (lane->file >= 0) {
+				while (!lane->eof && lane->len < DIGEST_LANE_BUFF_LEN) {
+					ssize_t bytes_read = recoverable_read(fds[lane->file], lane->buffer + lane->len,
+							DIGEST_LANE_BUFF_LEN - lane->len);
+					if (bytes_read <= 0) {
+						lane->eof = bytes_read < 0 ? -1 : 1;
+						break;
+					}
+
+					lane->len += (size_t) bytes_read;
+				}
+
+				if (lane->eof < 0) {
+					failed[lane->file] = 1;
+					failures++;
+					digest_lane_load(lane, &next, count);
+					continue;
+				}
+
+				if (lane->eof && lane->len < MD5_MB_BLOCK_SIZE) {
+					md5_process_bytes(lane->buffer, lane->len, &lane->ctx);
+					md5_finish_ctx(&lane->ctx, hashes[lane->file]);
+					failed[lane->file] = 0;
+					digest_lane_load(lane, &next, count);
+					continue;
+				}
+
+				break;
+			}
+
+			if (lane->file < 0)
+				continue;
+
+			ctx[active_len] = &lane->ctx;
+			buffers[active_len] = lane->buffer;
+			active[active_len++] = lane;
+			if (lane->len / MD5_MB_BLOCK_SIZE < blocks)
+				blocks = lane->len / MD5_MB_BLOCK_SIZE;
+		}
+
+		if (!active_len)
+			break;
+
+		md5_mb_process_blocks(ctx, buffers, active_len, blocks);
+
+		size_t consumed = blocks * MD5_MB_BLOCK_SIZE;
+		for (size_t i = 0; i < active_len; i++) {
+			active[i]->len -= consumed;
+			memmove(active[i]->buffer, active[i]->buffer + consumed, active[i]->len);
+		}
+	}
+
+	for (size_t i = 0; i < lane_count; i++)
+		free(lanes[i].buffer);
+
+	return failures;
+}
 
-	fd = open(file_path, O_RDONLY);
+void print_file_summary(const char *file_path, enum digest_type type, int filename_table_len)
+{
+	unsigned char hash[DIGEST_MAX_SIZE];
+
+	int fd = open(file_path, O_RDONLY);
 	if (fd < 0)
 		DIE(FILE_OPEN_FAILED, file_path);
 
-	if (compute_md5_sum(fd, md5_hash))
-		FATAL("failed to compute md5 hash of file '%s'", file_path);
+	if (compute_file_digest(fd, type, hash))
+		FATAL("failed to compute %s hash of file '%s'", digest_name(type), file_path);
+
+	close(fd);
+	print_file_summary_with_digest(file_path, type, hash, filename_table_len);
+}
+
+void print_file_summary_with_digest(const char *file_path, enum digest_type type,
+		const unsigned char hash[], int filename_table_len)
+{
+	struct stat st;
+
+	// print input file summary
+	if (lstat(file_path, &st) && errno == ENOENT)
+		FATAL("failed to stat %s'", file_path);
 
 	const char *filename = strrchr(file_path, '/');
 	filename = !filename ? file_path : filename + 1;
 
 	fprintf(stdout, "%s %*s", filename, filename_table_len, " ");
 	fprintf(stdout, "%o %lld ", st.st_mode, (unsigned long long int)st.st_size);
-	for (size_t i = 0; i < MD5_DIGEST_SIZE; i++)
-		fprintf(stdout, "%02x", md5_hash[i]);
+	print_digest(stdout, type, hash);
 	fprintf(stdout, "\n");
-
-	close(fd);
 }
@@ -0,0 +1,306 @@
+#include <string.h>
+
+#include "xxh3.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE 192
+#define SECRET_CONSUME_RATE 8
+#define SECRET_MERGEACCS_START 11
+#define SECRET_LASTACC_START 7
+#define MIDSIZE_START_OFFSET 3
+#define MIDSIZE_LAST_OFFSET 17
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - XXH3_STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define SECRET_LIMIT (SECRET_SIZE - XXH3_STRIPE_LEN)
+
+static const unsigned char secret[SECRET_SIZE] = {
+		0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+		0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+		0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+		0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+		0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+		0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+		0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+		0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+		0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+		0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+		0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+		0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t read_le64(const unsigned char *p)
+{
+	return (uint64_t) read_le32(p) | ((uint64_t) read_le32(p + 4) << 32);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t swap32(uint32_t x)
+{
+	return ((x << 24) & 0xff000000U) | ((x << 8) & 0x00ff0000U) |
+			((x >> 8) & 0x0000ff00U) | ((x >> 24) & 0x000000ffU);
+}
+
+static inline uint64_t swap64(uint64_t x)
+{
+	return ((uint64_t) swap32((uint32_t) x) << 32) | swap32((uint32_t) (x >> 32));
+}
+
+/**
+ * Multiply two 64-bit integers into a 128-bit product, and fold it back into 64
+ * bits by XORing its two halves. Done in 32-bit pieces, since ISO C has no
+ * 128-bit integers.
+ * */
+static uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+	uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+	uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+	uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+	uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+	uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+
+	return lower ^ upper;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return h ^ (h >> 28);
+}
+
+static uint64_t mix16(const unsigned char *input, const unsigned char *key)
+{
+	return mul128_fold64(read_le64(input) ^ read_le64(key), read_le64(input + 8) ^ read_le64(key + 8));
+}
+
+/**
+ * Hash an input of at most 240 bytes, which XXH3 handles without stripes.
+ * */
+static uint64_t hash_short(const unsigned char *input, size_t len)
+{
+	if (!len)
+		return xxh64_avalanche(read_le64(secret + 56) ^ read_le64(secret + 64));
+
+	if (len <= 3) {
+		uint32_t combined = ((uint32_t) input[0] << 16) | ((uint32_t) input[len >> 1] << 24) |
+				(uint32_t) input[len - 1] | ((uint32_t) len << 8);
+		uint64_t bitflip = (uint64_t) (read_le32(secret) ^ read_le32(secret + 4));
+		return xxh64_avalanche((uint64_t) combined ^ bitflip);
+	}
+
+	if (len <= 8) {
+		uint64_t bitflip = read_le64(secret + 8) ^ read_le64(secret + 16);
+		uint64_t value = (uint64_t) read_le32(input + len - 4) + ((uint64_t) read_le32(input) << 32);
+		return rrmxmx(value ^ bitflip, len);
+	}
+
+	if (len <= 16) {
+		uint64_t lo = read_le64(input) ^ (read_le64(secret + 24) ^ read_le64(secret + 32));
+		uint64_t hi = read_le64(input + len - 8) ^ (read_le64(secret + 40) ^ read_le64(secret + 48));
+		return avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+	}
+
+	uint64_t acc = len * PRIME64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += mix16(input + 48, secret + 96);
+					acc += mix16(input + len - 64, secret + 112);
+				}
+				acc += mix16(input + 32, secret + 64);
+				acc += mix16(input + len - 48, secret + 80);
+			}
+			acc += mix16(input + 16, secret + 32);
+			acc += mix16(input + len - 32, secret + 48);
+		}
+		acc += mix16(input, secret);
+		acc += mix16(input + len - 16, secret + 16);
+		return avalanche(acc);
+	}
+
+	size_t rounds = len / 16;
+	for (size_t i = 0; i < 8; i++)
+		acc += mix16(input + 16 * i, secret + 16 * i);
+
+	acc = avalanche(acc);
+	for (size_t i = 8; i < rounds; i++)
+		acc += mix16(input + 16 * i, secret + 16 * (i - 8) + MIDSIZE_START_OFFSET);
+
+	acc += mix16(input + len - 16, secret + 136 - MIDSIZE_LAST_OFFSET);
+	return avalanche(acc);
+}
+
+static void accumulate_stripe(uint64_t acc[], const unsigned char *input, const unsigned char *key)
+{
+	for (size_t i = 0; i < 8; i++) {
+		uint64_t value = read_le64(input + 8 * i);
+		uint64_t keyed = value ^ read_le64(key + 8 * i);
+		acc[i ^ 1] += value;
+		acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+	}
+}
+
+static void scramble(uint64_t acc[])
+{
+	const unsigned char *key = secret + SECRET_LIMIT;
+	for (size_t i = 0; i < 8; i++) {
+		uint64_t value = acc[i];
+		value ^= value >> 47;
+		value ^= read_le64(key + 8 * i);
+		acc[i] = value * PRIME32_1;
+	}
+}
+
+/**
+ * Accumulate `stripes` stripes of input, scrambling the accumulators whenever a
+ * block of stripes is completed.
+ * */
+static void consume_stripes(uint64_t acc[], size_t *stripes_so_far, const unsigned char *input, size_t stripes)
+{
+	while (stripes) {
+		size_t to_end_of_block = STRIPES_PER_BLOCK - *stripes_so_far;
+		size_t n = stripes < to_end_of_block ? stripes : to_end_of_block;
+		for (size_t i = 0; i < n; i++)
+			accumulate_stripe(acc, input + i * XXH3_STRIPE_LEN, secret + (*stripes_so_far + i) * SECRET_CONSUME_RATE);
+
+		*stripes_so_far += n;
+		input += n * XXH3_STRIPE_LEN;
+		stripes -= n;
+
+		if (*stripes_so_far == STRIPES_PER_BLOCK) {
+			scramble(acc);
+			*stripes_so_far = 0;
+		}
+	}
+}
+
+void xxh3_init(struct xxh3_state *state)
+{
+	const uint64_t initial[8] = {
+			PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+			PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+	};
+
+	memcpy(state->acc, initial, sizeof(initial));
+	state->total_len = 0;
+	state->stripes_so_far = 0;
+	state->buffered = 0;
+}
+
+void xxh3_update(struct xxh3_state *state, const void *input, size_t len)
+{
+	const unsigned char *pos = (const unsigned char *) input;
+	const unsigned char *end = pos + len;
+	state->total_len += len;
+
+	if (state->buffered + len <= XXH3_BUFFER_SIZE) {
+		memcpy(state->buffer + state->buffered, pos, len);
+		state->buffered += len;
+		return;
+	}
+
+	/*
+	 * Input is only ever consumed once more follows it, since the last stripe
+	 * of the whole input is treated specially by xxh3_final().
+	 * */
+	if (state->buffered) {
+		size_t fill = XXH3_BUFFER_SIZE - state->buffered;
+		memcpy(state->buffer + state->buffered, pos, fill);
+		pos += fill;
+
+		consume_stripes(state->acc, &state->stripes_so_far, state->buffer, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+		state->buffered = 0;
+	}
+
+	if (end - pos > XXH3_BUFFER_SIZE) {
+		do {
+			consume_stripes(state->acc, &state->stripes_so_far, pos, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+			pos += XXH3_BUFFER_SIZE;
+		} while (end - pos > XXH3_BUFFER_SIZE);
+
+		// keep the last stripe consumed, in case it's needed to complete the final stripe
+		memcpy(state->buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN, pos - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+	}
+
+	memcpy(state->buffer, pos, (size_t) (end - pos));
+	state->buffered = (size_t) (end - pos);
+}
+
+void xxh3_final(const struct xxh3_state *state, unsigned char digest[])
+{
+	uint64_t hash;
+	if (state->total_len <= 240) {
+		hash = hash_short(state->buffer, (size_t) state->total_len);
+	} else {
+		uint64_t acc[8];
+		size_t stripes_so_far = state->stripes_so_far;
+		memcpy(acc, state->acc, sizeof(acc));
+
+		// the final stripe always ends with the last byte of input, overlapping earlier stripes if need be
+		unsigned char last_stripe[XXH3_STRIPE_LEN];
+		const unsigned char *last = last_stripe;
+		if (state->buffered >= XXH3_STRIPE_LEN) {
+			consume_stripes(acc, &stripes_so_far, state->buffer, (state->buffered - 1) / XXH3_STRIPE_LEN);
+			last = state->buffer + state->buffered - XXH3_STRIPE_LEN;
+		} else {
+			size_t catchup = XXH3_STRIPE_LEN - state->buffered;
+			memcpy(last_stripe, state->buffer + XXH3_BUFFER_SIZE - catchup, catchup);
+			memcpy(last_stripe + catchup, state->buffer, state->buffered);
+		}
+
+		accumulate_stripe(acc, last, secret + SECRET_LIMIT - SECRET_LASTACC_START);
+
+		hash = state->total_len * PRIME64_1;
+		for (size_t i = 0; i < 4; i++) {
+			const unsigned char *key = secret + SECRET_MERGEACCS_START + 16 * i;
+			hash += mul128_fold64(acc[2 * i] ^ read_le64(key), acc[2 * i + 1] ^ read_le64(key + 8));
+		}
+
+		hash = avalanche(hash);
+	}
+
+	for (size_t i = 0; i < XXH3_DIGEST_SIZE; i++)
+		digest[i] = (unsigned char) (hash >> (56 - 8 * i));
+}
@@ -0,0 +1,112 @@
+/**
+ * crc32-bench is a micro-benchmark of crc32_update() and
+ * crc32_update_parallel() (see crc32.h) against the crc32_z() of the system
+ * zlib. crc32_update_parallel() runs on a pool that is started once, before
+ * timing, as callers reuse theirs; the time taken to start and stop the pool is
+ * reported on its own. Before timing anything, the CRC of every length and
+ * alignment up to a few hundred bytes is compared with zlib's:
+ * crc32-bench [<MiB> [<threads>]]
+ *
+ * The engine under test is the one selected for the processor running the
+ * benchmark; defining STEG_PNG_NO_SIMD selects zlib.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+#include "thread-pool.h"
+#include "zlib.h"
+
+#define ROUNDS 5
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mib = argc > 1 ? (size_t) strtoul(argv[1], NULL, 10) : 256;
+	unsigned int threads = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : thread_pool_cpu_count();
+	size_t len = mib * 1024 * 1024;
+	if (!len || !threads) {
+		fprintf(stderr, "usage: crc32-bench [<MiB> [<threads>]]\n");
+		return 1;
+	}
+
+	unsigned char *buffer = (unsigned char *) malloc(len);
+	if (!buffer) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		buffer[i] = (unsigned char) rand();
+
+	for (size_t offset = 0; offset < 16; offset++) {
+		for (size_t n = 0; n < 512; n++) {
+			u_int32_t seed = (u_int32_t) (n * 2654435761u);
+			if (crc32_update(seed, buffer + offset, n) != (u_int32_t) crc32_z(seed, buffer + offset, n)) {
+				fprintf(stderr, "CRC of %zu bytes at offset %zu does not match crc32_z()\n", n, offset);
+				return 1;
+			}
+		}
+	}
+
+	double pool_best = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		struct thread_pool pool;
+		double start = now();
+		thread_pool_init(&pool, threads);
+		thread_pool_destroy(&pool);
+		double elapsed = now() - start;
+		if (!round || elapsed < pool_best)
+			pool_best = elapsed;
+	}
+
+	struct thread_pool pool;
+	thread_pool_init(&pool, threads);
+
+	double zlib_best = 0, engine_best = 0, parallel_best = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		double start = now();
+		u_int32_t expected = (u_int32_t) crc32_z(0, buffer, len);
+		double elapsed = now() - start;
+		if (!round || elapsed < zlib_best)
+			zlib_best = elapsed;
+
+		start = now();
+		u_int32_t actual = crc32_update(0, buffer, len);
+		elapsed = now() - start;
+		if (!round || elapsed < engine_best)
+			engine_best = elapsed;
+
+		start = now();
+		u_int32_t parallel = crc32_update_parallel(0, buffer, len, &pool);
+		elapsed = now() - start;
+		if (!round || elapsed < parallel_best)
+			parallel_best = elapsed;
+
+		if (actual != expected || parallel != expected) {
+			fprintf(stderr, "CRC of the %s engine does not match crc32_z()\n", crc32_engine());
+			return 1;
+		}
+	}
+
+	thread_pool_destroy(&pool);
+
+	double gib = (double) len / (1024.0 * 1024.0 * 1024.0);
+	printf("crc32_z (zlib):             %6.2f GiB/s\n", gib / zlib_best);
+	printf("crc32_update (%-6s):      %6.2f GiB/s (%.2fx)\n", crc32_engine(), gib / engine_best,
+			zlib_best / engine_best);
+	printf("crc32_update_parallel (%2u): %6.2f GiB/s (%.2fx)\n", threads, gib / parallel_best,
+			zlib_best / parallel_best);
+	printf("thread pool start/stop (%2u): %6.3f ms\n", threads, pool_best * 1e3);
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * io-counter is a tiny LD_PRELOAD shim used by the test suite to count the
+ * read-related system calls made by steg-png. When the process exits, the
+ * counts are written to the file named by the IO_COUNTER_OUTPUT environment
+ * variable in the following format:
+ * read <n>
+ * pread <n>
+ * lseek <n>
+ * */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+static unsigned long read_count = 0;
+static unsigned long pread_count = 0;
+static unsigned long lseek_count = 0;
+
+#define LOAD_REAL(fn, name) \
+	do { \
+		if (!(fn)) \
+			*(void **) (&(fn)) = dlsym(RTLD_NEXT, (name)); \
+	} while (0)
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+	static ssize_t (*real_read)(int, void *, size_t) = NULL;
+	LOAD_REAL(real_read, "read");
+
+	read_count++;
+	return real_read(fd, buf, len);
+}
+
+ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+	static ssize_t (*real_pread)(int, void *, size_t, off_t) = NULL;
+	LOAD_REAL(real_pread, "pread");
+
+	pread_count++;
+	return real_pread(fd, buf, len, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t len, off_t offset)
+{
+	static ssize_t (*real_pread64)(int, void *, size_t, off_t) = NULL;
+	LOAD_REAL(real_pread64, "pread64");
+
+	pread_count++;
+	return real_pread64(fd, buf, len, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+	static off_t (*real_lseek)(int, off_t, int) = NULL;
+	LOAD_REAL(real_lseek, "lseek");
+
+	lseek_count++;
+	return real_lseek(fd, offset, whence);
+}
+
+off_t lseek64(int fd, off_t offset, int whence)
+{
+	static off_t (*real_lseek64)(int, off_t, int) = NULL;
+	LOAD_REAL(real_lseek64, "lseek64");
+
+	lseek_count++;
+	return real_lseek64(fd, offset, whence);
+}
+
+__attribute__((destructor))
+static void write_counts(void)
+{
+	const char *output_path = getenv("IO_COUNTER_OUTPUT");
+	if (!output_path)
+		return;
+
+	FILE *output = fopen(output_path, "w");
+	if (!output)
+		return;
+
+	fprintf(output, "read %lu\npread %lu\nlseek %lu\n", read_count, pread_count, lseek_count);
+	fclose(output);
+}
@@ -0,0 +1,98 @@
+/**
+ * md5-bench is a micro-benchmark of the multi-buffer MD5 engine (see
+ * md5-mb.h) against md5_process_block(). The same buffers are hashed both
+ * ways, and the digests compared, before the throughput of each is reported:
+ * md5-bench [<MiB per lane>]
+ *
+ * The engine under test is the one selected for the processor running the
+ * benchmark; defining STEG_PNG_NO_SIMD selects the scalar engine.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "md5.h"
+#include "md5-mb.h"
+
+#define ROUNDS 5
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mib = argc > 1 ? (size_t) strtoul(argv[1], NULL, 10) : 16;
+	size_t len = mib * 1024 * 1024;
+	if (!len) {
+		fprintf(stderr, "usage: md5-bench [<MiB per lane>]\n");
+		return 1;
+	}
+
+	unsigned char *buffers[MD5_MB_LANES];
+	srand(1);
+	for (size_t i = 0; i < MD5_MB_LANES; i++) {
+		buffers[i] = (unsigned char *) malloc(len);
+		if (!buffers[i]) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		for (size_t j = 0; j < len; j++)
+			buffers[i][j] = (unsigned char) rand();
+	}
+
+	unsigned char expected[MD5_MB_LANES][MD5_DIGEST_SIZE];
+	unsigned char actual[MD5_MB_LANES][MD5_DIGEST_SIZE];
+	double scalar_best = 0, mb_best = 0;
+
+	for (int round = 0; round < ROUNDS; round++) {
+		double start = now();
+		for (size_t i = 0; i < MD5_MB_LANES; i++) {
+			struct md5_ctx ctx;
+			md5_init_ctx(&ctx);
+			md5_process_block(buffers[i], len, &ctx);
+			md5_finish_ctx(&ctx, expected[i]);
+		}
+
+		double elapsed = now() - start;
+		if (!round || elapsed < scalar_best)
+			scalar_best = elapsed;
+
+		struct md5_ctx ctx[MD5_MB_LANES];
+		struct md5_ctx *lanes[MD5_MB_LANES];
+		for (size_t i = 0; i < MD5_MB_LANES; i++) {
+			md5_init_ctx(&ctx[i]);
+			lanes[i] = &ctx[i];
+		}
+
+		start = now();
+		md5_mb_process_blocks(lanes, (const unsigned char *const *) buffers, MD5_MB_LANES,
+				len / MD5_MB_BLOCK_SIZE);
+		for (size_t i = 0; i < MD5_MB_LANES; i++)
+			md5_finish_ctx(&ctx[i], actual[i]);
+
+		elapsed = now() - start;
+		if (!round || elapsed < mb_best)
+			mb_best = elapsed;
+
+		if (memcmp(expected, actual, sizeof(expected)) != 0) {
+			fprintf(stderr, "digests of the %s engine do not match md5_process_block()\n", md5_mb_engine());
+			return 1;
+		}
+	}
+
+	double total_mib = (double) (mib * MD5_MB_LANES);
+	printf("md5_process_block:   %8.1f MiB/s\n", total_mib / scalar_best);
+	printf("md5_mb (%-6s, %d): %8.1f MiB/s (%.2fx)\n", md5_mb_engine(), MD5_MB_LANES,
+			total_mib / mb_best, scalar_best / mb_best);
+
+	for (size_t i = 0; i < MD5_MB_LANES; i++)
+		free(buffers[i]);
+
+	return 0;
+}
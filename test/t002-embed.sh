@@ -6,7 +6,8 @@
 	steg-png embed -h >out &&
 	grep "usage: steg-png embed" out &&
 	steg-png embed --help >out &&
-	grep "usage: steg-png embed" out
+	grep "usage: steg-png embed" out &&
+	grep -e "^    -f, --file <file> .*specify a file to embed" out
 ) && (
 	echo '-m and --message should embed the message in the file' &&
 
@@ -77,6 +78,328 @@
 	cat in | steg-png embed -o steg resources/test.png &&
 	steg-png extract -o out steg &&
 	grep "hello world" out
+) && (
+	echo '--verify-crc should detect corrupted chunks while embedding' &&
+
+	cp resources/test.png corrupt.png &&
+	printf '\xff\xff\xff\xff' | dd of=corrupt.png bs=1 seek=4000 conv=notrunc &&
+	steg-png embed -m "hello world" -o steg corrupt.png >out 2>err &&
+	! grep "invalid CRC" err &&
+	steg-png embed -m "hello world" --verify-crc -o steg corrupt.png >out 2>err &&
+	grep "IDAT chunk at file offset .* has invalid CRC" err &&
+	steg-png extract -o out steg &&
+	grep "hello world" out
+) && (
+	echo '--verify-crc should check the CRC of large chunks on several threads' &&
+
+	head -c 12582912 /dev/urandom >huge &&
+	crc="$({ printf 'huGe' && cat huge; } | gzip -c | tail -c 8 | head -c 4 | od -An -tx1 | tr -d ' \n')" &&
+	{
+		head -c 33 resources/test.png &&
+		printf '\x00\xc0\x00\x00huGe' && cat huge &&
+		printf "\\x${crc:6:2}\\x${crc:4:2}\\x${crc:2:2}\\x${crc:0:2}" &&
+		tail -c +34 resources/test.png
+	} >huge.png &&
+	steg-png embed -m "hello world" --verify-crc --threads 4 -o steg huge.png >out 2>err &&
+	! grep "invalid CRC" err &&
+	STEG_PNG_NO_SIMD=1 steg-png embed -m "hello world" --verify-crc -o steg huge.png >out 2>err &&
+	! grep "invalid CRC" err &&
+	printf '\xff\xff\xff\xff' | dd of=huge.png bs=1 seek=10000000 conv=notrunc &&
+	steg-png embed -m "hello world" --verify-crc --threads 4 -o steg huge.png >out 2>err &&
+	grep "huGe chunk at file offset 33 has invalid CRC" err &&
+	rm huge huge.png
+) && (
+	echo 'payloads spanning many stEG chunks should embed correctly' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in -o steg resources/test.png >out &&
+	grep -e "chunks embedded in file: 37" out &&
+	steg-png extract -o out steg &&
+	cmp out in
+) && (
+	echo '-o - should stream the output image to stdout' &&
+
+	steg-png embed -m "hello world" -o - resources/test.png >steg &&
+	steg-png extract -o out steg &&
+	grep "hello world" out &&
+	cat in | steg-png embed -o - resources/test.png | cat >steg &&
+	steg-png extract -o out steg &&
+	cmp out in
+) && (
+	echo 'failing to embed should not leave any output behind' &&
+
+	rm -f steg &&
+	echo "not a png" >notpng &&
+	! steg-png embed -m "hello world" -o steg notpng 2>err &&
+	grep "input file is not a PNG" err &&
+	[ ! -e steg ] &&
+	! ls -a | grep "steg-png_"
+) && (
+	echo 'an image piped through stdin should be embedded and written to stdout' &&
+
+	head -c 300000 /dev/urandom >in &&
+	cat resources/test.png | steg-png embed -f in - | cat >steg &&
+	steg-png extract -o out steg &&
+	cmp out in &&
+	steg-png embed --no-index -f in -o expected resources/test.png &&
+	cmp steg expected &&
+	cat resources/test.png | steg-png embed -m "hello world" -o steg - >out &&
+	! grep -e "^in " out &&
+	steg-png extract -o out steg &&
+	grep "hello world" out
+) && (
+	echo 'an image piped through stdin requires --file or --message' &&
+
+	! cat resources/test.png | steg-png embed - 2>err &&
+	grep "reading image from stdin requires --file or --message" err
+) && (
+	echo '--threads should compress the payload into a single stream in parallel' &&
+
+	head -c 1000000 /dev/urandom >in &&
+	seq 1 100000 >>in &&
+	steg-png embed -f in --threads 3 -o steg resources/test.png &&
+	steg-png extract -o out steg &&
+	cmp out in &&
+	steg-png embed -f in --threads 4 -o steg2 resources/test.png &&
+	cmp steg steg2 &&
+	steg-png embed -m "hello world" --threads 0 -o steg resources/test.png &&
+	steg-png extract -o out steg &&
+	grep "hello world" out &&
+	! steg-png embed -m "hello world" --threads -1 resources/test.png 2>err &&
+	grep "invalid number of threads -1" err
+) && (
+	echo '--codec should compress the payload in segments with the given codec' &&
+
+	seq 1 1000 >in &&
+	steg-png embed --codec store -f in -o stored.png resources/test.png 2>err &&
+	grep "without compression" err &&
+	LC_ALL=C grep -qaF "$(printf '\211STG\001\001')" stored.png &&
+	grep -qa "^999$" stored.png &&
+	steg-png extract -o out stored.png &&
+	cmp out in &&
+	steg-png embed --codec zlib -f in -o zlib.png resources/test.png &&
+	steg-png extract --list zlib.png | grep "^1 segmented " &&
+	! grep -qa "^999$" zlib.png &&
+	! steg-png embed --codec lzma -m "hello" resources/test.png 2>err &&
+	grep "unknown codec 'lzma'" err &&
+	! steg-png embed --codec store --batch manifest 2>err &&
+	grep "\-\-batch cannot be combined with .*\-\-codec" err
+) && (
+	echo '--in-place --tail should append the payload without rewriting the image' &&
+
+	cp resources/test.png steg &&
+	steg-png embed -m "hello world" --in-place --tail steg >out &&
+	! grep -e "^in " out &&
+	grep -e "out.*steg" out &&
+	steg-png extract -o out steg &&
+	grep "hello world" out &&
+	cmp -n 936083 steg resources/test.png &&
+	steg-png inspect --machine-readable steg | tail -3 | cut -d' ' -f1 | tr '\n' ' ' >out &&
+	grep "IDAT stEG IEND" out
+) && (
+	echo '--in-place --tail should keep a payload appended before' &&
+
+	head -c 300000 /dev/urandom >in &&
+	cp resources/test.png steg &&
+	steg-png embed -f in --in-place --tail steg &&
+	steg-png embed -m "hello world" --in-place --tail steg &&
+	steg-png extract --list steg | cut -d' ' -f1 | tr '\n' ' ' >out &&
+	grep "^1 2 $" out &&
+	steg-png extract --stream 1 -o out steg &&
+	cmp out in &&
+	steg-png extract --stream 2 -o out steg &&
+	grep "hello world" out &&
+	cmp -n 936083 steg resources/test.png &&
+	steg-png inspect --machine-readable steg | cut -d' ' -f1 >out &&
+	! grep "stIX" out &&
+	STEG_PNG_NO_MMAP=1 steg-png extract --stream 2 -o out steg &&
+	grep "hello world" out
+) && (
+	echo '--in-place --tail should keep a payload scattered through the image' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in -o steg resources/test.png &&
+	steg-png embed -m "hello world" --in-place --tail steg &&
+	steg-png extract --list steg | cut -d' ' -f1 | tr '\n' ' ' >out &&
+	grep "^1 2 $" out &&
+	steg-png extract --stream 1 -o out steg &&
+	cmp out in &&
+	steg-png extract --stream 2 -o out steg &&
+	grep "hello world" out &&
+	head -c 300000 /dev/urandom >more &&
+	steg-png embed -f more --in-place --tail steg &&
+	steg-png inspect --machine-readable steg | tail -3 | cut -d' ' -f1 | tr '\n' ' ' >out &&
+	grep "stEG stIX IEND" out &&
+	steg-png extract --stream 3 -o out steg &&
+	cmp out more &&
+	steg-png embed --no-index -f in -o steg resources/test.png &&
+	steg-png embed -m "hello world" --in-place --tail steg &&
+	steg-png extract --stream 1 -o out steg &&
+	cmp out in &&
+	steg-png extract --stream 2 -o out steg &&
+	grep "hello world" out
+) && (
+	echo '--in-place usage errors should fail' &&
+
+	cp resources/test.png steg &&
+	! steg-png embed -m "hello world" --in-place steg 2>err &&
+	grep "\-\-in-place requires \-\-tail" err &&
+	! steg-png embed -m "hello world" --in-place --tail -o out steg 2>err &&
+	grep "cannot mix \-\-in-place and \-\-output" err &&
+	! cat steg | steg-png embed -m "hello world" --in-place --tail - 2>err &&
+	grep "cannot modify an image read from stdin in place" err &&
+	cmp steg resources/test.png
+) && (
+	echo '--replace should overwrite the embedded data in place when it fits' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in -o steg resources/test.png &&
+	size="$(wc -c <steg)" &&
+	steg-png embed -m "hello world" --replace steg >out &&
+	! grep -e "^in " out &&
+	steg-png extract -o out steg &&
+	grep "hello world" out &&
+	[ "$(wc -c <steg)" -eq "$size" ] &&
+	steg-png inspect --machine-readable steg | cut -d' ' -f1 >out &&
+	[ "$(grep -c "stEG" out)" -eq 1 ] &&
+	grep "stFL" out &&
+	seq 1 20000 >in &&
+	steg-png embed -f in --replace steg &&
+	steg-png extract -o out steg &&
+	cmp out in &&
+	[ "$(wc -c <steg)" -eq "$size" ]
+) && (
+	echo '--replace should rewrite the image when the new data does not fit' &&
+
+	steg-png embed -m "hello world" -o steg resources/test.png &&
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in --replace steg &&
+	steg-png extract -o out steg &&
+	cmp out in &&
+	steg-png inspect --machine-readable steg | cut -d' ' -f1 >out &&
+	! grep "stFL" out &&
+	steg-png strip steg &&
+	cmp steg resources/test.png
+) && (
+	echo '--replace should replace data appended at the tail' &&
+
+	cp resources/test.png steg &&
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in --in-place --tail steg &&
+	steg-png embed -m "hello world" --replace steg &&
+	steg-png extract -o out steg &&
+	grep "hello world" out &&
+	[ "$(wc -c <steg)" -lt 936200 ] &&
+	cmp -n 936083 steg resources/test.png
+) && (
+	echo '--replace should embed data in images without any' &&
+
+	cp resources/test.png steg &&
+	steg-png embed -m "hello world" --replace steg &&
+	steg-png extract -o out steg &&
+	grep "hello world" out
+) && (
+	echo '--replace usage errors should fail' &&
+
+	cp resources/test.png steg &&
+	! steg-png embed -m "hello world" --replace -o out steg 2>err &&
+	grep "cannot mix \-\-replace and \-\-output" err &&
+	! steg-png embed -m "hello world" --replace --in-place --tail steg 2>err &&
+	grep "cannot mix \-\-replace and \-\-in-place" err &&
+	! cat steg | steg-png embed -m "hello world" --replace - 2>err &&
+	grep "cannot modify an image read from stdin in place" err &&
+	cmp steg resources/test.png
+) && (
+	echo 'repeated files should be embedded as an archive' &&
+
+	printf 'first\n' >first &&
+	mkdir -p dir &&
+	printf 'second\n' >dir/second &&
+	steg-png embed -f first -f dir/second resources/test.png &&
+	steg-png extract --list-members test.png.steg | cut -f 2 >names &&
+	printf 'first\nsecond\n' | cmp - names &&
+	steg-png embed --archive -f first resources/test.png &&
+	steg-png extract --member first -o out test.png.steg &&
+	cmp out first
+) && (
+	echo 'archives with conflicting member names should be rejected' &&
+
+	printf 'other\n' >dir/first &&
+	! steg-png embed -f first -f dir/first resources/test.png 2>err &&
+	grep "duplicate archive member name 'first'" err &&
+	! steg-png embed --archive -m "hello" resources/test.png 2>err &&
+	grep "\-\-archive requires \-\-file" err
+) && (
+	echo 'batch manifests should embed into every image' &&
+
+	rm -f manifest &&
+	for i in 1 2 3 4 5 6; do
+		printf "payload $i\n" >payload$i &&
+		printf "resources/test.png\tpayload$i\tbatch$i.png\n" >>manifest || exit 1
+	done &&
+	steg-png embed --threads 3 --batch manifest >results &&
+	[ "$(cut -f 2 results | sort | uniq -c | tr -s " ")" = " 6 ok" ] &&
+	[ "$(cut -f 1 results | sort -n | tr '\n' ' ')" = "1 2 3 4 5 6 " ] &&
+	for i in 1 2 3 4 5 6; do
+		steg-png extract -o out batch$i.png && cmp out payload$i || exit 1
+	done
+) && (
+	echo 'batch rows that fail should be reported without stopping the batch' &&
+
+	printf "missing.png\tpayload1\tbad.png\nresources/test.png\tpayload2\n" >manifest &&
+	printf "resources/test.png\tpayload3\tgood.png\n" >>manifest &&
+	! steg-png embed --batch manifest >results &&
+	grep "^1	error	bad.png	failed to open carrier image$" results &&
+	grep "^2	error		row must have a carrier, a payload and an output field$" results &&
+	grep "^3	ok	good.png	" results &&
+	[ ! -e bad.png ] &&
+	steg-png extract -o out good.png &&
+	cmp out payload3
+) && (
+	echo 'NUL-terminated batch manifests should be accepted' &&
+
+	printf 'resources/test.png\0payload4\0nul batch.png\0' | steg-png embed -z --tail --batch - >results &&
+	[ "$(tr '\0' '|' <results)" = "1|ok|nul batch.png|10|18|" ] &&
+	steg-png extract -o out "nul batch.png" &&
+	cmp out payload4 &&
+	! steg-png embed --batch manifest -m "hello" 2>err &&
+	grep "\-\-batch takes images and payloads from the manifest only" err &&
+	! steg-png embed -z -m "hello" resources/test.png 2>err &&
+	grep "\-\-nul requires \-\-batch" err
+) && (
+	echo 'the summary should carry the md5 hashes of both images' &&
+
+	head -c 100000 /dev/urandom >payload &&
+	for args in "" "--no-index" "--segmented" "--tail --verify-crc"; do
+		steg-png embed $args -f payload -o summarized.png resources/test.png >out &&
+		grep "^in  test.png .* $(md5sum <resources/test.png | cut -d' ' -f1)$" out &&
+		grep "^out summarized.png .* $(md5sum <summarized.png | cut -d' ' -f1)$" out || exit 1
+	done &&
+	STEG_PNG_NO_MMAP=1 steg-png embed -f payload -o summarized.png resources/test.png >out &&
+	grep "^out summarized.png .* $(md5sum <summarized.png | cut -d' ' -f1)$" out
+) && (
+	echo 'the summary should carry the digests selected with --digest' &&
+
+	steg-png embed --digest xxh3 -f payload -o summarized.png resources/test.png >out &&
+	grep "^in  test.png .* e0db85c0debe6532$" out &&
+	steg-png embed --digest blake3 --threads 4 -f payload -o summarized.png resources/test.png >out &&
+	grep "^in  test.png .* 7b003af2dae8342b843c0e6e1d830c20ac672f4504081b2bd8d664fa3731b344$" out &&
+	digest="$(steg-png inspect --digest blake3 summarized.png | sed -n 2p | cut -d' ' -f5)" &&
+	grep "^out summarized.png .* $digest$" out &&
+	STEG_PNG_NO_MMAP=1 steg-png embed --digest blake3 -f payload -o summarized.png resources/test.png >out &&
+	digest="$(steg-png inspect --digest blake3 summarized.png | sed -n 2p | cut -d' ' -f5)" &&
+	grep "^out summarized.png .* $digest$" out &&
+	! steg-png embed --digest sha1 -m "hello" resources/test.png 2>err &&
+	grep "unknown digest algorithm 'sha1'" err
+) && (
+	echo 'batch results should carry the digest of each output with --digest' &&
+
+	printf "resources/test.png\tpayload\tdigest1.png\nresources/test.png\tpayload\tdigest2.png\n" >manifest &&
+	steg-png embed --threads 2 --digest xxh3 --batch manifest >results &&
+	for i in 1 2; do
+		digest="$(steg-png inspect --digest xxh3 digest$i.png | sed -n 2p | cut -d' ' -f5)" &&
+		grep "	ok	digest$i.png	100000	[0-9]*	$digest$" results || exit 1
+	done
 ) || (
 	>&2 echo "failure" &&
 	exit 1
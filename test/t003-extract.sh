@@ -40,6 +40,312 @@
 	steg-png extract --hexdump -o outf test.png.steg >out &&
 	grep "hello world" out &&
 	grep "hello world" outf
+) && (
+	echo 'extract should produce identical output with and without mmap' &&
+
+	steg-png embed -m "hello world" resources/test.png &&
+	steg-png extract -o out test.png.steg &&
+	STEG_PNG_NO_MMAP=1 steg-png extract -o outf test.png.steg &&
+	cmp out outf
+) && (
+	echo '-o - should stream the embedded data to stdout' &&
+
+	head -c 100003 /dev/urandom >in &&
+	steg-png embed -f in resources/test.png &&
+	steg-png extract -o - test.png.steg >out &&
+	cmp out in &&
+	! steg-png extract --hexdump -o - test.png.steg 2>err &&
+	grep "cannot mix --hexdump and --output to stdout" err
+) && (
+	echo 'clean input file should fail without leaving output behind' &&
+
+	rm -f test.png.out &&
+	! steg-png extract -o test.png.out resources/test.png 2>err &&
+	grep "input file is clean" err &&
+	[ ! -e test.png.out ]
+) && (
+	echo 'an image piped through stdin should be extracted to stdout' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in resources/test.png &&
+	cat test.png.steg | steg-png extract - | cat >out &&
+	cmp out in &&
+	cat test.png.steg | STEG_PNG_NO_MMAP=1 steg-png extract -o outf - &&
+	cmp outf in &&
+	steg-png embed -m "hello world" resources/test.png &&
+	cat test.png.steg | steg-png extract --hexdump - >out &&
+	grep "|hello world|" out
+) && (
+	echo 'segmented payloads should extract identically with and without threads' &&
+
+	head -c 3000000 /dev/urandom >in &&
+	seq 1 100000 >>in &&
+	steg-png embed --segmented -f in resources/test.png &&
+	steg-png extract -o out test.png.steg &&
+	cmp out in &&
+	steg-png extract --threads 4 -o out test.png.steg &&
+	cmp out in &&
+	STEG_PNG_NO_MMAP=1 steg-png extract --threads 4 -o - test.png.steg >out &&
+	cmp out in &&
+	cat test.png.steg | steg-png extract --threads 4 - >out &&
+	cmp out in &&
+	steg-png extract --hexdump test.png.steg >expected &&
+	steg-png extract --threads 3 --hexdump test.png.steg >out &&
+	cmp out expected
+) && (
+	echo 'legacy payloads should extract with --threads' &&
+
+	steg-png embed -f in resources/test.png &&
+	steg-png extract --threads 4 -o out test.png.steg &&
+	cmp out in
+) && (
+	echo 'corrupt segments should fail without leaving output behind' &&
+
+	steg-png embed --segmented -f in resources/test.png &&
+	printf '\xff\xff\xff\xff' | dd of=test.png.steg bs=1 seek=2000000 conv=notrunc &&
+	rm -f out &&
+	! steg-png extract --threads 4 -o out test.png.steg 2>err &&
+	grep "failed to extract embedded data" err &&
+	[ ! -e out ]
+) && (
+	echo 'payloads should extract identically with every available codec' &&
+
+	codecs="zlib store" &&
+	if steg-png embed -h | grep -q zstd; then codecs="$codecs zstd"; fi &&
+	for codec in $codecs; do
+		steg-png embed --codec $codec -f in -o $codec.png resources/test.png 2>/dev/null &&
+		steg-png extract --threads 4 -o out $codec.png &&
+		cmp out in &&
+		cat $codec.png | steg-png extract - >out &&
+		cmp out in &&
+		steg-png extract --range 1048000:5000 -o out $codec.png &&
+		tail -c +1048001 in | head -c 5000 | cmp - out &&
+		printf '\xff\xff\xff\xff' | dd of=$codec.png bs=1 seek=2000000 conv=notrunc &&
+		! steg-png extract --threads 4 -o out $codec.png 2>err &&
+		grep "failed to extract embedded data" err &&
+		! cat $codec.png | steg-png extract - >out 2>err &&
+		grep "failed to extract embedded data" err || exit 1
+	done
+) && (
+	echo 'ranges of legacy and segmented payloads should match the payload' &&
+
+	head -c 6000000 /dev/urandom >in &&
+	seq 1 1000000 >>in &&
+	tail -c +5000001 in | head -c 3000000 >expected &&
+	steg-png embed -f in resources/test.png &&
+	steg-png extract --range 5000000:3000000 -o out test.png.steg &&
+	cmp out expected &&
+	STEG_PNG_NO_MMAP=1 steg-png extract --range 5000000:3000000 -o - test.png.steg >out &&
+	cmp out expected &&
+	steg-png embed --segmented -f in resources/test.png &&
+	steg-png extract --range 5000000:3000000 -o out test.png.steg &&
+	cmp out expected &&
+	steg-png extract --range 0:0 -o out test.png.steg &&
+	[ ! -s out ]
+) && (
+	echo 'ranges extending beyond the end of the payload should be truncated' &&
+
+	tail -c +12000001 in >expected &&
+	steg-png extract --range 12000000:99999999 -o out test.png.steg &&
+	cmp out expected &&
+	steg-png embed -f in resources/test.png &&
+	steg-png extract --range 12000000:99999999 -o out test.png.steg &&
+	cmp out expected
+) && (
+	echo 'an index file should be created on first use and reused afterwards' &&
+
+	rm -f test.idx &&
+	tail -c +9000001 in | head -c 1000 >expected &&
+	steg-png extract --range 9000000:1000 --index test.idx -o out test.png.steg &&
+	cmp out expected &&
+	[ -s test.idx ] &&
+	cp test.idx test.idx.orig &&
+	steg-png extract --range 9000000:1000 --index test.idx -o out test.png.steg &&
+	cmp out expected &&
+	cmp test.idx test.idx.orig &&
+	steg-png embed -m "hello world" resources/test.png &&
+	steg-png extract --range 6:5 --index test.idx -o out test.png.steg &&
+	printf 'world' | cmp - out &&
+	! cmp -s test.idx test.idx.orig
+) && (
+	echo 'malformed ranges and unseekable inputs should be rejected' &&
+
+	! steg-png extract --range 10 test.png.steg 2>err &&
+	grep "invalid range '10'" err &&
+	! steg-png extract --range 10:-1 test.png.steg 2>err &&
+	grep "invalid range '10:-1'" err &&
+	! steg-png extract --index test.idx test.png.steg 2>err &&
+	grep "\-\-index requires \-\-range" err &&
+	! cat test.png.steg | steg-png extract --range 0:5 - 2>err &&
+	grep "\-\-range requires a seekable input file" err
+) && (
+	echo 'payloads should be extracted through the stIX chunk when present' &&
+
+	head -c 3000000 /dev/urandom >in &&
+	steg-png embed -f in resources/test.png &&
+	steg-png inspect --machine-readable test.png.steg | sed -n 2p | grep -e "^stIX" &&
+	steg-png extract -o out test.png.steg 2>err &&
+	cmp out in &&
+	[ ! -s err ] &&
+	STEG_PNG_NO_MMAP=1 steg-png extract -o out test.png.steg &&
+	cmp out in &&
+	steg-png embed --segmented -f in resources/test.png &&
+	steg-png extract --threads 4 -o out test.png.steg &&
+	cmp out in &&
+	steg-png embed --no-index -f in resources/test.png &&
+	! steg-png inspect --machine-readable test.png.steg | grep -e "^stIX" &&
+	steg-png extract -o out test.png.steg &&
+	cmp out in
+) && (
+	echo 'a corrupt or stale stIX chunk should fall back to walking the file' &&
+
+	steg-png embed -f in resources/test.png &&
+	printf '\xff' | dd of=test.png.steg bs=1 seek=45 conv=notrunc &&
+	steg-png extract -o out test.png.steg 2>err &&
+	cmp out in &&
+	grep "stIX chunk is corrupt" err &&
+	steg-png embed -m "hello world" resources/test.png &&
+	offset="$(steg-png inspect --machine-readable test.png.steg | grep -e "^stEG" | cut -d " " -f 2)" &&
+	printf 'x' | dd of=test.png.steg bs=1 seek="$((offset + 4))" conv=notrunc &&
+	rm -f out &&
+	! steg-png extract -o out test.png.steg 2>err &&
+	grep "stIX chunk doesn't match the file" err &&
+	grep "input file is clean" err &&
+	[ ! -e out ]
+) && (
+	echo 'members of an archive should be listed and extracted individually' &&
+
+	printf 'manifest\n' >manifest &&
+	seq 1 200000 >numbers &&
+	: >empty &&
+	steg-png embed -f manifest -f in -f empty -f numbers resources/test.png &&
+	steg-png extract --list-members test.png.steg >members &&
+	printf '9\tmanifest\n3000000\tin\n0\tempty\n%s\tnumbers\n' "$(wc -c <numbers)" | cmp - members &&
+	steg-png extract --member in -o out test.png.steg &&
+	cmp out in &&
+	steg-png extract --member manifest -o out test.png.steg &&
+	cmp out manifest &&
+	steg-png extract --member empty -o out test.png.steg &&
+	cmp out empty &&
+	steg-png extract --member numbers --range 1000:5000 -o out test.png.steg &&
+	tail -c +1001 numbers | head -c 5000 | cmp - out
+) && (
+	echo 'archives should only be extracted by member' &&
+
+	rm -f out &&
+	! steg-png extract -o out test.png.steg 2>err &&
+	grep "embedded data is an archive" err &&
+	[ ! -e out ] &&
+	! steg-png extract --member missing -o out test.png.steg 2>err &&
+	grep "embedded archive has no member 'missing'" err &&
+	! cat test.png.steg | steg-png extract --member in - 2>err &&
+	grep "\-\-member requires a seekable input file" err &&
+	steg-png embed -f in resources/test.png &&
+	! steg-png extract --list-members test.png.steg 2>err &&
+	grep "embedded data is not an archive" err
+) && (
+	echo 'images embedded into more than once should expose each stream' &&
+
+	seq 1 100000 >first &&
+	steg-png embed -f first -o one.png resources/test.png &&
+	steg-png embed --tail --segmented -f in -o two.png one.png &&
+	steg-png embed --tail --no-index -f manifest -f numbers -o three.png two.png &&
+	steg-png extract --list three.png >streams &&
+	[ "$(cut -d " " -f 1,2 streams | tr '\n' ' ')" = "1 zlib 2 segmented 3 archive " ] &&
+	[ "$(sed -n 2p streams | cut -d " " -f 4)" = "3000000" ] &&
+	steg-png extract --stream 1 -o out three.png &&
+	cmp out first &&
+	steg-png extract --stream 2 --threads 4 -o out three.png &&
+	cmp out in &&
+	steg-png extract --stream 3 --member manifest -o out three.png &&
+	cmp out manifest &&
+	steg-png extract --stream 2 --range 100:50 -o out three.png &&
+	tail -c +101 in | head -c 50 | cmp - out
+) && (
+	echo 'all streams should be extracted to their own files' &&
+
+	rm -f out.* &&
+	steg-png embed --tail --no-index -f manifest -o four.png two.png &&
+	steg-png extract --stream all --threads 2 -o out four.png &&
+	cmp out.1 first &&
+	cmp out.2 in &&
+	cmp out.3 manifest &&
+	rm -f out.* &&
+	! steg-png extract --stream all -o out three.png 2>err &&
+	grep "failed to extract embedded stream 3: embedded data is an archive" err &&
+	cmp out.2 in &&
+	[ ! -e out.3 ]
+) && (
+	echo 'extracting an image with several streams should warn' &&
+
+	steg-png extract -o out four.png 2>err &&
+	cmp out first &&
+	grep "more than one embedded stream" err &&
+	! steg-png extract --stream 5 four.png 2>err &&
+	grep "image holds only 3 embedded streams" err &&
+	! steg-png extract --stream 0 four.png 2>err &&
+	grep "invalid stream '0'" err &&
+	! steg-png extract --stream all -o - four.png 2>err &&
+	grep "\-\-stream all cannot write to stdout" err &&
+	! cat four.png | steg-png extract --list - 2>err &&
+	grep "\-\-list requires a seekable input file" err
+) && (
+	echo 'recursive extract should mirror the input tree' &&
+
+	rm -rf tree extracted &&
+	mkdir -p tree/a/b tree/c &&
+	head -c 3000000 /dev/urandom >big &&
+	steg-png embed -m "hello world" -o tree/a/one.png resources/test.png &&
+	steg-png embed --segmented -f big -o tree/a/b/two.png resources/test.png &&
+	cp resources/test.png tree/c/clean.png &&
+	printf 'not a png\n' >tree/c/notes.txt &&
+	steg-png extract --recursive --output-dir extracted --threads 4 tree >out &&
+	[ "$(sort out | tr '\n' ' ')" = "clean	tree/c/clean.png ok	tree/a/b/two.png ok	tree/a/one.png " ] &&
+	grep "hello world" extracted/a/one.png.out &&
+	cmp big extracted/a/b/two.png.out &&
+	[ ! -e extracted/c/clean.png.out ] &&
+	[ ! -e extracted/c/notes.txt.out ] &&
+	rm -rf extracted &&
+	steg-png extract --recursive tree --output-dir extracted --threads 4 >out &&
+	cmp big extracted/a/b/two.png.out &&
+	grep "hello world" extracted/a/one.png.out &&
+	rm -rf extracted &&
+	steg-png extract tree --recursive --output-dir extracted >out &&
+	cmp big extracted/a/b/two.png.out &&
+	grep "hello world" extracted/a/one.png.out &&
+	! steg-png extract tree --recursive --bogus --output-dir extracted 2>err &&
+	grep "unknown option '\-\-bogus'" err
+) && (
+	echo 'recursive extract should report corrupt images and carry on' &&
+
+	rm -rf extracted &&
+	steg-png embed --no-index -m "hello world" -o tree/c/corrupt.png resources/test.png &&
+	offset="$(grep -obUaP "stEG" tree/c/corrupt.png | head -n 1 | cut -d : -f 1)" &&
+	printf '\377\377\377\377' | dd of=tree/c/corrupt.png bs=1 seek=$((offset + 6)) conv=notrunc 2>/dev/null &&
+	! steg-png extract --recursive --output-dir extracted tree >out &&
+	grep "^corrupt	tree/c/corrupt.png	" out &&
+	grep "^ok	tree/a/one.png$" out &&
+	[ ! -e extracted/c/corrupt.png.out ] &&
+	! steg-png extract --recursive tree 2>err &&
+	grep "\-\-recursive and \-\-output-dir must be used together" err &&
+	! steg-png extract --recursive --output-dir extracted -o out tree 2>err &&
+	grep "\-\-recursive extracts whole payloads to \-\-output-dir only" err
+) && (
+	echo 'recursive extract should match with and without io_uring' &&
+
+	rm -rf extracted extractedf &&
+	for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+		head -c $((i * 20000)) big >tree/c/part$i &&
+		steg-png embed -f tree/c/part$i -o tree/c/many$i.png resources/test.png >/dev/null || exit 1
+	done &&
+	steg-png embed -m "second" --in-place --tail tree/c/many3.png >/dev/null &&
+	! steg-png extract --recursive tree --output-dir extracted --threads 2 >out &&
+	! STEG_PNG_NO_IO_URING=1 steg-png extract --recursive tree --output-dir extractedf --threads 2 >outf &&
+	sort out >expected &&
+	sort outf | cmp expected - &&
+	diff -r extracted extractedf &&
+	grep "^corrupt	tree/c/corrupt.png	" out &&
+	cmp tree/c/part12 extracted/c/many12.png.out
 ) || (
 	>&2 echo "failure" &&
 	exit 1
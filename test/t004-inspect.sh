@@ -10,13 +10,13 @@
 	echo 'inspect should list chuns in file' &&
 
 	steg-png inspect resources/test.png >out &&
-	grep -e "^chunks:" -C 0 out >chunks &&
+	sed -n '/^chunks:/,/^$/p' out >chunks &&
 	grep "IHDR" chunks &&
 	grep "IEND" chunks &&
 	! grep "stEG" chunks &&
 	steg-png embed -m "hello world" resources/test.png &&
 	steg-png inspect test.png.steg >out &&
-	grep -e "^chunks:" -C 0 out >chunks &&
+	sed -n '/^chunks:/,/^$/p' out >chunks &&
 	grep "IHDR" chunks &&
 	grep "IEND" chunks &&
 	grep "stEG" chunks
@@ -59,7 +59,7 @@
 
 	steg-png embed -m "hello world" resources/test.png &&
 	steg-png inspect --machine-readable test.png.steg >out &&
-	[[ "$(wc -l <out)" =~ "66" ]] &&
+	[[ "$(wc -l <out)" =~ "67" ]] &&
 	grep -e "^IDAT" out >chunks &&
 	[[ "$(wc -l <chunks)" =~ "58" ]] &&
 	grep -e "^stEG" out >chunks &&
@@ -70,6 +70,47 @@
 	tail -1 out >ftail &&
 	grep -e "^IEND" ftail >chunks &&
 	[[ "$(wc -l <chunks)" =~ "1" ]]
+) && (
+	echo 'stIX chunk should immediately follow IHDR and list the stEG chunks' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in resources/test.png &&
+	steg-png inspect --machine-readable test.png.steg >out &&
+	sed -n 2p out | grep -e "^stIX" &&
+	grep -e "^stEG" out >expected &&
+	steg-png inspect --filter stEG --machine-readable test.png.steg >chunks &&
+	cmp chunks expected &&
+	STEG_PNG_NO_MMAP=1 steg-png inspect --filter stEG --machine-readable test.png.steg >chunks &&
+	cmp chunks expected &&
+	steg-png inspect --filter stEG test.png.steg >out &&
+	[[ "$(grep -c "chunk type: stEG" out)" =~ "37" ]]
+) && (
+	echo 'a corrupt stIX chunk should be ignored' &&
+
+	steg-png embed -f in resources/test.png &&
+	printf '\xff' | dd of=test.png.steg bs=1 seek=45 conv=notrunc &&
+	steg-png inspect --filter stEG --machine-readable test.png.steg >chunks 2>err &&
+	grep "stIX chunk is corrupt" err &&
+	[[ "$(wc -l <chunks)" =~ "37" ]]
+) && (
+	echo 'the summary header should carry the md5 hash of the image' &&
+
+	steg-png embed -q -m "hello world" -o hashed.png resources/test.png &&
+	steg-png inspect hashed.png >out &&
+	grep "^hashed.png .* $(md5sum <hashed.png | cut -d' ' -f1)$" out &&
+	STEG_PNG_NO_MMAP=1 steg-png inspect hashed.png >out &&
+	grep "^hashed.png .* $(md5sum <hashed.png | cut -d' ' -f1)$" out
+) && (
+	echo 'the summary header should carry the digest selected with --digest' &&
+
+	steg-png inspect --digest xxh3 resources/test.png >out &&
+	grep "^test.png .* e0db85c0debe6532$" out &&
+	steg-png inspect --digest blake3 resources/test.png >out &&
+	grep "^test.png .* 7b003af2dae8342b843c0e6e1d830c20ac672f4504081b2bd8d664fa3731b344$" out &&
+	STEG_PNG_NO_MMAP=1 steg-png inspect --digest blake3 resources/test.png >out &&
+	grep "^test.png .* 7b003af2dae8342b843c0e6e1d830c20ac672f4504081b2bd8d664fa3731b344$" out &&
+	! steg-png inspect --digest blake3 --machine-readable resources/test.png 2>err &&
+	grep "\-\-digest has no effect with \-\-machine-readable" err
 ) || (
 	>&2 echo "failure" &&
 	exit 1
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+
+# Every chunk header should be decoded once, and read through a buffer, so
+# walking a file should cost well under one read-related syscall per chunk.
+syscall_budget_met () {
+	local chunks="$1"
+	local reads="$(awk '{ total += $2 } END { print total }' counts)"
+
+	echo "${reads} read-related syscalls for ${chunks} chunks" &&
+	[ "${reads}" -le "${chunks}" ]
+}
+
+if [ "$(uname)" != "Linux" ] || [ ! -f libio-counter.so ]; then
+	echo 'syscall budget tests require LD_PRELOAD; skipping'
+	exit 0
+fi
+
+(
+	echo 'walking chunk headers should be within the syscall budget' &&
+
+	steg-png embed -m "hello world" resources/test.png &&
+	steg-png inspect --machine-readable test.png.steg >out &&
+	STEG_PNG_NO_MMAP=1 IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png inspect --machine-readable test.png.steg >outf &&
+	cmp out outf &&
+	syscall_budget_met "$(wc -l <out)"
+) && (
+	echo 'reading chunk data should be within the syscall budget' &&
+
+	steg-png embed -m "hello world" resources/test.png &&
+	steg-png inspect --machine-readable test.png.steg >out &&
+	STEG_PNG_NO_MMAP=1 IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png extract -o outf test.png.steg &&
+	grep "hello world" outf &&
+	syscall_budget_met "$(wc -l <out)"
+) && (
+	echo 'memory mapped files should not be read chunk by chunk' &&
+
+	steg-png embed -m "hello world" resources/test.png &&
+	IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png inspect --machine-readable test.png.steg >out &&
+	syscall_budget_met 0
+) && (
+	echo 'scanning should read nothing but chunk headers' &&
+
+	steg-png inspect --machine-readable resources/test.png >out &&
+	STEG_PNG_NO_IO_URING=1 IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png scan -q --threads 1 resources/test.png >outf &&
+	[ ! -s outf ] &&
+	reads="$(awk '$1 == "pread" { print $2 }' counts)" &&
+	echo "${reads} preads for $(wc -l <out) chunks" &&
+	[ "${reads}" -le "$(( $(wc -l <out) + 2 ))" ]
+) && (
+	echo 'summaries should not read the images again' &&
+
+	IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png embed -m "hello world" resources/test.png >out &&
+	grep "^out test.png.steg " out &&
+	syscall_budget_met 8 &&
+	IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png inspect test.png.steg >out &&
+	grep "^test.png.steg " out &&
+	syscall_budget_met 1
+) && (
+	echo 'appending in place should not walk the image' &&
+
+	cp resources/test.png steg &&
+	IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png embed -q -m "hello world" --in-place --tail steg &&
+	syscall_budget_met 8 &&
+	IO_COUNTER_OUTPUT=counts LD_PRELOAD="${PWD}/libio-counter.so" \
+		steg-png embed -q -m "hello again" --in-place --tail steg &&
+	syscall_budget_met 8 &&
+	steg-png extract --stream 2 -o out steg &&
+	grep "hello again" out
+) || (
+	>&2 echo "failure" &&
+	exit 1
+)
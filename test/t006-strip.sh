@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+
+(
+	echo '-h and --help should print usage information' &&
+
+	steg-png strip -h >out &&
+	grep "usage: steg-png strip" out &&
+	steg-png strip --help >out &&
+	grep "usage: steg-png strip" out
+) && (
+	echo 'strip should remove embedded data and restore the original image' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -f in -o steg resources/test.png &&
+	steg-png strip steg >out &&
+	grep "steg: removed .* chunks, .* bytes saved" out &&
+	cmp steg resources/test.png &&
+	steg-png embed --no-index -m "hello world" -o steg resources/test.png &&
+	steg-png strip steg &&
+	cmp steg resources/test.png
+) && (
+	echo 'strip should truncate images with data appended at the tail' &&
+
+	cp resources/test.png steg &&
+	steg-png embed -f in --in-place --tail steg &&
+	steg-png strip steg >out &&
+	grep "steg: removed" out &&
+	cmp steg resources/test.png
+) && (
+	echo 'strip should leave clean images untouched' &&
+
+	cp resources/test.png clean &&
+	steg-png strip clean >out &&
+	grep "clean: nothing to strip" out &&
+	cmp clean resources/test.png
+) && (
+	echo 'strip should handle many files and report the total bytes saved' &&
+
+	steg-png embed -m "hello world" -o steg1 resources/test.png &&
+	steg-png embed -f in -o steg2 resources/test.png &&
+	cp resources/test.png clean &&
+	steg-png strip steg1 clean steg2 >out &&
+	grep "stripped 2 of 3 files" out &&
+	cmp steg1 resources/test.png &&
+	cmp steg2 resources/test.png &&
+	steg-png strip -q steg1 steg2 >out &&
+	[ ! -s out ]
+) && (
+	echo '--dry-run should report without modifying the file' &&
+
+	steg-png embed -m "hello world" -o steg resources/test.png &&
+	cp steg expected &&
+	steg-png strip --dry-run steg >out &&
+	grep "steg: would remove" out &&
+	cmp steg expected
+) && (
+	echo '--output should write the stripped image to another file' &&
+
+	steg-png embed -f in -o steg resources/test.png &&
+	cp steg expected &&
+	steg-png strip -o stripped steg &&
+	cmp stripped resources/test.png &&
+	cmp steg expected &&
+	! steg-png strip -o stripped steg expected 2>err &&
+	grep "\-\-output requires a single file" err
+) && (
+	echo 'strip should skip files that are not PNG images and fail' &&
+
+	steg-png embed -m "hello world" -o steg resources/test.png &&
+	! steg-png strip in missing steg >out 2>err &&
+	grep "unable to strip 'in': file is not a PNG" err &&
+	grep "failed to open file 'missing'" err &&
+	cmp steg resources/test.png
+) || (
+	>&2 echo "failure" &&
+	exit 1
+)
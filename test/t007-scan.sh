@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+
+(
+	echo '-h and --help should print usage information' &&
+
+	steg-png scan -h >out &&
+	grep "usage: steg-png scan" out &&
+	steg-png scan --help >out &&
+	grep "usage: steg-png scan" out
+) && (
+	echo 'scan should print the paths of images carrying embedded data' &&
+
+	rm -rf corpus &&
+	mkdir -p corpus/a/b corpus/c &&
+	cp resources/test.png corpus/a/plain.png &&
+	steg-png embed -m "hello world" -o corpus/a/b/one.png resources/test.png &&
+	steg-png embed --tail --no-index -m "hello world" -o corpus/c/two.png resources/test.png &&
+	printf 'not a png\n' >corpus/c/notes.txt &&
+	ln -s .. corpus/a/loop &&
+	steg-png scan --threads 4 corpus 2>err | tr '\0' '\n' | sort >out &&
+	printf 'corpus/a/b/one.png\ncorpus/c/two.png\n' | cmp - out &&
+	grep "scanned 4 files in .* seconds (.* files/s), 2 with embedded data" err
+) && (
+	echo 'scan should accept files as well as directories' &&
+
+	steg-png scan -q corpus/a/b/one.png corpus/a/plain.png >out 2>err &&
+	printf 'corpus/a/b/one.png\0' | cmp - out &&
+	[ ! -s err ]
+) && (
+	echo 'unreadable paths should be reported' &&
+
+	! steg-png scan -q corpus missing 2>err >out &&
+	grep "unable to scan 'missing'" err &&
+	[ "$(tr '\0' '\n' <out | wc -l)" -eq 2 ]
+) && (
+	echo 'scanning through io_uring and synchronously should agree' &&
+
+	head -c 5 resources/test.png >corpus/a/short.png &&
+	head -c 600000 corpus/c/two.png >corpus/c/truncated.png &&
+	for i in 1 2 3 4 5 6 7 8; do
+		cp corpus/a/b/one.png corpus/a/b/copy$i.png &&
+		cp resources/test.png corpus/c/plain$i.png || exit 1
+	done &&
+	steg-png scan -q corpus | tr '\0' '\n' | sort >out &&
+	STEG_PNG_NO_IO_URING=1 steg-png scan -q corpus | tr '\0' '\n' | sort >outf &&
+	cmp out outf &&
+	[ "$(wc -l <out)" -eq 10 ] &&
+	steg-png scan -q corpus/a/b/* corpus/c/* | tr '\0' '\n' | sort >out &&
+	STEG_PNG_NO_IO_URING=1 steg-png scan -q corpus/a/b/* corpus/c/* | tr '\0' '\n' | sort >outf &&
+	cmp out outf &&
+	[ "$(wc -l <out)" -eq 10 ]
+) && (
+	echo 'scan should print the digest of each match with --digest' &&
+
+	digest="$(steg-png inspect --digest blake3 corpus/a/b/one.png | sed -n 2p | cut -d' ' -f5)" &&
+	steg-png scan -q --digest blake3 corpus/a/b/one.png corpus/c/plain1.png >out &&
+	printf '%s  corpus/a/b/one.png\0' "$digest" | cmp - out &&
+	STEG_PNG_NO_IO_URING=1 steg-png scan -q --digest blake3 corpus/a/b/one.png corpus/c/plain1.png >out &&
+	printf '%s  corpus/a/b/one.png\0' "$digest" | cmp - out
+) && (
+	echo 'md5 digests of many matches of different lengths should match md5sum' &&
+
+	rm -rf corpus &&
+	mkdir -p corpus &&
+	head -c 300000 /dev/urandom >payload &&
+	for i in 1 2 3 4 5 6 7 8 9 10 11; do
+		head -c $((i * 27000)) payload >part &&
+		steg-png embed -l 0 -f part -o corpus/match$i.png resources/test.png >/dev/null || exit 1
+	done &&
+	md5sum corpus/*.png | sort >expected &&
+	steg-png scan -q --digest md5 --threads 2 corpus | tr '\0' '\n' | sort >out &&
+	cmp expected out &&
+	steg-png scan -q --digest md5 corpus/*.png | tr '\0' '\n' | sort >out &&
+	cmp expected out &&
+	STEG_PNG_NO_SIMD=1 STEG_PNG_NO_IO_URING=1 steg-png scan -q --digest md5 corpus | tr '\0' '\n' | sort >out &&
+	cmp expected out
+) || (
+	>&2 echo "failure" &&
+	exit 1
+)
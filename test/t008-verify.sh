@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+
+(
+	echo '-h and --help should print usage information' &&
+
+	steg-png verify -h >out &&
+	grep "usage: steg-png verify" out &&
+	steg-png verify --help >out &&
+	grep "usage: steg-png verify" out
+) && (
+	echo 'valid images should verify, with or without embedded data' &&
+
+	head -c 300000 /dev/urandom >in &&
+	steg-png embed -m "hello world" -o legacy.png resources/test.png &&
+	steg-png embed --segmented --threads 4 -f in -o segmented.png resources/test.png &&
+	steg-png embed -f in -f resources/test.png -o archive.png resources/test.png &&
+	steg-png verify --inflate resources/test.png legacy.png segmented.png archive.png >out 2>err &&
+	printf '%s: ok\n' resources/test.png legacy.png segmented.png archive.png | sort | cmp - <(sort out) &&
+	grep "verified 4 files: 4 ok, 0 corrupt, 0 unreadable" err
+) && (
+	echo 'chunks with invalid CRCs should be reported' &&
+
+	cp resources/test.png corrupt.png &&
+	printf '\xff\xff\xff\xff' | dd of=corrupt.png bs=1 seek=4000 conv=notrunc &&
+	! steg-png verify corrupt.png >out &&
+	grep "corrupt.png: IDAT chunk at file offset 3888 has invalid CRC" out &&
+	{ steg-png verify -q legacy.png corrupt.png >out; [ $? -eq 1 ]; } &&
+	! grep "legacy.png" out &&
+	{ STEG_PNG_NO_MMAP=1 STEG_PNG_NO_SIMD=1 steg-png verify corrupt.png >outf; [ $? -eq 1 ]; } &&
+	cmp out outf
+) && (
+	echo 'chunk ordering should be checked' &&
+
+	{ head -c 8 resources/test.png && tail -c +34 resources/test.png; } >no-ihdr.png &&
+	! steg-png verify no-ihdr.png >out &&
+	grep "no-ihdr.png: first chunk is .*, not IHDR" out &&
+	{ cat resources/test.png && tail -c 12 resources/test.png; } >two-iend.png &&
+	! steg-png verify two-iend.png >out &&
+	grep "two-iend.png: IEND chunk defined more than once" out &&
+	head -c 500000 resources/test.png >truncated.png &&
+	! steg-png verify truncated.png >out &&
+	grep "truncated.png: IEND chunk is missing" out &&
+	grep "truncated.png: chunk at file offset .* is truncated or corrupt" out
+) && (
+	echo 'unreadable files should exit with status 2' &&
+
+	printf 'not a png\n' >notes.txt &&
+	{ steg-png verify -q notes.txt >out; [ $? -eq 1 ]; } &&
+	grep "notes.txt: file is not a PNG" out &&
+	{ steg-png verify -q legacy.png missing.png notes.txt >out 2>err; [ $? -eq 2 ]; } &&
+	grep "missing.png: unable to open file" out
+) && (
+	echo '--inflate should detect embedded data that cannot be inflated' &&
+
+	head -c 100000 /dev/urandom >in &&
+	steg-png embed -f in -o steg.png resources/test.png &&
+	read -r type offset len crc < <(steg-png inspect --machine-readable steg.png | grep stEG | sed -n 2p) &&
+	{ head -c "$offset" steg.png && tail -c +$((offset + len + 13)) steg.png; } >cut.png &&
+	steg-png verify cut.png &&
+	! steg-png verify --inflate cut.png >out &&
+	grep "cut.png: embedded stream 1: " out
+) && (
+	echo 'the CRCs of large chunks should be split across threads' &&
+
+	head -c 12582912 /dev/urandom >huge &&
+	crc="$({ printf 'huGe' && cat huge; } | gzip -c | tail -c 8 | head -c 4 | od -An -tx1 | tr -d ' \n')" &&
+	{
+		head -c 33 resources/test.png &&
+		printf '\x00\xc0\x00\x00huGe' && cat huge &&
+		printf "\\x${crc:6:2}\\x${crc:4:2}\\x${crc:2:2}\\x${crc:0:2}" &&
+		tail -c +34 resources/test.png
+	} >huge.png &&
+	steg-png verify --threads 4 huge.png &&
+	STEG_PNG_NO_MMAP=1 steg-png verify --threads 3 huge.png &&
+	printf '\xff\xff\xff\xff' | dd of=huge.png bs=1 seek=9000000 conv=notrunc &&
+	! steg-png verify --threads 4 huge.png >out &&
+	grep "huge.png: huGe chunk at file offset 33 has invalid CRC" out &&
+	rm huge huge.png
+) || (
+	>&2 echo "failure" &&
+	exit 1
+)